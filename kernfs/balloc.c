@@ -2,8 +2,14 @@
 #include <sched.h> //sched_getcpu
 
 #include "balloc.h"
+#ifdef KERNFS
+#include "extents.h"	// mlfs_crc32c
+#include "undo_log.h"
+#endif
 
 #define SHARED_PARTITION (65536)
+// index blocks (TREE) are allocated from the first free list.
+#define META_PARTITION 0
 
 static int layout_score_percent = 0;
 static double layout_score_fraction = 0.0;
@@ -95,6 +101,11 @@ void store_all_bitmap(uint8_t dev, struct block_bitmap *b_bitmap)
 	uint8_t *bitmap = b_bitmap->bitmap;
 	mlfs_fsblk_t bitmap_block = b_bitmap->bitmap_block;
 
+#ifdef KERNFS
+	// the undo entries for these bits must be durable first.
+	undo_log_flush();
+#endif
+
 	for (i = 0; i < bitmap_nrblocks; i++) {
 		struct buffer_head *bh;
 
@@ -337,16 +348,16 @@ finish_it:
 	return -ENOSPC;
 }
 
+#ifdef KERNFS
+static int mlfs_load_snapshot(uint8_t dev, struct super_block *sb);
+static void mlfs_drop_snapshot(uint8_t dev, struct super_block *sb);
+#endif
+
 void balloc_init(uint8_t dev, struct super_block *_sb)
 {
   _sb->s_blk_bitmap = read_all_bitmap(dev,
       _sb->ondisk->ndatablocks, _sb->ondisk->bmap_start);
 
-  // compute used_blocks from bitmap.
-  _sb->used_blocks = bitmap_weight((uint64_t *)_sb->s_blk_bitmap->bitmap,
-      _sb->ondisk->ndatablocks);
-
-  mlfs_debug("[dev %u] used blocks %lu\n", dev, _sb->used_blocks);
 #if 0
   {
     mlfs_fsblk_t a;
@@ -359,8 +370,30 @@ void balloc_init(uint8_t dev, struct super_block *_sb)
 #ifdef BALLOC
 #define NO_INITIALIZE 0
 #define INITIALIZE 1 // reset all block allocation information.
+  if (dev == g_root_dev)
+    _sb->n_partition = balloc_n_partitions(_sb->num_blocks);
+
   mlfs_alloc_block_free_lists(_sb);
   mlfs_init_blockmap(_sb, NO_INITIALIZE);
+#ifdef KERNFS
+  int loaded = mlfs_load_snapshot(dev, _sb) == 0;
+
+  mlfs_drop_snapshot(dev, _sb);
+  if (loaded) {
+    mlfs_info("dev %u: free lists loaded from snapshot, used blocks %lu\n",
+        dev, _sb->used_blocks);
+    return;
+  }
+#endif
+#endif
+
+  // compute used_blocks from bitmap.
+  _sb->used_blocks = bitmap_weight((uint64_t *)_sb->s_blk_bitmap->bitmap,
+      _sb->ondisk->ndatablocks);
+
+  mlfs_debug("[dev %u] used blocks %lu\n", dev, _sb->used_blocks);
+
+#ifdef BALLOC
   mlfs_build_blocknode_map(_sb, (uint64_t *)_sb->s_blk_bitmap->bitmap,
       _sb->s_blk_bitmap->nr_bits, 0);
 #endif
@@ -742,6 +775,19 @@ out:
 	return ret;
 }
 
+// drop stale cached copies of blocks that were just allocated.
+static void mlfs_clear_new_blocks(struct super_block *sb,
+	unsigned long blocknr, unsigned long num_blocks)
+{
+    if (IDXAPI_IS_PER_FILE()) {
+        for (unsigned long i = 0; i < num_blocks; ++i) {
+            ensure_block_is_clear(sb->s_bdev, blocknr + i);
+        }
+    } else {
+        sync_all_buffers(sb->s_bdev);
+    }
+}
+
 static unsigned long mlfs_alloc_blocks_in_free_list(struct super_block *sb,
 	struct free_list *free_list, unsigned short btype,
 	unsigned long num_blocks, unsigned long *new_blocknr)
@@ -854,44 +900,208 @@ static unsigned long mlfs_alloc_blocks_in_free_list(struct super_block *sb,
 		return -ENOSPC;
     }
 
-    if (IDXAPI_IS_PER_FILE()) {
-        for (unsigned long i = 0; i < num_blocks; ++i) {
-            ensure_block_is_clear(sb->s_bdev, (*new_blocknr) + i);
-        }
-    } else {
-        sync_all_buffers(sb->s_bdev);
-    }
+	mlfs_clear_new_blocks(sb, *new_blocknr, num_blocks);
+
+	return num_blocks;
+}
+
+/* Take [start, start + num_blocks) out of the free range curr, which
+ * must hold it. Returns num_blocks, or 0 if curr had to be split and no
+ * blocknode was left for the second half. */
+static unsigned long mlfs_carve_range_node(struct super_block *sb,
+	struct free_list *free_list, struct mlfs_range_node *curr,
+	unsigned long start, unsigned long num_blocks)
+{
+	struct rb_root *tree = &(free_list->block_free_tree);
+	struct mlfs_range_node *blknode;
+	struct rb_node *temp;
+	unsigned long avail = curr->range_high - start + 1;
+
+	if (start == curr->range_low && num_blocks == avail) {
+		/* Allocate the whole blocknode */
+		if (curr == free_list->first_node) {
+			temp = rb_next(&curr->node);
+			free_list->first_node = temp ?
+				container_of(temp, struct mlfs_range_node, node) : NULL;
+		}
+
+		rb_erase(&curr->node, tree);
+		free_list->num_blocknode--;
+		mlfs_free_blocknode(sb, curr);
+	} else if (start == curr->range_low) {
+		curr->range_low += num_blocks;
+	} else if (num_blocks == avail) {
+		curr->range_high = start - 1;
+	} else {
+		/* start is inside the range: split off the part after the allocation */
+		blknode = mlfs_alloc_blocknode(sb);
+		if (NULL == blknode)
+			return 0;
+
+		blknode->range_low = start + num_blocks;
+		blknode->range_high = curr->range_high;
+		curr->range_high = start - 1;
+
+		if (mlfs_insert_blocktree(sb, tree, blknode)) {
+			curr->range_high = blknode->range_high;
+			mlfs_free_blocknode(sb, blknode);
+			return 0;
+		}
+		free_list->num_blocknode++;
+	}
+
+	free_list->num_free_blocks -= num_blocks;
+
+	mlfs_clear_new_blocks(sb, start, num_blocks);
+
+	return num_blocks;
+}
+
+/* Allocate up to num_blocks from goal if it is free, or all of them from
+ * the first free range after goal that fits them. Returns 0, leaving the
+ * free list untouched, if there is no such range nearby. */
+static unsigned long mlfs_alloc_blocks_near_goal(struct super_block *sb,
+	struct free_list *free_list, unsigned long goal,
+	unsigned long num_blocks, unsigned long *new_blocknr)
+{
+	struct rb_root *tree;
+	struct mlfs_range_node *curr;
+	struct rb_node *temp;
+	unsigned long avail;
+	int i;
+
+	tree = &(free_list->block_free_tree);
+
+	if (mlfs_find_range_node(sb, tree, goal, &curr)) {
+		free_list->goal_hit_count++;
+	} else {
+		if (!curr)
+			return 0;
+
+		temp = &curr->node;
+		if (curr->range_high < goal)
+			temp = rb_next(temp);
+
+		for (i = 0; temp && i < BALLOC_GOAL_SCAN; i++) {
+			curr = container_of(temp, struct mlfs_range_node, node);
+			if (curr->range_high - curr->range_low + 1 >= num_blocks)
+				break;
+			temp = rb_next(temp);
+		}
+
+		if (!temp || i == BALLOC_GOAL_SCAN)
+			return 0;
+
+		goal = curr->range_low;
+	}
+
+	avail = curr->range_high - goal + 1;
+	if (num_blocks > avail)
+		num_blocks = avail;
+
+	num_blocks = mlfs_carve_range_node(sb, free_list, curr, goal, num_blocks);
+	if (num_blocks)
+		*new_blocknr = goal;
 
 	return num_blocks;
 }
 
+uint32_t balloc_n_partitions(uint64_t num_blocks)
+{
+	char *env = getenv("MLFS_BALLOC_PARTITIONS");
+	uint32_t n = BALLOC_DEFAULT_PARTITIONS;
+
+	if (env)
+		n = strtoul(env, NULL, 10);
+
+	while (n > 1 && num_blocks / n < BALLOC_MIN_PARTITION_BLOCKS)
+		n--;
+
+	return n ? n : 1;
+}
+
+// data free list of the calling thread, handed out on its first allocation.
+static __thread int balloc_home = -1;
+static int balloc_next_home;
+
+static inline int mlfs_home_free_list(struct super_block *sb,
+		enum alloc_type a_type)
+{
+	if (sb->n_partition == 1)
+		return 0;
+
+	if (a_type == TREE)
+		return META_PARTITION;
+
+	if (balloc_home < 0)
+		balloc_home = __sync_fetch_and_add(&balloc_next_home, 1);
+
+	return 1 + balloc_home % (sb->n_partition - 1);
+}
+
+/* Pick the free list for an allocation: the caller's own list if it has
+ * room, so that digest workers do not share a lock, and otherwise the
+ * next list with room (stealing), then the shared list. Data is put in
+ * the index partition only when all of these are full, so that index
+ * nodes stay clustered. */
 static int mlfs_find_free_list(struct super_block *sb,
 		unsigned int num, enum alloc_type a_type)
 {
 	struct free_list *free_list;
-	int i;
+	int home = mlfs_home_free_list(sb, a_type);
+	int data = (a_type != TREE && sb->n_partition > 1);
+	int i, id;
 
-	if (a_type == DATA_LOG) {
-		// FIXME: find out GCed segment.
-		for (i = 0; i < sb->n_partition; i++) {
-			free_list = mlfs_get_free_list(sb, i);
-			if (free_list->num_free_blocks > num) {
-				return i;
-			}
+	// FIXME: DATA_LOG should find out GCed segment.
+	for (i = 0; i < sb->n_partition; i++) {
+		id = (home + i) % sb->n_partition;
+		if (data && id == META_PARTITION)
+			continue;
+
+		free_list = mlfs_get_free_list(sb, id);
+		if (free_list->num_free_blocks > num) {
+			if (i)
+				__sync_fetch_and_add(&free_list->steal_count, 1);
+			return id;
 		}
-	} else {
-		/* Find out the first free list to allocate requested blocks */
-		for (i = 0; i < sb->n_partition; i++) {
-			free_list = mlfs_get_free_list(sb, i);
-			if (free_list->num_free_blocks > num) {
-				return i;
-			}
+	}
+
+	if (sb->shared_free_list.num_free_blocks > num)
+		return SHARED_PARTITION;
+
+	if (data) {
+		free_list = mlfs_get_free_list(sb, META_PARTITION);
+		if (free_list->num_free_blocks > num) {
+			__sync_fetch_and_add(&free_list->steal_count, 1);
+			return META_PARTITION;
 		}
 	}
 
 	return -1;
 }
 
+/* The free list holding goal, if it has room for a DATA allocation.
+ * Goals in the index partition are ignored so data stays out of it. */
+static int mlfs_goal_free_list(struct super_block *sb,
+		unsigned int num, enum alloc_type a_type, unsigned long goal)
+{
+	int id;
+
+	if (!goal || a_type != DATA || goal >= sb->num_blocks)
+		return -1;
+
+	id = goal / sb->per_list_blocks;
+	if (id >= sb->n_partition)
+		id = SHARED_PARTITION;
+	else if (id == META_PARTITION && sb->n_partition > 1)
+		return -1;
+
+	if (mlfs_get_free_list(sb, id)->num_free_blocks > num)
+		return id;
+
+	return -1;
+}
+
 /* core part of mlfs block allocator.
  * block allocation policy is different from device type.
  * NVM, HDD: atype == DATA - in-place update
@@ -899,7 +1109,7 @@ static int mlfs_find_free_list(struct super_block *sb,
  */
 int mlfs_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	unsigned int num, unsigned short btype, int zero,
-	enum alloc_type atype, int goal)
+	enum alloc_type atype, unsigned long goal)
 {
 	struct free_list *free_list;
 	void *bp;
@@ -911,30 +1121,16 @@ int mlfs_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	int id;
 	int retried = 0;
 	UNUSED(btype);
-	UNUSED(goal);
 
 	num_blocks = num * 1;
 	if (num_blocks == 0)
 		return -EINVAL;
 
-	/* per-CPU allocations
-	if (atype == TREE)
-		id = SHARED_PARTITION;
-	else
-		id = sched_getcpu();
-	*/
-
-	// FIXME: A known bug
-	// When the TREE partition is full,
-#if 0
-	if (atype == TREE) {
-		id = sb->n_partition - 2;
-
-		if (id == -1)
-			id = mlfs_find_free_list(sb, num, atype);
-	} else
-#endif
+	id = mlfs_goal_free_list(sb, num, atype, goal);
+	if (id == -1) {
+		goal = 0;
 		id = mlfs_find_free_list(sb, num, atype);
+	}
 
 	if (id == -1)
 		return -ENOSPC;
@@ -965,6 +1161,7 @@ retry:
 				}
 				return -ENOSPC;
 			}
+			goal = 0;
 			id = mlfs_find_free_list(sb, num, atype);
 			mlfs_assert(id >= 0);
 			retried++;
@@ -1004,8 +1201,12 @@ retry:
 	ret_blocks = mlfs_alloc_blocks_in_free_list(sb, free_list, btype,
 			new_num_blocks, &new_blocknr);
 #else
-	ret_blocks = mlfs_alloc_blocks_in_free_list(sb, free_list, btype,
-			num_blocks, &new_blocknr);
+	if (goal)
+		ret_blocks = mlfs_alloc_blocks_near_goal(sb, free_list, goal,
+				num_blocks, &new_blocknr);
+	if (!ret_blocks)
+		ret_blocks = mlfs_alloc_blocks_in_free_list(sb, free_list, btype,
+				num_blocks, &new_blocknr);
 #endif
 
 
@@ -1035,6 +1236,48 @@ retry:
   return ret_blocks;
 }
 
+/* Allocate exactly num contiguous DATA blocks, or nothing: the first free
+ * range large enough in any data free list is used. */
+int mlfs_new_contiguous_blocks(struct super_block *sb, unsigned long *blocknr,
+	unsigned int num)
+{
+	struct free_list *free_list;
+	struct mlfs_range_node *curr;
+	struct rb_node *temp;
+	unsigned long ret = 0;
+	int i, id;
+
+	for (i = 0; i <= sb->n_partition && !ret; i++) {
+		id = i < sb->n_partition ? i : SHARED_PARTITION;
+		if (id == META_PARTITION && sb->n_partition > 1)
+			continue;
+
+		free_list = mlfs_get_free_list(sb, id);
+		if (free_list->num_free_blocks < num)
+			continue;
+
+		pthread_mutex_lock(&free_list->mutex);
+		for (temp = rb_first(&free_list->block_free_tree); temp;
+				temp = rb_next(temp)) {
+			curr = container_of(temp, struct mlfs_range_node, node);
+			if (curr->range_high - curr->range_low + 1 < num)
+				continue;
+
+			*blocknr = curr->range_low;
+			ret = mlfs_carve_range_node(sb, free_list, curr,
+					curr->range_low, num);
+			if (ret) {
+				free_list->alloc_data_count++;
+				free_list->alloc_data_pages += ret;
+			}
+			break;
+		}
+		pthread_mutex_unlock(&free_list->mutex);
+	}
+
+	return ret ? (int)ret : -ENOSPC;
+}
+
 unsigned long mlfs_count_free_blocks(struct super_block *sb)
 {
 	struct free_list *free_list;
@@ -1053,6 +1296,28 @@ unsigned long mlfs_count_free_blocks(struct super_block *sb)
 	return num_free_blocks;
 }
 
+unsigned long mlfs_count_steals(struct super_block *sb)
+{
+	unsigned long steals = sb->shared_free_list.steal_count;
+	int i;
+
+	for (i = 0; i < sb->n_partition; i++)
+		steals += mlfs_get_free_list(sb, i)->steal_count;
+
+	return steals;
+}
+
+unsigned long mlfs_count_goal_hits(struct super_block *sb)
+{
+	unsigned long hits = sb->shared_free_list.goal_hit_count;
+	int i;
+
+	for (i = 0; i < sb->n_partition; i++)
+		hits += mlfs_get_free_list(sb, i)->goal_hit_count;
+
+	return hits;
+}
+
 static int mlfs_insert_blocknode_map(struct super_block *sb,
 		int id, unsigned long low, unsigned long high)
 {
@@ -1091,61 +1356,362 @@ out:
 	return ret;
 }
 
-int mlfs_build_blocknode_map(struct super_block *sb,
-		unsigned long *bitmap, unsigned long bsize, unsigned long scale)
+typedef void (*free_run_fn)(struct super_block *sb, int id,
+		unsigned long low, unsigned long high, void *arg);
+
+// split the free run low..high at partition boundaries.
+static void mlfs_emit_free_run(struct super_block *sb, unsigned long low,
+		unsigned long high, free_run_fn fn, void *arg)
 {
-	struct free_list *free_list;
-	unsigned long next = 0;
-	unsigned long low = 0;
-	unsigned long start, end;
-	int id = 0;
+	unsigned long part_end = sb->per_list_blocks * sb->n_partition;
+	unsigned long end;
+	int id;
 
-	free_list = mlfs_get_free_list(sb, id);
-	start = free_list->block_start;
-	end = free_list->block_end + 1;
-	while (1) {
-		next = find_next_zero_bit(bitmap, end, start);
-		if (next == bsize)
-			break;
-		if (next == end) {
-			mlfs_debug("id %u # of free blocks %lu\n",
-					free_list->id, free_list->num_free_blocks);
-
-			if (id == sb->n_partition - 1)
-				id = SHARED_PARTITION;
-			else
-				id++;
-			free_list = mlfs_get_free_list(sb, id);
-			start = free_list->block_start;
-			end = free_list->block_end + 1;
+	while (low <= high) {
+		if (low < part_end) {
+			id = low / sb->per_list_blocks;
+			end = sb->per_list_blocks * (id + 1) - 1;
+			if (end > high)
+				end = high;
+		} else {
+			id = SHARED_PARTITION;
+			end = high;
+		}
+
+		fn(sb, id, low, end, arg);
+		low = end + 1;
+	}
+}
 
+/* Hand every run of clear bits in bitmap to fn, a word at a time: all-used
+ * and all-free words are skipped whole and the edges of a run inside a
+ * word are found with tzcnt. */
+static void mlfs_scan_free_runs(struct super_block *sb,
+		const unsigned long *bitmap, unsigned long bsize,
+		free_run_fn fn, void *arg)
+{
+	unsigned long nwords = BITS_TO_LONGS(bsize);
+	unsigned long run = ~0UL;	// first block of the open run
+	unsigned long i, base, used, m;
+	unsigned int bit;
+
+	for (i = 0; i < nwords; i++) {
+		base = i * BITS_PER_LONG;
+		used = bitmap[i];
+
+		// bits past the end of the device are not blocks.
+		if (bsize - base < BITS_PER_LONG)
+			used |= ~0UL << (bsize - base);
+
+		if (used == 0) {
+			if (run == ~0UL)
+				run = base;
 			continue;
 		}
 
-		low = next;
-		next = find_next_bit(bitmap, end, next);
-		if (mlfs_insert_blocknode_map(sb, id,
-					low << scale, (next << scale) - 1)) {
-			mlfs_info("Error: could not insert %lu - %lu\n",
-					low << scale, ((next << scale) - 1));
+		if (used == ~0UL) {
+			if (run != ~0UL) {
+				mlfs_emit_free_run(sb, run, base - 1, fn, arg);
+				run = ~0UL;
+			}
+			continue;
 		}
-		start = next;
-		if (next == bsize)
-			break;
-		if (next == end) {
-			mlfs_debug("id %u # of free blocks %lu\n",
-					free_list->id, free_list->num_free_blocks);
-
-			if (id == sb->n_partition - 1)
-				id = SHARED_PARTITION;
-			else
-				id++;
-			free_list = mlfs_get_free_list(sb, id);
-			start = free_list->block_start;
-			end = free_list->block_end + 1;
+
+		bit = 0;
+		while (1) {
+			if (run == ~0UL) {
+				m = ~used & (~0UL << bit);
+				if (!m)
+					break;
+				bit = __builtin_ctzl(m);
+				run = base + bit;
+			} else {
+				m = used & (~0UL << bit);
+				if (!m)
+					break;
+				bit = __builtin_ctzl(m);
+				mlfs_emit_free_run(sb, run, base + bit - 1, fn, arg);
+				run = ~0UL;
+			}
 		}
 	}
 
+	if (run != ~0UL)
+		mlfs_emit_free_run(sb, run, bsize - 1, fn, arg);
+}
+
+static void mlfs_insert_free_run(struct super_block *sb, int id,
+		unsigned long low, unsigned long high, void *arg)
+{
+	unsigned long scale = *(unsigned long *)arg;
+
+	if (mlfs_insert_blocknode_map(sb, id,
+				low << scale, ((high + 1) << scale) - 1)) {
+		mlfs_info("Error: could not insert %lu - %lu\n",
+				low << scale, ((high + 1) << scale) - 1);
+	}
+}
+
+int mlfs_build_blocknode_map(struct super_block *sb,
+		unsigned long *bitmap, unsigned long bsize, unsigned long scale)
+{
+	mlfs_scan_free_runs(sb, bitmap, bsize, mlfs_insert_free_run, &scale);
+
 	mlfs_debug("total free blocks %lu\n", mlfs_count_free_blocks(sb));
 	return 0;
 }
+
+/* Drop the free lists and build them again from the bitmap, after undo
+ * log recovery changed it under them. */
+void balloc_rebuild_free_lists(struct super_block *sb)
+{
+	struct free_list *free_list;
+	struct rb_node *temp;
+	int i, id;
+
+	for (i = 0; i <= sb->n_partition; i++) {
+		id = i < sb->n_partition ? i : SHARED_PARTITION;
+		free_list = mlfs_get_free_list(sb, id);
+
+		pthread_mutex_lock(&free_list->mutex);
+		while ((temp = rb_first(&free_list->block_free_tree))) {
+			rb_erase(temp, &free_list->block_free_tree);
+			mlfs_free_blocknode(sb,
+					container_of(temp, struct mlfs_range_node, node));
+		}
+		free_list->first_node = NULL;
+		free_list->num_blocknode = 0;
+		free_list->num_free_blocks = 0;
+		pthread_mutex_unlock(&free_list->mutex);
+	}
+
+	sb->used_blocks = bitmap_weight((uint64_t *)sb->s_blk_bitmap->bitmap,
+			sb->ondisk->ndatablocks);
+	mlfs_build_blocknode_map(sb, (unsigned long *)sb->s_blk_bitmap->bitmap,
+			sb->s_blk_bitmap->nr_bits, 0);
+}
+
+#ifdef KERNFS
+struct fl_snap_runs {
+	struct fl_snap_run *runs;
+	uint64_t nr_runs;
+	uint64_t max_runs;
+	uint64_t free_blocks;
+};
+
+static void mlfs_collect_free_run(struct super_block *sb, int id,
+		unsigned long low, unsigned long high, void *arg)
+{
+	struct fl_snap_runs *s = (struct fl_snap_runs *)arg;
+
+	if (s->nr_runs == s->max_runs) {
+		s->max_runs = s->max_runs ? s->max_runs * 2 : 1024;
+		s->runs = (struct fl_snap_run *)realloc(s->runs,
+				sizeof(struct fl_snap_run) * s->max_runs);
+		if (!s->runs)
+			panic("cannot grow free-extent snapshot\n");
+	}
+
+	s->runs[s->nr_runs].low = low;
+	s->runs[s->nr_runs].high = high;
+	s->nr_runs++;
+	s->free_blocks += high - low + 1;
+}
+
+static void mlfs_write_superblock(uint8_t dev, struct super_block *sb)
+{
+	struct buffer_head *bh;
+	uint8_t *buf = (uint8_t *)mlfs_zalloc(g_bdev[dev]->bd_blocksize);
+
+	memmove(buf, sb->ondisk, sizeof(struct disk_superblock));
+
+	bh = bh_get_sync_IO(dev, 1, BH_NO_DATA_ALLOC);
+	bh->b_data = buf;
+	bh->b_size = g_block_size_bytes;
+	mlfs_write(bh);
+	mlfs_io_wait(dev, 0);
+	bh_release(bh);
+
+	mlfs_free(buf);
+}
+
+static void mlfs_snapshot_io(uint8_t dev, mlfs_fsblk_t blocknr,
+		uint8_t *buf, int read)
+{
+	struct buffer_head *bh;
+
+	bh = bh_get_sync_IO(dev, blocknr, BH_NO_DATA_ALLOC);
+	bh->b_data = buf;
+	bh->b_size = g_block_size_bytes;
+	if (read)
+		bh_submit_read_sync_IO(bh);
+	else
+		mlfs_write(bh);
+	mlfs_io_wait(dev, read);
+	bh_release(bh);
+}
+
+// called at clean shutdown, after the last digest.
+void balloc_save_snapshot(uint8_t dev, struct super_block *sb)
+{
+	struct block_bitmap *b_bitmap = sb->s_blk_bitmap;
+	uint32_t payload = g_bdev[dev]->bd_blocksize - FL_SNAP_LINK;
+	struct fl_snap_runs s = {0};
+	struct fl_snap_header *hdr;
+	unsigned long *blocks, blocknr;
+	uint32_t nblocks, got = 0, want, i;
+	uint8_t *stream, *block;
+	size_t bytes;
+	int ret;
+
+	/* Take the runs from the bitmap rather than the free lists, so the
+	 * snapshot holds exactly what a scan would build: blocks held back
+	 * by the defragmenter or a pre-allocation window are free again. */
+	store_all_bitmap(dev, b_bitmap);
+	mlfs_scan_free_runs(sb, (unsigned long *)b_bitmap->bitmap,
+			b_bitmap->nr_bits, mlfs_collect_free_run, &s);
+
+	bytes = sizeof(struct fl_snap_header) +
+		s.nr_runs * sizeof(struct fl_snap_run);
+	nblocks = (bytes + payload - 1) / payload;
+
+	/* The snapshot is stored in blocks it lists as free, taken from the
+	 * free lists in as few pieces as they allow. */
+	blocks = (unsigned long *)mlfs_alloc(sizeof(unsigned long) * nblocks);
+	want = nblocks;
+	while (got < nblocks) {
+		if (want > nblocks - got)
+			want = nblocks - got;
+
+		ret = mlfs_new_contiguous_blocks(sb, &blocknr, want);
+		if (ret < 0) {
+			if (want == 1) {
+				mlfs_info("dev %u: no room for a free-extent snapshot\n", dev);
+				goto out;
+			}
+			want = (want + 1) / 2;
+			continue;
+		}
+
+		for (i = 0; i < (uint32_t)ret; i++)
+			blocks[got++] = blocknr + i;
+	}
+
+	stream = (uint8_t *)mlfs_zalloc((size_t)nblocks * payload);
+	hdr = (struct fl_snap_header *)stream;
+	hdr->magic = FL_SNAP_MAGIC;
+	hdr->gen = sb->ondisk->fl_snap_gen;
+	hdr->num_blocks = sb->num_blocks;
+	hdr->per_list_blocks = sb->per_list_blocks;
+	hdr->used_blocks = b_bitmap->nr_bits - s.free_blocks;
+	hdr->nr_runs = s.nr_runs;
+	hdr->n_partition = sb->n_partition;
+	memmove(hdr + 1, s.runs, s.nr_runs * sizeof(struct fl_snap_run));
+	hdr->csum = mlfs_crc32c(~0, stream, bytes);
+
+	block = (uint8_t *)mlfs_zalloc(g_bdev[dev]->bd_blocksize);
+	for (i = 0; i < nblocks; i++) {
+		*(uint64_t *)block = i + 1 < nblocks ? blocks[i + 1] : 0;
+		memmove(block + FL_SNAP_LINK, stream + (size_t)i * payload, payload);
+		mlfs_snapshot_io(dev, blocks[i], block, 0);
+	}
+
+	// the snapshot must be durable before the superblock points at it.
+	sb->ondisk->fl_snap_block = blocks[0];
+	sb->ondisk->fl_snap_nblocks = nblocks;
+	mlfs_write_superblock(dev, sb);
+
+	mlfs_info("dev %u: saved %lu free ranges in %u blocks\n",
+			dev, s.nr_runs, nblocks);
+
+	mlfs_free(block);
+	mlfs_free(stream);
+out:
+	// shutting down: blocks taken above need not go back to the lists.
+	mlfs_free(blocks);
+	free(s.runs);
+}
+
+static int mlfs_load_snapshot(uint8_t dev, struct super_block *sb)
+{
+	struct disk_superblock *ondisk = sb->ondisk;
+	uint32_t payload = g_bdev[dev]->bd_blocksize - FL_SNAP_LINK;
+	struct fl_snap_header *hdr;
+	struct fl_snap_run *runs;
+	unsigned long scale = 0;
+	uint8_t *stream, *block;
+	mlfs_fsblk_t blocknr;
+	uint32_t csum, i;
+	size_t bytes;
+	int ret = -EINVAL;
+
+	if (!ondisk->fl_snap_block)
+		return -ENOENT;
+
+	stream = (uint8_t *)mlfs_alloc((size_t)ondisk->fl_snap_nblocks * payload);
+	block = (uint8_t *)mlfs_alloc(g_bdev[dev]->bd_blocksize);
+	if (!stream || !block) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	blocknr = ondisk->fl_snap_block;
+	for (i = 0; i < ondisk->fl_snap_nblocks; i++) {
+		if (!blocknr || blocknr >= sb->num_blocks)
+			goto out;
+
+		mlfs_snapshot_io(dev, blocknr, block, 1);
+		memmove(stream + (size_t)i * payload, block + FL_SNAP_LINK, payload);
+		blocknr = *(uint64_t *)block;
+	}
+
+	hdr = (struct fl_snap_header *)stream;
+	runs = (struct fl_snap_run *)(hdr + 1);
+	bytes = (size_t)ondisk->fl_snap_nblocks * payload;
+
+	// a snapshot from another mount, or from another partition layout.
+	if (!ondisk->fl_snap_nblocks || blocknr ||
+			hdr->magic != FL_SNAP_MAGIC || hdr->gen != ondisk->fl_snap_gen ||
+			hdr->num_blocks != sb->num_blocks ||
+			hdr->per_list_blocks != sb->per_list_blocks ||
+			hdr->n_partition != sb->n_partition ||
+			hdr->nr_runs > (bytes - sizeof(*hdr)) / sizeof(*runs))
+		goto out;
+
+	bytes = sizeof(*hdr) + hdr->nr_runs * sizeof(*runs);
+	csum = hdr->csum;
+	hdr->csum = 0;
+	if (mlfs_crc32c(~0, stream, bytes) != csum)
+		goto out;
+
+	// check every run before touching the free lists.
+	for (i = 0; i < hdr->nr_runs; i++) {
+		if (runs[i].low > runs[i].high || runs[i].high >= sb->num_blocks)
+			goto out;
+		if (i && runs[i].low <= runs[i - 1].high)
+			goto out;
+	}
+
+	for (i = 0; i < hdr->nr_runs; i++)
+		mlfs_emit_free_run(sb, runs[i].low, runs[i].high,
+				mlfs_insert_free_run, &scale);
+
+	sb->used_blocks = hdr->used_blocks;
+	ret = 0;
+out:
+	if (stream)
+		mlfs_free(stream);
+	if (block)
+		mlfs_free(block);
+	return ret;
+}
+
+// blocks are about to be allocated: no later crash may trust the snapshot.
+static void mlfs_drop_snapshot(uint8_t dev, struct super_block *sb)
+{
+	sb->ondisk->fl_snap_gen++;
+	sb->ondisk->fl_snap_block = 0;
+	sb->ondisk->fl_snap_nblocks = 0;
+	mlfs_write_superblock(dev, sb);
+}
+#endif
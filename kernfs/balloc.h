@@ -61,17 +61,73 @@ enum alloc_type {
 	DATA_LOG, // allow blocks from GCed segment
 };
 
+/* The NVM free space is split into partitions, each with its own free
+ * list and lock. Index blocks come from the first one, so they stay
+ * together; each allocating thread (digest worker) gets one of the others
+ * for data and steals from the rest only when its own runs dry.
+ * MLFS_BALLOC_PARTITIONS overrides the default count; partitions are
+ * never made smaller than BALLOC_MIN_PARTITION_BLOCKS.
+ */
+// the eight file digest workers and the index partition.
+#define BALLOC_DEFAULT_PARTITIONS 9
+#define BALLOC_MIN_PARTITION_BLOCKS (1UL << 15)
+
+/* A DATA allocation with a goal (the block after the file's last extent)
+ * takes blocks from the goal if it is free, so the extent just grows, and
+ * otherwise the first free range after it that fits the whole request,
+ * looking at no more than BALLOC_GOAL_SCAN ranges before falling back to
+ * the first fit.
+ */
+#define BALLOC_GOAL_SCAN 16
+
+/* Mounting rebuilds the free lists from the bitmap, which takes time in
+ * proportion to the device. A clean shutdown instead writes the free
+ * ranges to free blocks and records the first one in the superblock under
+ * the current mount generation; the next mount loads them in time
+ * proportional to the number of ranges. Mount bumps the generation and
+ * drops the snapshot from the superblock before anything is allocated,
+ * so a crash always falls back to the bitmap.
+ */
+#define FL_SNAP_MAGIC 0x50414e534c46ULL
+// every snapshot block starts with the number of the next one (0: last).
+#define FL_SNAP_LINK sizeof(uint64_t)
+
+struct fl_snap_header {
+	uint64_t magic;
+	uint64_t gen;
+	uint64_t num_blocks;
+	uint64_t per_list_blocks;
+	uint64_t used_blocks;
+	uint64_t nr_runs;
+	uint32_t n_partition;
+	uint32_t csum;		// crc32c of header (csum 0) and runs
+};
+
+struct fl_snap_run {
+	uint64_t low;
+	uint64_t high;
+};
+
+uint32_t balloc_n_partitions(uint64_t num_blocks);
 void balloc_init(uint8_t dev, struct super_block *_sb);
 int mlfs_alloc_block_free_lists(struct super_block *sb);
 void mlfs_init_blockmap(struct super_block *sb, int initialize);
 int mlfs_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	unsigned int num, unsigned short btype, int zero,
-	enum alloc_type atype, int goal);
+	enum alloc_type atype, unsigned long goal);
+int mlfs_new_contiguous_blocks(struct super_block *sb, unsigned long *blocknr,
+	unsigned int num);
 int mlfs_build_blocknode_map(struct super_block *sb, unsigned long *bitmap,
 		unsigned long bsize, unsigned long scale);
 int mlfs_free_blocks_node(struct super_block *sb, unsigned long blocknr,
 	int num, unsigned short btype, int log_page);
 unsigned long mlfs_count_free_blocks(struct super_block *sb);
+unsigned long mlfs_count_steals(struct super_block *sb);
+unsigned long mlfs_count_goal_hits(struct super_block *sb);
+void balloc_rebuild_free_lists(struct super_block *sb);
+#ifdef KERNFS
+void balloc_save_snapshot(uint8_t dev, struct super_block *sb);
+#endif
 
 #ifdef __cplusplus
 }
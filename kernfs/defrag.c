@@ -0,0 +1,415 @@
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <libpmem.h>
+
+#include "fs.h"
+#include "balloc.h"
+#include "defrag.h"
+#include "extents.h"
+#include "global/util.h"
+#include "indexing_api_interface.h"
+#include "undo_log.h"
+
+extern uint8_t *dax_addr[];
+
+int persist_dirty_objects_nvm(void);
+
+struct defrag_file {
+	struct inode *inode;
+	uint32_t nblocks;
+	uint32_t nfrags;
+};
+
+struct defrag_retired {
+	addr_t pblk;
+	uint32_t nr;
+	// log devices that must still see the move, and those already sent it.
+	uint32_t wait;
+	uint32_t sent;
+};
+
+static struct defrag_retired retired[DEFRAG_RETIRED_MAX];
+static uint32_t n_retired;
+
+// moved inodes not yet published to each log device.
+static uint32_t pending[g_n_devices][DEFRAG_RETIRED_MAX];
+static uint32_t n_pending[g_n_devices];
+
+// log devices that have digested since kernfs started.
+static uint32_t active_devs;
+
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t defrag_interval_ms;
+static uint64_t defrag_blocks_per_sec;
+static double defrag_tokens, defrag_last_refill;
+static uint32_t defrag_cursor;
+static volatile int defrag_queued;
+
+static double defrag_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// blocks the pass may move now; at most one second's worth is saved up.
+static uint64_t defrag_refill(void)
+{
+	double now = defrag_now();
+
+	defrag_tokens += (now - defrag_last_refill) * defrag_blocks_per_sec;
+	if (defrag_tokens > defrag_blocks_per_sec)
+		defrag_tokens = defrag_blocks_per_sec;
+	defrag_last_refill = now;
+
+	return (uint64_t)defrag_tokens;
+}
+
+/* Map inode into runs of contiguous blocks, in logical order. Returns
+ * NULL if the file is empty, too large, or has unwritten extents. */
+static struct mlfs_map_run *defrag_runs(struct inode *inode,
+		uint32_t *n_runs, uint32_t *nblocks)
+{
+	struct mlfs_map_run *runs = NULL;
+	struct mlfs_map_blocks map;
+	handle_t handle = {.dev = g_root_dev};
+	mlfs_lblk_t lblk = 0, size;
+	uint32_t max_runs = 0;
+	int ret;
+
+	size = (inode->size + g_block_size_bytes - 1) >> g_block_size_shift;
+	*n_runs = 0;
+	*nblocks = 0;
+
+	if (!size || size > DEFRAG_MAX_FILE_BLOCKS)
+		return NULL;
+
+	while (lblk < size) {
+		map.m_lblk = lblk;
+		map.m_len = size - lblk;
+		map.m_pblk = 0;
+		map.m_flags = 0;
+
+		ret = mlfs_ext_get_blocks(&handle, inode, &map, 0);
+		if (ret < 0)
+			goto fail;
+
+		// a hole; the extent tree tells how long it is.
+		if (ret == 0) {
+			lblk += (g_idx_choice == NONE && map.m_len) ? map.m_len : 1;
+			continue;
+		}
+
+		if (!map.m_pblk)
+			goto fail;
+
+		if (ret > size - lblk)
+			ret = size - lblk;
+
+		mlfs_map_runs_push(&runs, n_runs, &max_runs, lblk, map.m_pblk, ret);
+		*nblocks += ret;
+		lblk += ret;
+	}
+
+	return runs;
+
+fail:
+	free(runs);
+	*n_runs = 0;
+	return NULL;
+}
+
+// point the index of inode at the blocks from pblk on, run after run.
+static void defrag_remap(struct inode *inode, struct mlfs_map_run *runs,
+		uint32_t n_runs, addr_t pblk)
+{
+	if (IDXAPI_IS_PER_FILE()) {
+		mlfs_lblk_t end = runs[n_runs - 1].m_lblk + runs[n_runs - 1].m_len;
+
+		idx_api_keep_data(true);
+		FN(inode->ext_idx, im_remove, inode->ext_idx, inode->inum, 0, end);
+		idx_api_keep_data(false);
+	}
+
+	mlfs_map_runs_remap(inode, runs, n_runs, pblk);
+}
+
+// the old blocks of a moved file leave the bitmap now, the free lists later.
+static void defrag_retire(addr_t pblk, uint32_t nr)
+{
+	struct super_block *root_sb = sb[g_root_dev];
+
+	bitmap_bits_free(root_sb->s_blk_bitmap, pblk, nr);
+	balloc_undo_log(pblk, nr, 1);
+
+	mlfs_assert(root_sb->used_blocks >= nr);
+	root_sb->used_blocks -= nr;
+
+	if (!active_devs) {
+		mlfs_free_blocks_node(root_sb, pblk, nr, 0, 0);
+		return;
+	}
+
+	retired[n_retired].pblk = pblk;
+	retired[n_retired].nr = nr;
+	retired[n_retired].wait = active_devs;
+	retired[n_retired].sent = 0;
+	n_retired++;
+}
+
+// move inode into one free range; returns the blocks moved.
+static uint32_t defrag_move(struct inode *inode)
+{
+	struct super_block *root_sb = sb[g_root_dev];
+	struct mlfs_map_run *runs;
+	uint32_t n_runs, nblocks, i, dev;
+	unsigned long pblk;
+	addr_t to;
+
+	runs = defrag_runs(inode, &n_runs, &nblocks);
+	if (!runs)
+		return 0;
+
+	// no room to remember the old runs until libfs has seen the move.
+	if (n_retired + n_runs > DEFRAG_RETIRED_MAX)
+		goto out;
+
+	for (dev = 0; dev < g_n_devices; dev++)
+		if ((active_devs & (1U << dev)) &&
+				n_pending[dev] == DEFRAG_RETIRED_MAX)
+			goto out;
+
+	if (mlfs_new_contiguous_blocks(root_sb, &pblk, nblocks) <= 0)
+		goto out;
+
+	balloc_undo_log(pblk, nblocks, 0);
+	bitmap_bits_set_range(root_sb->s_blk_bitmap, pblk, nblocks);
+	root_sb->used_blocks += nblocks;
+
+	// the new blocks are not in any index yet, so the copy needs no undo.
+	to = pblk;
+	for (i = 0; i < n_runs; i++) {
+		pmem_memcpy_persist(dax_addr[g_root_dev] + (to << g_block_size_shift),
+				dax_addr[g_root_dev] + (runs[i].m_pblk << g_block_size_shift),
+				(size_t)runs[i].m_len << g_block_size_shift);
+		to += runs[i].m_len;
+	}
+
+	defrag_remap(inode, runs, n_runs, pblk);
+
+	for (i = 0; i < n_runs; i++)
+		defrag_retire(runs[i].m_pblk, runs[i].m_len);
+
+	for (dev = 0; dev < g_n_devices; dev++)
+		if (active_devs & (1U << dev))
+			pending[dev][n_pending[dev]++] = inode->inum;
+
+	if (enable_perf_stats) {
+		g_perf_stats.defrag_files++;
+		g_perf_stats.defrag_blocks += nblocks;
+		g_perf_stats.defrag_frags += n_runs;
+	}
+
+	free(runs);
+	return nblocks;
+
+out:
+	free(runs);
+	return 0;
+}
+
+static int defrag_cmp(const void *a, const void *b)
+{
+	const struct defrag_file *x = a, *y = b;
+	uint64_t lhs = (uint64_t)x->nfrags * y->nblocks;
+	uint64_t rhs = (uint64_t)y->nfrags * x->nblocks;
+
+	// most fragments per block first.
+	return lhs > rhs ? -1 : lhs < rhs;
+}
+
+static void defrag_pass(void *arg)
+{
+	struct inode *scan[DEFRAG_SCAN_FILES];
+	struct defrag_file pick[DEFRAG_PICK];
+	struct inode *inode, *tmp;
+	uint32_t n_scan = 0, n_pick = 0, pos = 0, i;
+	uint64_t budget, tsc_begin = 0;
+	UNUSED(arg);
+
+	if (enable_perf_stats)
+		tsc_begin = asm_rdtscp();
+
+	budget = defrag_refill();
+	if (!budget)
+		goto done;
+
+	// the icache iterates in insertion order, so a position is a cursor.
+	pthread_spin_lock(&icache_spinlock);
+	HASH_ITER(hash_handle, inode_hash[g_root_dev], inode, tmp) {
+		if (pos++ < defrag_cursor)
+			continue;
+		if (n_scan == DEFRAG_SCAN_FILES)
+			break;
+		if (inode->itype == T_FILE && !(inode->flags & I_DELETING) &&
+				inode->size > ((offset_t)DEFRAG_MIN_FRAGS << g_block_size_shift))
+			scan[n_scan++] = inode;
+	}
+	defrag_cursor = inode ? pos - 1 : 0;
+	pthread_spin_unlock(&icache_spinlock);
+
+	for (i = 0; i < n_scan; i++) {
+		struct mlfs_map_run *runs;
+		uint32_t n_runs, nblocks;
+
+		if (IDXAPI_IS_PER_FILE() && !scan[i]->ext_idx)
+			init_api_idx_struct(g_root_dev, scan[i]);
+
+		runs = defrag_runs(scan[i], &n_runs, &nblocks);
+		free(runs);
+
+		if (n_runs < DEFRAG_MIN_FRAGS || nblocks / n_runs >= DEFRAG_GOOD_RUN ||
+				nblocks > budget)
+			continue;
+
+		if (n_pick < DEFRAG_PICK) {
+			pick[n_pick].inode = scan[i];
+			pick[n_pick].nblocks = nblocks;
+			pick[n_pick].nfrags = n_runs;
+			n_pick++;
+			qsort(pick, n_pick, sizeof(pick[0]), defrag_cmp);
+		} else if ((uint64_t)n_runs * pick[n_pick - 1].nblocks >
+				(uint64_t)pick[n_pick - 1].nfrags * nblocks) {
+			pick[n_pick - 1].inode = scan[i];
+			pick[n_pick - 1].nblocks = nblocks;
+			pick[n_pick - 1].nfrags = n_runs;
+			qsort(pick, n_pick, sizeof(pick[0]), defrag_cmp);
+		}
+	}
+
+	if (!n_pick)
+		goto done;
+
+	pthread_mutex_lock(&defrag_lock);
+	undo_log_start_tx();
+
+	for (i = 0; i < n_pick && pick[i].nblocks <= budget; i++) {
+		uint32_t moved = defrag_move(pick[i].inode);
+
+		budget -= moved;
+		defrag_tokens -= moved;
+	}
+
+	persist_dirty_objects_nvm();
+	undo_log_commit_tx();
+	pthread_mutex_unlock(&defrag_lock);
+
+done:
+	if (enable_perf_stats)
+		g_perf_stats.defrag_tsc += asm_rdtscp() - tsc_begin;
+
+	defrag_queued = 0;
+}
+
+static void *defrag_thread(void *arg)
+{
+	threadpool pool = (threadpool)arg;
+
+	while (1) {
+		usleep(defrag_interval_ms * 1000);
+
+		// a digest in flight goes first; a pass is queued only when idle.
+		if (defrag_queued || thpool_num_threads_working(pool))
+			continue;
+
+		defrag_queued = 1;
+		thpool_add_work(pool, defrag_pass, NULL);
+	}
+
+	return NULL;
+}
+
+void defrag_init(threadpool pool)
+{
+	pthread_t tid;
+	char *env;
+
+	env = getenv("MLFS_DEFRAG_MBPS");
+	if (!env || !strtoul(env, NULL, 10))
+		return;
+
+	defrag_blocks_per_sec = (strtoull(env, NULL, 10) << 20) >> g_block_size_shift;
+
+	defrag_interval_ms = 1000;
+	env = getenv("MLFS_DEFRAG_INTERVAL_MS");
+	if (env && strtoul(env, NULL, 10))
+		defrag_interval_ms = strtoul(env, NULL, 10);
+
+	if (!(g_idx_choice == NONE || IDXAPI_IS_PER_FILE())) {
+		mlfs_info("defrag: not supported with %s\n", idx_choice_name(g_idx_choice));
+		return;
+	}
+
+#ifndef CONCURRENT
+	// passes rely on the digest thread pool to stay out of digest's way.
+	mlfs_info("%s\n", "defrag: needs CONCURRENT digest");
+	return;
+#endif
+
+#ifndef DIGEST_SHM_RING
+	/* libfs learns of a move only from the inodes on the digest ring;
+	 * without it, its cached mappings would point at the freed blocks. */
+	mlfs_info("%s\n", "defrag: needs DIGEST_SHM_RING");
+	return;
+#endif
+
+	defrag_last_refill = defrag_now();
+
+	if (pthread_create(&tid, NULL, defrag_thread, (void *)pool))
+		panic("cannot create defrag thread\n");
+	pthread_detach(tid);
+
+	mlfs_info("defrag: %lu blocks/s, every %u ms\n",
+			defrag_blocks_per_sec, defrag_interval_ms);
+}
+
+void defrag_publish(uint8_t from_dev)
+{
+	struct super_block *root_sb = sb[g_root_dev];
+	uint32_t bit = 1U << from_dev, i, n = 0;
+
+	pthread_mutex_lock(&defrag_lock);
+
+	active_devs |= bit;
+
+	// defrag_init starts no passes without the ring, so nothing is pending.
+#ifdef DIGEST_SHM_RING
+	for (i = 0; i < n_pending[from_dev]; i++)
+		digest_inodes_add_inum(from_dev, pending[from_dev][i]);
+#endif
+	n_pending[from_dev] = 0;
+
+	/* A run sent with the previous digest of from_dev is safe once this
+	 * one comes in: libfs handled that ack before asking again. */
+	for (i = 0; i < n_retired; i++) {
+		struct defrag_retired *r = &retired[i];
+
+		if (r->wait & bit) {
+			if (r->sent & bit)
+				r->wait &= ~bit;
+			else
+				r->sent |= bit;
+		}
+
+		if (!r->wait)
+			mlfs_free_blocks_node(root_sb, r->pblk, r->nr, 0, 0);
+		else
+			retired[n++] = *r;
+	}
+	n_retired = n;
+
+	pthread_mutex_unlock(&defrag_lock);
+}
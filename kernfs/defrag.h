@@ -0,0 +1,46 @@
+#ifndef _DEFRAG_H_
+#define _DEFRAG_H_
+
+#include "shared.h"
+#include "global/global.h"
+#include "thpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Online defragmentation (MLFS_DEFRAG_MBPS, off by default).
+ *
+ * A background thread wakes every MLFS_DEFRAG_INTERVAL_MS ms (default
+ * 1000) and, if no digest is running, queues a pass on the digest thread,
+ * so a pass never runs alongside a digest. A pass measures up to
+ * DEFRAG_SCAN_FILES cached files, picks the ones with the most fragments
+ * per block, and moves each into one free range: the data is copied and
+ * the index rebuilt over the new blocks inside an undo transaction.
+ * Passes move at most MLFS_DEFRAG_MBPS MB per second of wall time.
+ *
+ * The old blocks are cleared in the bitmap at once but kept off the free
+ * lists until every log device that has digested so far has been told
+ * about the move with one digest and has sent the next, so a libfs that
+ * still reads through its old mapping finds the old data.
+ */
+#define DEFRAG_SCAN_FILES 256
+// files moved per pass, worst first.
+#define DEFRAG_PICK 16
+// leave files with fewer fragments, or longer runs on average, alone.
+#define DEFRAG_MIN_FRAGS 4
+#define DEFRAG_GOOD_RUN 64
+#define DEFRAG_MAX_FILE_BLOCKS (1U << 16)
+// old runs waiting for libfs to see the move.
+#define DEFRAG_RETIRED_MAX 4096
+
+void defrag_init(threadpool pool);
+
+// digest of from_dev is about to be acked: publish moved files to it.
+void defrag_publish(uint8_t from_dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
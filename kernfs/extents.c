@@ -40,10 +40,6 @@
 
 #define ZERO_FREED_BLOCKS
 
-#if defined(REUSE_PREVIOUS_PATH)
-#undef REUSE_PREVIOUS_PATH
-#endif
-
 pthread_mutex_t block_bitmap_mutex;
 
 static struct inode *__buffer_search(struct rb_root *root,
@@ -95,9 +91,7 @@ int mlfs_mark_inode_dirty(struct inode *inode)
 			&inode->i_rb_node, inode_cmp);
 	// unlock
 
-#ifdef REUSE_PREVIOUS_PATH
-	inode->invalidate_path = 1;
-#endif
+	mlfs_ext_invalidate_path(inode);
 
 	return 0;
 }
@@ -116,7 +110,8 @@ static inline int mlfs_handle_dirty_metadata(handle_t *handle,
 }
 
 int mlfs_ext_alloc_blocks(handle_t *handle, struct inode *inode,
-		int goal, unsigned int flags, mlfs_fsblk_t *blockp, mlfs_lblk_t *count)
+		mlfs_fsblk_t goal, unsigned int flags, mlfs_fsblk_t *blockp,
+		mlfs_lblk_t *count)
 {
 #ifdef KERNFS
 
@@ -144,8 +139,10 @@ int mlfs_ext_alloc_blocks(handle_t *handle, struct inode *inode,
 		a_type = DATA;
 
 retry:
-	ret = mlfs_new_blocks(get_inode_sb(handle->dev, inode), blockp,
-			*count, 0, 0, a_type, goal);
+	if (a_type == DATA && handle->dev == g_root_dev)
+		ret = mlfs_new_file_blocks(sb, inode, goal, *count, blockp);
+	else
+		ret = mlfs_new_blocks(sb, blockp, *count, 0, 0, a_type, goal);
 
     mlfs_debug("[dev %d] [inum %d] ret = %d, pblk = %llu, count = %lu\n",
             handle->dev, inode->inum, ret, *blockp, *count);
@@ -228,6 +225,95 @@ retry:
 #endif
 }
 
+#ifdef KERNFS
+// set while a file is moved: removing extents leaves their data allocated.
+static __thread bool ext_keep_data;
+
+void mlfs_ext_keep_data(bool keep)
+{
+	ext_keep_data = keep;
+}
+
+// window size in blocks; set from MLFS_PREALLOC_BLOCKS by mlfs_ext_init.
+static uint32_t prealloc_blocks = PREALLOC_DEFAULT_BLOCKS;
+
+void mlfs_ext_discard_prealloc(struct inode *inode)
+{
+	if (inode->pa_len)
+		mlfs_free_blocks_node(get_inode_sb(g_root_dev, inode),
+				inode->pa_start, inode->pa_len, 0, 0);
+
+	inode->pa_start = 0;
+	inode->pa_len = 0;
+}
+
+/* Allocate up to num data blocks of inode on the root device, near goal.
+ * An allocation at the start of the inode's window is served from it. */
+int mlfs_new_file_blocks(struct super_block *sb, struct inode *inode,
+		mlfs_fsblk_t goal, unsigned int num, mlfs_fsblk_t *blockp)
+{
+	int ret = -ENOSPC;
+
+	if (inode->pa_len && goal == inode->pa_start) {
+		ret = min(num, inode->pa_len);
+		*blockp = inode->pa_start;
+		inode->pa_start += ret;
+		inode->pa_len -= ret;
+		inode->pa_goal = inode->pa_start;
+
+		if (enable_perf_stats)
+			g_perf_stats.prealloc_hit_nr++;
+
+		return ret;
+	}
+
+	if (prealloc_blocks && goal && inode->pa_appends >= PREALLOC_MIN_APPENDS) {
+		// the file grows somewhere else now; its old window is of no use.
+		mlfs_ext_discard_prealloc(inode);
+
+		ret = mlfs_new_blocks(sb, blockp, num + prealloc_blocks, 0, 0,
+				DATA, goal);
+		if (ret > (int)num) {
+			inode->pa_start = *blockp + num;
+			inode->pa_len = ret - num;
+			ret = num;
+
+			if (enable_perf_stats)
+				g_perf_stats.prealloc_blocks += inode->pa_len;
+		}
+	}
+
+	// no room for a window: allocate just what was asked for.
+	if (ret == -ENOSPC)
+		ret = mlfs_new_blocks(sb, blockp, num, 0, 0, DATA, goal);
+
+	if (ret > 0)
+		inode->pa_goal = *blockp + ret;
+
+	return ret;
+}
+
+/* Called before data blocks are allocated for len blocks of inode at lblk.
+ * Counts appends in a row and returns the block after the file's last
+ * data allocation if lblk continues it, 0 otherwise. */
+static mlfs_fsblk_t mlfs_prealloc_note_create(struct inode *inode,
+		mlfs_lblk_t lblk, mlfs_lblk_t len)
+{
+	mlfs_fsblk_t goal = 0;
+
+	if (inode->pa_goal && lblk == inode->pa_lblk) {
+		inode->pa_appends++;
+		goal = inode->pa_goal;
+	} else {
+		inode->pa_appends = 0;
+	}
+
+	inode->pa_lblk = lblk + len;
+
+	return goal;
+}
+#endif
+
 static inline mlfs_fsblk_t mlfs_inode_to_goal_block(struct inode *inode)
 {
 	return 0;
@@ -235,7 +321,7 @@ static inline mlfs_fsblk_t mlfs_inode_to_goal_block(struct inode *inode)
 
 /* used for file data blocks in extent tree */
 static mlfs_fsblk_t mlfs_new_data_blocks(handle_t *handle,
-		struct inode *inode, int goal, unsigned int flags,
+		struct inode *inode, mlfs_fsblk_t goal, unsigned int flags,
 		mlfs_lblk_t *count, int *errp)
 {
 	struct super_block *sb = get_inode_sb(handle->dev, inode);
@@ -471,9 +557,14 @@ int mlfs_ext_tree_init(handle_t *handle, struct inode *inode)
 }
 
 void mlfs_ext_init(struct super_block *sb) {
-	/*
-	 * possible initialization would be here
-	 */
+#ifdef KERNFS
+	char *env = getenv("MLFS_PREALLOC_BLOCKS");
+
+	if (env)
+		prealloc_blocks = strtoul(env, NULL, 10);
+
+	mlfs_info("prealloc: %u blocks per append stream\n", prealloc_blocks);
+#endif
 }
 
 /*
@@ -613,7 +704,7 @@ static mlfs_fsblk_t mlfs_ext_new_meta_block(handle_t *handle,
 		struct mlfs_extent *ex, int *err,
 		unsigned int flags)
 {
-	mlfs_fsblk_t goal, newblock;
+	mlfs_fsblk_t goal = 0, newblock;
 	mlfs_lblk_t count = 1;
 
 	//goal = mlfs_ext_find_goal(inode, path, le32_to_cpu(ex->ee_block));
@@ -640,9 +731,7 @@ int __mlfs_ext_dirty(const char *where, unsigned int line,
 		err = mlfs_mark_inode_dirty(inode);
 	}
 
-#ifdef REUSE_PREVIOUS_PATH
-	inode->invalidate_path = 1;
-#endif
+	mlfs_ext_invalidate_path(inode);
 	return err;
 }
 
@@ -1965,6 +2054,9 @@ int mlfs_ext_insert_extent(handle_t *handle, struct inode *inode,
 		return -EIO;
 	}
 
+	/* the leaf may be split or merged, and the tree may grow */
+	mlfs_ext_invalidate_path(inode);
+
 	depth = ext_depth(handle, inode);
 	ex = path[depth].p_ext;
 	eh = path[depth].p_hdr;
@@ -2216,7 +2308,10 @@ static int mlfs_remove_blocks(handle_t *handle, struct inode *inode,
 		unsigned long num, start;
 		num = le32_to_cpu(ex->ee_block) + mlfs_ext_get_actual_len(ex) - from;
 		start = mlfs_ext_pblock(ex) + mlfs_ext_get_actual_len(ex) - num;
-		mlfs_free_blocks(handle, inode, NULL, start, num, 0);
+#ifdef KERNFS
+		if (!ext_keep_data)
+#endif
+			mlfs_free_blocks(handle, inode, NULL, start, num, 0);
 	} else if (from == le32_to_cpu(ex->ee_block) &&
 			to <= le32_to_cpu(ex->ee_block) + mlfs_ext_get_actual_len(ex) - 1) {
 	} else {
@@ -2235,6 +2330,8 @@ int mlfs_ext_rm_idx(handle_t *handle, struct inode *inode,
 	int err;
 	mlfs_fsblk_t leaf;
 
+	mlfs_ext_invalidate_path(inode);
+
 	path--;
 	path = path + depth;
 	leaf = mlfs_idx_pblock(path->p_idx);
@@ -2574,6 +2671,8 @@ int mlfs_ext_remove_space(handle_t *handle, struct inode *inode,
 	struct mlfs_ext_path *path;
 	int i = 0, err = 0;
 
+	mlfs_ext_invalidate_path(inode);
+
 	mlfs_lsm_debug("truncate from %u(0x%x) to %u(0x%x)\n",
 			start << g_block_size_shift,
 			start << g_block_size_shift,
@@ -2780,6 +2879,8 @@ static int mlfs_ext_convert_to_initialized(handle_t *handle,
 
 	assert(le32_to_cpu(ex->ee_block) <= split);
 
+	mlfs_ext_invalidate_path(inode);
+
 	if (split + blocks ==
 			le32_to_cpu(ex->ee_block) + mlfs_ext_get_actual_len(ex)) {
 		/* split and initialize right part */
@@ -2929,6 +3030,17 @@ int mlfs_hashfs_get_blocks(handle_t *handle, struct inode *inode,
 	
 }
 
+// lookup cost of a file's own index type, reported per type.
+static inline void mlfs_hybrid_lookup_stats(struct inode *inode,
+		uint64_t tsc_start)
+{
+	if (enable_perf_stats && g_idx_choice == HYBRID) {
+		g_perf_stats.idx_lookup_tsc[inode->idx_type] +=
+			asm_rdtscp() - tsc_start;
+		g_perf_stats.idx_lookup_nr[inode->idx_type]++;
+	}
+}
+
 /* Core interface API to get/allocate blocks of an inode
  *
  * return > 0, number of of blocks already mapped/allocated
@@ -2949,7 +3061,8 @@ int mlfs_api_get_blocks(handle_t *handle, struct inode *inode,
 
 	struct mlfs_ext_path *path = NULL;
 	struct mlfs_extent newex, *ex;
-	int goal, err = 0, depth;
+	mlfs_fsblk_t goal = 0;
+	int err = 0, depth;
 	mlfs_lblk_t allocated = 0;
 	mlfs_fsblk_t next, newblock;
 	int create;
@@ -2990,6 +3103,8 @@ int mlfs_api_get_blocks(handle_t *handle, struct inode *inode,
 
     nblk = nblk > map_arr->m_len ? map_arr->m_len : nblk;
 
+    mlfs_hybrid_lookup_stats(inode, tsc_start);
+
     if (enable_perf_stats) {
         update_stats_dist(&(g_perf_stats.read_per_index),
                             g_perf_stats.path_storage_nr);
@@ -2999,6 +3114,270 @@ int mlfs_api_get_blocks(handle_t *handle, struct inode *inode,
     return nblk;
 }
 
+// append [lblk, lblk + len) -> pblk to runs, merging with the last run.
+static int mlfs_map_run_add(struct mlfs_map_run *runs, int *n_runs,
+		int max_runs, mlfs_lblk_t lblk, mlfs_fsblk_t pblk, uint32_t len)
+{
+	struct mlfs_map_run *last = *n_runs ? &runs[*n_runs - 1] : NULL;
+
+	if (last && last->m_lblk + last->m_len == lblk &&
+			last->m_pblk + last->m_len == pblk) {
+		last->m_len += len;
+		return 1;
+	}
+
+	if (*n_runs == max_runs)
+		return 0;
+
+	runs[*n_runs].m_lblk = lblk;
+	runs[*n_runs].m_pblk = pblk;
+	runs[*n_runs].m_len = len;
+	(*n_runs)++;
+
+	return 1;
+}
+
+/* Map [lblk, lblk + len) of an inode to runs of physically contiguous
+ * blocks. The extent tree and the API-backed indexes are asked once per
+ * run, however long it is. HashFS maps a block per hash entry, so it is
+ * asked MAX_GET_BLOCKS_RETURN blocks at a time and adjacent blocks are
+ * merged. Stops at a hole (lookup) or when runs is full.
+ *
+ * return >= 0, number of runs; *nr_found is the number of blocks they cover.
+ * return < 0, error from the index.
+ */
+int mlfs_get_block_runs(handle_t *handle, struct inode *inode,
+			mlfs_lblk_t lblk, uint32_t len, int flags,
+			struct mlfs_map_run *runs, int max_runs, uint32_t *nr_found)
+{
+	struct mlfs_map_blocks map;
+	struct mlfs_map_blocks_arr map_arr;
+	uint32_t done = 0;
+	int n_runs = 0, ret = 0, i;
+
+	while (done < len) {
+		if (IDXAPI_IS_HASHFS()) {
+			map_arr.m_lblk = lblk + done;
+			map_arr.m_len = len - done;
+			if (map_arr.m_len > MAX_GET_BLOCKS_RETURN)
+				map_arr.m_len = MAX_GET_BLOCKS_RETURN;
+			map_arr.m_flags = 0;
+
+			ret = mlfs_hashfs_get_blocks(handle, inode, &map_arr, flags);
+
+			// a SIMD lookup fails as a whole; the scalar one stops at the hole.
+			if (ret == 0 && map_arr.m_len == MAX_GET_BLOCKS_RETURN) {
+				map_arr.m_len--;
+				ret = mlfs_hashfs_get_blocks(handle, inode, &map_arr, flags);
+			}
+
+			if (ret <= 0)
+				break;
+
+			for (i = 0; i < ret; i++) {
+				if (!mlfs_map_run_add(runs, &n_runs, max_runs,
+							lblk + done, map_arr.m_pblk[i], 1))
+					goto out;
+				done++;
+			}
+
+			if (ret < map_arr.m_len)
+				break;
+		} else {
+			map.m_lblk = lblk + done;
+			map.m_len = len - done;
+			map.m_pblk = 0;
+			map.m_flags = 0;
+
+			ret = mlfs_ext_get_blocks(handle, inode, &map, flags);
+			if (ret <= 0)
+				break;
+
+			if (!mlfs_map_run_add(runs, &n_runs, max_runs,
+						map.m_lblk, map.m_pblk, ret))
+				break;
+			done += ret;
+		}
+	}
+
+out:
+	*nr_found = done;
+
+	return ret < 0 ? ret : n_runs;
+}
+
+#ifdef KERNFS
+// append a run to *runs like mlfs_map_run_add, growing the array as needed.
+void mlfs_map_runs_push(struct mlfs_map_run **runs, uint32_t *n_runs,
+		uint32_t *max_runs, mlfs_lblk_t lblk, mlfs_fsblk_t pblk, uint32_t len)
+{
+	int n = *n_runs;
+
+	if (*n_runs == *max_runs) {
+		*max_runs = *max_runs ? *max_runs * 2 : 64;
+		*runs = (struct mlfs_map_run *)realloc(*runs,
+				sizeof(struct mlfs_map_run) * *max_runs);
+		if (!*runs)
+			panic("cannot grow map runs\n");
+	}
+
+	mlfs_map_run_add(*runs, &n, *max_runs, lblk, pblk, len);
+	*n_runs = n;
+}
+
+/* Map the logical blocks of each run to blocks the caller already owns:
+ * the blocks from to on, run after run, or each run's own m_pblk if to is
+ * 0. No data block is allocated or freed. The API-backed indexes must have
+ * no mapping left for the runs; the extent tree replaces its mappings. */
+void mlfs_map_runs_remap(struct inode *inode, struct mlfs_map_run *runs,
+		uint32_t n_runs, mlfs_fsblk_t to)
+{
+	handle_t handle = {.dev = g_root_dev};
+	struct mlfs_map_blocks map;
+	struct dinode dinode;
+	uint32_t i;
+
+	if (!IDXAPI_IS_PER_FILE())
+		mlfs_ext_keep_data(true);
+
+	for (i = 0; i < n_runs; i++) {
+		mlfs_lblk_t l = runs[i].m_lblk;
+		mlfs_fsblk_t pblk = to ? to : runs[i].m_pblk;
+		uint32_t left = runs[i].m_len;
+		ssize_t n;
+
+		while (left) {
+			paddr_t got = 0;
+
+			if (IDXAPI_IS_PER_FILE()) {
+				idx_api_adopt_data(pblk, left);
+				n = FN(inode->ext_idx, im_create, inode->ext_idx,
+						inode->inum, l, left, &got);
+				idx_api_adopt_data(0, 0);
+			} else {
+				map.m_lblk = l;
+				map.m_pblk = pblk;
+				map.m_len = left;
+				map.m_flags = MLFS_MAP_REMAP;
+				n = mlfs_ext_get_blocks(&handle, inode, &map,
+						MLFS_GET_BLOCKS_CREATE_DATA);
+				got = map.m_pblk;
+			}
+
+			if (n <= 0 || got != pblk)
+				panic("remapping a file lost a block\n");
+
+			if (n > left)
+				n = left;
+			l += n;
+			pblk += n;
+			left -= n;
+		}
+
+		if (to)
+			to = pblk;
+	}
+
+	if (IDXAPI_IS_PER_FILE()) {
+		// im_create wrote the new root to the dinode.
+		(void)read_ondisk_inode(g_root_dev, inode->inum, &dinode);
+		memmove(inode->l1.addrs, dinode.l1_addrs, sizeof(addr_t) * (NDIRECT + 1));
+	} else {
+		mlfs_ext_keep_data(false);
+	}
+
+	mlfs_ext_invalidate_path(inode);
+	mlfs_mark_inode_dirty(inode);
+}
+#endif
+
+#ifdef REUSE_PREVIOUS_PATH
+/*
+ * Per-inode cache of the last extent path.
+ *
+ * Every change to the tree bumps inode->path_gen (see
+ * mlfs_ext_invalidate_path), so a cached path is used only while its
+ * generation is current, and only for blocks in [lo, hi), the range the
+ * index nodes on the path route into its leaf. A lookup there costs one
+ * binary search of that leaf. path_busy is a try-lock: a lookup that
+ * finds it taken walks the tree instead of waiting.
+ */
+static void mlfs_ext_cache_path(handle_t *handle, struct inode *inode,
+		struct mlfs_ext_path *path, uint32_t gen)
+{
+	struct mlfs_ext_path *old;
+	mlfs_lblk_t lo = 0, hi = EXT_MAX_BLOCKS;
+	int depth = path[0].p_depth, i;
+
+	for (i = 0; i < depth; i++) {
+		struct mlfs_extent_idx *ix = path[i].p_idx;
+
+		if (ix != EXT_FIRST_INDEX(path[i].p_hdr))
+			lo = max(lo, mlfs_idx_lblock(ix));
+		if (ix != EXT_LAST_INDEX(path[i].p_hdr))
+			hi = min(hi, mlfs_idx_lblock(ix + 1));
+	}
+
+	if (__sync_lock_test_and_set(&inode->path_busy, 1)) {
+		mlfs_ext_drop_refs(path);
+		mlfs_free(path);
+		return;
+	}
+
+	old = inode->previous_path;
+	inode->previous_path = path;
+	inode->previous_path_gen = gen;
+	inode->previous_path_lo = lo;
+	inode->previous_path_hi = hi;
+
+	__sync_lock_release(&inode->path_busy);
+
+	if (old) {
+		mlfs_ext_drop_refs(old);
+		mlfs_free(old);
+	}
+}
+
+/*
+ * Look up block in the leaf of the cached path. On a hit, copies the
+ * closest extent at or before block into ex and returns 1.
+ */
+static int mlfs_ext_cached_extent(struct inode *inode, mlfs_lblk_t block,
+		struct mlfs_extent *ex)
+{
+	struct mlfs_ext_path *path, leaf;
+	uint32_t gen = inode->path_gen;
+	int hit = 0;
+
+	if (!inode->previous_path)
+		return 0;
+
+	if (__sync_lock_test_and_set(&inode->path_busy, 1))
+		return 0;
+
+	path = inode->previous_path;
+	if (path && inode->previous_path_gen == gen &&
+			block >= inode->previous_path_lo &&
+			block < inode->previous_path_hi) {
+		leaf = path[path[0].p_depth];
+		leaf.p_ext = NULL;
+		mlfs_ext_binsearch(inode, &leaf, block);
+		if (leaf.p_ext) {
+			*ex = *leaf.p_ext;
+			hit = 1;
+		}
+	}
+
+	__sync_lock_release(&inode->path_busy);
+
+	// the tree changed under us.
+	if (hit && inode->path_gen != gen)
+		hit = 0;
+
+	return hit;
+}
+#endif
+
 /* Core interface API to get/allocate blocks of an inode
  *
  * return > 0, number of of blocks already mapped/allocated
@@ -3019,11 +3398,15 @@ int mlfs_ext_get_blocks(handle_t *handle, struct inode *inode,
 
 	struct mlfs_ext_path *path = NULL;
 	struct mlfs_extent newex, *ex;
-	int goal, err = 0, depth;
+	mlfs_fsblk_t goal = 0;
+	int err = 0, depth;
 	mlfs_lblk_t allocated = 0;
 	mlfs_fsblk_t next, newblock;
 	int create;
 	uint64_t tsc_start = 0;
+#ifdef REUSE_PREVIOUS_PATH
+	uint32_t path_gen;
+#endif
 
 	mlfs_assert(handle != NULL);
 
@@ -3044,9 +3427,16 @@ int mlfs_ext_get_blocks(handle_t *handle, struct inode *inode,
 
     if (IDXAPI_IS_PER_FILE()) {
         if (create) {
+#ifdef KERNFS
+            idx_api_data_goal(inode,
+                    mlfs_prealloc_note_create(inode, map->m_lblk, map->m_len));
+#endif
             ssize_t nblk = FN(inode->ext_idx, im_create,
                               inode->ext_idx, inode->inum, map->m_lblk, 
                               map->m_len, &map->m_pblk);
+#ifdef KERNFS
+            idx_api_data_goal(NULL, 0);
+#endif
             //map->m_len = nblk > 0 ? nblk : map->m_len;
             //nblk = map->m_len < nblk ? map->m_len : nblk;
 
@@ -3076,6 +3466,8 @@ int mlfs_ext_get_blocks(handle_t *handle, struct inode *inode,
                               map->m_len, &map->m_pblk);
             nblk = nblk > map->m_len ? map->m_len : nblk;
 
+            mlfs_hybrid_lookup_stats(inode, tsc_start);
+
             if (enable_perf_stats) {
                 update_stats_dist(&(g_perf_stats.read_per_index),
                                   g_perf_stats.path_storage_nr);
@@ -3129,50 +3521,24 @@ int mlfs_ext_get_blocks(handle_t *handle, struct inode *inode,
 	/*mutex_lock(&inode->truncate_mutex);*/
 
 #ifdef REUSE_PREVIOUS_PATH
-	if (create) {
-		mlfs_ext_drop_refs(inode->previous_path); 
-        mlfs_free(inode->previous_path); //TODO: for continue debug
-		inode->previous_path = NULL;
-		goto find_ext_path;
-	}
-
-	if (!inode->previous_path || (map->m_flags & MLFS_MAP_LOG_ALLOC))
-		goto find_ext_path;
+	path_gen = inode->path_gen;
 
-	struct mlfs_ext_path * _path = inode->previous_path;
-	depth = ext_depth(handle, inode);
-	ex = _path[depth].p_ext;
-	if (ex) {
-		mlfs_lblk_t ee_block = le32_to_cpu(ex->ee_block);
-		mlfs_fsblk_t ee_start = mlfs_ext_pblock(ex);
-		unsigned short ee_len;
+	if (!(map->m_flags & (MLFS_MAP_LOG_ALLOC | MLFS_MAP_REMAP)) &&
+			mlfs_ext_cached_extent(inode, map->m_lblk, &newex)) {
+		mlfs_lblk_t ee_block = le32_to_cpu(newex.ee_block);
+		unsigned short ee_len = mlfs_ext_get_actual_len(&newex);
 
-		/*
-		 * unwritten extents are treated as holes, except that
-		 * we split out initialized portions during a write.
-		 */
-		ee_len = mlfs_ext_get_actual_len(ex);
-
-		/* find extent covers block. simply return the extent */
-		if (in_range(map->m_lblk, ee_block, ee_len)) {
+		/* mapped blocks are returned as they are, create or not */
+		if (in_range(map->m_lblk, ee_block, ee_len) &&
+				!mlfs_ext_is_unwritten(&newex)) {
 			allocated = ee_len + ee_block - map->m_lblk;
-
-			if (!mlfs_ext_is_unwritten(ex)) {
-				newblock = map->m_lblk - ee_block + ee_start;
-				inode->invalidate_path = 0;
-				goto out;
-			}
+			newblock = map->m_lblk - ee_block + mlfs_ext_pblock(&newex);
+			if (enable_perf_stats)
+				g_perf_stats.path_cache_hit_nr++;
+			goto out;
 		}
 	}
-
-#if 0
-	mlfs_ext_drop_refs(_path);
-	mlfs_free(_path);
-	inode->previous_path = NULL;
-#endif
-
 #endif
-find_ext_path:
 
 	/* find extent for this block */
 	path = mlfs_find_extent(handle, inode, map->m_lblk, NULL, 0);
@@ -3182,14 +3548,6 @@ find_ext_path:
 		goto out2;
 	}
 
-#if defined(REUSE_PREVIOUS_PATH)
-    if (inode->previous_path) {
-        mlfs_ext_drop_refs(inode->previous_path);
-        mlfs_free(inode->previous_path);
-        inode->previous_path = NULL;
-    }
-#endif
-
 	depth = ext_depth(handle, inode);
 
 	/*
@@ -3221,7 +3579,7 @@ find_ext_path:
 			// FIXME: this is slightly inefficient since it searches mlfs_ext_path repeatedly
 			// Deletion of original block and allocating new block could be merged
 			// by a new API.
-			if (map->m_flags & MLFS_MAP_LOG_ALLOC) {
+			if (map->m_flags & (MLFS_MAP_LOG_ALLOC | MLFS_MAP_REMAP)) {
 				int ret;
 				ret = mlfs_ext_truncate(handle, inode, map->m_lblk,
 						map->m_lblk + map->m_len - 1);
@@ -3288,10 +3646,19 @@ find_ext_path:
 	if (allocated > map->m_len)
 		allocated = map->m_len;
 
-	//goal = mlfs_ext_find_goal(inode, path, map->m_lblk);
+	goal = mlfs_ext_find_goal(inode, path, map->m_lblk);
+#ifdef KERNFS
+	(void)mlfs_prealloc_note_create(inode, map->m_lblk, allocated);
+#endif
 
-	newblock = mlfs_new_data_blocks(handle, inode,
-			goal, flags, &allocated, &err);
+	if (map->m_flags & MLFS_MAP_REMAP) {
+		// the old blocks are truncated above; take over m_pblk.
+		if (allocated > EXT_INIT_MAX_LEN)
+			allocated = EXT_INIT_MAX_LEN;
+		newblock = map->m_pblk;
+	} else
+		newblock = mlfs_new_data_blocks(handle, inode,
+				goal, flags, &allocated, &err);
 
 	if (!newblock)
 		goto out2;
@@ -3334,17 +3701,11 @@ out:
 	map->m_pblk = newblock;
 	map->m_len = allocated;
 #ifdef REUSE_PREVIOUS_PATH
-	if (inode->invalidate_path) {
-		inode->invalidate_path = 0;
-		mlfs_ext_drop_refs(inode->previous_path); 
-        mlfs_free(inode->previous_path); //TODO: for continue debug
-		inode->previous_path = NULL;
-	}
-	else {
-		inode->previous_path = path;
+	// keep the path for the next lookup unless this call changed the tree.
+	if (path && inode->path_gen == path_gen) {
+		mlfs_ext_cache_path(handle, inode, path, path_gen);
 		path = NULL;
 	}
-
 #endif
 out2:
 	if (path) {
@@ -3372,6 +3733,11 @@ out2:
 int mlfs_ext_truncate(handle_t *handle, struct inode *inode,
 		mlfs_lblk_t start, mlfs_lblk_t end)
 {
+#ifdef KERNFS
+	mlfs_ext_discard_prealloc(inode);
+	inode->pa_goal = 0;
+	inode->pa_appends = 0;
+#endif
 
 	if(IDXAPI_IS_HASHFS()) {
 		size_t rc = 0;
@@ -188,6 +188,8 @@ struct mlfs_ext_path {
 #define MLFS_MAP_NEW        (1 << 0)
 #define MLFS_MAP_LOG_ALLOC  (1 << 1)
 #define MLFS_MAP_GC_ALLOC   (1 << 2)
+// m_pblk holds blocks the caller owns; map them instead of allocating.
+#define MLFS_MAP_REMAP      (1 << 3)
 #define MAX_GET_BLOCKS_RETURN 8
 #define MAX_NUM_BLOCKS_LOOKUP 256
 
@@ -205,6 +207,13 @@ struct mlfs_map_blocks_arr {
 	uint32_t m_flags;
 };
 
+// a run of file blocks that are also contiguous on the device.
+struct mlfs_map_run {
+	mlfs_lblk_t m_lblk;
+	mlfs_fsblk_t m_pblk;
+	uint32_t m_len;
+};
+
 struct mlfs_pblks {
 	mlfs_fsblk_t m_pblk[MAX_NUM_BLOCKS_LOOKUP];
 	uint32_t m_lens[MAX_NUM_BLOCKS_LOOKUP];
@@ -399,7 +408,28 @@ static inline void mlfs_idx_store_pblock(struct mlfs_extent_idx *ix,
 	__mlfs_ext_dirty(__func__, __LINE__, (handle), (inode), (path))
 
 int mlfs_ext_alloc_blocks(handle_t *handle, struct inode *inode,
-		int goal, unsigned int flags, mlfs_fsblk_t *blockp, mlfs_lblk_t *count);
+		mlfs_fsblk_t goal, unsigned int flags, mlfs_fsblk_t *blockp,
+		mlfs_lblk_t *count);
+
+/* Pre-allocation for append streams. Once a file has been extended
+ * PREALLOC_MIN_APPENDS times in a row, the next data allocation also
+ * reserves a window of MLFS_PREALLOC_BLOCKS blocks (default
+ * PREALLOC_DEFAULT_BLOCKS, 0 disables) right after its own blocks, and
+ * later appends are served from the window so the file stays in one run.
+ * The window is held in memory only: its blocks are off the free lists
+ * but not set in the bitmap, so a crash or remount simply frees them.
+ * Truncate, unlink, the last iput and unmount give the window back.
+ */
+#define PREALLOC_MIN_APPENDS 2
+#define PREALLOC_DEFAULT_BLOCKS 256
+
+#ifdef KERNFS
+int mlfs_new_file_blocks(struct super_block *sb, struct inode *inode,
+		mlfs_fsblk_t goal, unsigned int num, mlfs_fsblk_t *blockp);
+void mlfs_ext_discard_prealloc(struct inode *inode);
+// while set, truncating this thread's extents frees no data blocks.
+void mlfs_ext_keep_data(bool keep);
+#endif
 
 int mlfs_ext_get_blocks(handle_t *handle, struct inode *inode,
 			struct mlfs_map_blocks *map, int flags);
@@ -407,6 +437,15 @@ int mlfs_hashfs_get_blocks(handle_t *handle, struct inode *inode,
 			struct mlfs_map_blocks_arr *map_arr, int flags);
 int mlfs_api_get_blocks(handle_t *handle, struct inode *inode, 
 			struct mlfs_map_blocks_arr *map_arr, int flags);
+int mlfs_get_block_runs(handle_t *handle, struct inode *inode,
+			mlfs_lblk_t lblk, uint32_t len, int flags,
+			struct mlfs_map_run *runs, int max_runs, uint32_t *nr_found);
+#ifdef KERNFS
+void mlfs_map_runs_push(struct mlfs_map_run **runs, uint32_t *n_runs,
+		uint32_t *max_runs, mlfs_lblk_t lblk, mlfs_fsblk_t pblk, uint32_t len);
+void mlfs_map_runs_remap(struct inode *inode, struct mlfs_map_run *runs,
+		uint32_t n_runs, mlfs_fsblk_t to);
+#endif
 
 struct mlfs_ext_path *mlfs_find_extent(handle_t *handle, struct inode *inode,
 		mlfs_lblk_t block, struct mlfs_ext_path **orig_path, int flags);
@@ -422,6 +461,16 @@ extern pthread_mutex_t block_bitmap_mutex;
 
 int mlfs_mark_inode_dirty(struct inode *inode);
 
+#ifdef REUSE_PREVIOUS_PATH
+// any change to the extent tree of inode makes its cached path stale.
+static inline void mlfs_ext_invalidate_path(struct inode *inode)
+{
+	__sync_fetch_and_add(&inode->path_gen, 1);
+}
+#else
+#define mlfs_ext_invalidate_path(inode) do { } while (0)
+#endif
+
 void mlfs_free_blocks(handle_t *handle, struct inode *inode,
 		void *fake, mlfs_fsblk_t block, int count, int flags);
 
@@ -25,6 +25,8 @@
 #include "inode_hash.h"
 #include "lpmem_ghash.h"
 #include "undo_log.h"
+#include "idx_hybrid.h"
+#include "defrag.h"
 
 #define _min(a, b) ({\
 		__typeof__(a) _a = a;\
@@ -127,6 +129,10 @@ typedef struct file_io_vector {
 	offset_t offset;
 	uint32_t length;
 	addr_t blknr;
+	// byte offset of the data in blknr (see logheader.log_offset).
+	uint32_t log_offset;
+	// blknr is a leased shared-area block (see logheader.remap_mask).
+	uint8_t remap;
 	uint32_t n_list;
 	struct list_head iov_blk_list;
 	mlfs_hash_t hh;
@@ -157,11 +163,22 @@ struct replay_list {
 };
 
 struct digest_arg {
+#ifdef DIGEST_SHM_RING
+	struct digest_ring *ring;
+	digest_req_t req;
+#else
 	int sock_fd;
 	struct sockaddr_un cli_addr;
 	char msg[MAX_SOCK_BUF];
+#endif
 };
 
+#ifdef DIGEST_SHM_RING
+static struct digest_ring_area *digest_rings;
+// serializes ack producers of a ring when the thread pool has several workers.
+static pthread_spinlock_t digest_ack_lock[g_n_devices];
+#endif
+
 struct f_digest_worker_arg {
 	uint8_t from_dev;
 	uint8_t to_dev;
@@ -197,8 +214,47 @@ void show_kernfs_stats(void)
 	json_object *root = json_object_new_object();
     js_add_int64(root, "digest", g_perf_stats.digest_time_tsc);
     js_add_int64(root, "metadata_blocks", g_perf_stats.balloc_meta_nr);
+    js_add_int64(root, "balloc_steal", mlfs_count_steals(sb[g_root_dev]));
+    js_add_int64(root, "balloc_goal_hit", mlfs_count_goal_hits(sb[g_root_dev]));
+    json_object *prealloc = json_object_new_object(); {
+        js_add_int64(prealloc, "hit", g_perf_stats.prealloc_hit_nr);
+        js_add_int64(prealloc, "blocks", g_perf_stats.prealloc_blocks);
+        json_object_object_add(root, "prealloc", prealloc);
+    }
+    json_object *defrag = json_object_new_object(); {
+        js_add_int64(defrag, "files", g_perf_stats.defrag_files);
+        js_add_int64(defrag, "blocks", g_perf_stats.defrag_blocks);
+        js_add_int64(defrag, "fragments", g_perf_stats.defrag_frags);
+        js_add_int64(defrag, "tsc", g_perf_stats.defrag_tsc);
+        json_object_object_add(root, "defrag", defrag);
+    }
+    json_object *undo = json_object_new_object(); {
+        js_add_int64(undo, "tsc", g_perf_stats.undo_tsc);
+        js_add_int64(undo, "nr", g_perf_stats.undo_nr);
+        js_add_int64(undo, "fences", g_perf_stats.undo_fence_nr);
+        json_object_object_add(root, "undo", undo);
+    }
     js_add_int64(root, "path_search", g_perf_stats.path_search_tsc);
     js_add_int64(root, "path_storage", g_perf_stats.path_storage_tsc);
+    json_object *remap = json_object_new_object(); {
+        js_add_int64(remap, "nr", g_perf_stats.digest_remap_nr);
+        js_add_int64(remap, "blocks", g_perf_stats.digest_remap_blocks);
+        json_object_object_add(root, "remap", remap);
+    }
+    js_add_int64(root, "hashfs_compact", g_perf_stats.hashfs_compact_nr);
+    if (g_idx_choice == HYBRID) {
+        json_object *hybrid = json_object_new_object();
+        for (int t = 0; t < NONE; t++) {
+            if (!g_perf_stats.idx_lookup_nr[t]) continue;
+            json_object *lookup = json_object_new_object();
+            js_add_int64(lookup, "tsc", g_perf_stats.idx_lookup_tsc[t]);
+            js_add_int64(lookup, "nr", g_perf_stats.idx_lookup_nr[t]);
+            json_object_object_add(hybrid, idx_choice_name(t), lookup);
+        }
+        js_add_int64(hybrid, "convert_nr", g_perf_stats.hybrid_convert_nr);
+        js_add_int64(hybrid, "convert_blocks", g_perf_stats.hybrid_convert_blocks);
+        json_object_object_add(root, "hybrid", hybrid);
+    }
     json_object *storage = json_object_new_object(); {
         js_add_int64(storage, "rtsc", storage_rtsc.total);
         js_add_int64(storage, "rnr" , storage_rnr.total);
@@ -210,6 +266,7 @@ void show_kernfs_stats(void)
         js_add_int64(search, "total_time", g_perf_stats.path_search_tsc);
         js_add_int64(search, "total_blocks", g_perf_stats.path_search_size);
         js_add_int64(search, "nr_search", g_perf_stats.path_search_nr);
+        js_add_int64(search, "path_cache_hit", g_perf_stats.path_cache_hit_nr);
         json_object_object_add(root, "search", search);
     }
     add_cache_stats_to_json(root, "idx_cache", &(g_perf_stats.cache_stats)); 
@@ -257,12 +314,15 @@ void show_kernfs_stats(void)
 	printf("n_digest_skipped: %lu (%.1f %%)\n",
 			g_perf_stats.n_digest_skipped,
 			((float)g_perf_stats.n_digest_skipped * 100.0) / (float)n_digest);
+	printf("remapped        : %lu blocks / %lu ops\n",
+			g_perf_stats.digest_remap_blocks, g_perf_stats.digest_remap_nr);
 	printf("path search     : %lu / %lu (%.1f tsc/op)\n",
 			g_perf_stats.path_search_tsc, g_perf_stats.path_search_nr,
             (float)g_perf_stats.path_search_tsc / (float)g_perf_stats.path_search_nr);
 	printf("-- blocks indexed: %lu blocks / %lu ops (%.1f tsc/blk)\n",
 			g_perf_stats.path_search_size, g_perf_stats.path_search_nr,
             (float)g_perf_stats.path_search_tsc / (float)g_perf_stats.path_search_size);
+	printf("-- cached path hits: %lu\n", g_perf_stats.path_cache_hit_nr);
     printf("-- balloc: \n");
     printf("---- time per op : %lu / %lu (%.1f) tsc/op\n",
             g_perf_stats.balloc_tsc, g_perf_stats.balloc_nr, 
@@ -270,13 +330,34 @@ void show_kernfs_stats(void)
     printf("---- time per blk: %lu / %lu (%.1f) tsc/blk\n",
             g_perf_stats.balloc_tsc, g_perf_stats.balloc_nblk, 
             (float)g_perf_stats.balloc_tsc / (float)g_perf_stats.balloc_nblk);
-    printf("UNDO: %lu / %lu (%.1f) tsc/op\n",
+    printf("UNDO: %lu / %lu (%.1f) tsc/op, %lu fences\n",
             g_perf_stats.undo_tsc, g_perf_stats.undo_nr,
-            (float)g_perf_stats.undo_tsc / (float)g_perf_stats.undo_nr);
+            (float)g_perf_stats.undo_tsc / (float)g_perf_stats.undo_nr,
+            g_perf_stats.undo_fence_nr);
     printf("---- blk per op  : %lu / %lu (%.1f) blk/op\n",
             g_perf_stats.balloc_nblk, g_perf_stats.balloc_nr, 
             (float)g_perf_stats.balloc_nblk / (float)g_perf_stats.balloc_nr);
+    printf("---- stolen      : %lu allocs (%u free lists)\n",
+            mlfs_count_steals(sb[g_root_dev]), sb[g_root_dev]->n_partition);
+    printf("---- at goal     : %lu allocs\n", mlfs_count_goal_hits(sb[g_root_dev]));
+    printf("---- prealloc    : %lu hits / %lu blocks reserved\n",
+            g_perf_stats.prealloc_hit_nr, g_perf_stats.prealloc_blocks);
 	printf("total migrated  : %lu MB\n", g_perf_stats.total_migrated_mb);
+	printf("defragmented    : %lu files / %lu blocks (%lu fragments, %lu tsc)\n",
+			g_perf_stats.defrag_files, g_perf_stats.defrag_blocks,
+			g_perf_stats.defrag_frags, g_perf_stats.defrag_tsc);
+	if (IDXAPI_IS_HASHFS())
+		printf("hashfs compact  : %lu tombstones\n", g_perf_stats.hashfs_compact_nr);
+	if (g_idx_choice == HYBRID) {
+		for (int t = 0; t < NONE; t++) {
+			if (!g_perf_stats.idx_lookup_nr[t]) continue;
+			printf("lookup %-10.10s: %lu / %lu (%.1f tsc/op)\n", idx_choice_name(t),
+					g_perf_stats.idx_lookup_tsc[t], g_perf_stats.idx_lookup_nr[t],
+					(float)g_perf_stats.idx_lookup_tsc[t] / (float)g_perf_stats.idx_lookup_nr[t]);
+		}
+		printf("index converted : %lu files / %lu blocks\n",
+				g_perf_stats.hybrid_convert_nr, g_perf_stats.hybrid_convert_blocks);
+	}
 	printf("--------------------------------------\n");
     print_cache_stats(&(g_perf_stats.cache_stats));
 #ifdef STORAGE_PERF
@@ -441,6 +522,9 @@ int digest_inode(uint8_t from_dev, uint8_t to_dev,
 		inode->i_sb = sb;
 		inode->i_generation = 0;
 		inode->i_data_dirty = 0;
+
+		if (g_idx_choice == HYBRID && inode->itype == T_FILE)
+			idx_hybrid_reset(inode);
 	}
 
 	if (inode->itype == T_FILE) {
@@ -595,8 +679,49 @@ int digest_directory(uint8_t from_dev, uint8_t to_dev, int n, uint8_t type,
 	return 0;
 }
 
+// find the inode of a file being digested and extend it to size.
+static struct inode *digest_file_inode(uint32_t file_inum, offset_t size)
+{
+	struct inode *file_inode;
+
+	file_inode = icache_find(g_root_dev, file_inum);
+	if (!file_inode) {
+		struct dinode dip;
+		file_inode = icache_alloc_add(g_root_dev, file_inum);
+
+		read_ondisk_inode(g_root_dev, file_inum, &dip);
+		mlfs_assert(dip.itype != 0);
+
+		sync_inode_from_dinode(file_inode, &dip);
+
+		mlfs_assert(dip.dev != 0);
+	}
+
+	mlfs_assert(file_inode->dev != 0);
+	mlfs_assert(!(file_inode->flags & I_DELETING));
+
+	// update file inode length and mtime.
+	if (file_inode->size < size) {
+		/* Inode size should be synchronized among other layers.
+		 * So, update both inodes */
+		file_inode->size = size;
+
+		mlfs_mark_inode_dirty(file_inode);
+	}
+
+	return file_inode;
+}
+
+// runs mapped by one mlfs_get_block_runs call in digest_file.
+#define DIGEST_MAX_RUNS 16
+
+/* Copy a logged write to the shared area. The data is at log_offset of
+ * log block blknr: small writes are either laid out as in the file block
+ * or packed in a pack block shared by several transactions, larger ones
+ * start block aligned.
+ */
 int digest_file(uint8_t from_dev, uint8_t to_dev, uint32_t file_inum,
-		offset_t offset, uint32_t length, addr_t blknr)
+		offset_t offset, uint32_t length, addr_t blknr, uint32_t log_offset)
 {
 	int ret;
 	uint32_t offset_in_block = 0;
@@ -631,32 +756,14 @@ int digest_file(uint8_t from_dev, uint8_t to_dev, uint32_t file_inum,
 
 	// Storage to storage copy.
 	// FIXME: this does not work if migrating block from SSD to NVM.
-	data = g_bdev[from_dev]->map_base_addr + (blknr << g_block_size_shift);
-
-	file_inode = icache_find(g_root_dev, file_inum);
-	if (!file_inode) {
-		struct dinode dip;
-		file_inode = icache_alloc_add(g_root_dev, file_inum);
-
-		read_ondisk_inode(g_root_dev, file_inum, &dip);
-		mlfs_assert(dip.itype != 0);
-
-		sync_inode_from_dinode(file_inode, &dip);
-
-		mlfs_assert(dip.dev != 0);
-	}
+	data = g_bdev[from_dev]->map_base_addr + (blknr << g_block_size_shift) +
+		log_offset;
 
-	mlfs_assert(file_inode->dev != 0);
-	mlfs_assert(!(file_inode->flags & I_DELETING));
-
-	// update file inode length and mtime.
-	if (file_inode->size < offset + length) {
-		/* Inode size should be synchronized among other layers.
-		 * So, update both inodes */
-		file_inode->size = offset + length;
+	file_inode = digest_file_inode(file_inum, offset + length);
 
-		mlfs_mark_inode_dirty(file_inode);
-	}
+	if (g_idx_choice == HYBRID)
+		idx_hybrid_note_write(file_inode, offset >> g_block_size_shift,
+				nr_blocks);
 
 	nr_digested_blocks = 0;
 	cur_offset = offset;
@@ -693,7 +800,7 @@ int digest_file(uint8_t from_dev, uint8_t to_dev, uint32_t file_inum,
 
 		mlfs_assert(bh_data);
 
-		bh_data->b_data = data + offset_in_block; 
+		bh_data->b_data = data;
 		bh_data->b_size = _len; 
 		bh_data->b_offset = offset_in_block; 
 
@@ -735,61 +842,33 @@ int digest_file(uint8_t from_dev, uint8_t to_dev, uint32_t file_inum,
 	}
 
 	while (nr_digested_blocks < nr_blocks) {
-		int nr_block_get = 0, i;
+		struct mlfs_map_run runs[DIGEST_MAX_RUNS];
+		uint32_t nr_block_get = 0;
+		int n_runs, i;
 
 		mlfs_assert((cur_offset % g_block_size_bytes) == 0);
-		if(IDXAPI_IS_HASHFS()) {
-			map_arr.m_lblk = (cur_offset >> g_block_size_shift);
-		// map.m_pblk = 0;
-			map_arr.m_len = min(MAX_GET_BLOCKS_RETURN, nr_blocks - nr_digested_blocks);
-			map_arr.m_flags = 0;
-			// find block address of offset and update extent tree
-			if (to_dev == g_ssd_dev || to_dev == g_hdd_dev) {
-				//make kernelFS do log-structured update.
-				//map.m_flags |= MLFS_MAP_LOG_ALLOC;
-				nr_block_get = mlfs_hashfs_get_blocks(&handle, file_inode, &map_arr,
-						MLFS_GET_BLOCKS_CREATE_DATA);
-			} else {
-				nr_block_get = mlfs_hashfs_get_blocks(&handle, file_inode, &map_arr,
-						MLFS_GET_BLOCKS_CREATE_DATA);
-			}
-			for(uint32_t i = 0; i < nr_block_get; ++i) {
-				if(to_lookup.dyn) {
-					to_lookup.m_pblk_dyn[to_lookup.size] = map_arr.m_pblk[i];
-					to_lookup.m_lens_dyn[to_lookup.size] = 1;
-				} else {
-					to_lookup.m_pblk[to_lookup.size] = map_arr.m_pblk[i];
-					to_lookup.m_lens[to_lookup.size] = 1;
-				}
-				++to_lookup.size;
-			}
-		}	
-		else {
-			map.m_lblk = (cur_offset >> g_block_size_shift);
-			map.m_pblk = 0;
-			map.m_len = nr_blocks - nr_digested_blocks;
-			map.m_flags = 0;
-			// find block address of offset and update extent tree
-			if (to_dev == g_ssd_dev || to_dev == g_hdd_dev) {
-				//make kernelFS do log-structured update.
-				//map.m_flags |= MLFS_MAP_LOG_ALLOC;
-				nr_block_get = mlfs_ext_get_blocks(&handle, file_inode, &map,
-						MLFS_GET_BLOCKS_CREATE_DATA);
-			} else {
-				nr_block_get = mlfs_ext_get_blocks(&handle, file_inode, &map,
-						MLFS_GET_BLOCKS_CREATE_DATA);
-			}
 
+		// find block addresses of the range and update the index,
+		// one lookup per physically contiguous run.
+		//make kernelFS do log-structured update for SSD and HDD.
+		//map.m_flags |= MLFS_MAP_LOG_ALLOC;
+		n_runs = mlfs_get_block_runs(&handle, file_inode,
+				(cur_offset >> g_block_size_shift),
+				nr_blocks - nr_digested_blocks, MLFS_GET_BLOCKS_CREATE_DATA,
+				runs, DIGEST_MAX_RUNS, &nr_block_get);
+		mlfs_assert(n_runs > 0);
+
+		for (i = 0; i < n_runs; i++) {
 			if(to_lookup.dyn) {
-				to_lookup.m_pblk_dyn[to_lookup.size] = map.m_pblk;
-				to_lookup.m_lens_dyn[to_lookup.size] = nr_block_get;
+				to_lookup.m_pblk_dyn[to_lookup.size] = runs[i].m_pblk;
+				to_lookup.m_lens_dyn[to_lookup.size] = runs[i].m_len;
 			} else {
-				to_lookup.m_pblk[to_lookup.size] = map.m_pblk;
-				to_lookup.m_lens[to_lookup.size] = nr_block_get;
+				to_lookup.m_pblk[to_lookup.size] = runs[i].m_pblk;
+				to_lookup.m_lens[to_lookup.size] = runs[i].m_len;
 			}
 			++to_lookup.size;
 		}
-		
+
 		// mlfs_assert(map.m_pblk != 0);
 
 		mlfs_assert(nr_block_get <= (nr_blocks - nr_digested_blocks));
@@ -830,6 +909,110 @@ int digest_file(uint8_t from_dev, uint8_t to_dev, uint32_t file_inum,
 	return 0;
 }
 
+/* Shared-area blocks leased to a libfs for large writes (see
+ * remap_lease_alloc). They belong to the lease holder until a digest
+ * maps them into a file or they are given back. Like a pre-allocation
+ * window, a lease is off the free lists but not set in the bitmap until
+ * digest_file_remap maps it, so nothing about it is persisted: the
+ * unused part of a lease held by a crashed libfs is free again after
+ * the next mount.
+ */
+static void remap_release(addr_t blknr, uint32_t nr)
+{
+	int ret;
+
+	ret = mlfs_free_blocks_node(sb[g_root_dev], blknr, nr, 0, 0);
+	mlfs_assert(ret == 0);
+}
+
+#ifdef DIGEST_REMAP
+#if defined(DIGEST_OPT) && defined(EXPERIMENTAL)
+#error "DIGEST_REMAP is not supported by the EXPERIMENTAL file digest"
+#endif
+
+// upper bound of blocks granted by a single lease.
+#define REMAP_LEASE_MAX_BLOCKS 16384
+
+// returns the first leased block and sets *nr to the number leased.
+static addr_t remap_lease_alloc(uint32_t *nr)
+{
+	struct super_block *root_sb = sb[g_root_dev];
+	unsigned long blknr;
+	int ret;
+
+	ret = mlfs_new_blocks(root_sb, &blknr,
+			min(*nr, (uint32_t)REMAP_LEASE_MAX_BLOCKS), 0, 0, DATA, 0);
+	if (ret <= 0) {
+		*nr = 0;
+		return 0;
+	}
+
+	*nr = ret;
+	return blknr;
+}
+#endif
+
+/* Digest a large write whose data libfs put in leased shared-area
+ * blocks starting at blknr: the blocks are set in the bitmap, mapped into
+ * the extent tree in place, and the blocks they replace are freed.
+ * Nothing is copied.
+ */
+int digest_file_remap(uint8_t to_dev, uint32_t file_inum,
+		offset_t offset, uint32_t length, addr_t blknr)
+{
+	struct inode *file_inode;
+	struct mlfs_map_blocks map;
+	uint32_t nr_blocks, nr_digested_blocks = 0;
+	handle_t handle = {.dev = to_dev};
+	int ret;
+
+	mlfs_debug("[FILE] (remap) inum %d offset %lu length %u @ %lu\n",
+			file_inum, offset, length, blknr);
+
+	mlfs_assert(to_dev == g_root_dev);
+	mlfs_assert((offset % g_block_size_bytes) == 0);
+	mlfs_assert((length % g_block_size_bytes) == 0);
+
+	nr_blocks = length >> g_block_size_shift;
+
+	// only the extent tree can point at arbitrary blocks.
+	if (g_idx_choice != NONE) {
+		ret = digest_file(g_root_dev, to_dev, file_inum,
+				offset, length, blknr, 0);
+		remap_release(blknr, nr_blocks);
+		return ret;
+	}
+
+	file_inode = digest_file_inode(file_inum, offset + length);
+
+	// the blocks leave the lease; a crash before commit makes them free.
+	balloc_undo_log(blknr, nr_blocks, 0);
+	bitmap_bits_set_range(sb[g_root_dev]->s_blk_bitmap, blknr, nr_blocks);
+	sb[g_root_dev]->used_blocks += nr_blocks;
+
+	while (nr_digested_blocks < nr_blocks) {
+		map.m_lblk = (offset >> g_block_size_shift) + nr_digested_blocks;
+		map.m_pblk = blknr + nr_digested_blocks;
+		map.m_len = nr_blocks - nr_digested_blocks;
+		map.m_flags = MLFS_MAP_REMAP;
+
+		ret = mlfs_ext_get_blocks(&handle, file_inode, &map,
+				MLFS_GET_BLOCKS_CREATE_DATA);
+
+		mlfs_assert(ret > 0);
+		mlfs_assert(map.m_pblk == blknr + nr_digested_blocks);
+
+		nr_digested_blocks += ret;
+	}
+
+	if (enable_perf_stats) {
+		g_perf_stats.digest_remap_nr++;
+		g_perf_stats.digest_remap_blocks += nr_blocks;
+	}
+
+	return 0;
+}
+
 //FIXME: this function is not synchronized with up-to-date
 //changes. Refer digest_file to update this function.
 int digest_file_iovec(uint8_t from_dev, uint8_t to_dev,
@@ -934,7 +1117,7 @@ int digest_file_iovec(uint8_t from_dev, uint8_t to_dev,
 
 		bh_data = bh_get_sync_IO(to_dev, map.m_pblk, BH_NO_DATA_ALLOC);
 
-		bh_data->b_data = data + offset_in_block;
+		bh_data->b_data = data + iovec->log_offset;
 		bh_data->b_size = _len;
 		bh_data->b_offset = offset_in_block;
 
@@ -1167,12 +1350,20 @@ static void digest_each_log_entries(uint8_t from_dev, loghdr_meta_t *loghdr_meta
 				// for NVM bypassing test
 				//dest_dev = g_ssd_dev;
 #endif
-				ret = digest_file(from_dev,
-						dest_dev,
-						loghdr->inode_no[i],
-						loghdr->data[i],
-						loghdr->length[i],
-						loghdr->blocks[i]);
+				if (loghdr->remap_mask & (1ULL << i))
+					ret = digest_file_remap(dest_dev,
+							loghdr->inode_no[i],
+							loghdr->data[i],
+							loghdr->length[i],
+							loghdr->blocks[i]);
+				else
+					ret = digest_file(from_dev,
+							dest_dev,
+							loghdr->inode_no[i],
+							loghdr->data[i],
+							loghdr->length[i],
+							loghdr->blocks[i],
+							loghdr->log_offset[i]);
 				mlfs_assert(!ret);
 
 				if (enable_perf_stats)
@@ -1292,8 +1483,8 @@ static void digest_replay_and_optimize(uint8_t from_dev,
 				f_iovec_t *f_iovec;
 				f_blklist_t *_blk_list;
 				lru_key_t k;
-				offset_t iovec_key;
-				int found = 0;
+				offset_t iovec_key, cur_offset, end_offset;
+				addr_t log_pos;
 
 				memset(&search, 0, sizeof(f_replay_t));
 				search.key.inum = loghdr->inode_no[i];
@@ -1315,48 +1506,59 @@ static void digest_replay_and_optimize(uint8_t from_dev,
 				}
 
 #ifndef EXPERIMENTAL
-#ifdef IOMERGE
-				// IO data is merged if the same offset found.
-				// Reduce amount IO when IO data has locality such as Zipf dist.
-				// FIXME: currently iomerge works correctly when IO size is
-				// 4 KB and aligned.
-				iovec_key = ALIGN_FLOOR(loghdr->data[i], g_block_size_bytes);
-
-				if (loghdr->data[i] % g_block_size_bytes !=0 ||
-						loghdr->length[i] != g_block_size_bytes)
-					panic("IO merge is not support current IO pattern\n");
-
-				HASH_FIND(hh, item->iovec_hash,
-						&iovec_key, sizeof(offset_t), f_iovec);
-
-				if (f_iovec &&
-						(f_iovec->length == loghdr->length[i])) {
-					f_iovec->offset = iovec_key;
-					f_iovec->blknr = loghdr->blocks[i];
-					// TODO: merge data from loghdr->blocks to f_iovec buffer.
-					found = 1;
-				}
+				// Split the write at block boundaries. A piece that
+				// covers the latest logged piece of its block replaces
+				// it, so a block overwritten many times is copied once.
+				// Older pieces that are only partially overwritten stay
+				// in the list and are applied first, in log order.
+				cur_offset = loghdr->data[i];
+				end_offset = cur_offset + loghdr->length[i];
+				log_pos = (loghdr->blocks[i] << g_block_size_shift) +
+					loghdr->log_offset[i];
+
+				while (cur_offset < end_offset) {
+					offset_t next_offset;
+
+					iovec_key = ALIGN_FLOOR(cur_offset, g_block_size_bytes);
+					next_offset = min(iovec_key + g_block_size_bytes, end_offset);
+
+					HASH_FIND(hh, item->iovec_hash,
+							&iovec_key, sizeof(offset_t), f_iovec);
+
+					if (f_iovec) {
+						HASH_DEL(item->iovec_hash, f_iovec);
+
+						if (cur_offset <= f_iovec->offset &&
+								f_iovec->offset + f_iovec->length <= next_offset) {
+							// fully overwritten. reuse it for the new piece.
+							if (f_iovec->remap)
+								remap_release(f_iovec->blknr, 1);
+							list_move_tail(&f_iovec->list, &item->iovec_list);
+							if (enable_perf_stats)
+								g_perf_stats.n_digest_skipped++;
+						} else {
+							f_iovec = NULL;
+						}
+					}
 
-				if (!found) {
-					f_iovec = (f_iovec_t *)mlfs_zalloc(sizeof(f_iovec_t));
-					f_iovec->length = loghdr->length[i];
-					f_iovec->offset = loghdr->data[i];
-					f_iovec->blknr = loghdr->blocks[i];
-					INIT_LIST_HEAD(&f_iovec->list);
-					list_add_tail(&f_iovec->list, &item->iovec_list);
+					if (!f_iovec) {
+						f_iovec = (f_iovec_t *)mlfs_zalloc(sizeof(f_iovec_t));
+						INIT_LIST_HEAD(&f_iovec->list);
+						list_add_tail(&f_iovec->list, &item->iovec_list);
+					}
 
+					f_iovec->offset = cur_offset;
+					f_iovec->length = next_offset - cur_offset;
+					f_iovec->blknr = log_pos >> g_block_size_shift;
+					f_iovec->log_offset = log_pos & (g_block_size_bytes - 1);
+					f_iovec->remap = !!(loghdr->remap_mask & (1ULL << i));
 					f_iovec->hash_key = iovec_key;
 					HASH_ADD(hh, item->iovec_hash, hash_key,
 							sizeof(offset_t), f_iovec);
+
+					log_pos += f_iovec->length;
+					cur_offset = next_offset;
 				}
-#else
-				f_iovec = (f_iovec_t *)mlfs_zalloc(sizeof(f_iovec_t));
-				f_iovec->length = loghdr->length[i];
-				f_iovec->offset = loghdr->data[i];
-				f_iovec->blknr = loghdr->blocks[i];
-				INIT_LIST_HEAD(&f_iovec->list);
-				list_add_tail(&f_iovec->list, &item->iovec_list);
-#endif	//IOMERGE
 
 #else //EXPERIMENTAL
 				// Experimental feature: merge contiguous small writes to
@@ -1386,6 +1588,7 @@ static void digest_replay_and_optimize(uint8_t from_dev,
 						f_iovec->length = loghdr->length[i];
 						f_iovec->offset = loghdr->data[i];
 						f_iovec->blknr = loghdr->blocks[i];
+						f_iovec->log_offset = loghdr->log_offset[i];
 						INIT_LIST_HEAD(&f_iovec->list);
 						INIT_LIST_HEAD(&f_iovec->iov_blk_list);
 
@@ -1397,6 +1600,7 @@ static void digest_replay_and_optimize(uint8_t from_dev,
 					f_iovec->length = loghdr->length[i];
 					f_iovec->offset = loghdr->data[i];
 					f_iovec->blknr = loghdr->blocks[i];
+					f_iovec->log_offset = loghdr->log_offset[i];
 					INIT_LIST_HEAD(&f_iovec->list);
 					INIT_LIST_HEAD(&f_iovec->iov_blk_list);
 
@@ -1538,8 +1742,11 @@ static void digest_replay_and_optimize(uint8_t from_dev,
 						sizeof(replay_key_t), f_item);
 
 				if (f_item) {
+					HASH_CLEAR(hh, f_item->iovec_hash);
 					list_for_each_entry_safe(f_iovec, tmp,
 							&f_item->iovec_list, list) {
+						if (f_iovec->remap)
+							remap_release(f_iovec->blknr, 1);
 						list_del(&f_iovec->list);
 						mlfs_free(f_iovec);
 
@@ -1564,24 +1771,84 @@ static void digest_replay_and_optimize(uint8_t from_dev,
 	}
 }
 
-#ifdef FCONCURRENT
-static void file_digest_worker(void *arg)
+// contiguous both in the file and in the log: whole blocks of
+// a large write, or pieces within the same block.
+static int f_iovec_mergeable(f_iovec_t *run, f_iovec_t *f_iovec)
 {
-	struct f_digest_worker_arg *_arg = (struct f_digest_worker_arg *)arg;
-	f_iovec_t *f_iovec, *iovec_tmp;
-	f_replay_t *f_item;
-	lru_key_t k;
+	if (run->remap != f_iovec->remap)
+		return 0;
+
+	if (run->offset + run->length != f_iovec->offset)
+		return 0;
 
-	f_item = _arg->f_item;
+	if ((run->blknr << g_block_size_shift) + run->log_offset + run->length !=
+			(f_iovec->blknr << g_block_size_shift) + f_iovec->log_offset)
+		return 0;
+
+	if ((run->offset % g_block_size_bytes) == 0 &&
+			(run->length % g_block_size_bytes) == 0 &&
+			f_iovec->length == g_block_size_bytes)
+		return 1;
+
+	return (run->offset >> g_block_size_shift) ==
+		((f_iovec->offset + f_iovec->length - 1) >> g_block_size_shift);
+}
+
+static void digest_file_run(uint8_t from_dev, uint8_t to_dev,
+		uint32_t inum, f_iovec_t *run)
+{
+	int ret;
+
+	if (run->remap)
+		ret = digest_file_remap(to_dev, inum,
+				run->offset, run->length, run->blknr);
+	else
+		ret = digest_file(from_dev, to_dev, inum,
+				run->offset, run->length, run->blknr, run->log_offset);
+	mlfs_assert(!ret);
+	mlfs_free(run);
+
+	if (to_dev == g_ssd_dev)
+		mlfs_io_wait(g_ssd_dev, 0);
+}
+
+/* Digest the replayed pieces of a file in log order, merging runs
+ * that can be copied (or remapped) by a single digest_file().
+ */
+static void digest_file_replay(uint8_t from_dev, uint8_t to_dev,
+		f_replay_t *f_item)
+{
+	f_iovec_t *f_iovec, *iovec_tmp, *run = NULL;
+
+	HASH_CLEAR(hh, f_item->iovec_hash);
 
 	list_for_each_entry_safe(f_iovec, iovec_tmp,
 			&f_item->iovec_list, list) {
-		digest_file(_arg->from_dev, _arg->to_dev,
-				f_item->key.inum, f_iovec->offset,
-				f_iovec->length, f_iovec->blknr);
-		mlfs_free(f_iovec);
+		list_del(&f_iovec->list);
+
+		if (run && f_iovec_mergeable(run, f_iovec)) {
+			run->length += f_iovec->length;
+			mlfs_free(f_iovec);
+			continue;
+		}
+
+		if (run)
+			digest_file_run(from_dev, to_dev, f_item->key.inum, run);
+
+		run = f_iovec;
 	}
 
+	if (run)
+		digest_file_run(from_dev, to_dev, f_item->key.inum, run);
+}
+
+#ifdef FCONCURRENT
+static void file_digest_worker(void *arg)
+{
+	struct f_digest_worker_arg *_arg = (struct f_digest_worker_arg *)arg;
+
+	digest_file_replay(_arg->from_dev, _arg->to_dev, _arg->f_item);
+
 	mlfs_free(_arg);
 }
 #endif
@@ -1663,33 +1930,36 @@ static void digest_log_from_replay_list(uint8_t from_dev, struct replay_list *re
 				//if (thpool_num_threads_working(file_digest_thread_pool))
 				thpool_wait(file_digest_thread_pool);
 
+				// all files are digested now. drop their nodes from the
+				// replay list; l goes last since the iteration holds it.
 				HASH_ITER(hh, replay_list->f_digest_hash, f_item, t) {
 					HASH_DEL(replay_list->f_digest_hash, f_item);
-					mlfs_free(f_item);
+					if (&f_item->list != l) {
+						list_del(&f_item->list);
+						mlfs_free(f_item);
+					}
 				}
+				tmp = l->next;
+				list_del(l);
+				mlfs_free(container_of(l, f_replay_t, list));
 #else
-				list_for_each_entry_safe(f_iovec, iovec_tmp,
-						&f_item->iovec_list, list) {
-
 #ifndef EXPERIMENTAL
-					digest_file(from_dev, dest_dev,
-							f_item->key.inum, f_iovec->offset,
-							f_iovec->length, f_iovec->blknr);
-					mlfs_free(f_iovec);
+				digest_file_replay(from_dev, dest_dev, f_item);
 #else
+				list_for_each_entry_safe(f_iovec, iovec_tmp,
+						&f_item->iovec_list, list) {
 					digest_file_iovec(from_dev, dest_dev,
 							f_item->key.inum, f_iovec);
-#endif //EXPERIMETNAL
 					if (dest_dev == g_ssd_dev)
 						mlfs_io_wait(g_ssd_dev, 0);
 				}
+#endif //EXPERIMETNAL
 
 				HASH_DEL(replay_list->f_digest_hash, f_item);
+				list_del(l);
 				mlfs_free(f_item);
 #endif //FCONCURRENT
 
-				list_del(l);
-
 				if (enable_perf_stats)
 					g_perf_stats.digest_file_tsc += asm_rdtscp() - tsc_begin;
 				break;
@@ -1813,6 +2083,54 @@ static int persist_dirty_objects_hdd(void)
 	return 0;
 }
 
+#ifdef DIGEST_SHM_RING
+// per log device: inodes already in the published list of this digest.
+static DECLARE_BITMAP(digest_inode_seen[g_n_devices], NINODES);
+
+static void digest_inodes_reset(uint8_t from_dev)
+{
+	digest_inodes_t *di = digest_inodes_of(digest_rings, from_dev);
+	uint32_t i;
+
+	for (i = 0; i < di->n; i++)
+		bitmap_clear(digest_inode_seen[from_dev], di->inum[i], 1);
+
+	di->n = 0;
+	di->overflow = 0;
+}
+
+// publish an inode so libfs resyncs it after this digest.
+void digest_inodes_add_inum(uint8_t from_dev, uint32_t inum)
+{
+	digest_inodes_t *di = digest_inodes_of(digest_rings, from_dev);
+
+	if (inum >= NINODES) {
+		di->overflow = 1;
+		return;
+	}
+
+	if (test_bit(inum, digest_inode_seen[from_dev]))
+		return;
+
+	if (di->n == DIGEST_INODES_MAX) {
+		di->overflow = 1;
+		return;
+	}
+
+	bitmap_set(digest_inode_seen[from_dev], inum, 1);
+	di->inum[di->n++] = inum;
+}
+
+// publish the inodes of a logheader so libfs resyncs only those.
+static void digest_inodes_add(uint8_t from_dev, loghdr_t *loghdr)
+{
+	int i;
+
+	for (i = 0; i < loghdr->n; i++)
+		digest_inodes_add_inum(from_dev, loghdr->inode_no[i]);
+}
+#endif
+
 static int digest_logs(uint8_t from_dev, int n_hdrs,
 		addr_t *loghdr_to_digest, int *rotated)
 {
@@ -1831,6 +2149,10 @@ static int digest_logs(uint8_t from_dev, int n_hdrs,
 
 	memset(inode_version_table, 0, sizeof(uint16_t) * NINODES);
 
+#ifdef DIGEST_SHM_RING
+	digest_inodes_reset(from_dev);
+#endif
+
 	// digest log entries
 	for (i = 0 ; i < n_hdrs; i++) {
 		loghdr_meta = read_log_header(from_dev, *loghdr_to_digest);
@@ -1841,6 +2163,10 @@ static int digest_logs(uint8_t from_dev, int n_hdrs,
 			break;
 		}
 
+#ifdef DIGEST_SHM_RING
+		digest_inodes_add(from_dev, loghdr_meta->loghdr_p);
+#endif
+
 #ifdef DIGEST_OPT
 		if (enable_perf_stats)
 			tsc_begin = asm_rdtscp();
@@ -1885,35 +2211,95 @@ static int digest_logs(uint8_t from_dev, int n_hdrs,
 	return n_digest;
 }
 
+#ifdef DIGEST_SHM_RING
+static void send_digest_ack(struct digest_arg *digest_arg, digest_ack_t *ack)
+{
+	struct digest_ring *ring = digest_arg->ring;
+	uint8_t dev = digest_arg->req.dev;
+
+	ack->seq = digest_arg->req.seq;
+
+	pthread_spin_lock(&digest_ack_lock[dev]);
+	// libfs keeps at most a few requests in flight, so this rarely spins.
+	while (ring->ack_head - ring->ack_tail >= DIGEST_RING_SLOTS)
+		cpu_relax();
+
+	ring->ack[ring->ack_head % DIGEST_RING_SLOTS] = *ack;
+	__sync_synchronize();
+	ring->ack_head++;
+	pthread_spin_unlock(&digest_ack_lock[dev]);
+
+	sys_futex((void *)&ring->ack_head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+static void send_digest_ack(struct digest_arg *digest_arg, digest_ack_t *ack)
+{
+	char response[MAX_SOCK_BUF];
+	ssize_t err;
+
+	memset(response, 0, MAX_SOCK_BUF);
+	sprintf(response, "|ACK |%d|%lu|%d|%d|%lu|%u|%lu|",
+			ack->n_digested, ack->next_hdr, ack->rotated, ack->lru_updated,
+			ack->lease_blkno, ack->lease_count, ack->idx_gen);
+	//mlfs_info("Write %s to libfs\n", response);
+
+	err = sendto(digest_arg->sock_fd, response, MAX_SOCK_BUF, 0,
+			(struct sockaddr *)&digest_arg->cli_addr, sizeof(struct sockaddr_un));
+
+	if (err < 0) {
+		fprintf(stderr, "Bad response to libfs: %d (%s)\n", errno,
+				strerror(errno));
+	}
+}
+#endif
+
 static void handle_digest_request(void *arg)
 {
 	uint32_t dev_id;
-	int sock_fd;
 	struct digest_arg *digest_arg;
-	char *buf, response[MAX_SOCK_BUF];
-	char cmd_header[12];
+	int cmd;
 	int rotated = 0;
 	int lru_updated = 0;
-	addr_t digest_blkno, end_blkno;
+	addr_t digest_blkno;
 	uint32_t digest_count;
-	addr_t next_hdr_of_digested_hdr;
+	digest_ack_t ack;
+	// shared-area blocks wanted by and leased to libfs.
+	uint32_t lease_count = 0;
+	addr_t lease_blkno = 0;
     uint64_t tsc_begin;
 
 	fprintf(stderr, "\nBEGIN DIGEST\n");
 
-	memset(cmd_header, 0, 12);
-
 	digest_arg = (struct digest_arg *)arg;
 
-	sock_fd = digest_arg->sock_fd;
-	buf = digest_arg->msg;
-
-	// parsing digest request
-	sscanf(buf, "|%s |%d|%u|%lu|%lu|",
-			cmd_header, &dev_id, &digest_count, &digest_blkno, &end_blkno);
+#ifdef DIGEST_SHM_RING
+	cmd = digest_arg->req.cmd;
+	dev_id = digest_arg->req.dev;
+	digest_count = digest_arg->req.count;
+	digest_blkno = digest_arg->req.blkno;
+	lease_count = digest_arg->req.lease_want;
+#else
+	{
+		char cmd_header[12] = {0};
+		addr_t end_blkno;
+
+		// parsing digest request
+		sscanf(digest_arg->msg, "|%s |%d|%u|%lu|%lu|%u|", cmd_header, &dev_id,
+				&digest_count, &digest_blkno, &end_blkno, &lease_count);
+
+		mlfs_debug("%s\n", cmd_header);
+		if (strcmp(cmd_header, "digest") == 0)
+			cmd = DIGEST_CMD_DIGEST;
+		else if (strcmp(cmd_header, "lease") == 0)
+			cmd = DIGEST_CMD_LEASE;
+		else if (strcmp(cmd_header, "lru") == 0)
+			cmd = DIGEST_CMD_LRU;
+		else
+			cmd = 0;
+	}
+#endif
 
-	mlfs_debug("%s\n", cmd_header);
-	if (strcmp(cmd_header, "digest") == 0) {
+	if (cmd == DIGEST_CMD_DIGEST) {
 		mlfs_debug("digest command: dev_id %u, digest_blkno %lx, digest_count %u\n",
 				dev_id, digest_blkno, digest_count);
 
@@ -1925,14 +2311,37 @@ static void handle_digest_request(void *arg)
 
 		digest_count = digest_logs(dev_id, digest_count, &digest_blkno, &rotated);
 
+		if (IDXAPI_IS_HASHFS()) {
+			uint64_t reclaimed = pmem_nvm_hash_table_compact_step();
+
+			if (enable_perf_stats)
+				g_perf_stats.hashfs_compact_nr += reclaimed;
+		}
+
+		if (g_idx_choice == HYBRID)
+			idx_hybrid_convert_step(dev_id);
+
+		defrag_publish(dev_id);
+
 		mlfs_debug("-- Total used block %d\n",
 				bitmap_weight((uint64_t *)sb[g_root_dev].s_blk_bitmap->bitmap,
 					sb[g_root_dev].ondisk->ndatablocks));
 
-		memset(response, 0, MAX_SOCK_BUF);
-		sprintf(response, "|ACK |%d|%lu|%d|%d|",
-				digest_count, digest_blkno, rotated, lru_updated);
-		//mlfs_info("Write %s to libfs\n", response);
+#ifdef DIGEST_REMAP
+		// hand out blocks for large writes to be remapped at digest.
+		if (lease_count && g_idx_choice == NONE)
+			lease_blkno = remap_lease_alloc(&lease_count);
+		else
+#endif
+			lease_count = 0;
+
+		ack.n_digested = digest_count;
+		ack.next_hdr = digest_blkno;
+		ack.rotated = rotated;
+		ack.lru_updated = lru_updated;
+		ack.lease_blkno = lease_blkno;
+		ack.lease_count = lease_count;
+		ack.idx_gen = IDXAPI_IS_GLOBAL() ? hash_idx_gen : 0;
 
 		persist_dirty_objects_nvm();
 		if (enable_perf_stats) {
@@ -1949,14 +2358,7 @@ static void handle_digest_request(void *arg)
         // MUST commit before sending the ACK.
         undo_log_commit_tx();
 
-		ssize_t err = sendto(sock_fd, response, MAX_SOCK_BUF, 0,
-				(struct sockaddr *)&digest_arg->cli_addr, sizeof(struct sockaddr_un));
-
-        if (err < 0) {
-            fprintf(stderr, "Bad response to libfs: %d (%s)\n", errno,
-                    strerror(errno));
-        }
-
+		send_digest_ack(digest_arg, &ack);
 
 		show_storage_stats();
 
@@ -1964,7 +2366,13 @@ static void handle_digest_request(void *arg)
 			show_kernfs_stats();
         
 
-	} else if (strcmp(cmd_header, "lru") == 0) {
+	} else if (cmd == DIGEST_CMD_LEASE) {
+		// libfs gives back the unused tail of a remap lease.
+		mlfs_debug("lease return: dev_id %u, blkno %lu, count %u\n",
+				dev_id, digest_blkno, digest_count);
+
+		remap_release(digest_blkno, digest_count);
+	} else if (cmd == DIGEST_CMD_LRU) {
 		// only used for debugging.
 		if (0) {
 			lru_node_t *l;
@@ -1981,6 +2389,119 @@ static void handle_digest_request(void *arg)
 	mlfs_free(arg);
 }
 
+static void dispatch_digest_request(struct digest_arg *digest_arg,
+		uint32_t dev_id)
+{
+#ifdef CONCURRENT
+	if (dev_id == 4) {
+		thpool_add_work(thread_pool, handle_digest_request, (void *)digest_arg);
+	} else {
+		//thpool_add_work(thread_pool_ssd, handle_digest_request, (void *)digest_arg);
+		thpool_add_work(thread_pool, handle_digest_request, (void *)digest_arg);
+	}
+#else
+	handle_digest_request((void *)digest_arg);
+#endif
+
+#ifdef MIGRATION
+	/*
+	thpool_wait(thread_pool);
+	thpool_wait(thread_pool_ssd);
+	*/
+
+	//try_writeback_blocks();
+	try_migrate_blocks(g_root_dev, g_ssd_dev, 0, 0);
+	//try_migrate_blocks(g_root_dev, g_hdd_dev, 0);
+#endif
+}
+
+#ifdef DIGEST_SHM_RING
+static void digest_ring_init(void)
+{
+	int fd, ret, i;
+	struct stat st;
+
+	fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
+	if (fd == -1)
+		panic("cannot create shared memory\n");
+
+	ret = fstat(fd, &st);
+	if (ret == -1)
+		panic("cannot stat shared memory\n");
+
+	if (st.st_size < DIGEST_RING_OFFSET + DIGEST_SHM_AREA_SIZE) {
+		ret = ftruncate(fd, DIGEST_RING_OFFSET + DIGEST_SHM_AREA_SIZE);
+		if (ret == -1)
+			panic("cannot ftruncate shared memory\n");
+	}
+
+	digest_rings = (struct digest_ring_area *)mmap(NULL,
+			DIGEST_SHM_AREA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, DIGEST_RING_OFFSET);
+	if (digest_rings == MAP_FAILED)
+		panic("cannot map digest rings\n");
+
+	close(fd);
+
+	memset(digest_rings, 0, DIGEST_SHM_AREA_SIZE);
+
+	// libfs HASHFS_ROCACHE mirrors refresh only the entry lines we publish.
+	if (IDXAPI_IS_HASHFS())
+		pmem_nvm_hash_table_set_dirty_log(hashfs_dirty_log_of(digest_rings));
+	for (i = 0; i < g_n_devices; i++)
+		pthread_spin_init(&digest_ack_lock[i], PTHREAD_PROCESS_PRIVATE);
+
+	// libfs refuses to start until kernfs has published the rings.
+	__sync_synchronize();
+	digest_rings->magic = DIGEST_RING_MAGIC;
+}
+
+static void wait_for_event(void)
+{
+	struct digest_ring *ring;
+	struct digest_arg *digest_arg;
+	uint32_t req_seq;
+	int i, n;
+
+	digest_ring_init();
+
+	while(1) {
+		req_seq = digest_rings->req_seq;
+		n = 0;
+
+		// drain every ring before sleeping so that requests from many
+		// libfs instances are picked up in one pass.
+		for (i = 0; i < g_n_devices; i++) {
+			ring = &digest_rings->ring[i];
+
+			while (ring->req_tail != ring->req_head) {
+				__sync_synchronize();
+
+				digest_arg = (struct digest_arg *)mlfs_alloc(sizeof(struct digest_arg));
+				digest_arg->ring = ring;
+				digest_arg->req = ring->req[ring->req_tail % DIGEST_RING_SLOTS];
+
+				__sync_synchronize();
+				ring->req_tail++;
+
+				dispatch_digest_request(digest_arg, digest_arg->req.dev);
+				n++;
+			}
+		}
+
+		if (n)
+			continue;
+
+		// posters check kernfs_sleeping after bumping req_seq.
+		digest_rings->kernfs_sleeping = 1;
+		__sync_synchronize();
+		if (digest_rings->req_seq == req_seq)
+			sys_futex((void *)&digest_rings->req_seq, FUTEX_WAIT, req_seq,
+					NULL, NULL, 0);
+		digest_rings->kernfs_sleeping = 0;
+	}
+}
+#else
 #define MAX_EVENTS 4
 static void wait_for_event(void)
 {
@@ -2074,27 +2595,7 @@ static void wait_for_event(void)
 				digest_arg->cli_addr = cli_addr;
 				memmove(digest_arg->msg, buf, MAX_SOCK_BUF);
 
-#ifdef CONCURRENT
-				if (dev_id == 4) {
-					thpool_add_work(thread_pool, handle_digest_request, (void *)digest_arg);
-				} else {
-					//thpool_add_work(thread_pool_ssd, handle_digest_request, (void *)digest_arg);
-					thpool_add_work(thread_pool, handle_digest_request, (void *)digest_arg);
-        }
-#else
-				handle_digest_request((void *)digest_arg);
-#endif
-
-#ifdef MIGRATION
-				/*
-				thpool_wait(thread_pool);
-				thpool_wait(thread_pool_ssd);
-				*/
-
-				//try_writeback_blocks();
-				try_migrate_blocks(g_root_dev, g_ssd_dev, 0, 0);
-				//try_migrate_blocks(g_root_dev, g_hdd_dev, 0);
-#endif
+				dispatch_digest_request(digest_arg, dev_id);
 			} else {
 				mlfs_info("%s\n", "Huh?");
 			}
@@ -2103,9 +2604,12 @@ static void wait_for_event(void)
 
 	close(epfd);
 }
+#endif
 
 void shutdown_fs(void)
 {
+	struct inode *inode, *tmp;
+
 	if(IDXAPI_IS_HASHFS()) {
 		pmem_nvm_hash_table_close();
 	}
@@ -2116,6 +2620,21 @@ void shutdown_fs(void)
 
     shutdown_undo_log();
 
+	// windows are off the free lists; put them back before the snapshot.
+	pthread_spin_lock(&icache_spinlock);
+	HASH_ITER(hash_handle, inode_hash[g_root_dev], inode, tmp)
+		mlfs_ext_discard_prealloc(inode);
+	pthread_spin_unlock(&icache_spinlock);
+
+	// the next mount loads the free lists instead of scanning the bitmaps.
+	balloc_save_snapshot(g_root_dev, sb[g_root_dev]);
+#ifdef USE_SSD
+	balloc_save_snapshot(g_ssd_dev, sb[g_ssd_dev]);
+#endif
+#ifdef USE_HDD
+	balloc_save_snapshot(g_hdd_dev, sb[g_hdd_dev]);
+#endif
+
 	unlink(SRV_SOCK_PATH);
 	device_shutdown();
 	return ;
@@ -2153,7 +2672,8 @@ void shared_memory_init(void)
 		panic("cannot create shared memory\n");
   }
 
-	ret = ftruncate(shm_fd, SHM_SIZE);
+	// the digest rings follow the first SHM_SIZE bytes.
+	ret = ftruncate(shm_fd, SHM_SIZE + DIGEST_SHM_AREA_SIZE);
 	if (ret == -1)
 		panic("cannot ftruncate shared memory\n");
 
@@ -2240,6 +2760,7 @@ void init_fs_callback(void (*callback_fn)(void))
 	read_superblock(g_root_dev);
 	read_root_inode(g_root_dev);
 	balloc_init(g_root_dev, sb[g_root_dev]);
+	mlfs_ext_init(sb[g_root_dev]);
 
 #ifdef USE_SSD
 	read_superblock(g_ssd_dev);
@@ -2273,6 +2794,10 @@ void init_fs_callback(void (*callback_fn)(void))
         init_hash(sb[g_root_dev], enable_perf_stats);
     }
 
+    if (g_idx_choice == HYBRID) {
+        idx_hybrid_init();
+    }
+
 	// initialize profiling
 	char prof_fn[256];
 	sprintf(prof_fn, "/tmp/kernfs_prof.%d", getpid());
@@ -2290,6 +2815,8 @@ void init_fs_callback(void (*callback_fn)(void))
 	thread_pool_ssd = thpool_init(max_kernfs_io_queues);
 	//thread_pool_ssd = thpool_init(1);
 
+	defrag_init(thread_pool);
+
 	printf("Initialized thread pool with %d threads.\n", max_kernfs_io_queues);
 
 #ifdef FCONCURRENT
@@ -33,6 +33,12 @@ typedef struct mlfs_kernfs_stats {
 	uint64_t path_search_tsc;
     uint64_t path_search_size;
 	uint64_t path_search_nr;
+	uint64_t path_cache_hit_nr;
+	// HYBRID: lookups by index type (indexing_choice_t).
+	uint64_t idx_lookup_tsc[NONE];
+	uint64_t idx_lookup_nr[NONE];
+	uint64_t hybrid_convert_nr;
+	uint64_t hybrid_convert_blocks;
 	uint64_t path_storage_nr;
 	uint64_t path_storage_tsc;
 	uint64_t replay_time_tsc;
@@ -42,15 +48,29 @@ typedef struct mlfs_kernfs_stats {
 	uint64_t digest_file_tsc;
 	uint64_t n_digest;
 	uint64_t n_digest_skipped;
+	// large writes digested by remapping leased blocks
+	uint64_t digest_remap_nr;
+	uint64_t digest_remap_blocks;
 	uint64_t total_migrated_mb;
     // block allocator
     uint64_t balloc_tsc;
     uint64_t balloc_nblk;
     uint64_t balloc_nr;
     uint64_t balloc_meta_nr;
+    // data allocations served from a file's pre-allocation window
+    uint64_t prealloc_hit_nr;
+    uint64_t prealloc_blocks;
+    // online defragmentation
+    uint64_t defrag_files;
+    uint64_t defrag_blocks;
+    uint64_t defrag_frags;
+    uint64_t defrag_tsc;
     // undo log
     uint64_t undo_tsc;
     uint64_t undo_nr;
+    uint64_t undo_fence_nr;
+    // HashFS tombstones turned back into empty slots
+    uint64_t hashfs_compact_nr;
 
 	stats_dist_t read_per_index;
     // Indexing cache rates
@@ -142,8 +162,11 @@ static inline void init_api_idx_struct(uint8_t dev, struct inode *inode) {
 
         idx_struct_t *tmp = (idx_struct_t*)mlfs_zalloc(sizeof(*inode->ext_idx));
         int init_err;
+        // in a HYBRID run, the dinode says which structure the file uses.
+        indexing_choice_t choice = g_idx_choice == HYBRID ?
+            (indexing_choice_t)inode->idx_type : g_idx_choice;
 
-        switch(g_idx_choice) {
+        switch(choice) {
             case EXTENT_TREES_TOP_CACHED:
                 g_idx_cached = true;
             case EXTENT_TREES:
@@ -392,8 +415,13 @@ int mlfs_mark_inode_dirty(struct inode *inode);
 int persist_dirty_dirent_block(struct inode *inode);
 int persist_dirty_object(void);
 int digest_file(uint8_t from_dev, uint8_t to_dev, uint32_t file_inum,
+		offset_t offset, uint32_t length, addr_t blknr, uint32_t log_offset);
+int digest_file_remap(uint8_t to_dev, uint32_t file_inum,
 		offset_t offset, uint32_t length, addr_t blknr);
 void show_storage_stats(void);
+#ifdef DIGEST_SHM_RING
+void digest_inodes_add_inum(uint8_t from_dev, uint32_t inum);
+#endif
 
 //APIs for debugging.
 uint32_t dbg_get_iblkno(uint32_t inum);
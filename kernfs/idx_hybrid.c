@@ -0,0 +1,238 @@
+#include <stddef.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "extents.h"
+#include "global/util.h"
+#include "idx_hybrid.h"
+#include "indexing_api_interface.h"
+#include "undo_log.h"
+
+extern uint8_t *dax_addr[];
+
+struct hybrid_req {
+	uint32_t inum;
+	uint8_t to;
+};
+
+static struct hybrid_req hy_queue[HYBRID_QUEUE_LEN];
+static uint32_t hy_head, hy_tail;
+static pthread_mutex_t hy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hybrid_random_pct;
+static indexing_choice_t hybrid_random_idx;
+static uint64_t hybrid_convert_blocks;
+
+void idx_hybrid_init(void)
+{
+	char *env;
+
+	hybrid_random_pct = 50;
+	env = getenv("MLFS_HYBRID_RANDOM_PCT");
+	if (env)
+		hybrid_random_pct = strtoul(env, NULL, 10);
+
+	hybrid_random_idx = LEVEL_HASH_TABLES;
+	env = getenv("MLFS_HYBRID_RANDOM_IDX");
+	if (env && !strcmp(env, "RADIX_TREES"))
+		hybrid_random_idx = RADIX_TREES;
+	else if (env && strcmp(env, "LEVEL_HASH_TABLES"))
+		panic("MLFS_HYBRID_RANDOM_IDX: LEVEL_HASH_TABLES or RADIX_TREES\n");
+
+	hybrid_convert_blocks = 1UL << 16;
+	env = getenv("MLFS_HYBRID_CONVERT_BLOCKS");
+	if (env)
+		hybrid_convert_blocks = strtoull(env, NULL, 10);
+
+	mlfs_info("hybrid index: %u%% random writes -> %s, %lu blocks/digest\n",
+			hybrid_random_pct, idx_choice_name(hybrid_random_idx),
+			hybrid_convert_blocks);
+}
+
+static inline mlfs_lblk_t hybrid_nblocks(struct inode *inode)
+{
+	return (inode->size + g_block_size_bytes - 1) >> g_block_size_shift;
+}
+
+// the index type the last window of writes asks for.
+static indexing_choice_t hybrid_pick(struct inode *inode)
+{
+	uint32_t random_pct;
+
+	if (hybrid_nblocks(inode) <= HYBRID_TINY_BLOCKS)
+		return EXTENT_TREES;
+
+	random_pct = (inode->hy_writes - inode->hy_seq_writes) * 100 /
+		inode->hy_writes;
+
+	// the gap between the two thresholds keeps files from flapping.
+	if (inode->idx_type == EXTENT_TREES)
+		return random_pct >= hybrid_random_pct ?
+			hybrid_random_idx : EXTENT_TREES;
+
+	return random_pct < hybrid_random_pct / 2 ?
+		EXTENT_TREES : (indexing_choice_t)inode->idx_type;
+}
+
+void idx_hybrid_note_write(struct inode *inode, uint32_t lblk,
+		uint32_t nr_blocks)
+{
+	indexing_choice_t to;
+
+	// an unaligned append starts in the last block of the previous write.
+	if (lblk == inode->hy_next_lblk || lblk + 1 == inode->hy_next_lblk)
+		inode->hy_seq_writes++;
+	inode->hy_writes++;
+	inode->hy_next_lblk = lblk + nr_blocks;
+
+	if (inode->hy_writes < HYBRID_MIN_WRITES)
+		return;
+
+	to = hybrid_pick(inode);
+	inode->hy_writes = 0;
+	inode->hy_seq_writes = 0;
+
+	if (to == inode->idx_type || inode->hy_queued)
+		return;
+
+	// a full queue drops the request; the next window asks again.
+	pthread_mutex_lock(&hy_lock);
+	if (hy_tail - hy_head < HYBRID_QUEUE_LEN) {
+		hy_queue[hy_tail % HYBRID_QUEUE_LEN].inum = inode->inum;
+		hy_queue[hy_tail % HYBRID_QUEUE_LEN].to = to;
+		hy_tail++;
+		inode->hy_queued = 1;
+	}
+	pthread_mutex_unlock(&hy_lock);
+}
+
+/* Drop the index of inode, keeping the data blocks it maps, and leave an
+ * empty root of type to in the dinode. */
+static void hybrid_drop_index(struct inode *inode, mlfs_lblk_t nblocks,
+		indexing_choice_t to)
+{
+	addr_t iblk = get_inode_block(g_root_dev, inode->inum);
+	off_t ioff = sizeof(struct dinode) * (inode->inum % IPB);
+	char zero[sizeof(inode->l1.addrs)] = {0};
+
+	// a crash before the digest commits restores the old root.
+	idx_undo_log((iblk << g_block_size_shift) + ioff, sizeof(struct dinode),
+			dax_addr[g_root_dev] + (iblk << g_block_size_shift) + ioff);
+
+	if (inode->ext_idx) {
+		if (nblocks) {
+			idx_api_keep_data(true);
+			FN(inode->ext_idx, im_remove, inode->ext_idx, inode->inum,
+					0, nblocks);
+			idx_api_keep_data(false);
+		}
+
+		// the API has no destructor; its index blocks were freed above.
+		mlfs_free(inode->ext_idx);
+		inode->ext_idx = NULL;
+	}
+
+	nvm_write(iblk, ioff + offsetof(struct dinode, l1_addrs), sizeof(zero), zero);
+	memset(inode->l1.addrs, 0, sizeof(inode->l1.addrs));
+
+	inode->idx_type = to;
+	mlfs_ext_invalidate_path(inode);
+}
+
+void idx_hybrid_reset(struct inode *inode)
+{
+	inode->hy_writes = 0;
+	inode->hy_seq_writes = 0;
+	inode->hy_next_lblk = 0;
+
+	if (inode->idx_type == EXTENT_TREES)
+		return;
+
+	// digest_unlink already removed the old contents.
+	hybrid_drop_index(inode, 0, EXTENT_TREES);
+	mlfs_mark_inode_dirty(inode);
+}
+
+// rebuild the index of inode as type to; returns the blocks remapped.
+static uint64_t hybrid_convert(struct inode *inode, indexing_choice_t to)
+{
+	struct mlfs_map_run *runs = NULL;
+	uint32_t n_runs = 0, max_runs = 0;
+	mlfs_lblk_t lblk = 0, nblocks = hybrid_nblocks(inode);
+	uint64_t moved = 0;
+
+	if (!inode->ext_idx)
+		init_api_idx_struct(g_root_dev, inode);
+
+	// read the mapping out of the old index, one run per lookup.
+	while (lblk < nblocks) {
+		paddr_t pblk = 0;
+		ssize_t n = FN(inode->ext_idx, im_lookup, inode->ext_idx,
+				inode->inum, lblk, nblocks - lblk, &pblk);
+
+		if (n <= 0) {
+			lblk++;
+			continue;
+		}
+
+		if (n > nblocks - lblk)
+			n = nblocks - lblk;
+
+		mlfs_map_runs_push(&runs, &n_runs, &max_runs, lblk, pblk, n);
+		moved += n;
+		lblk += n;
+	}
+
+	hybrid_drop_index(inode, nblocks, to);
+	init_api_idx_struct(g_root_dev, inode);
+
+	// map the same blocks again: the new index "allocates" them.
+	mlfs_map_runs_remap(inode, runs, n_runs, 0);
+
+	free(runs);
+
+	return moved;
+}
+
+uint64_t idx_hybrid_convert_step(uint8_t from_dev)
+{
+	struct hybrid_req req;
+	struct inode *inode;
+	uint64_t done = 0;
+
+	while (done < hybrid_convert_blocks) {
+		pthread_mutex_lock(&hy_lock);
+		if (hy_head == hy_tail) {
+			pthread_mutex_unlock(&hy_lock);
+			break;
+		}
+		req = hy_queue[hy_head % HYBRID_QUEUE_LEN];
+		hy_head++;
+		pthread_mutex_unlock(&hy_lock);
+
+		inode = icache_find(g_root_dev, req.inum);
+		if (!inode)
+			continue;
+
+		inode->hy_queued = 0;
+
+		if ((inode->flags & I_DELETING) ||
+				inode->itype != T_FILE || inode->idx_type == req.to)
+			continue;
+
+		done += hybrid_convert(inode, (indexing_choice_t)req.to);
+
+		if (enable_perf_stats)
+			g_perf_stats.hybrid_convert_nr++;
+
+#ifdef DIGEST_SHM_RING
+		// libfs must drop its copy of the old index.
+		digest_inodes_add_inum(from_dev, inode->inum);
+#endif
+	}
+
+	if (enable_perf_stats)
+		g_perf_stats.hybrid_convert_blocks += done;
+
+	return done;
+}
@@ -0,0 +1,49 @@
+#ifndef _IDX_HYBRID_H_
+#define _IDX_HYBRID_H_
+
+#include "shared.h"
+#include "global/global.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Per-file index selection (MLFS_IDX_STRUCT=HYBRID).
+ *
+ * Each file records its index type in dinode->idx_type. Files start as
+ * extent trees (idx_type 0, EXTENT_TREES): the root lives in l1_addrs and
+ * holds a few extents, so a small file is mapped by direct pointers in the
+ * inode and never gets an index block.
+ *
+ * Digest watches how each file is written. Every HYBRID_MIN_WRITES writes,
+ * a file larger than HYBRID_TINY_BLOCKS whose writes were mostly not
+ * sequential (MLFS_HYBRID_RANDOM_PCT percent, default 50) is moved to the
+ * hash index named by MLFS_HYBRID_RANDOM_IDX (LEVEL_HASH_TABLES by
+ * default, or RADIX_TREES). A hashed file whose random writes fall below
+ * half that share goes back to an extent tree.
+ *
+ * Moves are queued and done after digest, up to MLFS_HYBRID_CONVERT_BLOCKS
+ * blocks per digest. Data blocks stay where they are; only the index is
+ * rebuilt over them, inside the digest's undo transaction.
+ */
+#define HYBRID_TINY_BLOCKS 16
+#define HYBRID_MIN_WRITES 64
+#define HYBRID_QUEUE_LEN 256
+
+void idx_hybrid_init(void);
+
+// digest wrote nr_blocks blocks of inode at lblk.
+void idx_hybrid_note_write(struct inode *inode, uint32_t lblk,
+		uint32_t nr_blocks);
+
+// a new file reuses inode: give it an empty extent tree.
+void idx_hybrid_reset(struct inode *inode);
+
+// move queued files to their new index; returns the blocks remapped.
+uint64_t idx_hybrid_convert_step(uint8_t from_dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #include "indexing_api_interface.h"
 #include "storage/storage.h"
+#include "extents.h"
 
 #if 0
 #define trace_me() \
@@ -90,6 +91,15 @@ static inline void balloc_unlock(void) {
 
 #endif
 
+// set by idx_api_data_goal() around im_create.
+static __thread struct inode *data_inode;
+static __thread paddr_t data_goal;
+
+void idx_api_data_goal(struct inode *inode, paddr_t goal) {
+    data_inode = inode;
+    data_goal = goal;
+}
+
 static inline ssize_t alloc_generic(size_t nblk,
                                     paddr_t* pblk,
                                     enum alloc_type a_type) {
@@ -106,7 +116,13 @@ static inline ssize_t alloc_generic(size_t nblk,
     balloc_lock();
     struct super_block *sblk = sb[g_root_dev];
 
-    int r = mlfs_new_blocks(sblk, pblk, nblk, 0, 0, a_type, 0);
+    int r;
+#ifdef KERNFS
+    if (a_type == DATA && data_inode)
+        r = mlfs_new_file_blocks(sblk, data_inode, data_goal, nblk, pblk);
+    else
+#endif
+        r = mlfs_new_blocks(sblk, pblk, nblk, 0, 0, a_type, 0);
     if (r > 0) {
 #ifdef KERNFS
         balloc_undo_log(*pblk, r, 0);
@@ -155,9 +171,37 @@ ssize_t alloc_metadata_blocks(size_t nblocks, paddr_t* pblk) {
     return ret;
 }
 
+/* While an index is rebuilt over blocks a file already owns, data
+ * "allocations" hand out those blocks and data deallocations are
+ * skipped; see idx_api_adopt_data() and idx_api_keep_data(). */
+static __thread paddr_t adopt_pblk;
+static __thread size_t adopt_nblk;
+static __thread bool keep_data;
+
+void idx_api_adopt_data(paddr_t pblk, size_t nblk) {
+    adopt_pblk = pblk;
+    adopt_nblk = nblk;
+}
+
+void idx_api_keep_data(bool keep) {
+    keep_data = keep;
+}
+
 ssize_t alloc_data_blocks(size_t nblocks, paddr_t *pblk) {
     trace_me();
-    return alloc_generic(nblocks, pblk, DATA);
+    if (adopt_nblk) {
+        size_t n = nblocks < adopt_nblk ? nblocks : adopt_nblk;
+
+        *pblk = adopt_pblk;
+        adopt_pblk += n;
+        adopt_nblk -= n;
+        return (ssize_t)n;
+    }
+    ssize_t r = alloc_generic(nblocks, pblk, DATA);
+    // the next run of the same create continues this one.
+    if (data_inode && r > 0)
+        data_goal = *pblk + r;
+    return r;
 }
 
 
@@ -201,6 +245,7 @@ ssize_t dealloc_metadata_blocks(size_t nblocks, paddr_t pblk) {
 
 ssize_t dealloc_data_blocks(size_t nblocks, paddr_t pblk) {
     trace_me();
+    if (keep_data) return (ssize_t)nblocks;
     return dealloc_generic(nblocks, pblk);
 }
 
@@ -33,6 +33,24 @@ ssize_t dealloc_data_blocks(size_t nblocks, paddr_t pblk);
 
 int get_dev_info(device_info_t* di);
 
+/**
+ * For moving a file between index types without copying its data.
+ * adopt_data: the next nblk data blocks the calling thread's index asks
+ *      for are pblk, pblk + 1, ... instead of new ones.
+ * keep_data: while set, the calling thread's index frees only its own
+ *      metadata blocks; data blocks stay allocated.
+ */
+void idx_api_adopt_data(paddr_t pblk, size_t nblk);
+
+void idx_api_keep_data(bool keep);
+
+/**
+ * data_goal: the calling thread's next data allocations are for inode,
+ *      placed from goal on (0: anywhere) and served from the inode's
+ *      pre-allocation window when they continue it. NULL clears it.
+ */
+void idx_api_data_goal(struct inode *inode, paddr_t goal);
+
 extern mem_man_fns_t strata_mem_man;
 extern callback_fns_t strata_callbacks;
 extern idx_spec_t strata_idx_spec;
@@ -225,7 +225,9 @@ void iunlock(struct inode *ip)
  */
 void iput(struct inode *ip)
 {
-	ip->i_ref--;
+	// nobody appends to the inode anymore; its window goes back to balloc.
+	if (--ip->i_ref == 0 && ip->itype == T_FILE)
+		mlfs_ext_discard_prealloc(ip);
 }
 
 int idealloc(struct inode *inode)
@@ -249,6 +251,7 @@ int idealloc(struct inode *inode)
 	mlfs_assert(inode->itype == dip.itype);
 
 	ilock(inode);
+	mlfs_ext_discard_prealloc(inode);
 	inode->size = 0;
 	/* After persisting the inode, libfs moves it to
 	 * deleted inode hash table in persist_log_inode() */
@@ -18,6 +18,10 @@ static GHashTable *gsuper = NULL;
 
 idx_struct_t hash_idx;
 
+#ifdef KERNFS
+uint64_t hash_idx_gen;
+#endif
+
 static pthread_mutex_t alloc_tex = PTHREAD_MUTEX_INITIALIZER;
 
 void init_hash(struct super_block *sb, bool enable_perf_stats) {
@@ -200,6 +204,9 @@ create:
 
         ret = nret;
         map->m_pblk = pblk;
+#ifdef KERNFS
+        __sync_fetch_and_add(&hash_idx_gen, 1);
+#endif
     }
 
     ret = min(ret, map->m_len);
@@ -244,6 +251,10 @@ int mlfs_hash_truncate(handle_t *handle, struct inode *inode,
           nremoved, strerror(-nremoved));
   if_then_panic(nremove != nremoved, "Could not remove all blocks! "
           "Asked to remove %ld, only removed %ld\n", nremove, nremoved);
+#ifdef KERNFS
+  if (nremoved)
+    __sync_fetch_and_add(&hash_idx_gen, 1);
+#endif
 #endif
 
   return 0;
@@ -102,6 +102,15 @@ int mlfs_hash_truncate(handle_t *handle, struct inode *inode,
 int mlfs_hash_persist();
 int mlfs_hash_cache_invalidate();
 
+#ifdef KERNFS
+/*
+ * Bumped whenever a digest adds or removes mappings in the global hash.
+ * Digest acks carry it so that a libfs drops its cached index only when
+ * the index changed since its last digest.
+ */
+extern uint64_t hash_idx_gen;
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,11 +31,13 @@
 #include <stdint.h>
 #include <emmintrin.h>
 #include <immintrin.h>
+#include <cpuid.h>
 #include "lpmem_ghash.h"
 
 #define G_DISABLE_ASSERT
 
 #define MAX(x,y) (x > y ? x : y)
+#define MIN(x,y) (x < y ? x : y)
 
 // stats
 uint64_t reads;
@@ -48,6 +50,25 @@ typedef union {__m256i vec; uint64_t arr[4];} u256i_64;
 typedef union {__m256i vec; uint32_t arr[8];} u256i_32;
 typedef union {__m128i vec; uint32_t arr[4];} u128i_32;
 
+/* The batched (_simd) operations come in three builds: AVX-512, AVX2 and
+ * scalar. Each kernel is compiled for its own target, so one binary runs
+ * on hosts with or without AVX-512; pmem_nvm_hash_table_new() picks the
+ * widest build the CPU supports (see pmem_nvm_hash_simd_init). */
+#define HASHFS_AVX512 __attribute__((target("avx512f,avx512vl,avx512dq,avx512bw,rtm")))
+#define HASHFS_AVX2 __attribute__((target("avx2")))
+
+// the AVX-512 insert commits its scatter in an RTM transaction.
+static int pmem_simd_has_rtm;
+
+static void pmem_nvm_hash_simd_init(void);
+static void pmem_nvm_hash_compact_init(void);
+
+/* Inserts hold this shared; tombstone compaction holds it exclusive, so an
+ * insert never claims a slot that compaction is about to reclaim or fills
+ * the empty slot that ends a run being reclaimed. Lookups and removes do
+ * not take it (see pmem_nvm_hash_table_compact). */
+static pthread_rwlock_t pmem_compact_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 #if 0
 #define pthread_rwlock_rdlock(x) 0
 #define pthread_rwlock_wrlock(x) 0
@@ -133,6 +154,29 @@ static void pmem_nvm_flush(void* start, uint32_t len) {
 #endif
 }
 
+/* Entry cache lines kernfs writes are published here for the
+ * HASHFS_ROCACHE mirrors of libfs (see hashfs_dirty_log_t). NULL when
+ * nobody listens. */
+static hashfs_dirty_log_t *pmem_dirty_log;
+
+#define HASHFS_ENTS_PER_LINE (64 / sizeof(paddr_t))
+
+// flush entry i and publish its cache line.
+static inline void pmem_nvm_ent_written(uint32_t i) {
+  hashfs_dirty_log_t *log = pmem_dirty_log;
+  uint64_t seq;
+
+  pmem_nvm_flush((void*)(pmem_ht_vol->entries + i), sizeof(paddr_t));
+
+  if (!log)
+    return;
+
+  seq = __sync_fetch_and_add(&log->head, 1);
+  log->ent[seq % HASHFS_DIRTY_MAX].line = i / HASHFS_ENTS_PER_LINE;
+  __atomic_store_n(&log->ent[seq % HASHFS_DIRTY_MAX].seq, seq + 1,
+      __ATOMIC_RELEASE);
+}
+
 /*
  * nvm_hash_table_lookup_node:
  * @hash_table: our #nvm_hash_idx_t
@@ -275,7 +319,7 @@ static void printVec_simd32(char* what, __m256i *vec) {
     printf("\n");
 }
 
-static void printMask_simd8(char* what, __mmask8 *mask) {
+HASHFS_AVX512 static void printMask_simd8(char* what, __mmask8 *mask) {
     printf("%s: ", what);
     uint32_t m = _cvtmask8_u32(*mask);
     int pOf2[8] = {1, 2, 4, 8, 16, 32, 64, 128};
@@ -292,13 +336,13 @@ static void printMask_simd8(char* what, __mmask8 *mask) {
 
 }
 
-static void directHash_simd8(__m512i *keys, __m256i *node_indices) {
+HASHFS_AVX512 static void directHash_simd8(__m512i *keys, __m256i *node_indices) {
   __mmask8 oneMask = _cvtu32_mask8(~0); // ones
   __m256i hash_values = _mm512_cvtepi64_epi32(*keys); // direct hash with truncation to 32-bit
   pmem_mod_simd8(&hash_values, node_indices);
 }
 
-static void
+HASHFS_AVX512 static void
 mixHash_simd8_helper(__m512i *first, __m512i *second, __m512i *third, int right, uint32_t shiftCount, __mmask8 searching) {
   *first = _mm512_maskz_sub_epi64(searching, *first, *second); //first = first - second
   *first = _mm512_maskz_sub_epi64(searching, *first, *third); //first = first - third
@@ -313,7 +357,7 @@ mixHash_simd8_helper(__m512i *first, __m512i *second, __m512i *third, int right,
 }
 
 
-static void mixHash_simd8(__m512i *keys, __m256i *node_indices, __mmask8 searching) {
+HASHFS_AVX512 static void mixHash_simd8(__m512i *keys, __m256i *node_indices, __mmask8 searching) {
   int RIGHT = 1;
   int LEFT = 0;
 
@@ -350,7 +394,7 @@ static void mixHash_simd8(__m512i *keys, __m256i *node_indices, __mmask8 searchi
 #endif
 }
 
-static void
+HASHFS_AVX512 static void
 mixHash_simd4_helper(__m256i *first, __m256i *second, __m256i *third, int right, uint32_t shiftCount, __mmask8 searching) {
   *first = _mm256_maskz_sub_epi64(searching, *first, *second); //first = first - second
   *first = _mm256_maskz_sub_epi64(searching, *first, *third); //first = first - third
@@ -364,7 +408,7 @@ mixHash_simd4_helper(__m256i *first, __m256i *second, __m256i *third, int right,
   *first = _mm256_maskz_xor_epi64(searching, *first, bsTemp); //first = first XOR (third (<< || >>) shiftcount)
 }
 
-static void mixHash_simd4(__m256i *keys, __m128i *node_indices, __mmask8 searching) {
+HASHFS_AVX512 static void mixHash_simd4(__m256i *keys, __m128i *node_indices, __mmask8 searching) {
   __m256i c = *keys;
   int RIGHT = 1;
   int LEFT = 0;
@@ -385,21 +429,21 @@ static void mixHash_simd4(__m256i *keys, __m128i *node_indices, __mmask8 searchi
   pmem_mod_simd4(&hash_values, node_indices);
 }
 
-static void pmem_make_key_simd8(__m512i *inums, __m512i *lblks, __m512i *keys) {
+HASHFS_AVX512 static void pmem_make_key_simd8(__m512i *inums, __m512i *lblks, __m512i *keys) {
   __mmask8 oneMask = _cvtu32_mask8(~0); //zeros
   *keys = _mm512_mask_mov_epi64(*inums, oneMask, *inums); // keys = inums
   *keys = _mm512_slli_epi64(*keys, 32); // rotate left 32 bits
   *keys = _mm512_or_epi64(*keys, *lblks); // & with lblks
 }
 
-static void pmem_make_key_simd4(__m256i *inums, __m256i *lblks, __m256i *keys) {
+HASHFS_AVX512 static void pmem_make_key_simd4(__m256i *inums, __m256i *lblks, __m256i *keys) {
   __mmask8 oneMask = _cvtu32_mask8(~0); //zeros
   *keys = _mm256_mask_mov_epi64(*inums, oneMask, *inums); // keys = inums
   *keys = _mm256_slli_epi64(*keys, 32); // rotate left 32 bits
   *keys = _mm256_or_epi64(*keys, *lblks); // & with lblks
 }
 
-void pmem_nvm_hash_table_lookup_node_simd8(__m512i *keys, __m256i *node_indices, __mmask8 *failure, __mmask8 searching) {
+HASHFS_AVX512 void pmem_nvm_hash_table_lookup_node_simd8(__m512i *keys, __m256i *node_indices, __mmask8 *failure, __mmask8 searching) {
 
 #ifdef SEQ_STEP
   uint32_t step = 1;
@@ -446,7 +490,7 @@ void pmem_nvm_hash_table_lookup_node_simd8(__m512i *keys, __m256i *node_indices,
   
 }
 
-void pmem_nvm_hash_table_lookup_node_simd4(__m256i *keys, __m128i *node_indices, __mmask8 *failure, __mmask8 searching) {
+HASHFS_AVX512 void pmem_nvm_hash_table_lookup_node_simd4(__m256i *keys, __m128i *node_indices, __mmask8 *failure, __mmask8 searching) {
 
 #ifdef SEQ_STEP
   uint32_t step = 1;
@@ -517,7 +561,7 @@ static void pmem_nvm_hash_table_remove_node (int              i//,
   
   paddr_t *entries = pmem_ht_vol->entries;
   HASHFS_ENT_SET_TOMBSTONE(entries[i]);
-  pmem_nvm_flush((void*)(entries + i), sizeof(paddr_t));
+  pmem_nvm_ent_written(i);
 }
 
 static uint64_t
@@ -586,6 +630,9 @@ pmem_nvm_hash_table_new(struct disk_superblock *sblk,
                    //paddr_t           metadata_location,
                    //const idx_spec_t *idx_spec
                    ) {
+  pmem_nvm_hash_simd_init();
+  pmem_nvm_hash_compact_init();
+
   pmem_ht = (pmem_nvm_hash_idx_t*)(dax_addr[g_root_dev] + (sblk->datablock_start * g_block_size_bytes));
   pmem_ht_vol = (pmem_nvm_hash_vol_t *)malloc(sizeof(pmem_nvm_hash_vol_t));
   //pmem_ht_vol->hash_func = hash_func ? hash_func : hash_64_32;
@@ -641,6 +688,78 @@ void pmem_nvm_hash_table_close() {
 	// free(pmem_ht_vol);  
 }
 
+/*
+ * HASHFS_ROCACHE mirror refresh.
+ *
+ * After a digest, libfs copies into its DRAM mirror only the cache lines
+ * of the table that kernfs published in the dirty log since the last
+ * refresh, instead of the whole table.
+ */
+
+// first dirty log index not applied to the mirror; valid once synced.
+static uint64_t pmem_cache_tail;
+static int pmem_cache_synced;
+
+void pmem_nvm_hash_table_set_dirty_log(hashfs_dirty_log_t *log) {
+  pmem_dirty_log = log;
+  // what was published before we knew the log is picked up by a full copy.
+  pmem_cache_synced = 0;
+}
+
+#ifndef KERNFS
+static void pmem_nvm_hash_cache_copy_all(void) {
+  // an entry is stored before its line is published, so everything below
+  // this head is in the copy.
+  if (pmem_dirty_log) {
+    pmem_cache_tail = __atomic_load_n(&pmem_dirty_log->head, __ATOMIC_ACQUIRE);
+    pmem_cache_synced = 1;
+  }
+
+  memcpy((char*)pmem_ht_vol->entries, pmem_ht_vol->entries_pm, pmem_ht_vol->nbytes);
+}
+
+int64_t pmem_nvm_hash_table_refresh_cache(void) {
+  hashfs_dirty_log_t *log = pmem_dirty_log;
+  uint64_t head, i, seq, line, off;
+  int64_t n = 0;
+
+  if (!log || !pmem_cache_synced)
+    goto copy_all;
+
+  head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+  if (head - pmem_cache_tail > HASHFS_DIRTY_MAX)
+    goto copy_all;
+
+  for (i = pmem_cache_tail; i < head; ++i) {
+    seq = __atomic_load_n(&log->ent[i % HASHFS_DIRTY_MAX].seq, __ATOMIC_ACQUIRE);
+    // still being published: start from here next time.
+    if (seq < i + 1)
+      break;
+
+    line = log->ent[i % HASHFS_DIRTY_MAX].line;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // reused by a later writer while we were behind.
+    if (seq != i + 1 || log->ent[i % HASHFS_DIRTY_MAX].seq != seq)
+      goto copy_all;
+
+    off = line * HASHFS_ENTS_PER_LINE * sizeof(paddr_t);
+    if (off >= pmem_ht_vol->nbytes)
+      continue;
+
+    memcpy((char*)pmem_ht_vol->entries + off, (char*)pmem_ht_vol->entries_pm + off,
+        MIN(64, pmem_ht_vol->nbytes - off));
+    ++n;
+  }
+
+  pmem_cache_tail = i;
+  return n;
+
+copy_all:
+  pmem_nvm_hash_cache_copy_all();
+  return -1;
+}
+#endif
+
 
 /*
  * nvm_hash_table_insert_node:
@@ -676,7 +795,7 @@ pmem_nvm_hash_table_insert_node(uint32_t node_index, uint32_t key_hash,
   }
   int success = atomic_compare_exchange_strong(entries + node_index, &expected, new_key);
   if(success) {
-    pmem_nvm_flush((void*)(entries + node_index), sizeof(paddr_t));
+    pmem_nvm_ent_written(node_index);
   }
   return success;
 }
@@ -706,7 +825,7 @@ int pmem_nvm_hash_table_lookup(inum_t inum, paddr_t lblk,
   return success;
 }
 
-static inline int 
+HASHFS_AVX512 static inline int 
 pmem_nvm_hash_table_lookup_internal_simd8(__m512i *inums, __m512i *lblks, __m256i *val, __mmask8 to_find) {
     //create keys vector
   __mmask8 zeroMask = _cvtu32_mask8(0); //zeros
@@ -718,7 +837,7 @@ pmem_nvm_hash_table_lookup_internal_simd8(__m512i *inums, __m512i *lblks, __m256
   return _cvtmask8_u32(failure) == 0;
 }
 
-static inline int 
+HASHFS_AVX512 static inline int 
 pmem_nvm_hash_table_lookup_internal_simd4(__m256i *inums, __m256i *lblks, __m128i *val, __mmask8 to_find) {
     //create keys vector
   __mmask8 zeroMask = _cvtu32_mask8(0); //zeros
@@ -730,7 +849,8 @@ pmem_nvm_hash_table_lookup_internal_simd4(__m256i *inums, __m256i *lblks, __m128
   return _cvtmask8_u32(failure) == 0;
 }
 
-int pmem_nvm_hash_table_lookup_simd(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+static HASHFS_AVX512 int
+pmem_nvm_hash_table_lookup_avx512(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
 
   int entries4 = len <= 4;
   u512i_64 inum_vec8; u512i_64 lblk_vec8;
@@ -896,10 +1016,16 @@ pmem_nvm_hash_table_insert (inum_t     inum,
                        )
 {
   paddr_t key = HASHFS_MAKEKEY(inum, lblk);
-  return pmem_nvm_hash_table_insert_internal(key, index);//, index, size);
+  int ret;
+
+  pthread_rwlock_rdlock(&pmem_compact_lock);
+  ret = pmem_nvm_hash_table_insert_internal(key, index);//, index, size);
+  pthread_rwlock_unlock(&pmem_compact_lock);
+
+  return ret;
 }
 
-void pmem_find_next_invalid_entry_simd8(__m256i *node_indices, uint32_t duplicates) {
+HASHFS_AVX512 void pmem_find_next_invalid_entry_simd8(__m256i *node_indices, uint32_t duplicates) {
   
 
 #ifdef SEQ_STEP
@@ -941,7 +1067,7 @@ void pmem_find_next_invalid_entry_simd8(__m256i *node_indices, uint32_t duplicat
   }
 }
 
-void pmem_find_next_invalid_entry_simd4(__m128i *node_indices, uint32_t duplicates) {
+HASHFS_AVX512 void pmem_find_next_invalid_entry_simd4(__m128i *node_indices, uint32_t duplicates) {
   
 
 #ifdef SEQ_STEP
@@ -983,7 +1109,7 @@ void pmem_find_next_invalid_entry_simd4(__m128i *node_indices, uint32_t duplicat
   }
 }
 
-static inline int pmem_nvm_hash_table_insert_internal_simd8(__m512i *inums, __m512i *lblks, __m256i *indices, __mmask8 to_find) {
+HASHFS_AVX512 static inline int pmem_nvm_hash_table_insert_internal_simd8(__m512i *inums, __m512i *lblks, __m256i *indices, __mmask8 to_find) {
     //create keys vector
   __mmask8 zeroMask = _cvtu32_mask8(0); //zeros
   __mmask8 oneMask = _cvtu32_mask8(~0);
@@ -1018,6 +1144,10 @@ static inline int pmem_nvm_hash_table_insert_internal_simd8(__m512i *inums, __m5
 
   static uint64_t successes = 0;
   unsigned status;
+  // without RTM the caller inserts one key at a time.
+  if (!pmem_simd_has_rtm)
+    return false;
+
   if ((status = _xbegin ()) == _XBEGIN_STARTED) {
     _mm512_mask_i32scatter_epi64(pmem_ht_vol->entries, to_find, *indices, keys, 8);
     _xend();
@@ -1030,15 +1160,14 @@ static inline int pmem_nvm_hash_table_insert_internal_simd8(__m512i *inums, __m5
   for (int i = 0; i < 8; ++i) {
       if (!(to_find & (1 << i))) continue;
 
-      pmem_flush((void*)&pmem_ht_vol->entries[node_indices->arr[i]], 
-                  sizeof(*pmem_ht_vol->entries));
+      pmem_nvm_ent_written(node_indices->arr[i]);
   }
 
   return true;
 
 }
 
-static inline int pmem_nvm_hash_table_insert_internal_simd4(__m256i *inums, __m256i *lblks, __m128i *indices, __mmask8 to_find) {
+HASHFS_AVX512 static inline int pmem_nvm_hash_table_insert_internal_simd4(__m256i *inums, __m256i *lblks, __m128i *indices, __mmask8 to_find) {
     //create keys vector
   __mmask8 zeroMask = _cvtu32_mask8(0); //zeros
   __mmask8 oneMask = _cvtu32_mask8(~0);
@@ -1071,11 +1200,18 @@ static inline int pmem_nvm_hash_table_insert_internal_simd4(__m256i *inums, __m2
   } while(duplicates_mask != 0);
   _mm256_mask_i32scatter_epi64(pmem_ht_vol->entries, to_find, *indices, keys, 8);
 
+  for (int i = 0; i < 4; ++i) {
+      if (!(to_find_int & (1 << i))) continue;
+
+      pmem_nvm_ent_written(node_indices->arr[i]);
+  }
+
   return true;
 
 }
 
-int pmem_nvm_hash_table_insert_simd(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks){
+static HASHFS_AVX512 int
+pmem_nvm_hash_table_insert_avx512(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks){
   int entries4 = len <= 4;
   u512i_64 inum_vec8; u512i_64 lblk_vec8;
   u256i_64 inum_vec4; u256i_64 lblk_vec4;
@@ -1172,7 +1308,7 @@ pmem_nvm_hash_table_remove_internal (paddr_t         key,
   return 0;
 }
 
-static inline
+HASHFS_AVX512 static inline
 int pmem_nvm_hash_table_remove_internal_simd8(__m512i *inums, __m512i *lblks, __mmask8 to_remove) {
   
   __mmask8 zeroMask = _cvtu32_mask8(0); //zeros
@@ -1188,17 +1324,17 @@ int pmem_nvm_hash_table_remove_internal_simd8(__m512i *inums, __m512i *lblks, __
   _mm512_mask_i32scatter_epi64(pmem_ht_vol->entries, to_tombstone, node_indices, tombstone_val, 8);
 
   u256i_32 *narr = (u256i_32*)&node_indices;
+  uint32_t removed = _cvtmask8_u32(to_remove) & _cvtmask8_u32(to_tombstone);
   for (int i = 0; i < 8; ++i) {
-      if (!(to_remove & (1 << i))) continue;
+      if (!(removed & (1 << i))) continue;
 
-      pmem_flush((void*)&pmem_ht_vol->entries[narr->arr[i]], 
-                  sizeof(*pmem_ht_vol->entries));
+      pmem_nvm_ent_written(narr->arr[i]);
   }
 
   return _cvtmask8_u32(failure) == 0;
 }
 
-static inline
+HASHFS_AVX512 static inline
 int pmem_nvm_hash_table_remove_internal_simd4(__m256i *inums, __m256i *lblks, __mmask8 to_remove) {
   
   __mmask8 zeroMask = _cvtu32_mask8(0); //zeros
@@ -1214,10 +1350,19 @@ int pmem_nvm_hash_table_remove_internal_simd4(__m256i *inums, __m256i *lblks, __
 
   _mm256_mask_i32scatter_epi64(pmem_ht_vol->entries, to_tombstone, node_indices, tombstone_val, 8);
 
+  u128i_32 *narr = (u128i_32*)&node_indices;
+  uint32_t removed = _cvtmask8_u32(to_remove) & _cvtmask8_u32(to_tombstone);
+  for (int i = 0; i < 4; ++i) {
+      if (!(removed & (1 << i))) continue;
+
+      pmem_nvm_ent_written(narr->arr[i]);
+  }
+
   return _cvtmask8_u32(failure) == 0;
 }
 
-int pmem_nvm_hash_table_remove_simd(uint32_t inum, uint32_t lblk, uint32_t len){
+static HASHFS_AVX512 int
+pmem_nvm_hash_table_remove_avx512(uint32_t inum, uint32_t lblk, uint32_t len){
   int entries4 = len <= 4;
   u512i_64 inum_vec8; u512i_64 lblk_vec8;
   u256i_64 inum_vec4; u256i_64 lblk_vec4;
@@ -1272,24 +1417,456 @@ pmem_nvm_hash_table_remove (inum_t         inum,
                                         );
 }
 
-void debug_stat_pmem_ht() {
+/*
+ * AVX2 build of the batched operations.
+ *
+ * AVX2 has no mask registers and no scatter. The 8 lanes of a batch are
+ * probed as two 4-lane halves with 64-bit gathers, and lane masks are
+ * kept as bits of an int. New keys are inserted one at a time.
+ */
+static HASHFS_AVX2 __m256i pmem_mix64_avx2(__m256i c) {
+  __m256i a = _mm256_set1_epi64x(0xff51afd7ed558ccdL);
+  __m256i b = _mm256_set1_epi64x(0xc4ceb9fe1a85ec53L);
+
+#define MIX_AVX2(x, y, z, shift) \
+  x = _mm256_sub_epi64(x, y); x = _mm256_sub_epi64(x, z); \
+  x = _mm256_xor_si256(x, shift)
+  MIX_AVX2(a, b, c, _mm256_srli_epi64(c, 13));
+  MIX_AVX2(b, c, a, _mm256_slli_epi64(a, 8));
+  MIX_AVX2(c, a, b, _mm256_srli_epi64(b, 13));
+  MIX_AVX2(a, b, c, _mm256_srli_epi64(c, 12));
+  MIX_AVX2(b, c, a, _mm256_slli_epi64(a, 16));
+  MIX_AVX2(c, a, b, _mm256_srli_epi64(b, 5));
+  MIX_AVX2(a, b, c, _mm256_srli_epi64(c, 3));
+  MIX_AVX2(b, c, a, _mm256_slli_epi64(a, 10));
+  MIX_AVX2(c, a, b, _mm256_srli_epi64(b, 15));
+#undef MIX_AVX2
+
+  return c;
+}
+
+// all-ones in the 64-bit lanes whose bit is set in the low 4 bits of m.
+static HASHFS_AVX2 __m256i pmem_lanes_avx2(uint32_t m) {
+  return _mm256_set_epi64x(-(long long)((m >> 3) & 1), -(long long)((m >> 2) & 1),
+      -(long long)((m >> 1) & 1), -(long long)(m & 1));
+}
+
+static HASHFS_AVX2 uint32_t pmem_movemask_avx2(__m256i v) {
+  return (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(v));
+}
+
+/* Same probe as pmem_nvm_hash_table_lookup_node_simd8() for the lanes in
+ * searching. Returns the lanes that hit an empty entry (not found); their
+ * node_indices hold the first tombstone or the empty entry. */
+static HASHFS_AVX2 uint32_t
+pmem_nvm_hash_table_lookup_node_avx2(const uint64_t *keys, uint32_t *node_indices,
+    uint32_t searching) {
+#ifdef SEQ_STEP
+  uint32_t step = 1;
+#else
+  uint32_t step = 0;
+#endif
+  const __m256i empty_val = _mm256_set1_epi64x(HASHFS_EMPTY_VAL);
+  const __m256i tombstone_vec = _mm256_set1_epi64x(HASHFS_TOMBSTONE_VAL);
+  const long long *entries = (const long long *)pmem_ht_vol->entries;
+  uint64_t mod = (uint64_t)pmem_ht->mod;
+  uint32_t first_tombstone[8];
+  uint32_t found_tombstone = 0, failure = 0;
+  __m256i key_vec[2];
+  u256i_64 hash;
+  int h, i;
+
+  for (h = 0; h < 2; h++) {
+    key_vec[h] = _mm256_loadu_si256((const __m256i *)(keys + 4 * h));
+    hash.vec = pmem_mix64_avx2(key_vec[h]);
+    for (i = 0; i < 4; i++)
+      node_indices[4 * h + i] = (uint32_t)(hash.arr[i] % mod);
+  }
+
+  while (searching) {
+    uint32_t hit = 0, is_tombstone = 0, is_empty = 0, m;
+
+    for (h = 0; h < 2; h++) {
+      uint32_t *idx = node_indices + 4 * h;
+      __m256i cur = _mm256_mask_i64gather_epi64(empty_val, entries,
+          _mm256_set_epi64x(idx[3], idx[2], idx[1], idx[0]),
+          pmem_lanes_avx2(searching >> (4 * h)), 8);
+
+      hit |= pmem_movemask_avx2(_mm256_cmpeq_epi64(cur, key_vec[h])) << (4 * h);
+      is_tombstone |= pmem_movemask_avx2(_mm256_cmpeq_epi64(cur, tombstone_vec)) << (4 * h);
+      is_empty |= pmem_movemask_avx2(_mm256_cmpeq_epi64(cur, empty_val)) << (4 * h);
+    }
+
+    searching &= ~hit;
+
+    m = searching & is_tombstone & ~found_tombstone;
+    found_tombstone |= m;
+    for (i = 0; i < 8; i++) {
+      if (m & (1 << i))
+        first_tombstone[i] = node_indices[i];
+    }
+
+    is_empty &= searching;
+    failure |= is_empty;
+    for (i = 0; i < 8; i++) {
+      if (is_empty & found_tombstone & (1 << i))
+        node_indices[i] = first_tombstone[i];
+    }
+
+    searching &= ~is_empty;
+#ifndef SEQ_STEP
+    step++;
+#endif
+    for (i = 0; i < 8; i++) {
+      if (searching & (1 << i))
+        node_indices[i] = (uint32_t)((node_indices[i] + step) % mod);
+    }
+  }
+
+  return failure;
+}
+
+static void pmem_make_keys(uint32_t inum, uint32_t lblk, uint32_t len,
+    uint64_t *keys) {
+  uint32_t i;
+
+  for (i = 0; i < 8; ++i)
+    keys[i] = i < len ? HASHFS_MAKEKEY(inum, lblk + i) : HASHFS_EMPTY_VAL;
+}
+
+static HASHFS_AVX2 int
+pmem_nvm_hash_table_lookup_avx2(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+  uint64_t keys[8];
+  uint32_t node_indices[8];
+  uint32_t i;
+
+  pmem_make_keys(inum, lblk, len, keys);
+  if (pmem_nvm_hash_table_lookup_node_avx2(keys, node_indices, (1U << len) - 1))
+    return 0;
+
+  for (i = 0; i < len; ++i)
+    pblks[i] = (uint64_t)node_indices[i] + (uint64_t)pmem_ht->meta_size;
+
+  return 1;
+}
+
+static HASHFS_AVX2 int
+pmem_nvm_hash_table_insert_avx2(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+  uint64_t keys[8];
+  uint32_t node_indices[8];
+  uint32_t not_found, i;
+
+  pmem_make_keys(inum, lblk, len, keys);
+  not_found = pmem_nvm_hash_table_lookup_node_avx2(keys, node_indices, (1U << len) - 1);
+
+  for (i = 0; i < len; ++i) {
+    if (not_found & (1 << i))
+      pmem_nvm_hash_table_insert_internal(HASHFS_MAKEKEY(inum, lblk + i), &pblks[i]);
+    else
+      pblks[i] = (uint64_t)node_indices[i] + (uint64_t)pmem_ht->meta_size;
+  }
+
+  return 1;
+}
+
+static HASHFS_AVX2 int
+pmem_nvm_hash_table_remove_avx2(uint32_t inum, uint32_t lblk, uint32_t len) {
+  uint64_t keys[8];
+  uint32_t node_indices[8];
+  uint32_t not_found, i;
+
+  pmem_make_keys(inum, lblk, len, keys);
+  not_found = pmem_nvm_hash_table_lookup_node_avx2(keys, node_indices, (1U << len) - 1);
+
+  for (i = 0; i < len; ++i) {
+    if (!(not_found & (1 << i)))
+      pmem_nvm_hash_table_remove_node(node_indices[i]);
+  }
+
+  return not_found == 0;
+}
+
+/*
+ * Scalar build: one probe per key.
+ */
+static int
+pmem_nvm_hash_table_lookup_scalar(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+  uint32_t i;
+
+  for (i = 0; i < len; ++i) {
+    if (!pmem_nvm_hash_table_lookup(inum, lblk + i, &pblks[i]))
+      return 0;
+  }
+
+  return 1;
+}
+
+static int
+pmem_nvm_hash_table_insert_scalar(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    pmem_nvm_hash_table_insert_internal(HASHFS_MAKEKEY(inum, lblk + i), &pblks[i]);
+
+  return 1;
+}
+
+static int
+pmem_nvm_hash_table_remove_scalar(uint32_t inum, uint32_t lblk, uint32_t len) {
+  paddr_t index;
+  int success = 1;
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    success &= pmem_nvm_hash_table_remove(inum, lblk + i, &index);
+
+  return success;
+}
+
+typedef struct pmem_nvm_hash_simd_ops {
+  const char *name;
+  int (*insert)(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks);
+  int (*lookup)(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks);
+  int (*remove)(uint32_t inum, uint32_t lblk, uint32_t len);
+} pmem_nvm_hash_simd_ops_t;
+
+// widest first.
+static const pmem_nvm_hash_simd_ops_t pmem_simd_ops[] = {
+  {"avx512", pmem_nvm_hash_table_insert_avx512,
+    pmem_nvm_hash_table_lookup_avx512, pmem_nvm_hash_table_remove_avx512},
+  {"avx2", pmem_nvm_hash_table_insert_avx2,
+    pmem_nvm_hash_table_lookup_avx2, pmem_nvm_hash_table_remove_avx2},
+  {"scalar", pmem_nvm_hash_table_insert_scalar,
+    pmem_nvm_hash_table_lookup_scalar, pmem_nvm_hash_table_remove_scalar},
+};
+
+#define N_SIMD_OPS (sizeof(pmem_simd_ops) / sizeof(pmem_simd_ops[0]))
+
+static const pmem_nvm_hash_simd_ops_t *pmem_simd = &pmem_simd_ops[N_SIMD_OPS - 1];
+
+static int pmem_simd_supported(const pmem_nvm_hash_simd_ops_t *ops) {
+  __builtin_cpu_init();
+
+  if (!strcmp(ops->name, "avx512"))
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+      __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw");
+  if (!strcmp(ops->name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+
+  return 1;
+}
+
+int pmem_nvm_hash_table_set_simd(const char *name) {
+  unsigned int eax, ebx, ecx, edx;
+  size_t i;
+
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    pmem_simd_has_rtm = !!(ebx & bit_RTM);
+
+  for (i = 0; i < N_SIMD_OPS; ++i) {
+    if (!strcmp(pmem_simd_ops[i].name, name)) {
+      if (!pmem_simd_supported(&pmem_simd_ops[i]))
+        return -1;
+      pmem_simd = &pmem_simd_ops[i];
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+const char *pmem_nvm_hash_table_simd_name(void) {
+  return pmem_simd->name;
+}
+
+// MLFS_HASHFS_SIMD=avx512|avx2|scalar overrides the choice.
+static void pmem_nvm_hash_simd_init(void) {
+  const char *name = getenv("MLFS_HASHFS_SIMD");
+  size_t i;
+
+  if (!name || pmem_nvm_hash_table_set_simd(name)) {
+    for (i = 0; i < N_SIMD_OPS; ++i) {
+      if (!pmem_nvm_hash_table_set_simd(pmem_simd_ops[i].name))
+        break;
+    }
+  }
+
+  mlfs_info("hashfs simd: %s\n", pmem_simd->name);
+}
+
+int pmem_nvm_hash_table_insert_simd(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+  int ret;
+
+  pthread_rwlock_rdlock(&pmem_compact_lock);
+  ret = pmem_simd->insert(inum, lblk, len, pblks);
+  pthread_rwlock_unlock(&pmem_compact_lock);
+
+  return ret;
+}
+
+int pmem_nvm_hash_table_lookup_simd(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks) {
+  return pmem_simd->lookup(inum, lblk, len, pblks);
+}
+
+int pmem_nvm_hash_table_remove_simd(uint32_t inum, uint32_t lblk, uint32_t len) {
+  return pmem_simd->remove(inum, lblk, len);
+}
+
+/*
+ * Tombstone compaction.
+ *
+ * The table cannot be rehashed into a bigger or smaller one: a key's slot
+ * index is the data block it maps, so moving a key means moving its data.
+ * What can be undone in place is the tombstone build-up that lengthens
+ * probes for misses and for keys inserted behind them.
+ *
+ * A tombstone may become EMPTY if every slot between it and the next EMPTY
+ * slot is a tombstone too. No key sits in such a run, and a key past the
+ * terminating EMPTY slot cannot have a home before it, so no probe chain
+ * crosses the run. Turning any subset of the run EMPTY keeps that true,
+ * which makes each 8-byte store safe on its own: concurrent lookups see a
+ * valid table at every step, and a crash in the middle leaves one that
+ * needs no undo. Removes only create tombstones, which at worst end a run
+ * early. Inserts are excluded by pmem_compact_lock.
+ */
+
+// slots scanned per digest; MLFS_HASHFS_COMPACT overrides, 0 disables.
+#define HASHFS_COMPACT_SLOTS (1UL << 16)
+
+static uint64_t pmem_compact_slots = HASHFS_COMPACT_SLOTS;
+// first slot of the next window; windows sweep the whole table in turn.
+static uint64_t pmem_compact_cursor;
+static uint64_t pmem_compact_reclaimed;
+
+static void pmem_nvm_hash_compact_init(void) {
+  const char *slots = getenv("MLFS_HASHFS_COMPACT");
+
+  if (slots)
+    pmem_compact_slots = strtoull(slots, NULL, 10);
+}
+
+/**
+ * pmem_nvm_hash_table_compact:
+ * @start: first slot to scan
+ * @nslots: number of slots to scan, wrapping around the end of the table
+ *
+ * Turns every tombstone in the window that is followed by nothing but
+ * tombstones up to an EMPTY slot into an EMPTY slot. A run that extends
+ * past the end of the window is left for the next one.
+ *
+ * Returns: the number of tombstones reclaimed
+ */
+uint64_t pmem_nvm_hash_table_compact(uint64_t start, uint64_t nslots) {
+  paddr_t *entries = pmem_ht_vol->entries;
+  uint64_t mod = (uint64_t)pmem_ht->mod;
+  uint64_t run = 0, reclaimed = 0, n, k, idx;
+
+  if (nslots > mod)
+    nslots = mod;
+
+  pthread_rwlock_wrlock(&pmem_compact_lock);
+
+  for (n = 0; n < nslots; ++n) {
+    idx = (start + n) % mod;
+    paddr_t cur = entries[idx];
+
+    if (HASHFS_ENT_IS_TOMBSTONE(cur)) {
+      ++run;
+      continue;
+    }
+
+    if (HASHFS_ENT_IS_EMPTY(cur)) {
+      for (k = 1; k <= run; ++k) {
+        uint64_t t = (idx + mod - k) % mod;
+
+        HASHFS_ENT_SET_EMPTY(entries[t]);
+        pmem_nvm_ent_written(t);
+      }
+      reclaimed += run;
+    }
+    run = 0;
+  }
+
+  pthread_rwlock_unlock(&pmem_compact_lock);
+
+  __sync_fetch_and_add(&pmem_compact_reclaimed, reclaimed);
+
+  return reclaimed;
+}
+
+/*
+ * Compacts the next window of the table. Called once per digest, inside
+ * the digest's undo log transaction so its flushes are fenced with the
+ * rest of the digest.
+ */
+uint64_t pmem_nvm_hash_table_compact_step(void) {
+  uint64_t start;
+
+  if (!pmem_compact_slots || !pmem_ht || !pmem_ht->mod)
+    return 0;
+
+  start = __sync_fetch_and_add(&pmem_compact_cursor, pmem_compact_slots);
+
+  return pmem_nvm_hash_table_compact(start % (uint64_t)pmem_ht->mod,
+      pmem_compact_slots);
+}
+
+void debug_stat_pmem_ht(void) {
     uint64_t empty_cnt = 0;
     uint64_t tombstone_cnt = 0;
     uint64_t valid_cnt = 0;
+    // probe length of a key: slots from its home to where it sits, plus one.
+    uint64_t probe_sum = 0, probe_max = 0;
+    // clusters are maximal runs of non-empty slots.
+    uint64_t cluster_cnt = 0, cluster_len = 0, cluster_max = 0;
+    // tombstones compaction can reclaim now.
+    uint64_t tombstone_run = 0, reclaimable = 0;
+    uint64_t mod = (uint64_t)pmem_ht->mod;
+
     for (unsigned int i=0; i < pmem_ht->num_entries; ++i) {
         paddr_t ent = pmem_ht_vol->entries[i];
         if (HASHFS_ENT_IS_EMPTY(ent)) {
             ++empty_cnt;
+            reclaimable += tombstone_run;
+            tombstone_run = 0;
+            if (cluster_len) {
+                ++cluster_cnt;
+                cluster_max = MAX(cluster_max, cluster_len);
+            }
+            cluster_len = 0;
+            continue;
         }
-        else if (HASHFS_ENT_IS_TOMBSTONE(ent)) {
+
+        ++cluster_len;
+        if (HASHFS_ENT_IS_TOMBSTONE(ent)) {
             ++tombstone_cnt;
+            ++tombstone_run;
         }
         else {
+            uint64_t home = pmem_ht_vol->hash_func(ent) % mod;
+            uint64_t probe = (i + mod - home) % mod + 1;
+
             ++valid_cnt;
+            tombstone_run = 0;
+            probe_sum += probe;
+            probe_max = MAX(probe_max, probe);
         }
     }
+    // a cluster that wraps around the end is counted as two.
+    if (cluster_len) {
+        ++cluster_cnt;
+        cluster_max = MAX(cluster_max, cluster_len);
+    }
+
     printf("empty_cnt: %lu tombstone_cnt : %lu valid_cnt %lu\n",
             empty_cnt, tombstone_cnt, valid_cnt);
+    printf("probe avg: %.2f max: %lu\n",
+            valid_cnt ? (double)probe_sum / (double)valid_cnt : 0.0, probe_max);
+    printf("clusters: %lu avg len: %.2f max len: %lu\n", cluster_cnt,
+            cluster_cnt ? (double)(valid_cnt + tombstone_cnt) / cluster_cnt : 0.0,
+            cluster_max);
+    printf("tombstones reclaimable: %lu reclaimed: %lu\n",
+            reclaimable, pmem_compact_reclaimed);
 }
 
 /*
@@ -57,7 +57,7 @@ extern "C" {
 #define HASHFS_ENT_SET_EMPTY(x) (x = (paddr_t)~0)
 #define HASHFS_ENT_SET_VAL(x,v) (x = v)
 
-#define HASHFS_MAKEKEY(inum, lblk) (((uint64_t)inum << 32) | lblk)
+#define HASHFS_MAKEKEY(inum, lblk) (((uint64_t)(inum) << 32) | (lblk))
 /*
 #define HASHCACHE
 
@@ -180,6 +180,25 @@ int pmem_nvm_hash_table_insert_simd(uint32_t inum, uint32_t lblk, uint32_t len,
 int pmem_nvm_hash_table_lookup_simd(uint32_t inum, uint32_t lblk, uint32_t len, uint64_t *pblks);
 int pmem_nvm_hash_table_remove_simd(uint32_t inum, uint32_t lblk, uint32_t len);
 
+// batches hold at most 8 keys. The kernels are picked at table creation;
+// set_simd("avx512" | "avx2" | "scalar") switches them, -1 if unsupported.
+int pmem_nvm_hash_table_set_simd(const char *name);
+const char *pmem_nvm_hash_table_simd_name(void);
+
+// reclaim tombstones that end in an empty slot; returns how many.
+uint64_t pmem_nvm_hash_table_compact(uint64_t start, uint64_t nslots);
+// compact the next MLFS_HASHFS_COMPACT slots; called once per digest.
+uint64_t pmem_nvm_hash_table_compact_step(void);
+void debug_stat_pmem_ht(void);
+
+// publish the entry lines kernfs writes to log; NULL stops publishing.
+void pmem_nvm_hash_table_set_dirty_log(hashfs_dirty_log_t *log);
+#ifndef KERNFS
+// bring the HASHFS_ROCACHE mirror up to date; returns the number of lines
+// copied, or -1 if the whole table was.
+int64_t pmem_nvm_hash_table_refresh_cache(void);
+#endif
+
 
 extern uint64_t reads;
 extern uint64_t writes;
@@ -0,0 +1,193 @@
+/* Test of the partitioned block allocator.
+ *
+ * Builds the free lists of an empty device and allocates data from several
+ * threads at once. Index blocks must come from partition 0 and each thread
+ * must get all of its data from one home list, with the homes spread over
+ * the data partitions. The main thread then allocates until the device is
+ * full: it must steal from the other lists, and take data from the index
+ * partition only once no data list and not the shared list has room.
+ *
+ * usage: balloc_partition_test [nthreads]
+ */
+#include <pthread.h>
+
+#include "../balloc.c"
+
+#define NBLOCKS (1UL << 18)
+#define MAX_THREADS 64
+#define THREAD_ALLOCS 1000
+#define THREAD_BLOCKS 4
+#define FILL_BLOCKS 1024
+
+static struct super_block test_sb;
+static unsigned long bitmap[NBLOCKS / BITS_PER_LONG];
+
+struct worker {
+	pthread_t tid;
+	int partition;		// -1 until the first allocation, -2 if mixed
+	int failed;
+};
+
+/*******************************************************************************
+ * Allocator stand-ins: no buffer cache here
+ ******************************************************************************/
+
+void sync_all_buffers(struct block_device *bdev)
+{
+}
+
+void ensure_block_is_clear(struct block_device *bdev, mlfs_fsblk_t blk)
+{
+}
+
+/*******************************************************************************
+ * Checks
+ ******************************************************************************/
+
+static int partition_of(unsigned long blocknr)
+{
+	unsigned long id = blocknr / test_sb.per_list_blocks;
+
+	return id < test_sb.n_partition ? (int)id : SHARED_PARTITION;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	unsigned long blocknr;
+	int i, id;
+
+	for (i = 0; i < THREAD_ALLOCS; i++) {
+		if (mlfs_new_blocks(&test_sb, &blocknr, THREAD_BLOCKS,
+					0, 0, DATA, 0) != THREAD_BLOCKS) {
+			w->failed = 1;
+			break;
+		}
+
+		id = partition_of(blocknr);
+		if (w->partition == -1)
+			w->partition = id;
+		else if (w->partition != id)
+			w->partition = -2;
+	}
+
+	return NULL;
+}
+
+// data must not go to the index partition while another list has room.
+static int check_fill(unsigned long *allocated)
+{
+	unsigned long blocknr;
+	int ret, i, bad = 0;
+
+	while (1) {
+		int others_full = 1;
+
+		for (i = 1; i < test_sb.n_partition; i++)
+			if (mlfs_get_free_list(&test_sb, i)->num_free_blocks > FILL_BLOCKS)
+				others_full = 0;
+		if (test_sb.shared_free_list.num_free_blocks > FILL_BLOCKS)
+			others_full = 0;
+
+		ret = mlfs_new_blocks(&test_sb, &blocknr, FILL_BLOCKS, 0, 0, DATA, 0);
+		if (ret < 0)
+			break;
+
+		*allocated += ret;
+		if (partition_of(blocknr) == META_PARTITION && !others_full) {
+			if (!bad)
+				printf("data at %lu in the index partition "
+						"while other lists had room\n", blocknr);
+			bad = 1;
+		}
+	}
+
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker workers[MAX_THREADS];
+	int nthreads = argc > 1 ? atoi(argv[1]) : 8;
+	int used[NBLOCKS / BALLOC_MIN_PARTITION_BLOCKS] = {0};
+	unsigned long blocknr, start_free, allocated = 0;
+	int i, n_data, homes = 0, failed = 0;
+
+	if (nthreads < 1 || nthreads > MAX_THREADS)
+		nthreads = 8;
+
+	test_sb.num_blocks = NBLOCKS;
+	test_sb.n_partition = balloc_n_partitions(NBLOCKS);
+	mlfs_alloc_block_free_lists(&test_sb);
+	mlfs_init_blockmap(&test_sb, 0);
+
+	// block 0 is never handed out.
+	bitmap[0] = 1;
+	mlfs_build_blocknode_map(&test_sb, bitmap, NBLOCKS, 0);
+	start_free = mlfs_count_free_blocks(&test_sb);
+
+	n_data = test_sb.n_partition - 1;
+	if (n_data < 2) {
+		printf("need at least 3 partitions, got %u\n", test_sb.n_partition);
+		return 1;
+	}
+
+	if (mlfs_new_blocks(&test_sb, &blocknr, 2, 0, 0, TREE, 0) != 2 ||
+			partition_of(blocknr) != META_PARTITION) {
+		printf("index blocks not in the index partition\n");
+		failed = 1;
+	}
+	allocated += 2;
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].partition = -1;
+		workers[i].failed = 0;
+		pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->tid, NULL);
+		allocated += THREAD_ALLOCS * THREAD_BLOCKS;
+
+		if (w->failed || w->partition <= META_PARTITION ||
+				w->partition >= test_sb.n_partition) {
+			printf("thread %d: %s\n", i, w->failed ?
+					"allocation failed" : "data outside one data list");
+			failed = 1;
+			continue;
+		}
+
+		if (!used[w->partition]++)
+			homes++;
+	}
+
+	if (homes != (nthreads < n_data ? nthreads : n_data)) {
+		printf("%d threads share %d of %d data lists\n",
+				nthreads, homes, n_data);
+		failed = 1;
+	}
+
+	failed |= check_fill(&allocated);
+
+	if (allocated + mlfs_count_free_blocks(&test_sb) != start_free) {
+		printf("allocated %lu + free %lu != %lu\n", allocated,
+				mlfs_count_free_blocks(&test_sb), start_free);
+		failed = 1;
+	}
+
+	printf("partitions %u threads %d steals %lu left %lu\n",
+			test_sb.n_partition, nthreads, mlfs_count_steals(&test_sb),
+			mlfs_count_free_blocks(&test_sb));
+
+	if (!mlfs_count_steals(&test_sb) ||
+			mlfs_count_free_blocks(&test_sb) >
+			(unsigned long)FILL_BLOCKS * (test_sb.n_partition + 1)) {
+		printf("device not filled by stealing\n");
+		failed = 1;
+	}
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
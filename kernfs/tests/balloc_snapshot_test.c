@@ -0,0 +1,364 @@
+/* Test of free-list building at mount.
+ *
+ * First the word-at-a-time bitmap scanner is checked against a plain
+ * bit-by-bit walk, on random bitmaps and partition layouts. Then a device
+ * is mounted on a simulated disk, its free-extent snapshot is saved and
+ * the next mount must load exactly the lists a scan of the saved bitmap
+ * gives. A snapshot is good for one mount only, and a corrupt or stale one
+ * must fall back to the scan.
+ *
+ * usage: balloc_snapshot_test [ntrials]
+ */
+#include "../balloc.c"
+
+#define NBLOCKS (1UL << 17)
+#define BMAP_START 2
+#define RESERVED 64		// superblock and bitmap blocks
+#define MARKER (NBLOCKS - 1)
+
+static struct block_device test_bdev = {
+	.bd_blocksize = g_block_size_bytes,
+	.bd_blocksize_bits = 12,
+};
+static struct disk_superblock test_dsb = {
+	.ndatablocks = NBLOCKS,
+	.bmap_start = BMAP_START,
+};
+static uint8_t *disk[NBLOCKS];
+static unsigned long bitmap[BITS_TO_LONGS(NBLOCKS)];
+static uint32_t snap_nblocks;
+
+/*******************************************************************************
+ * Simulated disk: blocks are allocated on first write, the superblock
+ * stays in test_dsb
+ ******************************************************************************/
+
+struct buffer_head *bh_get_sync_IO(uint8_t dev, addr_t block_nr, uint8_t mode)
+{
+	struct buffer_head *bh = (struct buffer_head *)calloc(1, sizeof(*bh));
+
+	bh->b_blocknr = block_nr;
+	return bh;
+}
+
+int bh_submit_read_sync_IO(struct buffer_head *bh)
+{
+	if (disk[bh->b_blocknr])
+		memcpy(bh->b_data, disk[bh->b_blocknr], bh->b_size);
+	else
+		memset(bh->b_data, 0, bh->b_size);
+	return 0;
+}
+
+int mlfs_write(struct buffer_head *bh)
+{
+	if (bh->b_blocknr == 1)
+		return 0;
+
+	if (!disk[bh->b_blocknr])
+		disk[bh->b_blocknr] = (uint8_t *)malloc(g_block_size_bytes);
+	memcpy(disk[bh->b_blocknr], bh->b_data, bh->b_size);
+	return 0;
+}
+
+int mlfs_io_wait(uint8_t dev, int isread)
+{
+	return 0;
+}
+
+void bh_release(struct buffer_head *bh)
+{
+	free(bh);
+}
+
+// no digest runs here: the undo log is always empty.
+int undo_log_flush(void)
+{
+	return 0;
+}
+
+void sync_all_buffers(struct block_device *bdev)
+{
+}
+
+void ensure_block_is_clear(struct block_device *bdev, mlfs_fsblk_t blk)
+{
+}
+
+/*******************************************************************************
+ * Free lists
+ ******************************************************************************/
+
+static void init_lists(struct super_block *sb, unsigned long nblocks,
+		uint32_t n_partition)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->num_blocks = nblocks;
+	sb->n_partition = n_partition;
+	mlfs_alloc_block_free_lists(sb);
+	mlfs_init_blockmap(sb, 0);
+}
+
+// the scan the word-at-a-time scanner replaced, one bit at a time.
+static void reference_build(struct super_block *sb,
+		const unsigned long *bits, unsigned long bsize)
+{
+	unsigned long part_end = sb->per_list_blocks * sb->n_partition;
+	unsigned long b, low = 0;
+	int open = 0;
+
+	for (b = 0; b <= bsize; b++) {
+		int used = b == bsize || (bits[b / BITS_PER_LONG] >> (b % BITS_PER_LONG)) & 1;
+		int boundary = b <= part_end && b % sb->per_list_blocks == 0;
+
+		if (open && (used || boundary)) {
+			mlfs_insert_blocknode_map(sb, low < part_end ?
+					(int)(low / sb->per_list_blocks) : SHARED_PARTITION,
+					low, b - 1);
+			open = 0;
+		}
+
+		if (!used && !open) {
+			low = b;
+			open = 1;
+		}
+	}
+}
+
+static int same_lists(struct super_block *a, struct super_block *b)
+{
+	struct free_list *fa, *fb;
+	struct rb_node *na, *nb;
+	int i, id;
+
+	for (i = 0; i <= a->n_partition; i++) {
+		id = i < a->n_partition ? i : SHARED_PARTITION;
+		fa = mlfs_get_free_list(a, id);
+		fb = mlfs_get_free_list(b, id);
+
+		if (fa->num_free_blocks != fb->num_free_blocks ||
+				fa->num_blocknode != fb->num_blocknode)
+			return 0;
+
+		na = rb_first(&fa->block_free_tree);
+		nb = rb_first(&fb->block_free_tree);
+		for (; na && nb; na = rb_next(na), nb = rb_next(nb)) {
+			struct mlfs_range_node *ra, *rb;
+
+			ra = container_of(na, struct mlfs_range_node, node);
+			rb = container_of(nb, struct mlfs_range_node, node);
+			if (ra->range_low != rb->range_low ||
+					ra->range_high != rb->range_high)
+				return 0;
+		}
+
+		if (na || nb)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*******************************************************************************
+ * Checks
+ ******************************************************************************/
+
+static void random_bitmap(unsigned long *bits, unsigned long nbits, int mode)
+{
+	unsigned long i;
+
+	// bits past the end are left random: the scanner must ignore them.
+	for (i = 0; i < BITS_TO_LONGS(nbits); i++)
+		bits[i] = (unsigned long)rand() << 33 ^ (unsigned long)rand() << 2 ^ rand();
+
+	for (i = 0; i < nbits; i++) {
+		int used;
+
+		switch (mode) {
+		case 0: used = rand() % 2; break;
+		case 1: used = rand() % 100 < 3; break;
+		case 2: used = rand() % 100 < 97; break;
+		default: used = (i / 700) % 2; break;
+		}
+
+		if (used)
+			bits[i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+		else
+			bits[i / BITS_PER_LONG] &= ~(1UL << (i % BITS_PER_LONG));
+	}
+}
+
+static int check_scanner(int ntrials)
+{
+	struct super_block scanned, reference;
+	int trial;
+
+	for (trial = 0; trial < ntrials; trial++) {
+		unsigned long nbits = NBLOCKS - rand() % 1000;
+		uint32_t n_partition = 1 + rand() % 9;
+
+		random_bitmap(bitmap, nbits, trial % 4);
+
+		init_lists(&scanned, nbits, n_partition);
+		mlfs_build_blocknode_map(&scanned, bitmap, nbits, 0);
+		init_lists(&reference, nbits, n_partition);
+		reference_build(&reference, bitmap, nbits);
+
+		if (!same_lists(&scanned, &reference)) {
+			printf("scan mismatch: trial %d, %lu blocks, %u partitions\n",
+					trial, nbits, n_partition);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void write_bitmap(void)
+{
+	unsigned long i, nr = size_of_bitmap(NBLOCKS) / g_block_size_bytes;
+
+	for (i = 0; i < nr; i++) {
+		if (!disk[BMAP_START + i])
+			disk[BMAP_START + i] = (uint8_t *)malloc(g_block_size_bytes);
+		memcpy(disk[BMAP_START + i], (uint8_t *)bitmap + i * g_block_size_bytes,
+				g_block_size_bytes);
+	}
+}
+
+static void mount(struct super_block *sb)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->ondisk = &test_dsb;
+	sb->num_blocks = NBLOCKS;
+	balloc_init(g_root_dev, sb);
+}
+
+static unsigned long used_blocks(void)
+{
+	return bitmap_weight((uint64_t *)bitmap, NBLOCKS);
+}
+
+/* Mount with MARKER in use and save a snapshot, then free MARKER in the
+ * on-disk bitmap only: a mount that loads the snapshot still sees it in
+ * use, one that scans does not, and any other lists are wrong. tamper
+ * spoils the snapshot (or not) before the second mount. Returns 1 if that
+ * mount loaded the snapshot. */
+static int save_and_mount(void (*tamper)(void), int *bad)
+{
+	struct super_block saved, mounted, in_snapshot, on_disk;
+	unsigned long used;
+	int loaded;
+
+	bitmap[MARKER / BITS_PER_LONG] |= 1UL << (MARKER % BITS_PER_LONG);
+	write_bitmap();
+	used = used_blocks();
+
+	mount(&saved);
+	init_lists(&in_snapshot, NBLOCKS, saved.n_partition);
+	reference_build(&in_snapshot, bitmap, NBLOCKS);
+	if (!same_lists(&saved, &in_snapshot) || saved.used_blocks != used) {
+		printf("scanned mount does not match the bitmap\n");
+		*bad = 1;
+	}
+
+	balloc_save_snapshot(g_root_dev, &saved);
+	snap_nblocks = test_dsb.fl_snap_nblocks;
+	if (!test_dsb.fl_snap_block || snap_nblocks < 2) {
+		printf("no multi-block snapshot saved\n");
+		*bad = 1;
+	}
+
+	bitmap[MARKER / BITS_PER_LONG] &= ~(1UL << (MARKER % BITS_PER_LONG));
+	write_bitmap();
+	init_lists(&on_disk, NBLOCKS, saved.n_partition);
+	reference_build(&on_disk, bitmap, NBLOCKS);
+	if (tamper)
+		tamper();
+
+	mount(&mounted);
+	loaded = same_lists(&mounted, &in_snapshot);
+	if (loaded && mounted.used_blocks != used) {
+		printf("snapshot loaded with %lu used blocks, not %lu\n",
+				mounted.used_blocks, used);
+		*bad = 1;
+	}
+
+	if (!loaded && (!same_lists(&mounted, &on_disk) ||
+				mounted.used_blocks != used - 1)) {
+		printf("mount matches neither the snapshot nor the bitmap\n");
+		*bad = 1;
+	}
+
+	if (test_dsb.fl_snap_block) {
+		printf("snapshot still in the superblock after mount\n");
+		*bad = 1;
+	}
+
+	return loaded;
+}
+
+static void corrupt_snapshot(void)
+{
+	disk[test_dsb.fl_snap_block][FL_SNAP_LINK +
+		sizeof(struct fl_snap_header)] ^= 1;
+}
+
+static void stale_snapshot(void)
+{
+	test_dsb.fl_snap_gen++;
+}
+
+static int check_snapshot(void)
+{
+	struct super_block mounted, reference;
+	unsigned long i;
+	int bad = 0;
+
+	g_bdev[g_root_dev] = &test_bdev;
+
+	random_bitmap(bitmap, NBLOCKS, 0);
+	for (i = 0; i < RESERVED; i++)
+		bitmap[i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+
+	if (!save_and_mount(NULL, &bad)) {
+		printf("snapshot not loaded\n");
+		bad = 1;
+	}
+
+	// the snapshot was dropped by the mount that loaded it.
+	mount(&mounted);
+	init_lists(&reference, NBLOCKS, mounted.n_partition);
+	reference_build(&reference, bitmap, NBLOCKS);
+	if (!same_lists(&mounted, &reference) ||
+			mounted.used_blocks != used_blocks()) {
+		printf("second mount did not scan the bitmap\n");
+		bad = 1;
+	}
+
+	if (save_and_mount(corrupt_snapshot, &bad)) {
+		printf("corrupt snapshot loaded\n");
+		bad = 1;
+	}
+
+	if (save_and_mount(stale_snapshot, &bad)) {
+		printf("stale snapshot loaded\n");
+		bad = 1;
+	}
+
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	int ntrials = argc > 1 ? atoi(argv[1]) : 200;
+	int failed;
+
+	srand(1);
+	failed = check_scanner(ntrials);
+	failed |= check_snapshot();
+
+	printf("scan trials %d snapshot blocks %u\n", ntrials, snap_nblocks);
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,128 @@
+/* Microbenchmark for the HashFS batched lookup kernels.
+ *
+ * Builds a hash table in DRAM, fills it with files of BLOCKS_PER_FILE
+ * blocks, then times pmem_nvm_hash_table_lookup_simd() with each kernel
+ * build (avx512, avx2, scalar) on the same random 8-block batches. Every
+ * build is first checked against the scalar results.
+ *
+ * usage: hashfs_simd_bench [nkeys] [nlookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lpmem_ghash.h"
+
+#define BATCH 8
+#define BLOCKS_PER_FILE 1024
+#define N_BATCHES (1 << 16)
+
+static const char *kernels[] = {"avx512", "avx2", "scalar"};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t nkeys = argc > 1 ? strtoull(argv[1], NULL, 10) : (1UL << 20);
+	uint64_t nlookups = argc > 2 ? strtoull(argv[2], NULL, 10) : (1UL << 26);
+	struct disk_superblock sblk;
+	uint32_t *inums, *lblks;
+	uint64_t *expected, pblks[BATCH];
+	uint64_t nfiles, f, b, i, sum = 0, bytes;
+	double start, elapsed;
+	size_t k;
+
+	nfiles = nkeys / BLOCKS_PER_FILE;
+	if (nfiles == 0)
+		nfiles = 1;
+	nkeys = nfiles * BLOCKS_PER_FILE;
+
+	// ~70% load.
+	memset(&sblk, 0, sizeof(sblk));
+	sblk.datablock_start = 0;
+	sblk.ndatablocks = nkeys * 10 / 7;
+
+	bytes = sblk.ndatablocks * sizeof(paddr_t) + 3 * g_block_size_bytes;
+	bytes = (bytes + g_block_size_bytes - 1) & ~(g_block_size_bytes - 1);
+	dax_addr[g_root_dev] = (uint8_t *)aligned_alloc(g_block_size_bytes, bytes);
+	if (!dax_addr[g_root_dev]) {
+		perror("aligned_alloc");
+		return 1;
+	}
+	memset(dax_addr[g_root_dev], 0, bytes);
+
+	pmem_nvm_hash_table_new(&sblk, NULL);
+
+	for (f = 0; f < nfiles; f++) {
+		for (b = 0; b < BLOCKS_PER_FILE; b++) {
+			paddr_t index;
+			pmem_nvm_hash_table_insert(f + 1, b, &index);
+		}
+	}
+
+	inums = malloc(N_BATCHES * sizeof(uint32_t));
+	lblks = malloc(N_BATCHES * sizeof(uint32_t));
+	expected = malloc(N_BATCHES * BATCH * sizeof(uint64_t));
+
+	srand(42);
+	for (i = 0; i < N_BATCHES; i++) {
+		inums[i] = 1 + rand() % nfiles;
+		lblks[i] = (rand() % (BLOCKS_PER_FILE / BATCH)) * BATCH;
+	}
+
+	if (pmem_nvm_hash_table_set_simd("scalar")) {
+		fprintf(stderr, "no scalar kernel\n");
+		return 1;
+	}
+	for (i = 0; i < N_BATCHES; i++) {
+		if (!pmem_nvm_hash_table_lookup_simd(inums[i], lblks[i], BATCH,
+					expected + i * BATCH)) {
+			fprintf(stderr, "scalar lookup failed: inum %u lblk %u\n",
+					inums[i], lblks[i]);
+			return 1;
+		}
+	}
+
+	printf("%lu keys in %lu files, %lu lookups per kernel\n",
+			nkeys, nfiles, nlookups);
+
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (pmem_nvm_hash_table_set_simd(kernels[k])) {
+			printf("%-8s: not supported on this CPU\n", kernels[k]);
+			continue;
+		}
+
+		for (i = 0; i < N_BATCHES; i++) {
+			if (!pmem_nvm_hash_table_lookup_simd(inums[i], lblks[i], BATCH, pblks) ||
+					memcmp(pblks, expected + i * BATCH, sizeof(pblks))) {
+				fprintf(stderr, "%s: wrong result for inum %u lblk %u\n",
+						kernels[k], inums[i], lblks[i]);
+				return 1;
+			}
+		}
+
+		start = now_sec();
+		for (i = 0; i < nlookups / BATCH; i++) {
+			pmem_nvm_hash_table_lookup_simd(inums[i % N_BATCHES],
+					lblks[i % N_BATCHES], BATCH, pblks);
+			sum += pblks[0];
+		}
+		elapsed = now_sec() - start;
+
+		printf("%-8s: %8.2f M lookups/s\n", kernels[k],
+				(nlookups / BATCH * BATCH) / elapsed / 1e6);
+	}
+
+	// keep the lookups from being optimized away.
+	if (sum == 0)
+		printf("\n");
+
+	return 0;
+}
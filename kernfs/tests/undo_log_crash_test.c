@@ -0,0 +1,359 @@
+/* Crash test for the batched undo log.
+ *
+ * Runs digest-like transactions (block allocations and frees, index
+ * updates, bitmap stores) against a DRAM log whose durable image only
+ * changes at pmem_drain(). Each transaction is replayed with a crash at
+ * every fence in turn; at the crash, any dirty 8-byte word of the log may
+ * or may not have reached NVM. After recovery the bitmap and the index
+ * area must hold either their state before the transaction or, once the
+ * COMMIT fence has been reached, their state after it.
+ *
+ * usage: undo_log_crash_test [nseeds]
+ */
+#include <setjmp.h>
+
+#include "../undo_log.c"
+
+#define LOG_BYTES (64 << 10)
+#define LINE 64
+#define NVM_BYTES 4096
+#define NBITS 1024
+#define TX_STEPS 48
+#define PREFIX_TXS 3
+
+uint8_t *dax_addr[g_n_devices + 1];
+struct super_block *sb[g_n_devices];
+kernfs_stats_t g_perf_stats;
+uint8_t enable_perf_stats;
+
+static uint8_t log_live[LOG_BYTES], log_durable[LOG_BYTES];
+static uint8_t pending[LOG_BYTES / LINE];
+static uint8_t nvm[NVM_BYTES];
+static uint8_t bits[NBITS / 8], bits_durable[NBITS / 8];
+
+static struct block_bitmap blk_bitmap = { .bitmap = bits, .nr_bits = NBITS };
+static struct super_block root_sb = { .s_blk_bitmap = &blk_bitmap };
+
+static uint64_t drains, crash_at;
+static unsigned int tear_seed;
+static jmp_buf crash_env;
+static int rebuilds;
+
+/*******************************************************************************
+ * Simulated NVM
+ ******************************************************************************/
+
+static int in_log(const void *p)
+{
+	return (uint8_t *)p >= log_live && (uint8_t *)p < log_live + LOG_BYTES;
+}
+
+static void sync_range(const void *p, size_t n)
+{
+	size_t off = (uint8_t *)p - log_live;
+
+	memcpy(log_durable + off, log_live + off, n);
+}
+
+void pmem_flush(const void *addr, size_t len)
+{
+	size_t off, l;
+
+	if (!in_log(addr))
+		return;
+
+	off = (uint8_t *)addr - log_live;
+	for (l = off / LINE; l * LINE < off + len; l++)
+		pending[l] = 1;
+}
+
+static void crash(void)
+{
+	uint64_t *live = (uint64_t *)log_live, *dur = (uint64_t *)log_durable;
+	size_t i;
+
+	// whatever was dirty, flushed or not, may or may not have made it.
+	for (i = 0; i < LOG_BYTES / 8; i++)
+		if (live[i] != dur[i] && rand_r(&tear_seed) & 1)
+			dur[i] = live[i];
+
+	longjmp(crash_env, 1);
+}
+
+void pmem_drain(void)
+{
+	size_t l;
+
+	if (++drains == crash_at)
+		crash();
+
+	for (l = 0; l < LOG_BYTES / LINE; l++) {
+		if (pending[l]) {
+			sync_range(log_live + l * LINE, LINE);
+			pending[l] = 0;
+		}
+	}
+}
+
+void *pmem_memcpy_persist(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+	if (in_log(dst))
+		sync_range(dst, n);
+	return dst;
+}
+
+void *pmem_memset_persist(void *dst, int c, size_t n)
+{
+	memset(dst, c, n);
+	if (in_log(dst))
+		sync_range(dst, n);
+	return dst;
+}
+
+/*******************************************************************************
+ * Allocator and digest stand-ins
+ ******************************************************************************/
+
+void bitmap_bits_set_range(struct block_bitmap *b_bitmap, mlfs_fsblk_t bit,
+		uint32_t length)
+{
+	for (; length; length--, bit++)
+		b_bitmap->bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+void bitmap_bits_free(struct block_bitmap *b_bitmap, mlfs_fsblk_t bit,
+		uint32_t bcnt)
+{
+	for (; bcnt; bcnt--, bit++)
+		b_bitmap->bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+void balloc_rebuild_free_lists(struct super_block *sb)
+{
+	rebuilds++;
+}
+
+// store_all_bitmap(): the staged balloc entries go out first.
+int persist_dirty_objects_nvm(void)
+{
+	undo_log_flush();
+	memcpy(bits_durable, bits, sizeof(bits));
+	return 0;
+}
+
+static int range_is(mlfs_fsblk_t bit, uint32_t n, int set)
+{
+	for (; n; n--, bit++)
+		if (!!(bits[bit / 8] & (1 << (bit % 8))) != set)
+			return 0;
+	return 1;
+}
+
+/*******************************************************************************
+ * Test driver
+ ******************************************************************************/
+
+struct tx_state {
+	uint8_t nvm[NVM_BYTES];
+	uint8_t bits[NBITS / 8];
+};
+
+static void save_state(struct tx_state *s)
+{
+	memcpy(s->nvm, nvm, sizeof(nvm));
+	memcpy(s->bits, bits_durable, sizeof(bits_durable));
+}
+
+static int same_state(struct tx_state *s)
+{
+	return !memcmp(s->nvm, nvm, sizeof(nvm)) &&
+		!memcmp(s->bits, bits_durable, sizeof(bits_durable));
+}
+
+// one digest; returns the number of undo entries it logged.
+static int run_tx(unsigned int *seed)
+{
+	int i, n = 0;
+
+	undo_log_start_tx();
+
+	for (i = 0; i < TX_STEPS; i++) {
+		mlfs_fsblk_t bit = rand_r(seed) % (NBITS - 16);
+		uint32_t len = 1 + rand_r(seed) % 16, off, j;
+
+		switch (rand_r(seed) % 4) {
+		case 0:
+			if (!range_is(bit, len, 0))
+				break;
+			balloc_undo_log(bit, len, 0);
+			bitmap_bits_set_range(&blk_bitmap, bit, len);
+			n++;
+			break;
+		case 1:
+			if (!range_is(bit, len, 1))
+				break;
+			balloc_undo_log(bit, len, 1);
+			bitmap_bits_free(&blk_bitmap, bit, len);
+			n++;
+			break;
+		case 2:
+			off = rand_r(seed) % (NVM_BYTES - 64);
+			len = 1 + rand_r(seed) % 64;
+			idx_undo_log(off, len, nvm + off);
+			for (j = 0; j < len; j++)
+				nvm[off + j] = rand_r(seed);
+			n++;
+			break;
+		case 3:
+			persist_dirty_objects_nvm();
+			break;
+		}
+	}
+
+	persist_dirty_objects_nvm();
+	undo_log_commit_tx();
+
+	return n;
+}
+
+// the machine restarts: DRAM is gone, the log is what reached NVM.
+static void remount(void)
+{
+	memcpy(log_live, log_durable, LOG_BYTES);
+	memset(pending, 0, sizeof(pending));
+	memcpy(bits, bits_durable, sizeof(bits));
+	pthread_mutex_init(&undo_lock, NULL);
+	tx_in_progress = false;
+	crash_at = 0;
+
+	if (init_undo_log())
+		panic("undo log init failed\n");
+}
+
+struct device {
+	uint8_t log[LOG_BYTES];
+	uint8_t nvm[NVM_BYTES];
+	uint8_t bits[NBITS / 8];
+};
+
+static struct device base, recovered;
+
+static void save_device(struct device *d)
+{
+	memcpy(d->log, log_durable, LOG_BYTES);
+	memcpy(d->nvm, nvm, NVM_BYTES);
+	memcpy(d->bits, bits_durable, sizeof(bits_durable));
+}
+
+static void restore_device(struct device *d)
+{
+	memcpy(log_durable, d->log, LOG_BYTES);
+	memcpy(nvm, d->nvm, NVM_BYTES);
+	memcpy(bits_durable, d->bits, sizeof(bits_durable));
+	remount();
+}
+
+/* Run the transaction of seed on dev without a crash; the fence count and
+ * the state after are what the crashed runs are checked against. */
+static uint64_t clean_tx(struct device *dev, unsigned int seed,
+		struct tx_state *before, struct tx_state *after, uint64_t *entries)
+{
+	restore_device(dev);
+	save_state(before);
+	drains = 0;
+	*entries += run_tx(&seed);
+	save_state(after);
+
+	return drains;
+}
+
+// run the transaction of seed on dev, crashing at fence at, and recover.
+static int crash_tx(struct device *dev, unsigned int seed, uint64_t at,
+		uint64_t commit_fence, struct tx_state *before, struct tx_state *after)
+{
+	restore_device(dev);
+
+	drains = 0;
+	crash_at = at;
+	if (!setjmp(crash_env)) {
+		run_tx(&seed);
+		panic("transaction finished past its crash point\n");
+	}
+
+	remount();
+
+	if (undo_log_sanity_check(false)) {
+		fprintf(stderr, "crash at fence %lu: log still open\n", at);
+		return 1;
+	}
+
+	if (same_state(before))
+		return 0;
+	if (at >= commit_fence && same_state(after))
+		return 0;
+
+	fprintf(stderr, "crash at fence %lu of %lu: state is neither before nor after\n",
+			at, commit_fence);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int nseeds = argc > 1 ? atoi(argv[1]) : 50;
+	uint64_t entries = 0, fences = 0, trials = 0;
+	int seed, i, failed = 0;
+
+	sb[g_root_dev] = &root_sb;
+	dax_addr[g_root_log_dev] = log_live;
+	dax_addr[g_root_dev] = nvm;
+	dev_size[g_root_log_dev] = LOG_BYTES;
+
+	for (seed = 1; seed <= nseeds && !failed; seed++) {
+		unsigned int ws = seed, tx_seed;
+		struct tx_state before, after, before2, after2;
+		uint64_t tx_fences, next_fences, c, ignored = 0;
+
+		tear_seed = seed;
+
+		// a few committed digests leave stale records behind.
+		memset(log_durable, 0, LOG_BYTES);
+		memset(bits_durable, 0, sizeof(bits_durable));
+		for (i = 0; i < NVM_BYTES; i++)
+			nvm[i] = rand_r(&ws);
+		remount();
+		for (i = 0; i < PREFIX_TXS; i++)
+			run_tx(&ws);
+		save_device(&base);
+		tx_seed = ws;
+
+		tx_fences = clean_tx(&base, tx_seed, &before, &after, &entries);
+		fences += tx_fences;
+
+		for (c = 1; c <= tx_fences && !failed; c++, trials++) {
+			failed = crash_tx(&base, tx_seed, c, tx_fences, &before, &after);
+			if (failed)
+				break;
+
+			// the log recovery closed must take the next digest.
+			save_device(&recovered);
+			next_fences = clean_tx(&recovered, tx_seed + 1, &before2, &after2,
+					&ignored);
+			if (next_fences)
+				failed = crash_tx(&recovered, tx_seed + 1,
+						1 + rand_r(&tear_seed) % next_fences, next_fences,
+						&before2, &after2);
+		}
+	}
+
+	printf("%lu entries, %lu fences, %lu crash points, %d balloc rollbacks\n",
+			entries, fences, trials, rebuilds);
+
+	if (failed) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("ok\n");
+	return 0;
+}
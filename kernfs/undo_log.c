@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <libpmem.h>
+
 #include "undo_log.h"
 
 #ifndef KERNFS
@@ -8,85 +11,193 @@
 
 extern uint8_t *dax_addr[];
 
+uint32_t mlfs_crc32c(uint32_t crc, const void *buf, size_t size);
+
 #define get_addr(blk, off) (void*)(dax_addr[g_root_log_dev] + (blk * g_block_size_bytes) + off)
 
 #define offset(p1, p2) (((char*)(p1)) - ((char*)(p2)))
 
+#define undo_align(sz) (((sz) + UNDO_ALIGN - 1) & ~((uint64_t)UNDO_ALIGN - 1))
+
 /**
- * The current pointer where the next log entry will go. Access atomically.
+ * Byte offsets into the log: where the next record goes, and how far the
+ * log has been flushed. Both only move under undo_lock.
  */
-static void *curp = NULL;
+static uint64_t cur;
+static uint64_t flushed;
 static uint64_t logsz;
 
+// sequence number of the last record written.
+static uint64_t log_seq;
+
+static pthread_mutex_t undo_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool tx_in_progress;
+// the START of this transaction is durable, so entries may follow it.
+static bool tx_started;
+
+int persist_dirty_objects_nvm(void);
+
+/*******************************************************************************
+ * Record helpers
+ ******************************************************************************/
+
+static uint32_t undo_csum(mlfs_undo_hdr_t *hp, size_t nbytes) {
+    mlfs_undo_hdr_t hdr = *hp;
+    uint32_t crc;
+
+    hdr.mb_csum = 0;
+    crc = mlfs_crc32c(~0, &hdr, sizeof(hdr));
+    return mlfs_crc32c(crc, (char*)hp + sizeof(hdr), nbytes - sizeof(hdr));
+}
+
+// bytes covered by the checksum of a record, or 0 if the type is unknown.
+static size_t undo_rec_bytes(mlfs_undo_hdr_t *hp) {
+    switch (hp->mb_type) {
+        case LOG_START:
+        case LOG_COMMIT:
+            return sizeof(mlfs_undo_meta_t);
+        case LOG_BALLOC_ENTRY:
+            return sizeof(mlfs_balloc_undo_ent_t);
+        case LOG_IDX_ENTRY:
+            if (((mlfs_idx_undo_ent_t*)hp)->idx_nbytes > logsz) return 0;
+            return sizeof(mlfs_idx_undo_ent_t) + ((mlfs_idx_undo_ent_t*)hp)->idx_nbytes;
+        default:
+            return 0;
+    }
+}
+
 /**
- * Treats the log like a big circular buffer.
+ * The record at off if it is intact and has sequence number seq, or NULL.
  */
-static inline void _incr_log_ptr(void *ptr, size_t sz) {
-    void *nextp = ptr + sz;
-    if (nextp - get_addr(0, 0) > logsz) {
-        nextp -= logsz;
+static mlfs_undo_hdr_t *undo_rec_at(uint64_t off, uint64_t seq) {
+    mlfs_undo_hdr_t *hp = (mlfs_undo_hdr_t*)get_addr(0, off);
+    size_t nbytes;
+
+    if (off + sizeof(mlfs_undo_meta_t) > logsz || hp->mb_seq != seq) return NULL;
+
+    nbytes = undo_rec_bytes(hp);
+    if (!nbytes || off + undo_align(nbytes) > logsz) return NULL;
+
+    if (undo_csum(hp, nbytes) != hp->mb_csum) return NULL;
+
+    return hp;
+}
+
+// caller holds undo_lock.
+static void *undo_reserve(size_t nbytes) {
+    void *p = get_addr(0, cur);
+
+    if (cur + undo_align(nbytes) > logsz) {
+        panic("undo log is full!\n");
     }
 
-    curp = nextp;
+    cur += undo_align(nbytes);
+    return p;
+}
+
+// caller holds undo_lock; the record body is already filled in.
+static void undo_seal(mlfs_undo_hdr_t *hp, mlfs_undo_meta_type_t type,
+        size_t nbytes) {
+    hp->mb_type = type;
+    hp->mb_seq  = ++log_seq;
+    hp->mb_csum = undo_csum(hp, nbytes);
 }
 
-static inline void* _get_next_aligned(size_t sz) {
-    void *current = curp; 
-    void *next = curp + sz;
-    
-    if (next - get_addr(0, 0) > logsz) {
-        next -= logsz;
+// caller holds undo_lock: one fence for everything staged so far.
+static void undo_flush_locked(void) {
+    if (flushed == cur) return;
+
+    pmem_flush(get_addr(0, flushed), cur - flushed);
+    pmem_drain();
+    flushed = cur;
+
+#ifdef KERNFS
+    if (enable_perf_stats) {
+        g_perf_stats.undo_fence_nr++;
     }
+#endif
+}
 
-    return next;
+// caller holds undo_lock: entries may only follow a durable START.
+static void undo_begin_entry(void) {
+    if (!tx_started) {
+        undo_flush_locked();
+        tx_started = true;
+    }
 }
 
-#define incr_curp(sz) _incr_log_ptr((void*)curp, sz)
-#define set_next(v) v = (typeof(v))_get_next_aligned(sizeof(*v)); incr_curp(sizeof(*v))
+/**
+ * Collect the intact records of the transaction at the head of the log.
+ * Returns the number of entries (not counting START and COMMIT) put in
+ * ents, or -1 if the head holds no transaction.
+ */
+static int64_t undo_log_scan(mlfs_undo_hdr_t ***ents, bool *committed) {
+    mlfs_undo_hdr_t *hp = (mlfs_undo_hdr_t*)get_addr(0, 0);
+    uint64_t off, seq, n = 0, max = 0;
 
-static mlfs_undo_meta_t *startp = NULL;
-static mlfs_undo_meta_t *commitp = NULL;
-static bool tx_in_progress;
+    *ents = NULL;
+    *committed = false;
+
+    if (!undo_rec_at(0, hp->mb_seq) || hp->mb_type != LOG_START) return -1;
+
+    seq = hp->mb_seq;
+    off = sizeof(mlfs_undo_meta_t);
+    while ((hp = undo_rec_at(off, ++seq))) {
+        if (hp->mb_type == LOG_START) break;
+        if (hp->mb_type == LOG_COMMIT) {
+            *committed = true;
+            break;
+        }
+
+        if (n == max) {
+            max = max ? max * 2 : 1024;
+            *ents = (mlfs_undo_hdr_t**)realloc(*ents, sizeof(**ents) * max);
+            if (!*ents) panic("cannot grow undo log scan!\n");
+        }
+
+        (*ents)[n++] = hp;
+        off += undo_align(undo_rec_bytes(hp));
+    }
 
-static int recover_undo_log(mlfs_undo_meta_t *startp);
+    return n;
+}
+
+/*******************************************************************************
+ * Recovery
+ ******************************************************************************/
+
+static int recover_undo_log(mlfs_undo_hdr_t **ents, int64_t n);
 
 int init_undo_log(void) {
     KERNFS_CHECK();
-    int err;
+    mlfs_undo_hdr_t **ents;
+    mlfs_undo_meta_t *rootp;
+    bool committed;
+    int64_t n;
+    int err = 0;
 
-    mlfs_undo_meta_t *rootp = (mlfs_undo_meta_t*)get_addr(0, 0);
     logsz = dev_size[g_root_log_dev];
+    rootp = (mlfs_undo_meta_t*)get_addr(0, 0);
 
-    int nstart = 0, ncommit = 0;
-    
-    // Find the current pointer and ensure consistency.
-    for (mlfs_undo_meta_t *mp = rootp; offset(mp, rootp) < logsz; ++mp) {
-        if (mp->mb_type == LOG_UNINITIALIZED) {
-            curp = mp;
-            break;
-        } else if (mp->mb_type == LOG_START) {
-            startp = mp;
-            ++nstart;
-        } else if (mp->mb_type == LOG_COMMIT) {
-            commitp = mp;
-            ++ncommit;
-        }
-    }
+    /* Every record on the device was written at most one log's worth of
+     * records after the START at the head (which is durable before any of
+     * its entries are written, and whose sequence number is written
+     * atomically), so new records cannot collide with old ones. */
+    log_seq = rootp->mb_hdr.mb_seq + logsz / UNDO_ALIGN;
 
-    // Inconsistent state.
-    if (ncommit > nstart || nstart - ncommit > 1) {
-        fprintf(stderr, "ncommit == %d, nstart == %d\n", ncommit, nstart);
-        panic("Inconsistent undo log---there's a bug somewhere!");
-    }
+    n = undo_log_scan(&ents, &committed);
 
     // Check if we need to repair.
-    if (ncommit < nstart) {
-        fprintf(stderr, "ncommit == %d, nstart == %d\n", ncommit, nstart);
-        err = recover_undo_log(startp);
-        if (err) goto abort;
+    if (n >= 0 && !committed) {
+        fprintf(stderr, "undo log: uncommitted transaction, %ld entries\n", n);
+        err = recover_undo_log(ents, n);
     }
 
+    free(ents);
+    if (err) goto abort;
+
     // After repair, we're good to go.
+    cur = flushed = 0;
 
     return 0;
 
@@ -106,47 +217,27 @@ int shutdown_undo_log(void) {
     return 0;
 }
 
-int persist_dirty_objects_nvm(void);
-
-int recover_undo_log(mlfs_undo_meta_t *startp) {
+static int recover_undo_log(mlfs_undo_hdr_t **ents, int64_t n) {
     KERNFS_CHECK();
-
-    if (!startp) panic("Cannot recover from nullptr!\n");
-
-    void *rootp = get_addr(0, 0);
-
-    mlfs_undo_meta_t *mp;
-    for (mp = startp; offset(mp, rootp) < logsz; ) {
-
-        mlfs_undo_skip_t *sp = (mlfs_undo_skip_t*)mp;
-        mlfs_balloc_undo_ent_t *bp = (mlfs_balloc_undo_ent_t*)mp;
-        mlfs_idx_undo_ent_t *ip = (mlfs_idx_undo_ent_t*)mp;
-
-        switch(mp->mb_type) {
-            case LOG_START:
-            case LOG_COMMIT:
-                panic("If you're recovering, you shouldn't hit a commit block.");
-                return -1;
-
-            case LOG_SKIP:
-                mp += sp->sb_skip_bytes;
-                break;
-
+    mlfs_undo_meta_t *donep;
+    bool balloc = false;
+    uint64_t end, seq;
+    int64_t i;
+
+    // Newest first, so a range logged twice ends at its oldest contents.
+    for (i = n - 1; i >= 0; i--) {
+        switch (ents[i]->mb_type) {
             case LOG_BALLOC_ENTRY:
-                balloc_undo_log_rollback(bp);
-                mp += sizeof(*bp);
+                balloc_undo_log_rollback((mlfs_balloc_undo_ent_t*)ents[i]);
+                balloc = true;
                 break;
 
             case LOG_IDX_ENTRY:
-                idx_undo_log_rollback(ip);
-                mp += sizeof(*ip) + ip->idx_nbytes;
+                idx_undo_log_rollback((mlfs_idx_undo_ent_t*)ents[i]);
                 break;
 
-            case LOG_UNINITIALIZED:
-                return 0;
-
             default:
-                panic("Undefined value %u\n", mp->mb_type);
+                panic("Undefined undo log entry!\n");
                 return -1;
         }
     }
@@ -155,10 +246,37 @@ int recover_undo_log(mlfs_undo_meta_t *startp) {
     persist_dirty_objects_nvm();
 #endif
 
-    pmem_memset_persist(startp, 0, mp - startp);
+    // the free lists were built from the bitmap before it was rolled back.
+    if (balloc) {
+        balloc_rebuild_free_lists(sb[g_root_dev]);
+    }
+
+    /* The transaction is undone: close it with a COMMIT after its last
+     * intact record. Dropping the START instead would lose the sequence
+     * number the next mount counts from. */
+    if (n > 0) {
+        end = offset(ents[n - 1], get_addr(0, 0)) + undo_align(undo_rec_bytes(ents[n - 1]));
+        seq = ents[n - 1]->mb_seq;
+    } else {
+        end = sizeof(mlfs_undo_meta_t);
+        seq = ((mlfs_undo_hdr_t*)get_addr(0, 0))->mb_seq;
+    }
+
+    if (end + sizeof(mlfs_undo_meta_t) > logsz) {
+        pmem_memset_persist(get_addr(0, 0), 0, sizeof(mlfs_undo_meta_t));
+        return 0;
+    }
+
+    donep = (mlfs_undo_meta_t*)get_addr(0, end);
+    memset(donep, 0, sizeof(*donep));
+    donep->mb_hdr.mb_type = LOG_COMMIT;
+    donep->mb_hdr.mb_seq  = seq + 1;
+    donep->mb_hdr.mb_csum = undo_csum(&donep->mb_hdr, sizeof(*donep));
+    pmem_flush(donep, sizeof(*donep));
+    pmem_drain();
 
     return 0;
-} 
+}
 
 
 /*******************************************************************************
@@ -166,29 +284,55 @@ int recover_undo_log(mlfs_undo_meta_t *startp) {
  ******************************************************************************/
 
 int undo_log_start_tx(void) {
+    mlfs_undo_meta_t *startp;
+
     if (!__sync_bool_compare_and_swap(&tx_in_progress, false, true)) {
         panic("TX already in progress!\n");
     }
 
-    // Force alignment
-    set_next(startp);
+    pthread_mutex_lock(&undo_lock);
+
+    // Each transaction starts over at the head of the log.
+    cur = flushed = 0;
+    tx_started = false;
+
+    // Persisted with the first entry; a transaction without any needs none.
+    startp = (mlfs_undo_meta_t*)undo_reserve(sizeof(*startp));
+    memset(startp->_padding, 0, sizeof(startp->_padding));
+    undo_seal(&startp->mb_hdr, LOG_START, sizeof(*startp));
 
-    startp->mb_type = LOG_START;
-    nvm_persist_struct_ptr(startp);
+    pthread_mutex_unlock(&undo_lock);
 
     return 0;
 }
 
 int undo_log_commit_tx(void) {
+    mlfs_undo_meta_t *commitp;
+
     if (!__sync_bool_compare_and_swap(&tx_in_progress, true, false)) {
         panic("TX already ended or never started!\n");
     }
 
-    // Force alignment
-    set_next(commitp);
+    pthread_mutex_lock(&undo_lock);
+
+    if (tx_started) {
+        commitp = (mlfs_undo_meta_t*)undo_reserve(sizeof(*commitp));
+        memset(commitp->_padding, 0, sizeof(commitp->_padding));
+        undo_seal(&commitp->mb_hdr, LOG_COMMIT, sizeof(*commitp));
+
+        // Anything still staged goes out with the commit.
+        undo_flush_locked();
+    }
+
+    pthread_mutex_unlock(&undo_lock);
+
+    return 0;
+}
 
-    commitp->mb_type = LOG_COMMIT;
-    nvm_persist_struct_ptr(commitp);
+int undo_log_flush(void) {
+    pthread_mutex_lock(&undo_lock);
+    undo_flush_locked();
+    pthread_mutex_unlock(&undo_lock);
 
     return 0;
 }
@@ -204,27 +348,18 @@ int balloc_undo_log(paddr_t start_block, uint32_t nblk, char orig_val) {
     uint64_t start_tsc = asm_rdtscp();
 #endif
 
-    set_next(ent);
-
-    unsigned status = 0;
+    pthread_mutex_lock(&undo_lock);
 
-    if ((status = _xbegin ()) == _XBEGIN_STARTED) {
-        ent->mb_type     = LOG_BALLOC_ENTRY;
-        ent->mb_start    = start_block;
-        ent->mb_nblk     = nblk;
-        ent->mb_orig_val = orig_val;
+    undo_begin_entry();
 
-        _xend ();
-        nvm_persist_struct_ptr(ent);
-    } else {
-        ent->mb_start    = start_block;
-        ent->mb_nblk     = nblk;
-        ent->mb_orig_val = orig_val;
-        nvm_persist_struct_ptr(ent);
+    // Staged only: undo_log_flush() persists it before the bitmap is stored.
+    ent = (mlfs_balloc_undo_ent_t*)undo_reserve(sizeof(*ent));
+    ent->mb_start    = start_block;
+    ent->mb_nblk     = nblk;
+    ent->mb_orig_val = orig_val;
+    undo_seal(&ent->mb_hdr, LOG_BALLOC_ENTRY, sizeof(*ent));
 
-        ent->mb_type     = LOG_BALLOC_ENTRY;
-        nvm_persist_struct_ptr(ent);
-    }
+    pthread_mutex_unlock(&undo_lock);
 
 #ifdef KERNFS
     if (enable_perf_stats) {
@@ -237,17 +372,12 @@ int balloc_undo_log(paddr_t start_block, uint32_t nblk, char orig_val) {
 }
 
 int balloc_undo_log_rollback(mlfs_balloc_undo_ent_t *ent) {
-    uint64_t start_tsc;
-
-    if (enable_perf_stats) start_tsc = asm_rdtscp();
-
     struct super_block *sblk = sb[g_root_dev];
-    unsigned status = 0;
 
     if (ent->mb_orig_val) {
-        bitmap_bits_free(sblk->s_blk_bitmap, ent->mb_start, ent->mb_nblk);
-    } else {
         bitmap_bits_set_range(sblk->s_blk_bitmap, ent->mb_start, ent->mb_nblk);
+    } else {
+        bitmap_bits_free(sblk->s_blk_bitmap, ent->mb_start, ent->mb_nblk);
     }
 
     return 0;
@@ -263,21 +393,20 @@ int idx_undo_log(uint64_t dev_byte_offset, size_t nbytes, void *nvm_ptr) {
     uint64_t start_tsc = asm_rdtscp();
 #endif
 
-    set_next(ent);
-    void *nvm_loc = curp;
-    incr_curp(nbytes);
+    pthread_mutex_lock(&undo_lock);
 
-    // Flush the data first
-    pmem_memcpy_persist(nvm_loc, nvm_ptr, nbytes);
+    undo_begin_entry();
 
-    // Then the other metadata
-    ent->idx_nbytes      = nbytes;
+    ent = (mlfs_idx_undo_ent_t*)undo_reserve(sizeof(*ent) + nbytes);
     ent->idx_byte_offset = dev_byte_offset;
-    nvm_persist_struct_ptr(ent);
+    ent->idx_nbytes      = nbytes;
+    memcpy(ent + 1, nvm_ptr, nbytes);
+    undo_seal(&ent->mb_hdr, LOG_IDX_ENTRY, sizeof(*ent) + nbytes);
+
+    // The caller updates the index next.
+    undo_flush_locked();
 
-    // Treating the mb_type as a valid bit.
-    ent->mb_type         = LOG_IDX_ENTRY;
-    nvm_persist_struct_ptr(ent);
+    pthread_mutex_unlock(&undo_lock);
 
 #ifdef KERNFS
     if (enable_perf_stats) {
@@ -298,9 +427,8 @@ int idx_undo_log_rollback(mlfs_idx_undo_ent_t *ent) {
     }
 #endif
 
-    void *nvm_ptr = get_addr(0, ent->idx_byte_offset);
-    void *orig_data = ((void*)ent) + ent->idx_nbytes;
-    pmem_memcpy_persist(nvm_ptr, orig_data, ent->idx_nbytes);
+    void *nvm_ptr = dax_addr[g_root_dev] + ent->idx_byte_offset;
+    pmem_memcpy_persist(nvm_ptr, ent + 1, ent->idx_nbytes);
 
 #ifdef KERNFS
     if (enable_perf_stats) {
@@ -321,43 +449,35 @@ static void print_entry(const char* type, uint64_t start, uint64_t nbytes) {
 
 int undo_log_sanity_check(bool display) {
     void *rootp = get_addr(0, 0);
+    mlfs_undo_hdr_t **ents;
+    bool committed;
+    int64_t n, i;
+
+    n = undo_log_scan(&ents, &committed);
+    if (n < 0) {
+        if (display) printf("undo log: empty\n");
+        return 0;
+    }
 
-    for (void *p = rootp; offset(p, rootp) < logsz; ) {
-        mlfs_undo_meta_t *mp = (mlfs_undo_meta_t*)p;
-
-        mlfs_undo_skip_t *sp = (mlfs_undo_skip_t*)mp;
-        mlfs_balloc_undo_ent_t *bp = (mlfs_balloc_undo_ent_t*)mp;
-        mlfs_idx_undo_ent_t *ip = (mlfs_idx_undo_ent_t*)mp;
-
-        switch(mp->mb_type) {
-            case LOG_START:
-            case LOG_COMMIT:
-                print_entry(mp->mb_type == LOG_START ? "START TX" : "COMMIT TX", 
-                        offset(p, rootp), sizeof(*mp));
-                p += sizeof(*mp);
-                break;
-
-            case LOG_SKIP:
-                print_entry("-align-", offset(p, rootp), sp->sb_skip_bytes);
-                p += sp->sb_skip_bytes;
-                break;
-
-            case LOG_BALLOC_ENTRY:
-                print_entry("BALLOC", offset(p, rootp), sizeof(*bp));
-                p += sizeof(*bp);
-                break;
-
-            case LOG_IDX_ENTRY:
-                print_entry("IDX UPDATE", offset(p, rootp), sizeof(*ip) + ip->idx_nbytes);
-                p += sizeof(*ip) + ip->idx_nbytes;
-
-            case LOG_UNINITIALIZED:
-                return 0;
+    if (display) {
+        print_entry("START TX", 0, sizeof(mlfs_undo_meta_t));
+
+        for (i = 0; i < n; i++) {
+            if (ents[i]->mb_type == LOG_BALLOC_ENTRY) {
+                print_entry("BALLOC", offset(ents[i], rootp),
+                        sizeof(mlfs_balloc_undo_ent_t));
+            } else {
+                print_entry("IDX UPDATE", offset(ents[i], rootp),
+                        undo_rec_bytes(ents[i]));
+            }
+        }
 
-            default:
-                panic("Undefined value %u\n", mp->mb_type);
+        if (committed) {
+            printf("COMMIT TX\n");
         }
     }
 
-    return -1;
+    free(ents);
+
+    return committed ? 0 : (int)n;
 }
@@ -34,18 +34,27 @@ extern "C" {
  *  ...
  *  [DIGEST END]
  *
- *  The size of each one of these entries should be a cacheline in size. Ergo,
- *  we can build an atomic log via TSX instructions.
+ * Entries are not persisted one by one. They are staged in the log, packed
+ * into cache lines, and flushed together with a single fence right before
+ * the NVM update they guard: idx_undo_log() flushes before it returns,
+ * since its caller writes the index next, and block allocator entries are
+ * flushed by undo_log_flush() when the bitmap is stored. Instead of a valid
+ * bit written with a second fence, every record carries a checksum and a
+ * sequence number one higher than the record before it, so a torn or stale
+ * record simply ends the transaction.
+ *
+ * A transaction always starts at the head of the log; its START is made
+ * durable before the first entry is written, so records of an older
+ * transaction are never mistaken for newer ones.
  *
  *  For recovery, the protocol should be:
  *
  *  1) If [DIGEST END] is present, do nothing.
- *  2) If [DIGEST END] is NOT present, execute all undos, then replay from the 
- *      application log. For this, for indexing structures, you would need an
- *      option were you could update/override entries, because if an insert
- *      goes through, then you undo the allocations and play it back, you may
- *      technically get different blocks with concurrent digests. But we can
- *      worry about this later.
+ *  2) If [DIGEST END] is NOT present, execute all undos, newest first, close
+ *      the transaction with a [DIGEST END], then replay from the application
+ *      log. Only entries whose batch was fenced
+ *      can have been acted on, and undoing an entry whose update never
+ *      happened is harmless.
  *
  * I'll use a third DAX device for this undo log.
  *
@@ -55,49 +64,60 @@ typedef enum mlfs_undo_meta_type {
     LOG_UNINITIALIZED = 0,
     LOG_START,
     LOG_COMMIT,
-    // An entry that denotes an entry left blank for alignment's sake
-    LOG_SKIP,
     // For actual log entries
     LOG_BALLOC_ENTRY,
     LOG_IDX_ENTRY,
 } mlfs_undo_meta_type_t;
 
-typedef struct mlfs_undo_meta_block {
+// records start on UNDO_ALIGN boundaries; two allocator entries fill a line.
+#define UNDO_ALIGN 32
+
+typedef struct mlfs_undo_hdr {
     mlfs_undo_meta_type_t mb_type;
-    uint64_t mb_next_byte_offset;
+    // crc32c of the record, data included, taken with mb_csum = 0.
+    uint32_t mb_csum;
+    uint64_t mb_seq;
+} mlfs_undo_hdr_t;
+
+typedef struct mlfs_undo_meta_block {
+    mlfs_undo_hdr_t mb_hdr;
     uint8_t _padding[48];
 } mlfs_undo_meta_t;
 
-typedef struct mlfs_undo_skip_block {
-    mlfs_undo_meta_type_t mb_type;
-    uint64_t sb_skip_bytes;
-} mlfs_undo_skip_t;
-
 _Static_assert(sizeof(mlfs_undo_meta_t) == 64, "must be cache line size!");
 
 int init_undo_log(void);
 
 int shutdown_undo_log(void);
 
+/**
+ * Walk the last transaction in the log, printing its records if display.
+ * Returns how many entries recovery would undo: 0 if it committed.
+ */
 int undo_log_sanity_check(bool display);
 
 int undo_log_start_tx(void);
 
 int undo_log_commit_tx(void);
 
+/**
+ * Persist the staged entries with one fence. Called before the block
+ * allocator bitmap is stored.
+ */
+int undo_log_flush(void);
+
 /*******************************************************************************
  * Block allocator interface
  ******************************************************************************/
 
 typedef struct mlfs_balloc_undo_ent {
-    mlfs_undo_meta_type_t mb_type;
+    mlfs_undo_hdr_t mb_hdr;
     uint64_t mb_start;
     uint32_t mb_nblk;
     uint32_t mb_orig_val;
 } mlfs_balloc_undo_ent_t;
 
-_Static_assert(sizeof(mlfs_balloc_undo_ent_t) < 64, "must be smaller than cache line!");
-_Static_assert(sizeof(mlfs_balloc_undo_ent_t) % 2 == 0, "must be a power of 2!");
+_Static_assert(sizeof(mlfs_balloc_undo_ent_t) == UNDO_ALIGN, "must be UNDO_ALIGN!");
 
 /**
  * start_block: which is the first block in the bitmap being modified.
@@ -118,19 +138,20 @@ int balloc_undo_log_rollback(mlfs_balloc_undo_ent_t *ent);
  * Indexing structure interface
  ******************************************************************************/
 
+// followed by idx_nbytes of original data.
 typedef struct mlfs_idx_struct_undo_ent {
-    mlfs_undo_meta_type_t mb_type;
+    mlfs_undo_hdr_t mb_hdr;
     uint64_t idx_byte_offset;
-    size_t idx_nbytes;
+    uint64_t idx_nbytes;
 } mlfs_idx_undo_ent_t;
 
-_Static_assert(sizeof(mlfs_idx_undo_ent_t) <= 64, "must be smaller than cache line!");
-_Static_assert(sizeof(mlfs_idx_undo_ent_t) % 2 == 0, "must be a power of 2!");
+_Static_assert(sizeof(mlfs_idx_undo_ent_t) == UNDO_ALIGN, "must be UNDO_ALIGN!");
 
 /** 
  * Log the original content of the extent tree node before committing changes,
  * so that if there is a crash before the end of the digest, we can recover
- * and replay the digest.
+ * and replay the digest. dev_byte_offset is on g_root_dev. The entry, and
+ * every entry staged before it, is durable when this returns.
  */
 int idx_undo_log(uint64_t dev_byte_offset, size_t nbytes, void *nvm_ptr);
 
@@ -0,0 +1,147 @@
+#include <pthread.h>
+
+#include "concurrency/epoch.h"
+#include "global/mem.h"
+#include "global/util.h"
+
+// reclaim once this many objects are waiting.
+#define EPOCH_RECLAIM_BATCH 64
+
+struct epoch_retired {
+	void *ptr;
+	uint64_t epoch;
+};
+
+volatile uint64_t g_epoch = 1;
+struct epoch_slot epoch_slots[EPOCH_MAX_THREADS];
+__thread int epoch_slot_id = -1;
+
+// highest slot ever handed out plus one; bounds the reclaim scan.
+static uint32_t n_epoch_slots;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_retired *retired;
+static uint32_t n_retired, max_retired;
+
+static void epoch_unregister(void *arg)
+{
+	struct epoch_slot *slot = (struct epoch_slot *)arg;
+
+	slot->nest = 0;
+	slot->epoch = 0;
+	__atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_key_create(void)
+{
+	pthread_key_create(&epoch_key, epoch_unregister);
+}
+
+int epoch_register(void)
+{
+	uint32_t id, n;
+
+	pthread_once(&epoch_key_once, epoch_key_create);
+
+	for (id = 0; id < EPOCH_MAX_THREADS; id++) {
+		if (!epoch_slots[id].in_use &&
+				__sync_bool_compare_and_swap(&epoch_slots[id].in_use, 0, 1))
+			break;
+	}
+
+	if (id == EPOCH_MAX_THREADS)
+		panic("too many threads for epoch reclamation\n");
+
+	do {
+		n = n_epoch_slots;
+	} while (n <= id && !__sync_bool_compare_and_swap(&n_epoch_slots, n, id + 1));
+
+	epoch_slot_id = id;
+	pthread_setspecific(epoch_key, &epoch_slots[id]);
+
+	return id;
+}
+
+// oldest epoch a reader may still be in. g_epoch if there is none.
+static uint64_t epoch_min_active(void)
+{
+	uint64_t min = g_epoch, e;
+	uint32_t i, n = n_epoch_slots;
+
+	for (i = 0; i < n; i++) {
+		e = epoch_slots[i].epoch;
+		if (e && e < min)
+			min = e;
+	}
+
+	return min;
+}
+
+// called with retire_lock held.
+static void __epoch_reclaim(void)
+{
+	uint64_t min = epoch_min_active();
+	uint32_t i, kept = 0;
+
+	for (i = 0; i < n_retired; i++) {
+		if (retired[i].epoch < min)
+			mlfs_free(retired[i].ptr);
+		else
+			retired[kept++] = retired[i];
+	}
+
+	n_retired = kept;
+}
+
+void epoch_retire(void *ptr)
+{
+	pthread_mutex_lock(&retire_lock);
+
+	if (n_retired == max_retired) {
+		max_retired = max_retired ? max_retired * 2 : EPOCH_RECLAIM_BATCH;
+		retired = (struct epoch_retired *)realloc(retired,
+				sizeof(struct epoch_retired) * max_retired);
+		if (!retired)
+			panic("cannot grow epoch retire list\n");
+	}
+
+	// readers that entered before this point may hold ptr.
+	retired[n_retired].ptr = ptr;
+	retired[n_retired].epoch = __sync_fetch_and_add(&g_epoch, 1);
+	n_retired++;
+
+	if (n_retired >= EPOCH_RECLAIM_BATCH)
+		__epoch_reclaim();
+
+	pthread_mutex_unlock(&retire_lock);
+}
+
+void epoch_reclaim(void)
+{
+	pthread_mutex_lock(&retire_lock);
+	__epoch_reclaim();
+	pthread_mutex_unlock(&retire_lock);
+}
+
+void epoch_synchronize(void)
+{
+	// full barrier: sections that begin after this see the caller's stores.
+	uint64_t e = __sync_fetch_and_add(&g_epoch, 1);
+	uint32_t i, n = n_epoch_slots;
+
+	for (i = 0; i < n; i++) {
+		// the caller cannot wait for its own section.
+		if ((int)i == epoch_slot_id)
+			continue;
+
+		while (1) {
+			uint64_t cur = epoch_slots[i].epoch;
+
+			if (cur == 0 || cur > e)
+				break;
+			cpu_relax();
+		}
+	}
+}
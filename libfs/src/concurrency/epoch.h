@@ -0,0 +1,67 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include "concurrency/synchronization.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Epoch-based reclamation for lock-free readers.
+ *
+ * A reader brackets its accesses with epoch_enter()/epoch_exit(). A
+ * writer unpublishes an object and hands it to epoch_retire(); the object
+ * is freed once every reader that might still see it has left its
+ * critical section. Sections nest, so a caller may hold one across
+ * several lookups to keep the looked-up objects alive. epoch_synchronize()
+ * waits for the sections open when it is called, for writers that need
+ * every earlier reader to have finished instead of freeing memory.
+ */
+
+#define EPOCH_MAX_THREADS 256
+
+struct epoch_slot {
+	// epoch seen on entry, 0 when outside a critical section.
+	volatile uint64_t epoch;
+	uint32_t nest;
+	// owned by a live thread; released when the thread exits.
+	volatile uint32_t in_use;
+} __attribute__((aligned(64)));
+
+extern volatile uint64_t g_epoch;
+extern struct epoch_slot epoch_slots[EPOCH_MAX_THREADS];
+extern __thread int epoch_slot_id;
+
+int epoch_register(void);
+void epoch_retire(void *ptr);
+void epoch_reclaim(void);
+void epoch_synchronize(void);
+
+static inline void epoch_enter(void)
+{
+	struct epoch_slot *slot;
+
+	if (epoch_slot_id < 0)
+		epoch_register();
+
+	slot = &epoch_slots[epoch_slot_id];
+	if (slot->nest++ == 0) {
+		slot->epoch = g_epoch;
+		// the announcement must be visible before any shared load.
+		__sync_synchronize();
+	}
+}
+
+static inline void epoch_exit(void)
+{
+	struct epoch_slot *slot = &epoch_slots[epoch_slot_id];
+
+	if (--slot->nest == 0)
+		__atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -44,6 +44,7 @@ struct file* mlfs_file_alloc(void)
 			f->ip = NULL;
 			f->type = FD_NONE;
 			f->readable = f->writable = f->off = 0;
+			memset(&f->ra, 0, sizeof(f->ra));
 			pthread_rwlock_unlock(&f->rwlock);
 			pthread_spin_unlock(&g_fd_table.lock);
 			return f;
@@ -129,6 +130,8 @@ ssize_t mlfs_file_read(struct file *f, uint8_t *buf, size_t n)
 		if (r < 0) 
 			panic("read error\n");
 
+		readahead_update(&f->ra, f->ip, f->off, r);
+
 		f->off += r;
 
 		iunlock(f->ip);
@@ -160,6 +163,8 @@ ssize_t mlfs_file_read_offset(struct file *f, uint8_t *buf, size_t n, offset_t o
 		if (r < 0) 
 			panic("read error\n");
 
+		readahead_update(&f->ra, f->ip, off, r);
+
 		iunlock(f->ip);
 		return r;
 	}
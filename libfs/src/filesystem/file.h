@@ -3,6 +3,7 @@
 
 #include "filesystem/stat.h"
 #include "global/global.h"
+#include "filesystem/readahead.h"
 
 typedef enum { FD_NONE, FD_PIPE, FD_INODE, FD_DIR } fd_type_t;
 struct file {
@@ -13,6 +14,7 @@ struct file {
 	uint8_t writable;
 	struct inode *ip;
 	offset_t off;
+	struct file_ra ra;
 
 	pthread_rwlock_t rwlock;
 };
@@ -11,6 +11,7 @@
 #include "filesystem/fs.h"
 #include "io/block_io.h"
 #include "filesystem/file.h"
+#include "filesystem/readahead.h"
 #include "log/log.h"
 #include "mlfs/mlfs_interface.h"
 #include "ds/bitmap.h"
@@ -49,8 +50,6 @@ json_object *libfs_stats_json;
 uint8_t enable_perf_stats;
 libfs_stat_t g_perf_stats;
 
-struct lru g_fcache_head;
-
 pthread_rwlock_t *icache_rwlock;
 pthread_rwlock_t *dcache_rwlock;
 pthread_rwlock_t *dlookup_rwlock;
@@ -79,6 +78,7 @@ void reset_libfs_stats(void)
     reset_stats_dist(&(g_perf_stats.read_per_index));
     reset_stats_dist(&(g_perf_stats.read_data_bytes));
     reset_stats_dist(&(g_perf_stats.hash_lookup_count));
+    reset_stats_hist(&(g_perf_stats.digest_stall));
     cache_stats_init();
     libfs_stats_json = json_object_new_array();
 
@@ -96,14 +96,76 @@ void show_libfs_stats(const char *title)
     js_add_int64(wait_digest, "nr" , g_perf_stats.digest_wait_nr);
     json_object_object_add(root, "wait_digest", wait_digest);
   }
+  json_object *resync = json_object_new_object(); {
+    js_add_int64(resync, "tsc", g_perf_stats.digest_resync_tsc);
+    js_add_int64(resync, "nr" , g_perf_stats.digest_resync_nr);
+    js_add_int64(resync, "inodes" , g_perf_stats.digest_resync_inodes);
+    json_object_object_add(root, "digest_resync", resync);
+  }
+  json_object *rocache = json_object_new_object(); {
+    js_add_int64(rocache, "tsc", g_perf_stats.rocache_refresh_tsc);
+    js_add_int64(rocache, "lines", g_perf_stats.rocache_refresh_lines);
+    js_add_int64(rocache, "full", g_perf_stats.rocache_refresh_full_nr);
+    json_object_object_add(root, "rocache_refresh", rocache);
+  }
+  json_object *inval = json_object_new_object(); {
+    js_add_int64(inval, "nr", g_perf_stats.idx_invalidate_nr);
+    js_add_int64(inval, "skip", g_perf_stats.idx_invalidate_skip_nr);
+    json_object_object_add(root, "idx_invalidate", inval);
+  }
+  if (g_idx_choice == HYBRID) {
+    json_object *hybrid = json_object_new_object();
+    for (int t = 0; t < NONE; t++) {
+      if (!g_perf_stats.idx_lookup_nr[t]) continue;
+      json_object *lookup = json_object_new_object();
+      js_add_int64(lookup, "tsc", g_perf_stats.idx_lookup_tsc[t]);
+      js_add_int64(lookup, "nr" , g_perf_stats.idx_lookup_nr[t]);
+      json_object_object_add(hybrid, idx_choice_name(t), lookup);
+    }
+    json_object_object_add(root, "hybrid", hybrid);
+  }
+  json_object *stall = json_object_new_object(); {
+    js_add_int64(stall, "tsc", g_perf_stats.digest_stall.dist.total);
+    js_add_int64(stall, "nr" , g_perf_stats.digest_stall.dist.cnt);
+    js_add_int64(stall, "max", g_perf_stats.digest_stall.dist.max);
+    js_add_int64(stall, "p50", stats_hist_percentile(&g_perf_stats.digest_stall, 50));
+    js_add_int64(stall, "p99", stats_hist_percentile(&g_perf_stats.digest_stall, 99));
+    js_add_int64(stall, "p999", stats_hist_percentile(&g_perf_stats.digest_stall, 99.9));
+    json_object_object_add(root, "digest_stall", stall);
+  }
+  json_object *stream = json_object_new_object(); {
+    js_add_int64(stream, "nr" , g_perf_stats.digest_stream_nr);
+    js_add_int64(stream, "hdrs", g_perf_stats.digest_stream_hdrs);
+    json_object_object_add(root, "digest_stream", stream);
+  }
+  json_object *direct = json_object_new_object(); {
+    js_add_int64(direct, "nr", g_perf_stats.read_direct_nr);
+    js_add_int64(direct, "bytes", g_perf_stats.read_direct_bytes);
+    json_object_object_add(root, "read_direct", direct);
+  }
+  json_object *rcache = json_object_new_object(); {
+    js_add_int64(rcache, "hit", g_perf_stats.read_cache_hit_nr);
+    js_add_int64(rcache, "evict", g_perf_stats.read_cache_evict_nr);
+    js_add_int64(rcache, "blocks", rcache_nr_blocks());
+    json_object_object_add(root, "read_cache", rcache);
+  }
+  json_object *ra = json_object_new_object(); {
+    js_add_int64(ra, "hit", g_perf_stats.readahead_hit_nr);
+    js_add_int64(ra, "miss", g_perf_stats.readahead_miss_nr);
+    js_add_int64(ra, "issue", g_perf_stats.readahead_issue_nr);
+    js_add_int64(ra, "blocks", g_perf_stats.readahead_blocks);
+    json_object_object_add(root, "readahead", ra);
+  }
   json_object *l0 = json_object_new_object(); {
     js_add_int64(l0, "tsc", g_perf_stats.l0_search_tsc);
     js_add_int64(l0, "nr" , g_perf_stats.l0_search_nr);
+    js_add_int64(l0, "skip", g_perf_stats.l0_skip_nr);
     json_object_object_add(root, "l0", l0);
   }
   json_object *lsm = json_object_new_object(); {
     js_add_int64(lsm, "tsc", g_perf_stats.tree_search_tsc);
     js_add_int64(lsm, "nr" , g_perf_stats.tree_search_nr);
+    js_add_int64(lsm, "path_cache_hit", g_perf_stats.path_cache_hit_nr);
     json_object_object_add(root, "lsm", lsm);
   }
   json_object *log = json_object_new_object(); {
@@ -122,6 +184,23 @@ void show_libfs_stats(const char *title)
       js_add_int64(alloc, "nr" , g_perf_stats.log_alloc_nr);
       json_object_object_add(log, "alloc", alloc);
     }
+    json_object *publish = json_object_new_object(); {
+      js_add_int64(publish, "tsc", g_perf_stats.log_publish_wait_tsc);
+      js_add_int64(publish, "nr" , g_perf_stats.log_publish_wait_nr);
+      json_object_object_add(log, "publish_wait", publish);
+    }
+    json_object *group = json_object_new_object(); {
+      js_add_int64(group, "wait_tsc", g_perf_stats.log_group_wait_tsc);
+      js_add_int64(group, "nr" , g_perf_stats.log_group_nr);
+      js_add_int64(group, "members" , g_perf_stats.log_group_members_nr);
+      json_object_object_add(log, "group_commit", group);
+    }
+    json_object *packed = json_object_new_object(); {
+      js_add_int64(packed, "nr" , g_perf_stats.log_packed_nr);
+      js_add_int64(packed, "bytes" , g_perf_stats.log_packed_bytes);
+      js_add_int64(packed, "blocks" , g_perf_stats.log_pack_blocks_nr);
+      json_object_object_add(log, "packed", packed);
+    }
     json_object *hdrwr = json_object_new_object(); {
       js_add_int64(hdrwr, "tsc", g_perf_stats.loghdr_write_tsc);
       js_add_int64(hdrwr, "nr" , g_perf_stats.loghdr_write_nr);
@@ -203,21 +282,40 @@ void show_libfs_stats(const char *title)
   printf("\n");
   printf("-------%s------------- %s libfs statistics\n", getenv("MLFS_IDX_STRUCT"), title);
   printf("wait on digest  (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.digest_wait_tsc,g_perf_stats.digest_wait_nr));
+  printf("  resync (tsc/digest)     : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.digest_resync_tsc,g_perf_stats.digest_resync_nr));
+  printf("  resync (inodes/digest)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.digest_resync_inodes,g_perf_stats.digest_resync_nr));
+  if (g_idx_cached && IDXAPI_IS_GLOBAL())
+    printf("  index cache drops       : %lu (%lu kept)\n", g_perf_stats.idx_invalidate_nr, g_perf_stats.idx_invalidate_skip_nr);
+  if (IDXAPI_IS_ROCACHED())
+    printf("  rocache refresh         : %lu tsc, %lu lines, %lu full copies\n", g_perf_stats.rocache_refresh_tsc, g_perf_stats.rocache_refresh_lines, g_perf_stats.rocache_refresh_full_nr);
+  printf("  stream (hdrs/digest)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.digest_stream_hdrs,g_perf_stats.digest_stream_nr));
+  print_stats_hist(&g_perf_stats.digest_stall, "  log space stall (tsc)");
   printf("inode allocation (tsc/op) : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.ialloc_tsc,g_perf_stats.ialloc_nr));
   printf("bcache search (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.bcache_search_tsc,g_perf_stats.bcache_search_nr));
   printf("search l0 tree  (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.l0_search_tsc,g_perf_stats.l0_search_nr));
+  printf("  log summary skips       : %lu\n", g_perf_stats.l0_skip_nr);
   printf("  fcache lock (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.fcache_lock_tsc,g_perf_stats.fcache_lock_nr));
   printf("  fcache init (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.fcache_init_tsc,g_perf_stats.fcache_init_nr));
   printf("  fcache get  (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.fcache_get_tsc,g_perf_stats.fcache_get_nr));
   printf("  fcache val  (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.fcache_val_tsc,g_perf_stats.fcache_val_nr));
   printf("  fcache ALL  (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.fcache_all_tsc,g_perf_stats.fcache_all_nr));
   printf("search lsm tree (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.tree_search_tsc,g_perf_stats.tree_search_nr));
+  printf("cached extent path hits   : %lu\n", g_perf_stats.path_cache_hit_nr);
+  if (g_idx_choice == HYBRID) {
+    for (int t = 0; t < NONE; t++) {
+      if (!g_perf_stats.idx_lookup_nr[t]) continue;
+      printf("  lookup %-17.17s : %lu / %lu(%.2f)\n", idx_choice_name(t),
+          tri_ratio(g_perf_stats.idx_lookup_tsc[t], g_perf_stats.idx_lookup_nr[t]));
+    }
+  }
     print_cache_stats(&(g_perf_stats.cache_stats));
   printf("log commit (tsc/op)       : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_commit_tsc,g_perf_stats.log_commit_nr));
   printf("  log writes (tsc/op)     : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_write_tsc,g_perf_stats.log_write_nr));
   printf("    log inode (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_write_inode_tsc,g_perf_stats.log_write_inode_nr));
   printf("    log data (tsc/op)     : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_write_data_tsc,g_perf_stats.log_write_data_nr));
   printf("      unaligned (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_write_data_unaligned_tsc,g_perf_stats.log_write_data_unaligned_nr));
+  printf("        packed (bytes/op) : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_packed_bytes,g_perf_stats.log_packed_nr));
+  printf("        packed (ops/blk)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_packed_nr,g_perf_stats.log_pack_blocks_nr));
   printf("      aligned (tsc/op)    : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_write_data_aligned_tsc,g_perf_stats.log_write_data_aligned_nr));
   printf("        get bh (tsc/op)   : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_aligned_bh_tsc,g_perf_stats.log_aligned_bh_nr));
   printf("        io time (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_aligned_wronly_tsc,g_perf_stats.log_aligned_wronly_nr));
@@ -226,8 +324,14 @@ void show_libfs_stats(const char *title)
   printf("            zalloc (tsc/op) : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.fc_add_zalloc_tsc,g_perf_stats.fc_add_zalloc_nr));
   printf("  log alloc (tsc/op)      : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_alloc_tsc,g_perf_stats.log_alloc_nr));
   printf("  loghdr writes (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.loghdr_write_tsc,g_perf_stats.loghdr_write_nr));
+  printf("  publish wait (tsc/op)   : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_publish_wait_tsc,g_perf_stats.log_publish_wait_nr));
+  printf("  group commit (tx/group) : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_group_members_nr,g_perf_stats.log_group_nr));
+  printf("    group wait (tsc/group): %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.log_group_wait_tsc,g_perf_stats.log_group_nr));
   printf("read data blocks (tsc/op) : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.read_data_tsc,g_perf_stats.read_data_bytes.cnt));
   print_stats_dist(&(g_perf_stats.read_data_bytes), "read data");
+  printf("  direct DAX (bytes/op)   : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.read_direct_bytes,g_perf_stats.read_direct_nr));
+  printf("read cache hit / evict    : %lu / %lu (%lu blocks cached)\n", g_perf_stats.read_cache_hit_nr, g_perf_stats.read_cache_evict_nr, rcache_nr_blocks());
+  printf("readahead hit / miss      : %lu / %lu (%lu windows, %lu blocks)\n", g_perf_stats.readahead_hit_nr, g_perf_stats.readahead_miss_nr, g_perf_stats.readahead_issue_nr, g_perf_stats.readahead_blocks);
   printf("read data (bytes/tsc)     : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.read_data_bytes.total,g_perf_stats.read_data_tsc));
   printf("directory search (tsc/op) : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.dir_search_tsc,g_perf_stats.dir_search_nr_hit));
   printf("  bmap ext tree (tsc/op)  : %lu / %lu(%.2f)\n", tri_ratio(g_perf_stats.dir_search_ext_tsc,g_perf_stats.dir_search_ext_nr));
@@ -413,9 +517,17 @@ static void cache_init(void)
   }
 
   lru_hash = NULL;
+}
+
+static void read_cache_init(void)
+{
+  uint64_t budget = g_read_cache_bytes;
+  char *read_cache_mb = getenv("MLFS_READ_CACHE_MB");
+
+  if (read_cache_mb)
+    budget = strtoull(read_cache_mb, NULL, 10) << 20;
 
-  INIT_LIST_HEAD(&g_fcache_head.lru_head);
-  g_fcache_head.n = 0;
+  rcache_init(budget);
 }
 
 static void locks_init(void)
@@ -489,6 +601,8 @@ void init_fs(void)
 
     cache_init();
 
+    read_cache_init();
+
     //shared_memory_init();
 
     locks_init();
@@ -506,6 +620,8 @@ void init_fs(void)
 
     init_log(g_log_dev);
 
+    readahead_init();
+
     // read root inode in NVM
     read_root_inode(g_root_dev);
     if(IDXAPI_IS_HASHFS()) {
@@ -657,6 +773,18 @@ int sync_inode_ext_tree(uint8_t dev, struct inode *inode)
 
     iwrlock(inode);
 
+    // kernfs may have rewritten the tree under the cached path.
+    mlfs_ext_invalidate_path(inode);
+
+    // kernfs moved the file to another index type; the next lookup
+    // builds a structure of the new type.
+    if (g_idx_choice == HYBRID && inode->idx_type != dinode.idx_type) {
+        mlfs_free(inode->ext_idx);
+        inode->ext_idx = NULL;
+        inode->idx_type = dinode.idx_type;
+        memmove(inode->l1.addrs, dinode.l1_addrs, sizeof(addr_t) * (NDIRECT + 1));
+    }
+
     if (IDXAPI_IS_PER_FILE() && inode->ext_idx) {
         FN(inode->ext_idx, im_clear_metadata, inode->ext_idx);
         
@@ -734,6 +862,7 @@ struct inode* ialloc(uint8_t dev, uint32_t inum, struct dinode *dip)
   mlfs_debug("allocate hash %u\n", ip->inum);
   ip->fcache_hash = kh_init(fcache);
 #endif
+  ip->fcache_table = NULL;
 
   ip->de_cache = NULL;
   pthread_spin_init(&ip->de_cache_spinlock, PTHREAD_PROCESS_SHARED);
@@ -1098,6 +1227,39 @@ L3_search:
   return -EIO;
 }
 
+/* Get block addresses of a file range from the L1 (NVM) index as runs of
+ * contiguous blocks, with one index lookup per run (see
+ * mlfs_get_block_runs). runs holds up to max_runs entries.
+ * return = 0, if all requested blocks are found.
+ * return = -EAGAIN, if only the first blk_count_found blocks are found.
+ * return = -EIO, if the first block is not on NVM.
+ */
+int bmap_runs(struct inode *ip, struct bmap_request *bmap_req,
+    struct mlfs_map_run *runs, int max_runs, int *n_runs)
+{
+  handle_t handle = {.dev = g_root_dev};
+  uint32_t nr_found = 0;
+  int ret;
+
+  mlfs_assert(ip->itype == T_FILE);
+  mlfs_assert(ip->dev == g_root_dev);
+
+  ret = mlfs_get_block_runs(&handle, ip,
+      (bmap_req->start_offset >> g_block_size_shift), bmap_req->blk_count,
+      0, runs, max_runs, &nr_found);
+
+  *n_runs = ret > 0 ? ret : 0;
+  bmap_req->blk_count_found = nr_found;
+
+  if (nr_found == 0)
+    return -EIO;
+
+  bmap_req->dev = g_root_dev;
+  bmap_req->block_no = runs[0].m_pblk;
+
+  return nr_found == bmap_req->blk_count ? 0 : -EAGAIN;
+}
+
 /* Get block addresses from extent trees.
  * return = 0, if all requested offsets are found.
  * return = -EAGAIN, if not all blocks are found.
@@ -1326,6 +1488,83 @@ L3_search:
   return -EIO;
 }
 
+/* Switch writers to the other half of ip's log summary.
+ * Called on digest before log_bloom_rebuild(), with an epoch_synchronize()
+ * in between so no writer still adds to the old half. */
+void log_bloom_flip(struct inode *ip)
+{
+  uint8_t next;
+
+  if (ip->itype != T_FILE)
+    return;
+
+  next = ip->log_bloom_cur ^ 1;
+  memset(ip->log_bloom[next], 0, sizeof(ip->log_bloom[next]));
+  __atomic_store_n(&ip->log_bloom_cur, next, __ATOMIC_SEQ_CST);
+}
+
+static void log_bloom_keep(struct fcache_block *fc_block, void *arg)
+{
+  struct inode *ip = (struct inode *)arg;
+
+  // blocks the digest made readable from the shared area can be dropped.
+  if (!fc_block->is_data_cached && fc_block->log_addr &&
+      (fc_block->log_version < g_fs_log->start_version ||
+       (fc_block->log_version == g_fs_log->start_version &&
+        fc_block->log_addr < g_fs_log->start_blk)))
+    return;
+
+  log_bloom_set(ip->log_bloom[ip->log_bloom_cur], fc_block->key);
+}
+
+/* Re-add the blocks that still need the fcache to the current half, then
+ * clear the half used before log_bloom_flip(). */
+void log_bloom_rebuild(struct inode *ip)
+{
+  if (ip->itype != T_FILE)
+    return;
+
+  fcache_for_each(ip, log_bloom_keep, ip);
+  memset(ip->log_bloom[ip->log_bloom_cur ^ 1], 0,
+      sizeof(ip->log_bloom[0]));
+}
+
+// fcache_find() for the read path; skips the probe if the log summary
+// rules the block out.
+static inline struct fcache_block *fcache_find_logged(struct inode *ip,
+    offset_t key)
+{
+  if (!log_bloom_test(ip, key)) {
+    if (enable_perf_stats)
+      g_perf_stats.l0_skip_nr++;
+    return NULL;
+  }
+
+  return fcache_find(ip, key);
+}
+
+/* Remove fc_block from ip's fcache and free it. A read cache block that
+ * eviction already took out of its shard is left to the evictor. */
+static void fcache_drop_block(struct inode *ip, struct fcache_block *fc_block)
+{
+  uint8_t *data = NULL;
+  int deleted;
+
+  if (fc_block->is_data_cached) {
+    if (!rcache_remove(fc_block))
+      return;
+    data = fc_block->data;
+  }
+
+  // out of the fcache before anything is retired; see rcache_insert.
+  deleted = fcache_del(ip, fc_block->key);
+
+  if (data)
+    fcache_free(data);
+  if (deleted)
+    fcache_free(fc_block);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -1355,13 +1594,8 @@ int itrunc(struct inode *ip, offset_t length)
       key = (size >> g_block_size_shift);
 
       fc_block = fcache_find(ip, key);
-      if (fc_block) {
-        if (fc_block->is_data_cached)
-          list_del(&fc_block->l);
-        if (fcache_del(ip, key)) {
-            mlfs_free(fc_block);
-        };
-      }
+      if (fc_block)
+        fcache_drop_block(ip, fc_block);
     }
   }
 
@@ -1411,34 +1645,6 @@ void stati(struct inode *ip, struct stat *st)
   iunlock(ip);
 }
 
-// TODO: Now, eviction is simply discarding. Extend this function
-// to evict data to the update log.
-static void evict_read_cache(struct inode *inode, uint32_t n_entries_to_evict)
-{
-  uint32_t i = 0;
-  struct fcache_block *_fcache_block, *tmp;
-
-  list_for_each_entry_safe_reverse(_fcache_block, tmp,
-      &g_fcache_head.lru_head, l) {
-    if (i > n_entries_to_evict)
-      break;
-
-    if (_fcache_block->is_data_cached) {
-      mlfs_free(_fcache_block->data);
-
-      //if (!_fcache_block->log_addr) {
-        list_del(&_fcache_block->l);
-        if(fcache_del(inode, _fcache_block->key)) {
-            mlfs_free(_fcache_block);
-        }
-      //}
-
-      g_fcache_head.n--;
-      i++;
-    }
-  }
-}
-
 // Note that read cache does not copying data (parameter) to _fcache_block->data.
 // Instead, _fcache_block->data points memory in data.
 static struct fcache_block *add_to_read_cache(struct inode *inode,
@@ -1446,25 +1652,89 @@ static struct fcache_block *add_to_read_cache(struct inode *inode,
 {
   struct fcache_block *_fcache_block;
 
+  // the summary must cover the block before readers can find it.
+  epoch_enter();
+  log_bloom_add_range(inode, (off >> g_block_size_shift), 1);
+
   _fcache_block = fcache_find(inode, (off >> g_block_size_shift));
 
   if (!_fcache_block) {
     _fcache_block = fcache_alloc_add(inode, (off >> g_block_size_shift), 0, 0);
-    g_fcache_head.n++;
   } else {
     mlfs_assert(_fcache_block->is_data_cached == 0);
   }
 
   _fcache_block->is_data_cached = 1;
   _fcache_block->data = data;
+  epoch_exit();
+
+  // may evict other blocks, from this or any other inode.
+  rcache_insert(inode, _fcache_block);
+
+  return _fcache_block;
+}
+
+/* Read [offset_in_block, offset_in_block + size) of a block whose latest
+ * update is a packed small write (see fcache_block.end_offset).
+ * Bytes outside the packed range come from the shared area; a block that
+ * is not digested yet reads as zeros there.
+ */
+void read_packed_block(struct inode *ip, struct fcache_block *fc_block,
+    uint8_t *dst, uint32_t offset_in_block, uint32_t size)
+{
+  struct buffer_head *bh;
+  uint32_t start, end;
+  int ret;
 
-  list_move(&_fcache_block->l, &g_fcache_head.lru_head);
+  mlfs_assert(fcache_log_packed(fc_block));
+  mlfs_assert(offset_in_block + size <= g_block_size_bytes);
 
-  if (g_fcache_head.n > g_max_read_cache_blocks) {
-    evict_read_cache(inode, g_fcache_head.n - g_max_read_cache_blocks);
+  if (!fcache_log_covers(fc_block, offset_in_block, size)) {
+    bmap_req_t bmap_req;
+    bmap_req_arr_t bmap_req_arr;
+    offset_t off_aligned = (fc_block->key << g_block_size_shift);
+
+    bmap_req.start_offset = off_aligned;
+    bmap_req.blk_count_found = 0;
+    bmap_req.blk_count = 1;
+    bmap_req_arr.start_offset = off_aligned;
+    bmap_req_arr.blk_count_found = 0;
+    bmap_req_arr.blk_count = 1;
+
+    if(IDXAPI_IS_HASHFS()) {
+      ret = bmap_hashfs(ip, &bmap_req_arr);
+    } else {
+      ret = bmap(ip, &bmap_req);
+    }
+
+    if (ret == -EIO) {
+      memset(dst, 0, size);
+    } else {
+      if(IDXAPI_IS_HASHFS()) {
+        bh = bh_get_sync_IO(bmap_req_arr.dev, bmap_req_arr.block_no[0], BH_NO_DATA_ALLOC);
+      } else {
+        bh = bh_get_sync_IO(bmap_req.dev, bmap_req.block_no, BH_NO_DATA_ALLOC);
+      }
+      bh->b_offset = offset_in_block;
+      bh->b_data = dst;
+      bh->b_size = size;
+      bh_submit_read_sync_IO(bh);
+      bh_release(bh);
+    }
   }
 
-  return _fcache_block;
+  // overlay the packed bytes.
+  start = max(offset_in_block, (uint32_t)fc_block->start_offset);
+  end = min(offset_in_block + size, (uint32_t)fc_block->end_offset);
+  if (start >= end)
+    return;
+
+  bh = bh_get_sync_IO(g_fs_log->dev, fc_block->pack_addr, BH_NO_DATA_ALLOC);
+  bh->b_offset = fcache_log_pos(fc_block, start);
+  bh->b_data = dst + (start - offset_in_block);
+  bh->b_size = end - start;
+  bh_submit_read_sync_IO(bh);
+  bh_release(bh);
 }
 
 ssize_t do_unaligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t io_size) // always one block
@@ -1495,14 +1765,12 @@ ssize_t do_unaligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t i
   if (enable_perf_stats)
     start_tsc = asm_rdtscp();
 
-  _fcache_block = fcache_find(ip, key);
+  _fcache_block = fcache_find_logged(ip, key);
 
   if (_fcache_block) {
     ret = check_read_log_invalidation(_fcache_block);
     if (ret) {
-      if (fcache_del(ip, key)) {
-          mlfs_free(_fcache_block);
-      }
+      fcache_drop_block(ip, _fcache_block);
       _fcache_block = NULL;
     }
   }
@@ -1518,9 +1786,41 @@ ssize_t do_unaligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t i
         start_tsc = asm_rdtscp();
     if (_fcache_block->is_data_cached) {
       memmove(dst, _fcache_block->data + (off - off_aligned), io_size);
-      list_move(&_fcache_block->l, &g_fcache_head.lru_head);
+      rcache_touch(_fcache_block);
+
+      if (enable_perf_stats)
+        g_perf_stats.read_cache_hit_nr++;
+
+      if (enable_perf_stats) {
+        g_perf_stats.end_to_end_read_tsc += asm_rdtscp() - all_tsc;
+        g_perf_stats.end_to_end_read_nr += 1;
+      }
+      return io_size;
+    }
+    // large write in a leased shared-area block.
+    else if (fcache_log_remapped(_fcache_block)) {
+      bh = bh_get_sync_IO(g_root_dev, _fcache_block->remap_addr, BH_NO_DATA_ALLOC);
+      bh->b_offset = off - off_aligned;
+      bh->b_data = dst;
+      bh->b_size = io_size;
+      bh_submit_read_sync_IO(bh);
+      bh_release(bh);
 
       if (enable_perf_stats) {
+        g_perf_stats.ua_fcache_tsc += asm_rdtscp() - start_tsc;
+        g_perf_stats.ua_fcache_nr++;
+        g_perf_stats.end_to_end_read_tsc += asm_rdtscp() - all_tsc;
+        g_perf_stats.end_to_end_read_nr += 1;
+      }
+      return io_size;
+    }
+    // packed small write in a shared pack block.
+    else if (_fcache_block->log_addr && fcache_log_packed(_fcache_block)) {
+      read_packed_block(ip, _fcache_block, dst, off - off_aligned, io_size);
+
+      if (enable_perf_stats) {
+        g_perf_stats.ua_fcache_tsc += asm_rdtscp() - start_tsc;
+        g_perf_stats.ua_fcache_nr++;
         g_perf_stats.end_to_end_read_tsc += asm_rdtscp() - all_tsc;
         g_perf_stats.end_to_end_read_nr += 1;
       }
@@ -1731,6 +2031,7 @@ ssize_t do_aligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t io_
   struct cache_copy_list copy_list[bitmap_size];
   bmap_req_t bmap_req;
   bmap_req_arr_t bmap_req_arr;
+  struct mlfs_map_run runs[BMAP_MAX_RUNS];
 
   if (enable_perf_stats) {
       all_tsc = asm_rdtscp();
@@ -1755,7 +2056,7 @@ ssize_t do_aligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t io_
     if (enable_perf_stats)
       start_tsc = asm_rdtscp();
 
-    _fcache_block = fcache_find(ip, key);
+    _fcache_block = fcache_find_logged(ip, key);
 
     if (enable_perf_stats) {
       g_perf_stats.l0_search_tsc += (asm_rdtscp() - start_tsc);
@@ -1779,8 +2080,11 @@ ssize_t do_aligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t io_
         copy_list[pos >> g_block_size_shift].cached_data = _fcache_block->data;
         copy_list[pos >> g_block_size_shift].size = g_block_size_bytes;
 
-        // move the fcache entry to head of LRU
-        list_move(&_fcache_block->l, &g_fcache_head.lru_head);
+        // give the block a second chance in its CLOCK ring.
+        rcache_touch(_fcache_block);
+
+        if (enable_perf_stats)
+          g_perf_stats.read_cache_hit_nr++;
 
         bitmap_clear(io_bitmap, (pos >> g_block_size_shift), 1);
         io_to_be_done++;
@@ -1788,6 +2092,25 @@ ssize_t do_aligned_read(struct inode *ip, uint8_t *dst, offset_t off, size_t io_
         mlfs_debug("read cache hit: offset %lu(0x%lx) size %u\n",
               off, off, io_size);
       }
+      // large write in a leased shared-area block.
+      else if (fcache_log_remapped(_fcache_block)) {
+        bh = bh_get_sync_IO(g_root_dev, _fcache_block->remap_addr, BH_NO_DATA_ALLOC);
+
+        bh->b_offset = 0;
+        bh->b_data = dst + pos;
+        bh->b_size = g_block_size_bytes;
+
+        list_add_tail(&bh->b_io_list, &io_list_log);
+        bitmap_clear(io_bitmap, (pos >> g_block_size_shift), 1);
+        io_to_be_done++;
+      }
+      // packed small write: read it here, it has no whole log block.
+      else if (_fcache_block->log_addr && fcache_log_packed(_fcache_block)) {
+        read_packed_block(ip, _fcache_block, dst + pos, 0, g_block_size_bytes);
+
+        bitmap_clear(io_bitmap, (pos >> g_block_size_shift), 1);
+        io_to_be_done++;
+      }
       // the update log search
       else if (_fcache_block->log_addr) {
         addr_t block_no = _fcache_block->log_addr;
@@ -1910,15 +2233,19 @@ do_global_search:
   }
 
   bool use_req_arr = false;
+  int n_runs = 0;
   // Get block address from shared area.
-  if (IDXAPI_IS_HASHFS()) {
-    use_req_arr = true;
-    ret = bmap_hashfs(ip, &bmap_req_arr);
-  } else if (g_idx_has_parallel_lookup && bmap_req_arr.blk_count >= 8) {
-    use_req_arr = true;
-    ret = bmap_api_parallel(ip, &bmap_req_arr);
-  } else {
-    ret = bmap(ip, &bmap_req);
+  if (ip->itype == T_FILE)
+    ret = bmap_runs(ip, &bmap_req, runs, BMAP_MAX_RUNS, &n_runs);
+
+  // not on NVM: search the lower layers.
+  if (n_runs == 0) {
+    if (IDXAPI_IS_HASHFS()) {
+      use_req_arr = true;
+      ret = bmap_hashfs(ip, &bmap_req_arr);
+    } else {
+      ret = bmap(ip, &bmap_req);
+    }
   }
 
   if (enable_perf_stats) {
@@ -1933,7 +2260,23 @@ do_global_search:
   // NVM case: no read caching.
   int which_dev = use_req_arr ? bmap_req_arr.dev : bmap_req.dev;
   if (which_dev == g_root_dev) {
-    if(use_req_arr) {
+    if (n_runs) {
+      for (int r = 0; r < n_runs; ++r) {
+        offset_t run_pos = pos +
+          ((offset_t)(runs[r].m_lblk - runs[0].m_lblk) << g_block_size_shift);
+
+        if(to_lookup.dyn) {
+          to_lookup.m_pblk_dyn[to_lookup.size] = runs[r].m_pblk;
+          to_lookup.m_lens_dyn[to_lookup.size] = runs[r].m_len;
+          to_lookup.m_offsets_dyn[to_lookup.size] = run_pos;
+        } else {
+          to_lookup.m_pblk[to_lookup.size] = runs[r].m_pblk;
+          to_lookup.m_lens[to_lookup.size] = runs[r].m_len;
+          to_lookup.m_offsets[to_lookup.size] = run_pos;
+        }
+        ++to_lookup.size;
+      }
+    } else if(use_req_arr) {
       for(size_t j = 0; j < bmap_req_arr.blk_count_found; ++j) {
         if(to_lookup.dyn) {
           to_lookup.m_pblk_dyn[to_lookup.size] = bmap_req_arr.block_no[j];
@@ -2144,6 +2487,83 @@ do_io_aligned:
   return io_size;
 }
 
+/* Fast path for aligned reads of blocks that are only in the shared area.
+ * The range is resolved into extents with bmap_runs and each is copied from
+ * the DAX mapping straight into dst, without buffer_heads. Stops at the first
+ * block that has an fcache entry (log or read cache) or is not on NVM.
+ * Returns the bytes read from the front of the request; the caller reads
+ * the rest with do_aligned_read. */
+static ssize_t do_aligned_read_dax(struct inode *ip, uint8_t *dst,
+    offset_t off, size_t io_size)
+{
+  struct mlfs_map_run runs[BMAP_MAX_RUNS];
+  size_t done = 0, len;
+  uint32_t nr_blocks, i;
+  bmap_req_t bmap_req;
+  uint64_t start_tsc;
+  int n_runs, r;
+
+  if (ip->itype != T_FILE ||
+      g_bdev[g_root_dev]->storage_engine != &storage_dax)
+    return 0;
+
+  while (done < io_size) {
+    nr_blocks = (io_size - done) >> g_block_size_shift;
+
+    // blocks in the log must be read through the fcache.
+    for (i = 0; i < nr_blocks; i++) {
+      if (fcache_find_logged(ip, ((off + done) >> g_block_size_shift) + i))
+        break;
+    }
+    nr_blocks = i;
+
+    if (nr_blocks == 0)
+      break;
+
+    bmap_req.start_offset = off + done;
+    bmap_req.blk_count = nr_blocks;
+    bmap_req.blk_count_found = 0;
+    bmap_req.block_no = 0;
+    bmap_req.dev = 0;
+
+    if (enable_perf_stats)
+      start_tsc = asm_rdtscp();
+
+    if (bmap_runs(ip, &bmap_req, runs, BMAP_MAX_RUNS, &n_runs) == -EIO)
+      n_runs = 0;
+
+    if (enable_perf_stats) {
+      g_perf_stats.tree_search_tsc += (asm_rdtscp() - start_tsc);
+      g_perf_stats.tree_search_nr++;
+    }
+
+    if (n_runs == 0)
+      break;
+
+    if (enable_perf_stats)
+      start_tsc = asm_rdtscp();
+
+    // runs are consecutive in the file, starting at off + done.
+    for (r = 0; r < n_runs; r++) {
+      len = (size_t)runs[r].m_len << g_block_size_shift;
+      dax_read_direct(g_root_dev, dst + done, runs[r].m_pblk, len);
+      done += len;
+
+      if (enable_perf_stats)
+        update_stats_dist(&(g_perf_stats.read_data_bytes), len);
+    }
+
+    if (enable_perf_stats) {
+      g_perf_stats.read_data_tsc += (asm_rdtscp() - start_tsc);
+      g_perf_stats.read_direct_nr++;
+      g_perf_stats.read_direct_bytes +=
+        (size_t)bmap_req.blk_count_found << g_block_size_shift;
+    }
+  }
+
+  return done;
+}
+
 ssize_t readi(struct inode *ip, uint8_t *dst, offset_t off, size_t io_size)
 {
   ssize_t ret = 0;
@@ -2157,6 +2577,11 @@ ssize_t readi(struct inode *ip, uint8_t *dst, offset_t off, size_t io_size)
   if (off + io_size > ip->size)
     io_size = ip->size - off;
 
+#ifdef FCACHE_RCU
+  // fcache blocks found below stay valid until epoch_exit.
+  epoch_enter();
+#endif
+
   _dst = dst;
   _off = off;
 
@@ -2210,7 +2635,10 @@ ssize_t readi(struct inode *ip, uint8_t *dst, offset_t off, size_t io_size)
   }
 
   if (size_aligned) {
-    io_done = do_aligned_read(ip, _dst, _off, size_aligned);
+    io_done = do_aligned_read_dax(ip, _dst, _off, size_aligned);
+    if (io_done < size_aligned)
+      io_done += do_aligned_read(ip, _dst + io_done, _off + io_done,
+          size_aligned - io_done);
 
     mlfs_assert(size_aligned == io_done);
 
@@ -2229,6 +2657,10 @@ ssize_t readi(struct inode *ip, uint8_t *dst, offset_t off, size_t io_size)
     ret += io_done;
   }
 
+#ifdef FCACHE_RCU
+  epoch_exit();
+#endif
+
   return ret;
 }
 
@@ -16,6 +16,8 @@
 #include "ds/khash.h"
 
 #include "filesystem/cache_stats.h"
+#include "filesystem/read_cache.h"
+#include "concurrency/epoch.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +44,8 @@ extern struct super_block *sb[g_n_devices + 1];
 #define MAX_GET_BLOCKS_RETURN 8
 #define MAX_NUM_BLOCKS_LOOKUP 256
 #endif
+// runs filled by one bmap_runs call.
+#define BMAP_MAX_RUNS 32
 
 // directory entry cache
 struct dirent_data {
@@ -87,9 +91,24 @@ struct fcache_block {
 	 * this offset should be 0 ~ g_block_size_bytes
 	 */
 	uint16_t start_offset;
+	/* non-zero for a packed small write: bytes [start_offset, end_offset)
+	 * of the block are at log_offset of pack_addr, a pack block shared
+	 * with other transactions; log_addr is then its logheader.
+	 * 0 means log_addr mirrors the block layout from start_offset on.
+	 */
+	uint16_t end_offset;
+	uint16_t log_offset;
+	addr_t pack_addr;
+	/* non-zero if a large write put the whole block in this shared-area
+	 * block (see logheader.remap_mask); log_addr is then its logheader.
+	 */
+	addr_t remap_addr;
 	uint8_t is_data_cached;
+	// read cache: CLOCK reference bit and owner inode.
+	uint8_t rc_ref;
+	struct inode *rc_inode;
 	uint8_t *data;
-	struct list_head l;	// entry for global list
+	struct list_head l;	// entry for a read cache shard ring
 };
 
 struct cache_copy_list {
@@ -140,9 +159,27 @@ typedef struct pblk_lookup_arr {
 typedef struct mlfs_libfs_stats {
 	uint64_t digest_wait_tsc;
 	uint64_t digest_wait_nr;
+	// inode resync after each digest.
+	uint64_t digest_resync_tsc;
+	uint64_t digest_resync_nr;
+	uint64_t digest_resync_inodes;
+	// HASHFS_ROCACHE mirror refresh after each digest.
+	uint64_t rocache_refresh_tsc;
+	uint64_t rocache_refresh_lines;
+	uint64_t rocache_refresh_full_nr;
+	// global hash cache drops after a digest, and digests that kept it.
+	uint64_t idx_invalidate_nr;
+	uint64_t idx_invalidate_skip_nr;
+	// cycles each log allocation waited for log space (digest stall).
+	stats_hist_t digest_stall;
+	// streaming digests and logheaders they covered.
+	uint64_t digest_stream_nr;
+	uint64_t digest_stream_hdrs;
 
 	uint64_t l0_search_tsc;
 	uint64_t l0_search_nr;
+	// fcache probes the log summary ruled out.
+	uint64_t l0_skip_nr;
         uint64_t fcache_lock_tsc;
         uint64_t fcache_lock_nr;
         uint64_t fcache_get_tsc;
@@ -156,6 +193,10 @@ typedef struct mlfs_libfs_stats {
 
 	uint64_t tree_search_tsc;
 	uint64_t tree_search_nr;
+	uint64_t path_cache_hit_nr;
+	// HYBRID: lookups by index type (indexing_choice_t).
+	uint64_t idx_lookup_tsc[NONE];
+	uint64_t idx_lookup_nr[NONE];
 	uint64_t log_write_tsc;
 	uint64_t log_write_nr;
 	uint64_t log_write_inode_tsc;
@@ -176,6 +217,14 @@ typedef struct mlfs_libfs_stats {
 	uint64_t log_write_data_unaligned_nr;
 	uint64_t log_alloc_tsc;
 	uint64_t log_alloc_nr;
+	uint64_t log_publish_wait_tsc;
+	uint64_t log_publish_wait_nr;
+	uint64_t log_group_wait_tsc;
+	uint64_t log_group_nr;
+	uint64_t log_group_members_nr;
+	uint64_t log_packed_nr;
+	uint64_t log_packed_bytes;
+	uint64_t log_pack_blocks_nr;
 	uint64_t loghdr_write_nr;
 	uint64_t loghdr_write_tsc;
     uint64_t log_hash_update_nr;
@@ -184,6 +233,16 @@ typedef struct mlfs_libfs_stats {
 	uint64_t log_commit_nr;
 	uint64_t read_data_tsc;
 	stats_dist_t read_data_bytes;
+	// aligned reads copied straight from the DAX mapping.
+	uint64_t read_direct_nr;
+	uint64_t read_direct_bytes;
+	uint64_t read_cache_hit_nr;
+	uint64_t read_cache_evict_nr;
+	// sequential readahead (see readahead.h).
+	uint64_t readahead_hit_nr;
+	uint64_t readahead_miss_nr;
+	uint64_t readahead_issue_nr;
+	uint64_t readahead_blocks;
 	uint64_t dir_search_tsc;
 	uint64_t dir_search_nr_hit;
 	uint64_t dir_search_nr_miss;
@@ -227,8 +286,6 @@ typedef struct mlfs_libfs_stats {
     double layout_score_derived;
 } libfs_stat_t;
 
-extern struct lru g_fcache_head;
-
 extern libfs_stat_t g_perf_stats;
 extern uint8_t enable_perf_stats;
 
@@ -288,8 +345,11 @@ static inline void init_api_idx_struct(uint8_t dev, struct inode *inode) {
 
         idx_struct_t *tmp = (idx_struct_t*)mlfs_zalloc(sizeof(*inode->ext_idx));
         int init_err;
+        // in a HYBRID run, the dinode says which structure the file uses.
+        indexing_choice_t choice = g_idx_choice == HYBRID ?
+            (indexing_choice_t)inode->idx_type : g_idx_choice;
 
-        switch(g_idx_choice) {
+        switch(choice) {
             case EXTENT_TREES_TOP_CACHED:
                 g_idx_cached = true;
             case EXTENT_TREES:
@@ -399,7 +459,297 @@ static inline int icache_del(struct inode *ip)
 	return 0;
 }
 
-#ifdef KLIB_HASH
+#ifdef FCACHE_RCU
+/* Read-optimized fcache: an open-addressing table with linear probing.
+ * Lookups take no lock. They run in an epoch section and see either the
+ * old or the new table across a resize. Writers serialize on
+ * fcache_rwlock and never move a key inside a table: a delete only
+ * clears the value, and re-adding the key reuses its slot. Resizing
+ * copies the live entries to a new table, publishes it and retires the
+ * old one. Removed blocks are retired too (fcache_free), so a reader
+ * inside an epoch section (readi holds one) can keep using them. */
+#define FCACHE_EMPTY_KEY ((offset_t)-1)
+#define FCACHE_TABLE_MIN 64
+
+struct fcache_slot {
+	offset_t key;
+	struct fcache_block *val;
+};
+
+struct fcache_table {
+	uint32_t mask;
+	// slots holding a key, with or without a value.
+	uint32_t n_used;
+	uint32_t n_live;
+	struct fcache_slot slots[];
+};
+
+static inline uint32_t fcache_slot_hash(offset_t key)
+{
+	return (uint32_t)((key * 0x9E3779B97F4A7C15UL) >> 32);
+}
+
+static inline struct fcache_table *fcache_table_alloc(uint32_t n_slots)
+{
+	struct fcache_table *tbl;
+	uint32_t i;
+
+	tbl = (struct fcache_table *)mlfs_alloc(sizeof(struct fcache_table) +
+			sizeof(struct fcache_slot) * n_slots);
+	if (!tbl)
+		panic("Fail to allocate fcache table\n");
+
+	tbl->mask = n_slots - 1;
+	tbl->n_used = 0;
+	tbl->n_live = 0;
+	for (i = 0; i < n_slots; i++) {
+		tbl->slots[i].key = FCACHE_EMPTY_KEY;
+		tbl->slots[i].val = NULL;
+	}
+
+	return tbl;
+}
+
+// slot holding key, or the empty slot ending its probe sequence.
+static inline struct fcache_slot *fcache_table_probe(struct fcache_table *tbl,
+		offset_t key)
+{
+	struct fcache_slot *slot;
+	uint32_t i = fcache_slot_hash(key) & tbl->mask;
+	offset_t k;
+
+	while (1) {
+		slot = &tbl->slots[i];
+		k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if (k == key || k == FCACHE_EMPTY_KEY)
+			return slot;
+		i = (i + 1) & tbl->mask;
+	}
+}
+
+// called with fcache_rwlock held for writing.
+static inline struct fcache_table *fcache_table_reserve(struct inode *inode)
+{
+	struct fcache_table *tbl = inode->fcache_table, *new_tbl;
+	uint32_t n_slots = FCACHE_TABLE_MIN, i;
+
+	// keep the load factor under 3/4 so probes stay short and end.
+	if (tbl && (tbl->n_used + 1) * 4 <= (tbl->mask + 1) * 3)
+		return tbl;
+
+	while (tbl && n_slots < (tbl->n_live + 1) * 2)
+		n_slots <<= 1;
+
+	new_tbl = fcache_table_alloc(n_slots);
+
+	if (tbl) {
+		for (i = 0; i <= tbl->mask; i++) {
+			struct fcache_slot *slot;
+
+			if (!tbl->slots[i].val)
+				continue;
+
+			slot = fcache_table_probe(new_tbl, tbl->slots[i].key);
+			slot->key = tbl->slots[i].key;
+			slot->val = tbl->slots[i].val;
+			new_tbl->n_used++;
+			new_tbl->n_live++;
+		}
+	}
+
+	__atomic_store_n(&inode->fcache_table, new_tbl, __ATOMIC_RELEASE);
+
+	if (tbl)
+		epoch_retire(tbl);
+
+	return new_tbl;
+}
+
+// free a block (or its data) taken out of the fcache.
+static inline void fcache_free(void *ptr)
+{
+	epoch_retire(ptr);
+}
+
+static inline struct fcache_block *fcache_find(struct inode *inode, offset_t key)
+{
+#define fcache_stats
+#undef fcache_stats
+	struct fcache_table *tbl;
+	struct fcache_slot *slot;
+	struct fcache_block *fc_block = NULL;
+    uint64_t start_tsc, total_tsc;
+
+#ifdef fcache_stats
+    if (enable_perf_stats) {
+        total_tsc = asm_rdtscp();
+        start_tsc = total_tsc;
+    }
+#endif
+
+	epoch_enter();
+
+#ifdef fcache_stats
+    if (enable_perf_stats) {
+        g_perf_stats.fcache_lock_tsc += (asm_rdtscp() - start_tsc);
+        g_perf_stats.fcache_lock_nr++;
+        start_tsc = asm_rdtscp();
+    }
+#endif
+
+	tbl = __atomic_load_n(&inode->fcache_table, __ATOMIC_ACQUIRE);
+	if (tbl) {
+		slot = fcache_table_probe(tbl, key);
+		if (slot->key == key)
+			fc_block = __atomic_load_n(&slot->val, __ATOMIC_ACQUIRE);
+	}
+
+#ifdef fcache_stats
+    if (enable_perf_stats) {
+        g_perf_stats.fcache_get_tsc += (asm_rdtscp() - start_tsc);
+        g_perf_stats.fcache_get_nr++;
+    }
+#endif
+
+	epoch_exit();
+
+#ifdef fcache_stats
+    if (enable_perf_stats) {
+        g_perf_stats.fcache_all_tsc += (asm_rdtscp() - total_tsc);
+        g_perf_stats.fcache_all_nr++;
+    }
+#endif
+
+	return fc_block;
+}
+
+// if cache data (instead of log), log_addr and start_offset aren't used
+static inline struct fcache_block *fcache_alloc_add(struct inode *inode,
+		offset_t key, addr_t log_addr, uint16_t start_offset)
+{
+	struct fcache_block *fc_block;
+	struct fcache_table *tbl;
+	struct fcache_slot *slot;
+	uint64_t start_tsc;
+
+	if (enable_perf_stats)
+		start_tsc = asm_rdtscp();
+
+	fc_block = (struct fcache_block *)mlfs_zalloc(sizeof(*fc_block));
+	if (!fc_block)
+		panic("Fail to allocate fcache block\n");
+
+	if (enable_perf_stats) {
+		g_perf_stats.fc_add_zalloc_tsc += (asm_rdtscp() - start_tsc);
+		g_perf_stats.fc_add_zalloc_nr++;
+	}
+
+	fc_block->key = key;
+	fc_block->log_addr = log_addr;
+	fc_block->invalidate = 0;
+	fc_block->is_data_cached = 0;
+	fc_block->inum = inode->inum;
+	fc_block->start_offset = start_offset;
+	fc_block->end_offset = 0;
+	fc_block->log_offset = start_offset;
+	fc_block->remap_addr = 0;
+	fc_block->pack_addr = 0;
+	INIT_LIST_HEAD(&fc_block->l);
+
+	pthread_rwlock_wrlock(&inode->fcache_rwlock);
+
+	tbl = fcache_table_reserve(inode);
+	slot = fcache_table_probe(tbl, key);
+
+	if (slot->key == FCACHE_EMPTY_KEY) {
+		// the value must be in place before readers can match the key.
+		slot->val = fc_block;
+		__atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+		tbl->n_used++;
+		tbl->n_live++;
+		inode->n_fcache_entries++;
+	} else {
+		if (!slot->val) {
+			tbl->n_live++;
+			inode->n_fcache_entries++;
+		}
+		__atomic_store_n(&slot->val, fc_block, __ATOMIC_RELEASE);
+	}
+
+	pthread_rwlock_unlock(&inode->fcache_rwlock);
+
+	return fc_block;
+}
+
+/*!
+ * try to delete key from inode's fcache hashtable
+ * @param[in] inode the file
+ * @param[in] key offset at block size granularity
+ * @return 0: already deleted 1: deleted successfully
+ */
+static inline int fcache_del(struct inode *inode,
+        offset_t key)
+{
+	struct fcache_table *tbl;
+	struct fcache_slot *slot;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&inode->fcache_rwlock);
+
+	tbl = inode->fcache_table;
+	if (tbl) {
+		slot = fcache_table_probe(tbl, key);
+		if (slot->key == key && slot->val) {
+			__atomic_store_n(&slot->val, NULL, __ATOMIC_RELEASE);
+			tbl->n_live--;
+			inode->n_fcache_entries--;
+			ret = 1;
+		}
+	}
+
+	pthread_rwlock_unlock(&inode->fcache_rwlock);
+
+	return ret;
+}
+
+static inline int fcache_del_all(struct inode *inode)
+{
+	struct fcache_table *tbl;
+	struct fcache_block *fc_block;
+	uint32_t i;
+
+	pthread_rwlock_wrlock(&inode->fcache_rwlock);
+
+	tbl = inode->fcache_table;
+	__atomic_store_n(&inode->fcache_table, NULL, __ATOMIC_RELEASE);
+
+	if (tbl) {
+		for (i = 0; i <= tbl->mask; i++) {
+			fc_block = tbl->slots[i].val;
+			if (!fc_block)
+				continue;
+
+			// eviction frees the data of a block it already took.
+			if (fc_block->is_data_cached && rcache_remove(fc_block))
+				fcache_free(fc_block->data);
+			fcache_free(fc_block);
+		}
+
+		epoch_retire(tbl);
+	}
+
+	inode->n_fcache_entries = 0;
+
+	mlfs_debug("destroy hash %u\n", inode->inum);
+	pthread_rwlock_unlock(&inode->fcache_rwlock);
+	return 0;
+}
+#elif defined(KLIB_HASH)
+static inline void fcache_free(void *ptr)
+{
+	mlfs_free(ptr);
+}
+
 static struct fcache_block *fcache_find(struct inode *inode, offset_t key)
 {
 #define fcache_stats
@@ -550,6 +900,10 @@ static inline struct fcache_block *fcache_alloc_add(struct inode *inode,
 	fc_block->is_data_cached = 0;
 	fc_block->inum = inode->inum;
     fc_block->start_offset = start_offset;
+	fc_block->end_offset = 0;
+	fc_block->log_offset = start_offset;
+	fc_block->remap_addr = 0;
+	fc_block->pack_addr = 0;
 	inode->n_fcache_entries++;
 	INIT_LIST_HEAD(&fc_block->l);
     //end_cache_stats(&(g_perf_stats.cache_stats));
@@ -623,8 +977,8 @@ static inline int fcache_del_all(struct inode *inode)
 		if (kh_exist(inode->fcache_hash, k)) {
 			fc_block = kh_value(inode->fcache_hash, k);
 
-			if (fc_block && fc_block->is_data_cached) {
-				list_del(&fc_block->l);
+			if (fc_block && fc_block->is_data_cached &&
+					rcache_remove(fc_block)) {
 				mlfs_free(fc_block->data);
 			} else if (fc_block) {
 #ifndef USE_FCACHE_POOL
@@ -642,6 +996,11 @@ static inline int fcache_del_all(struct inode *inode)
 }
 // UTHash version
 #else
+static inline void fcache_free(void *ptr)
+{
+	mlfs_free(ptr);
+}
+
 static inline struct fcache_block *fcache_find(struct inode *inode, offset_t key)
 {
 	struct fcache_block *fc_block = NULL;
@@ -703,10 +1062,8 @@ static inline int fcache_del_all(struct inode *inode)
 
 	HASH_ITER(hash_handle, inode->fcache, item, tmp) {
 		HASH_DELETE(hash_handle, inode->fcache, item);
-		if (item->is_data_cached) {
-			list_del(&item->l);
+		if (item->is_data_cached && rcache_remove(item))
 			mlfs_free(item->data);
-		}
 		mlfs_free(item);
 	}
 	HASH_CLEAR(hash_handle, inode->fcache);
@@ -719,6 +1076,124 @@ static inline int fcache_del_all(struct inode *inode)
 }
 #endif
 
+// visit every block in the fcache of inode.
+static inline void fcache_for_each(struct inode *inode,
+		void (*fn)(struct fcache_block *, void *), void *arg)
+{
+	pthread_rwlock_rdlock(&inode->fcache_rwlock);
+#if defined(FCACHE_RCU)
+	struct fcache_table *tbl = inode->fcache_table;
+	uint32_t i;
+
+	if (tbl) {
+		for (i = 0; i <= tbl->mask; i++) {
+			if (tbl->slots[i].val)
+				fn(tbl->slots[i].val, arg);
+		}
+	}
+#elif defined(KLIB_HASH)
+	struct fcache_block *fc_block;
+
+	kh_foreach_value(inode->fcache_hash, fc_block, fn(fc_block, arg));
+#else
+	struct fcache_block *item, *tmp;
+
+	HASH_ITER(hash_handle, inode->fcache, item, tmp) {
+		fn(item, arg);
+	}
+#endif
+	pthread_rwlock_unlock(&inode->fcache_rwlock);
+}
+
+/* Log summary: a bloom filter per inode of the blocks that may have an
+ * fcache entry. A read probes the fcache only if log_bloom_test() says
+ * the block may be there. Writers add blocks inside an epoch section;
+ * digests drop the blocks they made readable from the shared area
+ * (log_bloom_flip and log_bloom_rebuild). */
+static inline void log_bloom_set(uint64_t *bloom, offset_t key)
+{
+	uint64_t h = key * 0x9E3779B97F4A7C15UL;
+	uint32_t b0 = (h >> 32) % (LOG_BLOOM_WORDS * 64);
+	uint32_t b1 = (h >> 48) % (LOG_BLOOM_WORDS * 64);
+
+	if (!(bloom[b0 >> 6] & (1UL << (b0 & 63))))
+		__sync_fetch_and_or(&bloom[b0 >> 6], 1UL << (b0 & 63));
+	if (!(bloom[b1 >> 6] & (1UL << (b1 & 63))))
+		__sync_fetch_and_or(&bloom[b1 >> 6], 1UL << (b1 & 63));
+}
+
+static inline int log_bloom_test(struct inode *inode, offset_t key)
+{
+	uint64_t h = key * 0x9E3779B97F4A7C15UL;
+	uint32_t b0 = (h >> 32) % (LOG_BLOOM_WORDS * 64);
+	uint32_t b1 = (h >> 48) % (LOG_BLOOM_WORDS * 64);
+	uint64_t w0, w1;
+
+	w0 = inode->log_bloom[0][b0 >> 6] | inode->log_bloom[1][b0 >> 6];
+	w1 = inode->log_bloom[0][b1 >> 6] | inode->log_bloom[1][b1 >> 6];
+
+	return (w0 & (1UL << (b0 & 63))) && (w1 & (1UL << (b1 & 63)));
+}
+
+// called in an epoch section, before the fcache entries are updated.
+static inline void log_bloom_add_range(struct inode *inode, offset_t key,
+		uint32_t nr_blocks)
+{
+	uint64_t *bloom;
+	uint32_t i;
+
+	bloom = inode->log_bloom[__atomic_load_n(&inode->log_bloom_cur,
+			__ATOMIC_SEQ_CST)];
+
+	for (i = 0; i < nr_blocks; i++)
+		log_bloom_set(bloom, key + i);
+}
+
+void log_bloom_flip(struct inode *inode);
+void log_bloom_rebuild(struct inode *inode);
+
+static inline int fcache_log_packed(struct fcache_block *fc_block)
+{
+	return fc_block->end_offset != 0;
+}
+
+static inline int fcache_log_remapped(struct fcache_block *fc_block)
+{
+	return fc_block->remap_addr != 0;
+}
+
+// whether [offset_in_block, offset_in_block + size) is held in the log.
+static inline int fcache_log_covers(struct fcache_block *fc_block,
+		uint32_t offset_in_block, uint32_t size)
+{
+	uint32_t end = fcache_log_packed(fc_block) ?
+		fc_block->end_offset : g_block_size_bytes;
+
+	// a remapped block is not in the log and is never written in place.
+	if (fcache_log_remapped(fc_block))
+		return 0;
+
+	return offset_in_block >= fc_block->start_offset &&
+		offset_in_block + size <= end;
+}
+
+// log block holding the logged data of the file block.
+static inline addr_t fcache_log_blk(struct fcache_block *fc_block)
+{
+	return fcache_log_packed(fc_block) ?
+		fc_block->pack_addr : fc_block->log_addr;
+}
+
+// byte position in fcache_log_blk() of offset_in_block of the file block.
+static inline uint32_t fcache_log_pos(struct fcache_block *fc_block,
+		uint32_t offset_in_block)
+{
+	if (!fcache_log_packed(fc_block))
+		return offset_in_block;
+
+	return fc_block->log_offset + (offset_in_block - fc_block->start_offset);
+}
+
 static inline struct inode *de_cache_find(struct inode *dir_inode,
 		const char *_name, offset_t *offset)
 {
@@ -849,6 +1324,9 @@ void iupdate(struct inode*);
 int itrunc(struct inode *inode, offset_t length);
 int bmap(struct inode *ip, struct bmap_request *bmap_req);
 int bmap_hashfs(struct inode *ip, struct bmap_request_arr *bmap_req_arr);
+struct mlfs_map_run;
+int bmap_runs(struct inode *ip, struct bmap_request *bmap_req,
+		struct mlfs_map_run *runs, int max_runs, int *n_runs);
 
 int dir_check_entry_fast(struct inode *dir_inode);
 struct inode* dir_lookup(struct inode*, char*, offset_t *);
@@ -861,6 +1339,8 @@ struct inode* namei(const char*);
 struct inode* nameiparent(const char*, char*);
 ssize_t readi_unopt(struct inode*, uint8_t *dst, offset_t off, size_t io_size);
 ssize_t readi(struct inode*, uint8_t *dst, offset_t off, size_t io_size);
+void read_packed_block(struct inode *ip, struct fcache_block *fc_block,
+		uint8_t *dst, uint32_t offset_in_block, uint32_t size);
 void stati(struct inode*, struct stat *);
 size_t add_to_log(struct inode*, uint8_t*, offset_t, size_t);
 int check_log_invalidation(struct fcache_block *_fcache_block);
@@ -0,0 +1,181 @@
+#include "filesystem/read_cache.h"
+#include "filesystem/fs.h"
+#include "global/util.h"
+
+// most blocks one insert evicts; bounds the victims kept on the stack.
+#define RCACHE_EVICT_BATCH 8
+
+struct rcache_victim {
+	struct fcache_block *fc_block;
+	// not dereferenced until found in the icache again.
+	struct inode *inode;
+	uint32_t inum;
+	offset_t key;
+	uint8_t *data;
+};
+
+static struct rcache_shard rcache_shards[RCACHE_SHARDS];
+
+static inline struct rcache_shard *rcache_shard_of(uint32_t inum, offset_t key)
+{
+	uint64_t h = ((uint64_t)inum << 32) ^ key;
+
+	h *= 0x9E3779B97F4A7C15UL;
+
+	return &rcache_shards[(h >> 32) % RCACHE_SHARDS];
+}
+
+void rcache_init(uint64_t budget_bytes)
+{
+	uint64_t per_shard;
+	int i;
+
+	per_shard = (budget_bytes >> g_block_size_shift) / RCACHE_SHARDS;
+	if (per_shard == 0)
+		per_shard = 1;
+
+	for (i = 0; i < RCACHE_SHARDS; i++) {
+		pthread_spin_init(&rcache_shards[i].lock, PTHREAD_PROCESS_PRIVATE);
+		INIT_LIST_HEAD(&rcache_shards[i].ring);
+		rcache_shards[i].n_blocks = 0;
+		rcache_shards[i].max_blocks = per_shard;
+	}
+
+	mlfs_info("read cache: %lu MB in %d shards\n",
+			(per_shard * RCACHE_SHARDS) >> (20 - g_block_size_shift),
+			RCACHE_SHARDS);
+}
+
+/* Advance the clock hand until an unreferenced block is found and unlink
+ * it. Called with the shard lock held; never picks skip. */
+static struct fcache_block *rcache_clock_victim(struct rcache_shard *shard,
+		struct fcache_block *skip)
+{
+	struct fcache_block *fc_block;
+
+	while (!list_empty(&shard->ring)) {
+		fc_block = list_first_entry(&shard->ring, struct fcache_block, l);
+
+		if (fc_block == skip) {
+			if (shard->n_blocks == 1)
+				return NULL;
+			list_move_tail(&fc_block->l, &shard->ring);
+			continue;
+		}
+
+		if (fc_block->rc_ref) {
+			// second chance.
+			fc_block->rc_ref = 0;
+			list_move_tail(&fc_block->l, &shard->ring);
+			continue;
+		}
+
+		list_del_init(&fc_block->l);
+		shard->n_blocks--;
+		return fc_block;
+	}
+
+	return NULL;
+}
+
+/* Remove a victim from its inode's fcache. The inode is looked up again
+ * and used under icache_rwlock, so icache_del cannot take it away
+ * meanwhile. Returns 1 if the block was removed, as fcache_del does. */
+static int rcache_fcache_del(struct rcache_victim *victim)
+{
+	struct inode *inode;
+	int ret = 0;
+
+	pthread_rwlock_rdlock(icache_rwlock);
+
+	HASH_FIND(hash_handle, inode_hash[g_root_dev], &victim->inum,
+			sizeof(uint32_t), inode);
+	if (inode && inode == victim->inode)
+		ret = fcache_del(inode, victim->key);
+
+	pthread_rwlock_unlock(icache_rwlock);
+
+	return ret;
+}
+
+/* Add a block whose data was just set up to the read cache.
+ * inode owns the block; eviction removes it from that inode's fcache. */
+void rcache_insert(struct inode *inode, struct fcache_block *fc_block)
+{
+	struct rcache_shard *shard = rcache_shard_of(inode->inum, fc_block->key);
+	struct rcache_victim victims[RCACHE_EVICT_BATCH];
+	struct fcache_block *victim;
+	int n_victims = 0, i;
+
+	fc_block->rc_inode = inode;
+	fc_block->rc_ref = 0;
+
+	pthread_spin_lock(&shard->lock);
+
+	list_add_tail(&fc_block->l, &shard->ring);
+	shard->n_blocks++;
+
+	while (shard->n_blocks > shard->max_blocks &&
+			n_victims < RCACHE_EVICT_BATCH) {
+		victim = rcache_clock_victim(shard, fc_block);
+		if (!victim)
+			break;
+
+		// the block may be freed by fcache_del_all once the lock is dropped.
+		victims[n_victims].fc_block = victim;
+		victims[n_victims].inode = victim->rc_inode;
+		victims[n_victims].inum = victim->inum;
+		victims[n_victims].key = victim->key;
+		victims[n_victims].data = victim->data;
+		n_victims++;
+	}
+
+	pthread_spin_unlock(&shard->lock);
+
+	for (i = 0; i < n_victims; i++) {
+		int deleted = rcache_fcache_del(&victims[i]);
+
+		// unlinking the block made its data ours. It is retired only
+		// after the block is out of the fcache, so that no reader
+		// entering a later epoch can find it.
+		fcache_free(victims[i].data);
+
+		if (deleted)
+			fcache_free(victims[i].fc_block);
+	}
+
+	if (enable_perf_stats)
+		g_perf_stats.read_cache_evict_nr += n_victims;
+}
+
+/* Take a cached block out of its shard.
+ * Returns 1 if the caller now owns the block's data, 0 if eviction
+ * already took it (the evictor frees the data and the fcache entry). */
+int rcache_remove(struct fcache_block *fc_block)
+{
+	struct rcache_shard *shard = rcache_shard_of(fc_block->inum, fc_block->key);
+	int ret = 0;
+
+	pthread_spin_lock(&shard->lock);
+
+	if (!list_empty(&fc_block->l)) {
+		list_del_init(&fc_block->l);
+		shard->n_blocks--;
+		ret = 1;
+	}
+
+	pthread_spin_unlock(&shard->lock);
+
+	return ret;
+}
+
+uint64_t rcache_nr_blocks(void)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < RCACHE_SHARDS; i++)
+		n += rcache_shards[i].n_blocks;
+
+	return n;
+}
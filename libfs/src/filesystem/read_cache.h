@@ -0,0 +1,52 @@
+#ifndef _READ_CACHE_H_
+#define _READ_CACHE_H_
+
+#include <pthread.h>
+
+#include "global/global.h"
+#include "global/types.h"
+#include "ds/list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* DRAM read cache for file blocks read from SSD or HDD.
+ *
+ * A block is an fcache_block with is_data_cached set. Blocks are spread
+ * over RCACHE_SHARDS shards by (inum, key). Each shard keeps a CLOCK ring
+ * under its own lock, and each shard gets an equal share of the byte
+ * budget given to rcache_init(). A hit only sets the block's reference
+ * bit (rcache_touch), so readers never write to a ring. Inserting a block
+ * into a full shard evicts unreferenced blocks from the shard's ring.
+ * Evicted blocks are removed from the fcache of the inode that owns them.
+ */
+#define RCACHE_SHARDS 64
+
+struct inode;
+struct fcache_block;
+
+struct rcache_shard {
+	pthread_spinlock_t lock;
+	// insertion order; the clock hand is the head.
+	struct list_head ring;
+	uint64_t n_blocks;
+	uint64_t max_blocks;
+} __attribute__((aligned(64)));
+
+void rcache_init(uint64_t budget_bytes);
+void rcache_insert(struct inode *inode, struct fcache_block *fc_block);
+int rcache_remove(struct fcache_block *fc_block);
+uint64_t rcache_nr_blocks(void);
+
+#define rcache_touch(fc_block) \
+	do { \
+		if (!(fc_block)->rc_ref) \
+			(fc_block)->rc_ref = 1; \
+	} while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
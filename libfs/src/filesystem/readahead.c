@@ -0,0 +1,191 @@
+#include <pthread.h>
+
+#include "filesystem/readahead.h"
+#include "filesystem/fs.h"
+#include "extents.h"
+#include "io/block_io.h"
+#include "concurrency/thread.h"
+#include "global/util.h"
+
+// pending readahead requests; a request that finds the queue full is dropped.
+#define RA_QUEUE_LEN 64
+
+struct ra_request {
+	uint32_t inum;
+	offset_t off;
+	uint32_t nr_blocks;
+};
+
+static struct ra_request ra_queue[RA_QUEUE_LEN];
+static uint32_t ra_head, ra_tail;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+// largest window in bytes; 0 disables readahead.
+static uint32_t ra_max_window;
+
+/* Look up nr_blocks blocks of ip from off and read ahead the ones on SSD
+ * or HDD. Stops at the first hole. Called with ip locked. */
+static void ra_prefetch(struct inode *ip, offset_t off, uint32_t nr_blocks)
+{
+	struct mlfs_map_run runs[BMAP_MAX_RUNS];
+	bmap_req_t bmap_req;
+	int n_runs;
+
+	while (nr_blocks) {
+		bmap_req.start_offset = off;
+		bmap_req.blk_count = nr_blocks;
+		bmap_req.blk_count_found = 0;
+		bmap_req.block_no = 0;
+		bmap_req.dev = 0;
+
+		bmap_runs(ip, &bmap_req, runs, BMAP_MAX_RUNS, &n_runs);
+
+#if defined(USE_SSD) || defined(USE_HDD)
+		// not in NVM: the lower tiers are where readahead pays off.
+		if (bmap_req.blk_count_found == 0) {
+			bmap_req.blk_count = nr_blocks;
+			if (bmap(ip, &bmap_req) == -EIO)
+				break;
+
+			if (bmap_req.blk_count_found && bmap_req.dev != g_root_dev)
+				mlfs_readahead(bmap_req.dev, bmap_req.block_no,
+						bmap_req.blk_count_found << g_block_size_shift);
+		}
+#endif
+
+		if (bmap_req.blk_count_found == 0)
+			break;
+
+		if (enable_perf_stats)
+			g_perf_stats.readahead_blocks += bmap_req.blk_count_found;
+
+		off += (offset_t)bmap_req.blk_count_found << g_block_size_shift;
+		nr_blocks -= bmap_req.blk_count_found;
+	}
+}
+
+static void *readahead_thread(void *arg)
+{
+	struct ra_request req;
+	struct inode *ip;
+
+	while (1) {
+		pthread_mutex_lock(&ra_lock);
+		while (ra_head == ra_tail)
+			pthread_cond_wait(&ra_cond, &ra_lock);
+		req = ra_queue[ra_head % RA_QUEUE_LEN];
+		ra_head++;
+		pthread_mutex_unlock(&ra_lock);
+
+		// only inodes still cached; the reference keeps ip while it is
+		// read ahead. iget fails on an inode being deleted.
+		if (!icache_find(g_root_dev, req.inum))
+			continue;
+		ip = iget(g_root_dev, req.inum);
+		if (!ip)
+			continue;
+
+		irdlock(ip);
+		if (ip->itype == T_FILE && !(ip->flags & I_DELETING) &&
+				req.off < ip->size)
+			ra_prefetch(ip, req.off, req.nr_blocks);
+		iunlock(ip);
+
+		iput(ip);
+	}
+
+	return NULL;
+}
+
+void readahead_init(void)
+{
+	char *ra_kb = getenv("MLFS_READAHEAD_KB");
+
+	ra_max_window = RA_DEFAULT_MAX_WINDOW;
+	if (ra_kb)
+		ra_max_window = strtoul(ra_kb, NULL, 10) << 10;
+
+	if (ra_max_window == 0)
+		return;
+
+	if (ra_max_window < RA_MIN_WINDOW)
+		ra_max_window = RA_MIN_WINDOW;
+
+	// requests queued before the thread waits on ra_cond are not lost,
+	// so there is nothing to wait for.
+	mlfs_create_thread(readahead_thread, NULL);
+
+	mlfs_info("readahead: window up to %u KB\n", ra_max_window >> 10);
+}
+
+static void ra_submit(uint32_t inum, offset_t start, offset_t end)
+{
+	start = ALIGN_FLOOR(start, g_block_size_bytes);
+	end = ALIGN(end, g_block_size_bytes);
+
+	pthread_mutex_lock(&ra_lock);
+	if (ra_tail - ra_head < RA_QUEUE_LEN) {
+		ra_queue[ra_tail % RA_QUEUE_LEN].inum = inum;
+		ra_queue[ra_tail % RA_QUEUE_LEN].off = start;
+		ra_queue[ra_tail % RA_QUEUE_LEN].nr_blocks =
+			(end - start) >> g_block_size_shift;
+		ra_tail++;
+		pthread_cond_signal(&ra_cond);
+
+		if (enable_perf_stats)
+			g_perf_stats.readahead_issue_nr++;
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+void readahead_update(struct file_ra *ra, struct inode *ip, offset_t off,
+		size_t len)
+{
+	offset_t end = off + len, ra_end;
+
+	if (!ra_max_window || ip->itype != T_FILE)
+		return;
+
+	if (off != ra->next_off) {
+		// a broken stream wasted whatever was queued past it.
+		if (ra->ra_end > ra->next_off) {
+			ra->window = max(ra->window >> 1, RA_MIN_WINDOW);
+			if (enable_perf_stats)
+				g_perf_stats.readahead_miss_nr++;
+		}
+		ra->seq = 0;
+		ra->ra_end = 0;
+		ra->next_off = end;
+		return;
+	}
+
+	ra->next_off = end;
+	if (++ra->seq < RA_SEQ_TRIGGER)
+		return;
+
+	if (!ra->window)
+		ra->window = RA_MIN_WINDOW;
+
+	if (ra->ra_end) {
+		if (end <= ra->ra_end) {
+			if (enable_perf_stats)
+				g_perf_stats.readahead_hit_nr++;
+		} else if (enable_perf_stats) {
+			// the reader outran the readahead.
+			g_perf_stats.readahead_miss_nr++;
+		}
+	}
+
+	// refill once half of the window has been consumed.
+	if (ra->ra_end >= end + (ra->window >> 1))
+		return;
+
+	if (ra->ra_end)
+		ra->window = min(ra->window << 1, ra_max_window);
+
+	ra_end = min(end + ra->window, ALIGN(ip->size, g_block_size_bytes));
+	if (ra_end > max(ra->ra_end, end))
+		ra_submit(ip->inum, max(ra->ra_end, end), ra_end);
+	ra->ra_end = max(ra_end, end);
+}
@@ -0,0 +1,50 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include "global/global.h"
+#include "global/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sequential readahead for file reads.
+ *
+ * Each struct file tracks where the next sequential read would start. After
+ * RA_SEQ_TRIGGER sequential reads in a row, readahead_update() keeps a
+ * window of bytes ahead of the reader queued for a background thread. The
+ * thread looks up the blocks in the index, which warms the index caches,
+ * and asks the storage engine to read ahead blocks that live on SSD or HDD.
+ *
+ * A read that lands inside the queued range is a hit; one past it is a
+ * miss, and both grow the window up to the limit set by MLFS_READAHEAD_KB
+ * (0 disables readahead). A stream that breaks while queued bytes are
+ * still unread wasted them, so the window is halved.
+ */
+#define RA_SEQ_TRIGGER 2
+#define RA_MIN_WINDOW (128U << 10)
+#define RA_DEFAULT_MAX_WINDOW (2U << 20)
+
+struct inode;
+
+struct file_ra {
+	// where a sequential read would start.
+	offset_t next_off;
+	// end of the range queued for readahead; 0 if none.
+	offset_t ra_end;
+	// bytes to keep queued ahead of the reader; 0 until a stream is seen.
+	uint32_t window;
+	// sequential reads in a row.
+	uint32_t seq;
+};
+
+void readahead_init(void);
+// called with ip locked, after reading len bytes at off.
+void readahead_update(struct file_ra *ra, struct inode *ip, offset_t off,
+		size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
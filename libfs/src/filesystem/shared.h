@@ -42,6 +42,10 @@ struct free_list {
 	unsigned long   alloc_data_pages;
 	unsigned long   freed_log_pages;
 	unsigned long   freed_data_pages;
+	// allocations this list served for another list's thread.
+	unsigned long   steal_count;
+	// DATA allocations that started at their goal block.
+	unsigned long   goal_hit_count;
 };
 
 // in-memory format of superblock
@@ -82,6 +86,10 @@ struct disk_superblock {
 	addr_t log_start;		// Block number of first log block
     // For hash tables/indexing API: where is the metadata block?
     addr_t api_metadata_block; // for indexing api
+	// free-extent snapshot left by a clean shutdown (kernfs balloc.c).
+	uint64_t fl_snap_gen;		// bumped on every mount
+	addr_t fl_snap_block;		// 0 if there is no snapshot
+	uint32_t fl_snap_nblocks;
 };
 
 #define L_TYPE_DIR_ADD         1
@@ -107,16 +115,23 @@ struct disk_superblock {
  * The smaller size, the better performance */
 typedef struct logheader {
 	uint8_t n;
-	uint8_t type[g_max_blocks_per_operation];
-	uint32_t inode_no[g_max_blocks_per_operation];
+	uint8_t type[g_max_loghdr_entries];
+	uint32_t inode_no[g_max_loghdr_entries];
 	// opaque data.
 	// file: offset.
 	// directory: inode number of dirent.
 	// inode, unlink: no used.
-	offset_t data[g_max_blocks_per_operation];
-	uint32_t length[g_max_blocks_per_operation];
+	offset_t data[g_max_loghdr_entries];
+	uint32_t length[g_max_loghdr_entries];
 	// block number of on-disk log data blocks.
-	addr_t blocks[g_max_blocks_per_operation];
+	addr_t blocks[g_max_loghdr_entries];
+	// file: byte offset of the payload in blocks[]. Small writes of
+	// many transactions are packed into a shared pack block, so this
+	// is not necessarily the in-block offset of data[].
+	uint16_t log_offset[g_max_loghdr_entries];
+	// file: bit i set if blocks[i] is a shared-area block leased from
+	// kernfs (DIGEST_REMAP). Digest remaps it into the file index.
+	uint64_t remap_mask;
 	// block number of next logheader. 0 if no next log.
 	addr_t next_loghdr_blkno;
 	mlfs_time_t mtime;
@@ -149,18 +164,32 @@ typedef struct logheader_meta {
 	// io vector for user buffer. used for log write.
 	io_vec_t io_vec[10];
 
+	// small writes packed into the shared pack block: bytes used and
+	// bitmap of the packed entries. Their log_offset is relative to
+	// pack_off in pack_blk until the log is reserved.
+	uint16_t pack_used;
+	uint8_t pack_mask;
+	addr_t pack_blk;
+	uint16_t pack_off;
+
 	uint32_t ext_used;
 	// 2048 bytes that can be piggybacked to logheader.
 	// used for dirent name and very small write.
 	uint8_t loghdr_ext[2048];
 } loghdr_meta_t;
 
+// the ext is written right after the header, in the same block.
+_Static_assert(sizeof(struct logheader) +
+		sizeof(((struct logheader_meta *)0)->loghdr_ext) <= g_block_size_bytes,
+		"log header and its ext must fit in a block");
+
 // On-disk inode structure
 struct dinode {
 	uint8_t dev;		// Device id for multi-level storage
 	uint8_t itype;		// File type
 	uint8_t nlink;		// Number of links to inode in file system
-    uint8_t _padding[5];
+	uint8_t idx_type;	// indexing_choice_t of the file (HYBRID only)
+    uint8_t _padding[4];
 	uint64_t size;		// Size of file (bytes)
 
 	mlfs_time_t atime;
@@ -198,6 +227,8 @@ struct dinode {
 #define BMAP_SET 3
 
 #define DIRBITMAP_SIZE 1024
+// words in each half of an inode's log summary (512 bits).
+#define LOG_BLOOM_WORDS 8
 
 #ifdef KLIB_HASH
 KHASH_MAP_INIT_INT64(fcache, struct fcache_block *);
@@ -209,6 +240,7 @@ struct inode {
 	uint8_t dev;        // Device id for multi-level storage
 	uint8_t itype;      // File type
 	uint8_t nlink;      // Number of links to inode in file system
+	uint8_t idx_type;   // indexing_choice_t of the file (HYBRID only)
 	uint64_t size;      // Size of file (bytes)
 
 	mlfs_time_t atime;
@@ -262,9 +294,16 @@ struct inode {
 
 	pthread_rwlock_t i_rwlock;
 
-	// For extent tree search optimization.
+	// For extent tree search optimization (REUSE_PREVIOUS_PATH): the last
+	// path looked up, valid while path_gen equals previous_path_gen and
+	// only for blocks in [previous_path_lo, previous_path_hi).
 	struct mlfs_ext_path *previous_path;
-	uint8_t invalidate_path;
+	uint32_t previous_path_gen;
+	uint32_t path_gen;
+	uint32_t previous_path_lo;
+	uint32_t previous_path_hi;
+	// held while previous_path is read or replaced.
+	uint8_t path_busy;
 
 	// bitmap to track empty slots in directory blocks.
 	DECLARE_BITMAP(dirent_bitmap, DIRBITMAP_SIZE);
@@ -282,6 +321,19 @@ struct inode {
 	struct rb_root i_dirty_dblock; // rb root for dirty directory block.
 	struct list_head i_slru_head;
 	//cuckoofilter_t *filter;
+	// write pattern seen by digest since the last HYBRID decision.
+	uint32_t hy_writes;
+	uint32_t hy_seq_writes;
+	uint32_t hy_next_lblk;
+	// queued for conversion to another index type.
+	uint8_t hy_queued;
+	// data blocks reserved for the next appends (MLFS_PREALLOC_BLOCKS).
+	addr_t pa_start;
+	uint32_t pa_len;
+	// where the next append would go, and how many came in a row.
+	uint32_t pa_lblk;
+	addr_t pa_goal;
+	uint32_t pa_appends;
 	///////////////////////////////////////////////////////////////////
 
 	// libfs only
@@ -291,10 +343,17 @@ struct inode {
 #ifdef KLIB_HASH
 	khash_t(fcache) *fcache_hash;
 #endif
+	// -- for FCACHE_RCU, read without fcache_rwlock.
+	struct fcache_table *fcache_table;
     struct fcache_block *fcache_block_pool;
     size_t npool_blocks;
     int pool_pointer;
 	uint32_t n_fcache_entries;
+	// -- bloom filter of blocks that may have an fcache entry.
+	// writers set bits in log_bloom[log_bloom_cur]; a digest rebuilds the
+	// other half and switches to it.
+	uint64_t log_bloom[2][LOG_BLOOM_WORDS];
+	uint8_t log_bloom_cur;
 	///////////////////////////////////////////////////////////////////
 
 	///////////////////////////////////////////////////////////////////
@@ -323,6 +382,111 @@ static inline struct super_block* get_inode_sb(uint8_t dev, struct inode *inode)
 #define MAX_SOCK_BUF 128
 #define MAX_CMD_BUF 128
 
+/* Binary digest channel in shared memory (DIGEST_SHM_RING).
+ * Each libfs (one per log device) owns a ring of requests that kernfs
+ * consumes and a ring of acks that kernfs produces. Indices only grow;
+ * the slot is index % DIGEST_RING_SLOTS. Sleepers wait on futexes. */
+#define DIGEST_RING_SLOTS 8
+#define DIGEST_RING_MAGIC 0x44524E47
+
+#define DIGEST_CMD_DIGEST 1
+#define DIGEST_CMD_LEASE  2
+#define DIGEST_CMD_LRU    3
+
+typedef struct digest_req {
+	uint32_t seq;
+	uint8_t cmd;
+	uint8_t dev;
+	// digest: # of loghdrs. lease: # of blocks returned.
+	uint32_t count;
+	// digest: first loghdr to digest. lease: first block returned.
+	addr_t blkno;
+	// digest: # of shared-area blocks wanted for remapping.
+	uint32_t lease_want;
+} digest_req_t;
+
+typedef struct digest_ack {
+	// seq of the request this acks.
+	uint32_t seq;
+	int n_digested;
+	addr_t next_hdr;
+	int rotated;
+	int lru_updated;
+	addr_t lease_blkno;
+	uint32_t lease_count;
+	// global hash index generation after this digest (see hash_idx_gen).
+	uint64_t idx_gen;
+} digest_ack_t;
+
+struct digest_ring {
+	// written by libfs, read by kernfs.
+	volatile uint32_t req_head __attribute__((aligned(64)));
+	// written by kernfs, read by libfs.
+	volatile uint32_t req_tail __attribute__((aligned(64)));
+	volatile uint32_t ack_head;
+	// written by libfs; kernfs checks it before overwriting an ack slot.
+	volatile uint32_t ack_tail __attribute__((aligned(64)));
+	digest_req_t req[DIGEST_RING_SLOTS];
+	digest_ack_t ack[DIGEST_RING_SLOTS];
+};
+
+struct digest_ring_area {
+	volatile uint32_t magic;
+	// bumped on every posted request; kernfs futex-waits on it.
+	volatile uint32_t req_seq;
+	// set while kernfs sleeps, so posters skip FUTEX_WAKE when it is busy.
+	volatile uint32_t kernfs_sleeping;
+	struct digest_ring ring[g_n_devices] __attribute__((aligned(64)));
+};
+
+// Inodes touched by the latest digest of a log device, written by kernfs
+// before the ack so that libfs resyncs only those. overflow set means
+// the list is incomplete and libfs must resync all cached inodes.
+#define DIGEST_INODES_MAX 16382
+
+typedef struct digest_inodes {
+	uint32_t n;
+	uint32_t overflow;
+	uint32_t inum[DIGEST_INODES_MAX];
+} digest_inodes_t;
+
+// HashFS entry cache lines written by kernfs, so that a libfs with a
+// HASHFS_ROCACHE mirror copies only those after a digest. Indices only
+// grow; the slot is index % HASHFS_DIRTY_MAX and holds seq == index + 1
+// once its line is published. A reader more than HASHFS_DIRTY_MAX behind
+// the head, or that finds its slot reused, recopies the whole table.
+#define HASHFS_DIRTY_MAX (1 << 18)
+
+typedef struct hashfs_dirty_log {
+	volatile uint64_t head;
+	struct {
+		volatile uint64_t seq;
+		volatile uint64_t line;
+	} ent[HASHFS_DIRTY_MAX];
+} hashfs_dirty_log_t;
+
+// The ring area is the two pages after the first SHM_SIZE bytes of SHM_NAME,
+// followed by one digest_inodes_t per device and the HashFS dirty log.
+#define DIGEST_RING_OFFSET SHM_SIZE
+#define DIGEST_RING_AREA_SIZE 8192
+#define DIGEST_SHM_AREA_SIZE \
+	(DIGEST_RING_AREA_SIZE + sizeof(digest_inodes_t) * g_n_devices + \
+	 sizeof(hashfs_dirty_log_t))
+
+_Static_assert(sizeof(struct digest_ring_area) <= DIGEST_RING_AREA_SIZE,
+		"digest rings must fit in the reserved area");
+
+static inline digest_inodes_t *digest_inodes_of(void *digest_rings, uint8_t dev)
+{
+	return (digest_inodes_t *)((uint8_t *)digest_rings +
+			DIGEST_RING_AREA_SIZE) + dev;
+}
+
+static inline hashfs_dirty_log_t *hashfs_dirty_log_of(void *digest_rings)
+{
+	return (hashfs_dirty_log_t *)digest_inodes_of(digest_rings, g_n_devices);
+}
+
 struct mlfs_dirent {
   uint32_t inum;
   char name[DIRSIZ];
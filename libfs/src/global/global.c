@@ -46,6 +46,9 @@ indexing_choice_t get_indexing_choice(void) {
     } else if (env != NULL && !strcmp(env, "RADIX_TREES")) {
         printf("%s -> using API per-file radix trees!\n", env);
         return RADIX_TREES;
+    } else if (env != NULL && !strcmp(env, "HYBRID")) {
+        printf("%s -> using API per-file structures, chosen per file!\n", env);
+        return HYBRID;
     } else if (env == NULL || !strcmp(env, "") || !strcmp(env, "NONE")){
         printf("%s -> using Strata default indexing!\n", env);
     } else {
@@ -81,32 +84,57 @@ bool get_indexing_is_cached(void) {
     return false;
 }
 
-void print_global_idx_stats(bool enable_perf_stats) {
-    if (!enable_perf_stats) return;
+const char *idx_choice_name(indexing_choice_t choice) {
+    switch(choice) {
+        case EXTENT_TREES:
+            return "extent_trees";
+        case EXTENT_TREES_TOP_CACHED:
+            return "extent_trees_top_cached";
+        case GLOBAL_CUCKOO_HASH:
+            return "global_cuckoo_hash";
+        case GLOBAL_HASH_TABLE:
+            return "global_hash_table";
+        case HASHFS:
+            return "hashfs";
+        case HASHFS_ROCACHE:
+            return "hashfs_rocache";
+        case LEVEL_HASH_TABLES:
+            return "level_hash_tables";
+        case RADIX_TREES:
+            return "radix_trees";
+        case HYBRID:
+            return "hybrid";
+        default:
+            return "none";
+    }
+}
 
-    idx_fns_t *fns;
-    switch(g_idx_choice) {
+static idx_fns_t *idx_fns_of(indexing_choice_t choice) {
+    switch(choice) {
         case EXTENT_TREES:
         case EXTENT_TREES_TOP_CACHED:
-            fns = &extent_tree_fns;
-            break;
+            return &extent_tree_fns;
         case RADIX_TREES:
-            fns = &radixtree_fns;
-            break;
+            return &radixtree_fns;
         case LEVEL_HASH_TABLES:
-            fns = &levelhash_fns;
-            break;
+            return &levelhash_fns;
         case GLOBAL_HASH_TABLE:
-            fns = &hash_fns;
-            break;
+            return &hash_fns;
         case GLOBAL_CUCKOO_HASH:
-            fns = &cuckoohash_fns;
-            break;
+            return &cuckoohash_fns;
         default:
-            fprintf(stderr, "global stats method not found\n");
-            return;
+            return NULL;
     }
+}
 
+// the structures a HYBRID run may give a file.
+static const indexing_choice_t hybrid_choices[] = {
+    EXTENT_TREES, LEVEL_HASH_TABLES, RADIX_TREES
+};
+
+#define N_HYBRID_CHOICES (sizeof(hybrid_choices) / sizeof(hybrid_choices[0]))
+
+static void print_idx_stats(idx_fns_t *fns) {
     if (fns->im_print_global_stats) {
         fns->im_print_global_stats();
     }
@@ -118,29 +146,38 @@ void print_global_idx_stats(bool enable_perf_stats) {
     }
 }
 
+void print_global_idx_stats(bool enable_perf_stats) {
+    if (!enable_perf_stats) return;
+
+    if (g_idx_choice == HYBRID) {
+        for (size_t i = 0; i < N_HYBRID_CHOICES; i++) {
+            printf("-- %s:\n", idx_choice_name(hybrid_choices[i]));
+            print_idx_stats(idx_fns_of(hybrid_choices[i]));
+        }
+        return;
+    }
+
+    idx_fns_t *fns = idx_fns_of(g_idx_choice);
+    if (!fns) {
+        fprintf(stderr, "global stats method not found\n");
+        return;
+    }
+
+    print_idx_stats(fns);
+}
+
 bool get_idx_has_parallel_lookup() {
-    idx_fns_t *fns;
-    switch(g_idx_choice) {
-        case EXTENT_TREES:
-        case EXTENT_TREES_TOP_CACHED:
-            fns = &extent_tree_fns;
-            break;
-        case RADIX_TREES:
-            fns = &radixtree_fns;
-            break;
-        case LEVEL_HASH_TABLES:
-            fns = &levelhash_fns;
-            break;
-        case GLOBAL_HASH_TABLE:
-            fns = &hash_fns;
-            break;
-        case GLOBAL_CUCKOO_HASH:
-            fns = &cuckoohash_fns;
-            break;
-        default:
-            return false;
+    // every structure a file may end up with must have it.
+    if (g_idx_choice == HYBRID) {
+        for (size_t i = 0; i < N_HYBRID_CHOICES; i++) {
+            if (!idx_fns_of(hybrid_choices[i])->im_lookup_parallel) return false;
+        }
+        return true;
     }
 
+    idx_fns_t *fns = idx_fns_of(g_idx_choice);
+    if (!fns) return false;
+
     if (fns->im_lookup_parallel) return true;
 
     return false;
@@ -149,27 +186,24 @@ bool get_idx_has_parallel_lookup() {
 void add_idx_stats_to_json(bool enable_perf_stats, json_object *root) {
     if (!enable_perf_stats) return;
 
-    idx_fns_t *fns;
-    switch(g_idx_choice) {
-        case EXTENT_TREES:
-        case EXTENT_TREES_TOP_CACHED:
-            fns = &extent_tree_fns;
-            break;
-        case RADIX_TREES:
-            fns = &radixtree_fns;
-            break;
-        case LEVEL_HASH_TABLES:
-            fns = &levelhash_fns;
-            break;
-        case GLOBAL_HASH_TABLE:
-            fns = &hash_fns;
-            break;
-        case GLOBAL_CUCKOO_HASH:
-            fns = &cuckoohash_fns;
-            break;
-        default:
-            printf("(no print fn available)\n");
-            return;
+    if (g_idx_choice == HYBRID) {
+        for (size_t i = 0; i < N_HYBRID_CHOICES; i++) {
+            idx_fns_t *fns = idx_fns_of(hybrid_choices[i]);
+
+            if (fns->im_add_global_to_json) {
+                json_object *obj = json_object_new_object();
+                fns->im_add_global_to_json(obj);
+                json_object_object_add(root,
+                        idx_choice_name(hybrid_choices[i]), obj);
+            }
+        }
+        return;
+    }
+
+    idx_fns_t *fns = idx_fns_of(g_idx_choice);
+    if (!fns) {
+        printf("(no print fn available)\n");
+        return;
     }
 
     if (fns->im_add_global_to_json) {
@@ -26,13 +26,16 @@ extern uint8_t g_hdd_dev;
 // 2 is for microbenchmark
 // 6 is generally too big. but Redis AOF mode requires at least 6.
 #define g_max_blocks_per_operation 5
+// entries of an on-disk log header. A commit group of many transactions
+// shares one header, so it holds more than one operation.
+#define g_max_loghdr_entries 48
 #define g_hdd_block_size_bytes 4194304UL
 #define g_hdd_block_size_shift 22UL
 #define g_directory_shift  16UL
 #define g_directory_mask ((1 << ((sizeof(inum_t) * 8) - g_directory_shift)) - 1)
 #define g_segsize_bytes    (1ULL << 30)  // 1 GB
-#define g_max_read_cache_blocks  (2 << 18) // 2 GB
-//#define g_max_read_cache_blocks  (1 << 10) // 4 MB
+// default read cache budget, MLFS_READ_CACHE_MB overrides it.
+#define g_read_cache_bytes  (256UL << 20) // 256 MB
 
 #define g_fd_start  1000000
 
@@ -58,7 +61,7 @@ extern uint8_t g_hdd_dev;
 
 #define SHM_START_ADDR (void *)0x7ff000000000UL
 #define SHM_SIZE (200 << 20)
-#define SHM_NAME "/tmp/mlfs_shm"
+#define SHM_NAME "/mlfs_shm"
 
 /**
  *
@@ -89,6 +92,8 @@ typedef enum indexing_api_choice {
     HASHFS_ROCACHE,
     LEVEL_HASH_TABLES,
     RADIX_TREES,
+    // per-file structures picked per inode (see kernfs/idx_hybrid.h).
+    HYBRID,
     NONE
 } indexing_choice_t;
 
@@ -101,7 +106,8 @@ extern bool g_idx_has_parallel_lookup;
 #define IDXAPI_IS_PER_FILE() (g_idx_choice == EXTENT_TREES || \
         g_idx_choice == LEVEL_HASH_TABLES || \
         g_idx_choice == RADIX_TREES || \
-        g_idx_choice == EXTENT_TREES_TOP_CACHED)
+        g_idx_choice == EXTENT_TREES_TOP_CACHED || \
+        g_idx_choice == HYBRID)
 
 #define IDXAPI_IS_HASHFS() (g_idx_choice == HASHFS || g_idx_choice == HASHFS_ROCACHE)
 #define IDXAPI_IS_ROCACHED() (g_idx_choice == HASHFS_ROCACHE)
@@ -109,6 +115,7 @@ extern bool g_idx_has_parallel_lookup;
 
 indexing_choice_t get_indexing_choice(void);
 bool get_indexing_is_cached(void);
+const char *idx_choice_name(indexing_choice_t choice);
 void print_global_idx_stats(bool enable_perf_stats);
 void add_idx_stats_to_json(bool enable_perf_stats, json_object *root);
 bool get_idx_has_parallel_lookup(void);
@@ -2,6 +2,7 @@
 #define _UTIL_H_
 
 #include <stdint.h>
+#include <string.h>
 
 #include "global/global.h"
 
@@ -213,6 +214,40 @@ static inline void update_stats_dist(stats_dist_t *s, uint64_t newval) {
 static inline void print_stats_dist(stats_dist_t *s, const char *name) {
     printf("%s  : avg %.2f total %lu cnt %lu min %lu max %lu\n", name, (double)s->total/s->cnt, s->total, s->cnt, s->min, s->max);
 }
+// log2 histogram: bucket i counts values in [2^i, 2^(i+1)), 0 goes to 0.
+#define STATS_HIST_BUCKETS 48
+typedef struct {
+    stats_dist_t dist;
+    uint64_t bucket[STATS_HIST_BUCKETS];
+} stats_hist_t;
+static inline void reset_stats_hist(stats_hist_t *h) {
+    reset_stats_dist(&h->dist);
+    memset(h->bucket, 0, sizeof(h->bucket));
+}
+static inline void update_stats_hist(stats_hist_t *h, uint64_t newval) {
+    int b = newval ? 63 - __builtin_clzl(newval) : 0;
+    if (b >= STATS_HIST_BUCKETS)
+        b = STATS_HIST_BUCKETS - 1;
+    h->bucket[b]++;
+    update_stats_dist(&h->dist, newval);
+}
+// upper bound of the bucket holding the pct-th percentile.
+static inline uint64_t stats_hist_percentile(stats_hist_t *h, double pct) {
+    uint64_t want = (uint64_t)(h->dist.cnt * pct / 100.0), seen = 0;
+    int b;
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen > want)
+            return b ? (2UL << b) - 1 : 1;
+    }
+    return h->dist.max;
+}
+static inline void print_stats_hist(stats_hist_t *h, const char *name) {
+    print_stats_dist(&h->dist, name);
+    printf("%s  : p50 < %lu p99 < %lu p99.9 < %lu\n", name,
+            stats_hist_percentile(h, 50), stats_hist_percentile(h, 99),
+            stats_hist_percentile(h, 99.9));
+}
 
 void flush_llc(void);
 #endif
@@ -452,7 +452,7 @@ int mlfs_readahead(uint8_t dev, addr_t blockno, uint32_t io_size)
 	struct storage_operations *storage_engine;
 	storage_engine = g_bdev[dev]->storage_engine;
 
-	if (storage_engine->wait_io)
+	if (storage_engine->readahead)
 		storage_engine->readahead(dev, blockno, io_size);
 
 	return 0;
@@ -3,6 +3,7 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "mlfs/mlfs_user.h"
 #include "log/log.h"
@@ -49,29 +50,70 @@ volatile struct fs_log *g_fs_log;
 volatile struct log_superblock *g_log_sb;
 
 // for communication with kernel fs.
+#ifdef DIGEST_SHM_RING
+static struct digest_ring_area *digest_rings;
+static struct digest_ring *g_digest_ring;
+// serializes posters of requests (digest thread, lease return).
+static pthread_spinlock_t digest_req_lock;
+// seq of the outstanding digest request.
+static uint32_t digest_req_seq;
+#else
 int g_sock_fd;
+static int kernfs_epfd;
 static struct sockaddr_un g_srv_addr, g_addr;
+#endif
+
+// # of logheaders digested so far, for the streaming digest controller.
+static uint64_t n_digested_total;
 
 static void read_log_superblock(volatile struct log_superblock *log_sb);
 static void write_log_superblock(volatile struct log_superblock *log_sb);
 static void commit_log(void);
 static void digest_log(void);
+static void set_remap_lease(addr_t blknr, uint32_t nr);
+#ifdef CONCURRENT
+static void log_group_sync(void);
+static void *log_group_flusher(void *arg);
+#endif
 
 pthread_mutex_t *g_log_mutex_shared;
 static pthread_rwlock_t log_version_rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
 static pthread_mutex_t hacktx = PTHREAD_MUTEX_INITIALIZER;
 
+// bypass group commit for latency-sensitive callers.
+static __thread uint8_t tls_commit_now;
+
 //pthread_t is unsigned long
 static unsigned long digest_thread_id;
 //Thread entry point
 void *digest_thread(void *arg);
 
+// percentage of the log from the environment, or def if unset/invalid.
+static int log_env_percent(const char *name, int def)
+{
+	const char *env = getenv(name);
+	int pct;
+
+	if (!env)
+		return def;
+
+	pct = atoi(env);
+	if (pct <= 0 || pct >= 100) {
+		mlfs_info("%s=%s is not a percentage, using %d\n", name, env, def);
+		return def;
+	}
+
+	return pct;
+}
+
 void init_log(int dev)
 {
 	int ret;
 	int volatile done = 0;
 	pthread_mutexattr_t attr;
+	const char *group_commit_env;
+	const char *stream_env;
 
 	if (sizeof(struct logheader) > g_block_size_bytes) {
 		printf("log header size %lu block size %lu\n",
@@ -99,6 +141,7 @@ void init_log(int dev)
 	g_fs_log->next_avail_header = disk_sb[dev].log_start + 1; // +1: log superblock
 	g_fs_log->next_avail = g_fs_log->next_avail_header + 1;
 	g_fs_log->start_blk = disk_sb[dev].log_start + 1;
+	g_fs_log->next_publish_hdr = g_fs_log->next_avail_header;
 
 	mlfs_debug("end of the log %lx\n", g_fs_log->start_blk + g_fs_log->size);
 
@@ -125,6 +168,36 @@ void init_log(int dev)
 	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
 	pthread_mutex_init(g_fs_log->shared_log_lock, &attr);
 
+	group_commit_env = getenv("MLFS_GROUP_COMMIT");
+	if (group_commit_env && atoi(group_commit_env) > 0) {
+#ifdef CONCURRENT
+		volatile int flusher_done = 0;
+
+		g_fs_log->group_window_ns = atoi(group_commit_env) * 1000UL;
+		mlfs_create_thread(log_group_flusher, &flusher_done);
+		while (!flusher_done);
+		mlfs_info("group commit: wait window %d us\n", atoi(group_commit_env));
+#else
+		mlfs_info("%s", "group commit requires CONCURRENT, disabled\n");
+#endif
+	}
+
+	// The default 30% is ad-hoc: in general, 30% ~ 40% shows good
+	// performance in all workloads.
+	g_fs_log->digest_start_blk =
+		(log_env_percent("MLFS_DIGEST_START", 30) * g_fs_log->size) / 100;
+	g_fs_log->digest_stall_blk =
+		(log_env_percent("MLFS_DIGEST_STALL", 20) * g_fs_log->size) / 100;
+
+	stream_env = getenv("MLFS_DIGEST_STREAM");
+	if (stream_env && atoi(stream_env) > 0) {
+		g_fs_log->stream_tick_ms = atoi(stream_env);
+		g_fs_log->stream_target_blk = (log_env_percent(
+					"MLFS_DIGEST_STREAM_TARGET", 10) * g_fs_log->size) / 100;
+		mlfs_info("streaming digest: tick %d ms, target %lu blocks\n",
+				g_fs_log->stream_tick_ms, g_fs_log->stream_target_blk);
+	}
+
 	digest_thread_id = mlfs_create_thread(digest_thread, &done);
 
 	// enable/disable statistics for log
@@ -136,6 +209,12 @@ void init_log(int dev)
 
 void shutdown_log(void)
 {
+#ifdef CONCURRENT
+	if (g_fs_log->group_window_ns) {
+		log_group_sync();
+	}
+#endif
+
 	// wait until the digest_thead finishes job.
 	if (g_fs_log->digesting) {
 		mlfs_info("%s", "[L] Wait finishing on-going digest\n");
@@ -150,7 +229,14 @@ void shutdown_log(void)
 		wait_on_digesting();
 		mlfs_info("%s", "[L]\twaiting over\n");
 	}
+
+	// all remapped writes are digested. return the rest of the lease.
+	if (g_fs_log->remap_nr)
+		set_remap_lease(0, 0);
+
+#ifndef DIGEST_SHM_RING
 	unlink(g_addr.sun_path);
+#endif
 }
 
 static void read_log_superblock(volatile struct log_superblock *log_sb)
@@ -204,6 +290,75 @@ static loghdr_t *read_log_header(uint16_t dev, addr_t blkno)
 	return hdr_data;
 }
 
+static inline addr_t log_used_blocks(void)
+{
+	addr_t nr_used_blk = 0;
+
+	if (g_fs_log->avail_version == g_fs_log->start_version) {
+		mlfs_assert(g_fs_log->next_avail >= g_fs_log->start_blk);
+		nr_used_blk = g_fs_log->next_avail - g_fs_log->start_blk;
+	} else {
+		nr_used_blk = (g_fs_log->size - g_fs_log->start_blk);
+		nr_used_blk += (g_fs_log->next_avail - g_fs_log->log_sb_blk);
+	}
+
+	return nr_used_blk;
+}
+
+// Log is getting full. make asynchronous digest request.
+static inline void log_check_digest_threshold(void)
+{
+	addr_t nr_used_blk = 0;
+
+	if (g_fs_log->digesting)
+		return;
+
+	nr_used_blk = log_used_blocks();
+
+	if (nr_used_blk > g_fs_log->digest_start_blk) {
+
+		// digest 90% of log.
+		make_digest_request_async(100);
+		mlfs_debug("[L] log is getting full. asynchronous digest! av(%u)sv(%u)na(%lu)sb(%lu)nr(%lu)\n",
+                g_fs_log->avail_version, g_fs_log->start_version, g_fs_log->next_avail, g_fs_log->start_blk, nr_used_blk);
+	}
+}
+
+// This has many policy questions.
+// Current implmentation is very converative.
+// Pondering the way of optimization.
+static inline void log_wait_for_space(void)
+{
+	uint64_t tsc_begin;
+
+	if (enable_perf_stats)
+		tsc_begin = asm_rdtscp();
+
+	// the tail stays LOG_PACK_SPAN blocks behind the head: pack blocks
+	// are that far before the undigested headers that use them.
+retry:
+	if (g_fs_log->avail_version > g_fs_log->start_version) {
+		if (g_fs_log->start_blk - g_fs_log->next_avail
+				< g_fs_log->digest_stall_blk + LOG_PACK_SPAN) {
+			mlfs_info("%s", "\x1B[31m [L] synchronous digest request and wait! \x1B[0m\n");
+			while (make_digest_request_async(95) != -EBUSY);
+
+			m_barrier();
+			wait_on_digesting();
+		}
+	}
+
+	if (g_fs_log->avail_version > g_fs_log->start_version) {
+		if (g_fs_log->next_avail + LOG_PACK_SPAN > g_fs_log->start_blk)
+			goto retry;
+	}
+
+	// every allocation is sampled, so percentiles are over all writes.
+	if (enable_perf_stats)
+		update_stats_hist(&g_perf_stats.digest_stall,
+				asm_rdtscp() - tsc_begin);
+}
+
 inline addr_t log_alloc(uint32_t nr_blocks)
 {
 	int ret;
@@ -223,27 +378,7 @@ inline addr_t log_alloc(uint32_t nr_blocks)
 	 */
 	//mlfs_assert(g_fs_log->avail_version - g_fs_log->start_version < 2);
 
-	// Log is getting full. make asynchronous digest request.
-	if (!g_fs_log->digesting) {
-		addr_t nr_used_blk = 0;
-		if (g_fs_log->avail_version == g_fs_log->start_version) {
-			mlfs_assert(g_fs_log->next_avail >= g_fs_log->start_blk);
-			nr_used_blk = g_fs_log->next_avail - g_fs_log->start_blk;
-		} else {
-			nr_used_blk = (g_fs_log->size - g_fs_log->start_blk);
-			nr_used_blk += (g_fs_log->next_avail - g_fs_log->log_sb_blk);
-		}
-
-		// The 30% is ad-hoc parameter: In genernal, 30% ~ 40% shows good performance
-		// in all workloads
-		if (nr_used_blk > ((30 * g_fs_log->size) / 100)) {
-
-			// digest 90% of log.
-			make_digest_request_async(100);
-			mlfs_debug("[L] log is getting full. asynchronous digest! av(%u)sv(%u)na(%lu)sb(%lu)nr(%lu)\n",
-                    g_fs_log->avail_version, g_fs_log->start_version, g_fs_log->next_avail, g_fs_log->start_blk, nr_used_blk);
-		}
-	}
+	log_check_digest_threshold();
 
 	// next_avail reaches the end of log.
 	//if (g_fs_log->next_avail + nr_blocks > g_fs_log->log_sb_blk + g_fs_log->size) {
@@ -260,25 +395,7 @@ inline addr_t log_alloc(uint32_t nr_blocks)
 	addr_t next_log_blk =
 		__sync_fetch_and_add(&g_fs_log->next_avail, nr_blocks);
 
-	// This has many policy questions.
-	// Current implmentation is very converative.
-	// Pondering the way of optimization.
-retry:
-	if (g_fs_log->avail_version > g_fs_log->start_version) {
-		if (g_fs_log->start_blk - g_fs_log->next_avail
-				< (g_fs_log->size/ 5)) {
-			mlfs_info("%s", "\x1B[31m [L] synchronous digest request and wait! \x1B[0m\n");
-			while (make_digest_request_async(95) != -EBUSY);
-
-			m_barrier();
-			wait_on_digesting();
-		}
-	}
-
-	if (g_fs_log->avail_version > g_fs_log->start_version) {
-		if (g_fs_log->next_avail > g_fs_log->start_blk)
-			goto retry;
-	}
+	log_wait_for_space();
 
 	if (0) {
 		int i;
@@ -290,6 +407,226 @@ retry:
 	return next_log_blk;
 }
 
+/* The small writes of a transaction (loghdr_meta->pack_used bytes) go to
+ * the pack block shared with earlier transactions while it has room and
+ * the header at hdr is at most LOG_PACK_SPAN / 2 blocks after it in the
+ * same lap of the log; the other half covers READ_LOG_INVALIDATION_GUARD.
+ * Otherwise the transaction reserves a new pack block as its first log
+ * block. Called with the pack block locked.
+ */
+static inline int log_pack_need_blk(struct logheader_meta *loghdr_meta,
+		addr_t hdr)
+{
+	if (!loghdr_meta->pack_used)
+		return 0;
+
+	return !(g_fs_log->pack_blk &&
+			g_fs_log->pack_version == g_fs_log->avail_version &&
+			hdr >= g_fs_log->pack_blk &&
+			hdr - g_fs_log->pack_blk <= LOG_PACK_SPAN / 2 &&
+			g_fs_log->pack_used + loghdr_meta->pack_used <=
+			g_block_size_bytes);
+}
+
+// take room for the small writes; new_blk is the new pack block, if any.
+static inline void log_pack_take(struct logheader_meta *loghdr_meta,
+		addr_t new_blk)
+{
+	if (!loghdr_meta->pack_used)
+		return;
+
+	if (new_blk) {
+		g_fs_log->pack_blk = new_blk;
+		g_fs_log->pack_used = 0;
+		g_fs_log->pack_version = g_fs_log->avail_version;
+
+		if (enable_perf_stats)
+			g_perf_stats.log_pack_blocks_nr++;
+	}
+
+	loghdr_meta->pack_blk = g_fs_log->pack_blk;
+	loghdr_meta->pack_off = g_fs_log->pack_used;
+	g_fs_log->pack_used += loghdr_meta->pack_used;
+}
+
+#ifdef CONCURRENT
+// headers wait here for their predecessors to be published.
+static pthread_mutex_t log_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_publish_cond = PTHREAD_COND_INITIALIZER;
+
+/* 1 if the log blocks before end, in the lap of version, can be reserved:
+ * they are digested and at least margin blocks behind the head. */
+static inline int log_space_free(addr_t end, uint64_t version,
+		uint64_t margin)
+{
+	return version <= g_fs_log->start_version ||
+		end + margin <= g_fs_log->start_blk;
+}
+
+/* Digest synchronously until the blocks before end are free. Called
+ * before anything is reserved, so that the transactions that already
+ * hold log space are not kept from publishing. Returns the tsc waited. */
+static uint64_t log_wait_for_room(addr_t end, uint64_t version)
+{
+	uint64_t tsc_begin = asm_rdtscp();
+
+	do {
+		mlfs_info("%s", "\x1B[31m [L] synchronous digest request and wait! \x1B[0m\n");
+		while (make_digest_request_async(95) != -EBUSY);
+
+		m_barrier();
+		wait_on_digesting();
+	} while (!log_space_free(end, version, LOG_PACK_SPAN));
+
+	return asm_rdtscp() - tsc_begin;
+}
+
+/* Lock-free reservation of a transaction's log area.
+ *
+ * A transaction occupies [ header | nr_blocks ] where the header block is
+ * the one reserved by its predecessor and the last of nr_blocks becomes
+ * the header of its successor, so the data blocks are
+ * [log_blocks, log_blocks + nr_blocks - 1). Since g_fs_log->next_avail is
+ * always the block right after the next free header, a single CAS on
+ * next_avail reserves both the header and the log blocks.
+ *
+ * The CAS only claims blocks that are already free. When the log is
+ * short of space the reserver digests first and tries again; once a
+ * range is claimed the transaction never waits for digest, since every
+ * later header waits for it to be published.
+ *
+ * Rotation is done under log_version_rwlock so that avail_version
+ * moves together with the tail. A transaction with packed small writes
+ * holds it shared, with log_lock, while it picks the pack block for its
+ * header; a new pack block is reserved in front of the data blocks.
+ * Returns the first data block.
+ */
+static addr_t log_reserve(struct logheader_meta *loghdr_meta,
+		uint32_t nr_blocks)
+{
+	addr_t cur, end, log_blocks;
+	uint64_t version, margin, wait_tsc = 0;
+	uint32_t new_pack;
+	int packing = (loghdr_meta->pack_used != 0);
+
+	log_check_digest_threshold();
+
+	// ask for a synchronous digest within digest_stall_blk of the head;
+	// after one, go on as long as the range is free.
+	margin = g_fs_log->digest_stall_blk + LOG_PACK_SPAN;
+
+	while (1) {
+		if (packing) {
+			pthread_rwlock_rdlock(&log_version_rwlock);
+			pthread_spin_lock(&g_fs_log->log_lock);
+		}
+
+		cur = g_fs_log->next_avail;
+		new_pack = log_pack_need_blk(loghdr_meta, cur - 1);
+
+		version = g_fs_log->avail_version;
+		end = cur + new_pack + nr_blocks;
+		if (end > g_fs_log->size) {
+			version++;
+			end = g_fs_log->log_sb_blk + 1 + new_pack + nr_blocks;
+		}
+
+		if (!log_space_free(end, version, margin)) {
+			if (packing) {
+				pthread_spin_unlock(&g_fs_log->log_lock);
+				pthread_rwlock_unlock(&log_version_rwlock);
+			}
+
+			wait_tsc += log_wait_for_room(end, version);
+			margin = LOG_PACK_SPAN;
+			continue;
+		}
+
+		if (cur + new_pack + nr_blocks > g_fs_log->size) {
+			if (packing) {
+				pthread_spin_unlock(&g_fs_log->log_lock);
+				pthread_rwlock_unlock(&log_version_rwlock);
+			}
+
+			pthread_rwlock_wrlock(&log_version_rwlock);
+
+			// packed reservers are shut out; the pack block is ours.
+			new_pack = log_pack_need_blk(loghdr_meta, cur - 1);
+			log_blocks = g_fs_log->log_sb_blk + 1;
+			if (cmpxchg(&g_fs_log->next_avail, cur,
+						log_blocks + new_pack + nr_blocks) != cur) {
+				pthread_rwlock_unlock(&log_version_rwlock);
+				continue;
+			}
+
+			atomic_add(&g_fs_log->avail_version, 1);
+			log_pack_take(loghdr_meta, new_pack ? log_blocks : 0);
+			pthread_rwlock_unlock(&log_version_rwlock);
+
+			mlfs_debug("-- log tail is rotated: new start %lu\n", log_blocks);
+		} else {
+			log_blocks = cur;
+			if (cmpxchg(&g_fs_log->next_avail, cur,
+						log_blocks + new_pack + nr_blocks) != cur) {
+				if (packing) {
+					pthread_spin_unlock(&g_fs_log->log_lock);
+					pthread_rwlock_unlock(&log_version_rwlock);
+				}
+				continue;
+			}
+
+			log_pack_take(loghdr_meta, new_pack ? log_blocks : 0);
+			if (packing) {
+				pthread_spin_unlock(&g_fs_log->log_lock);
+				pthread_rwlock_unlock(&log_version_rwlock);
+			}
+		}
+
+		break;
+	}
+
+	// the header slot was left by the predecessor, right before cur.
+	loghdr_meta->hdr_blkno = cur - 1;
+
+	// every allocation is sampled, so percentiles are over all writes.
+	if (enable_perf_stats)
+		update_stats_hist(&g_perf_stats.digest_stall, wait_tsc);
+
+	return log_blocks + new_pack;
+}
+
+/* Make the committed header visible to digest in log order.
+ * KernFS walks the header chain from start_digest for n_digest headers,
+ * so a header may be counted only after all of its predecessors are.
+ * A header whose predecessor is not published yet sleeps until it is. */
+static void log_publish(struct logheader_meta *loghdr_meta)
+{
+	uint64_t tsc_begin;
+
+	if (enable_perf_stats)
+		tsc_begin = asm_rdtscp();
+
+	pthread_mutex_lock(&log_publish_lock);
+	while (g_fs_log->next_publish_hdr != loghdr_meta->hdr_blkno)
+		pthread_cond_wait(&log_publish_cond, &log_publish_lock);
+
+	atomic_fetch_add(&g_log_sb->n_digest, 1);
+
+	m_barrier();
+	// reservers race on the tail; only publish sees headers in order.
+	g_fs_log->next_avail_header = loghdr_meta->loghdr.next_loghdr_blkno;
+	g_fs_log->next_publish_hdr = loghdr_meta->loghdr.next_loghdr_blkno;
+
+	pthread_cond_broadcast(&log_publish_cond);
+	pthread_mutex_unlock(&log_publish_lock);
+
+	if (enable_perf_stats) {
+		g_perf_stats.log_publish_wait_tsc += (asm_rdtscp() - tsc_begin);
+		g_perf_stats.log_publish_wait_nr++;
+	}
+}
+#endif
+
 #if 0
 // allocate logheader meta and attach logheader.
 static inline struct logheader_meta *loghd_alloc(struct logheader *lh)
@@ -451,6 +788,40 @@ void commit_log_tx(void)
 	}
 }
 
+// Transactions of the calling thread are committed on their own
+// log header instead of waiting for a commit group.
+void set_log_commit_now(int enable)
+{
+	tls_commit_now = !!enable;
+
+#ifdef CONCURRENT
+	// earlier transactions of the caller may wait in the open group.
+	if (tls_commit_now && g_fs_log->group_window_ns) {
+		log_group_sync();
+	}
+#endif
+}
+
+// Make every transaction committed so far durable. Only writes waiting
+// in a commit group are not durable yet.
+void log_sync(void)
+{
+#ifdef CONCURRENT
+	if (g_fs_log->group_window_ns)
+		log_group_sync();
+#endif
+}
+
+// How transactions reserve their log area in this build.
+const char *log_commit_mode(void)
+{
+#ifdef CONCURRENT
+	return "lock-free reservation (CONCURRENT)";
+#else
+	return "shared log mutex";
+#endif
+}
+
 static int persist_log_inode(struct logheader_meta *loghdr_meta, uint32_t idx)
 {
 	struct inode *ip;
@@ -674,9 +1045,10 @@ int check_read_log_invalidation(struct fcache_block *_fcache_block)
 	pthread_rwlock_wrlock(&log_version_rwlock);
 	int version_diff = g_fs_log->avail_version - _fcache_block->log_version;
 	mlfs_assert(version_diff >= 0);
+	// a packed write is in a pack block before its logheader.
 	if ((version_diff > 1) ||
 			(version_diff == 1 &&
-	   _fcache_block->log_addr < g_fs_log->next_avail + READ_LOG_INVALIDATION_GUARD)) {
+	   fcache_log_blk(_fcache_block) < g_fs_log->next_avail + READ_LOG_INVALIDATION_GUARD)) {
 		mlfs_debug("invalidate: inum %u offset_key %lu -> addr %lu, start_offset %lu, version %d[%d](%d), start_blk %lu next_avail %lu\n",
 				_fcache_block->inum, _fcache_block->key, _fcache_block->log_addr, _fcache_block->start_offset, _fcache_block->log_version, _fcache_block->log_version_should_be, g_fs_log->avail_version, g_fs_log->start_blk, g_fs_log->next_avail);
 		ret = 1;
@@ -719,6 +1091,106 @@ int check_write_log_invalidation(struct fcache_block *_fcache_block)
 	return ret;
 }
 
+// whether fc_block holds log data that a write of
+// [offset_in_block, offset_in_block + size) does not overwrite.
+static inline int fcache_log_uncovered(struct fcache_block *fc_block,
+		uint32_t offset_in_block, uint32_t size)
+{
+	if (fc_block->start_offset < offset_in_block)
+		return 1;
+
+	if (fcache_log_remapped(fc_block))
+		return offset_in_block + size < g_block_size_bytes;
+
+	return fcache_log_packed(fc_block) &&
+		fc_block->end_offset > offset_in_block + size;
+}
+
+/* Small writes are packed into a pack block shared by successive
+ * transactions instead of taking a log block each, so the payloads of
+ * many small writes share one log block. A packed write is addressed by
+ * (blocks[i], log_offset[i], length[i]) in its header.
+ * Here a write only gets its place among the packed writes of its
+ * transaction; the pack block is picked when log space is reserved
+ * (log_pack_need_blk). A write still needs a log block of its own when
+ * the log holds other data of the same file block that has to be merged
+ * with it. A write into a packed range is done in place, or if that
+ * range is too far back in the log, the range is packed again with it;
+ * room is kept for that.
+ */
+static int log_pack_small_write(struct logheader_meta *loghdr_meta,
+		uint32_t idx, uint32_t size)
+{
+	struct logheader *loghdr = &(loghdr_meta->loghdr);
+	struct fcache_block *fc_block;
+	struct inode *inode;
+	uint32_t offset_in_block, room = size;
+	int packable = 1;
+
+	inode = icache_find(g_root_dev, loghdr->inode_no[idx]);
+	mlfs_assert(inode);
+
+	offset_in_block = (loghdr->data[idx] % g_block_size_bytes);
+
+	// fc_block may be retired by a concurrent eviction or truncate.
+	epoch_enter();
+	fc_block = fcache_find(inode, (loghdr->data[idx] >> g_block_size_shift));
+
+	if (fc_block) {
+		if (!check_write_log_invalidation(fc_block)) {
+			// overwritten in place if the log holds the whole range.
+			if (!fcache_log_covers(fc_block, offset_in_block, size))
+				packable = 0;
+			else if (fcache_log_packed(fc_block))
+				room = fc_block->end_offset - fc_block->start_offset;
+		} else if (!check_read_log_invalidation(fc_block) &&
+				fcache_log_uncovered(fc_block, offset_in_block, size)) {
+			packable = 0;
+		}
+	}
+	epoch_exit();
+
+	if (!packable || loghdr_meta->pack_used + room > g_block_size_bytes)
+		return 0;
+
+	// relative to pack_off until the pack block is known.
+	loghdr->log_offset[idx] = loghdr_meta->pack_used;
+	loghdr_meta->pack_used += room;
+	loghdr_meta->pack_mask |= (1 << idx);
+
+	return 1;
+}
+
+/* A large write goes straight to blocks leased from the shared area
+ * while a lease is held, and takes no log blocks. KernFS then maps the
+ * blocks into the file at digest instead of copying them (DIGEST_REMAP).
+ */
+static int log_remap_large_write(struct logheader_meta *loghdr_meta,
+		uint32_t idx, uint32_t size)
+{
+	struct logheader *loghdr = &(loghdr_meta->loghdr);
+	uint32_t nr_blocks = size >> g_block_size_shift;
+	addr_t blknr = 0;
+
+	if (!g_fs_log->remap_nr)
+		return 0;
+
+	pthread_spin_lock(&g_fs_log->log_lock);
+	if (g_fs_log->remap_used + nr_blocks <= g_fs_log->remap_nr) {
+		blknr = g_fs_log->remap_blk + g_fs_log->remap_used;
+		g_fs_log->remap_used += nr_blocks;
+	}
+	pthread_spin_unlock(&g_fs_log->log_lock);
+
+	if (!blknr)
+		return 0;
+
+	loghdr->blocks[idx] = blknr;
+	loghdr->remap_mask |= (1ULL << idx);
+
+	return 1;
+}
+
 /* This is a critical path for write performance.
  * Stay optimized and need to be careful when modifying it */
 static int persist_log_file(struct logheader_meta *loghdr_meta,
@@ -742,6 +1214,14 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 
 	size = loghdr_meta->io_vec[n_iovec].size;
 
+	// readers consult the log summary before the fcache, so mark the
+	// blocks first. The epoch section lets a digest wait for this write
+	// to reach the fcache before it rebuilds the summary.
+	epoch_enter();
+	log_bloom_add_range(inode, (loghdr->data[idx] >> g_block_size_shift),
+			((loghdr->data[idx] + size - 1) >> g_block_size_shift) -
+			(loghdr->data[idx] >> g_block_size_shift) + 1);
+
 	// Handling small write (< 4KB).
 	if (size < g_block_size_bytes) {
 		// fc_block invalidation and coalescing.
@@ -749,9 +1229,13 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 		// -> if exist, fc_block may or may not be valid.
 		// 2. if fc_block is valid, then do coalescing.
 		// 3. if fc_block is not valid, then skip coalescing and update fc_block.
+		// A write planned by log_pack_small_write() goes to the pack block
+		// unless it can be coalesced.
 
-		uint32_t offset_in_block;
-		int write_log_invalid;
+		uint32_t offset_in_block, log_offset;
+		uint32_t pack_start = 0, pack_end = 0;
+		int write_log_invalid = 0, coalesced = 0, packed;
+		uint8_t pack_buf[g_block_size_bytes];
         uint64_t unaligned_tsc;
 
         if (enable_perf_stats) {
@@ -760,8 +1244,7 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 
 		key = (loghdr->data[idx] >> g_block_size_shift);
 		offset_in_block = (loghdr->data[idx] % g_block_size_bytes);
-		logblk_no = loghdr_meta->log_blocks + loghdr_meta->pos;
-		loghdr_meta->pos++;
+		packed = (loghdr_meta->pack_mask & (1 << idx));
 
 		if (enable_perf_stats)
 			start_tsc = asm_rdtscp();
@@ -772,10 +1255,47 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 			g_perf_stats.l0_search_tsc += (asm_rdtscp() - start_tsc);
 			g_perf_stats.l0_search_nr++;
 		}
-		if (fc_block) {
+		if (fc_block)
 			write_log_invalid = check_write_log_invalidation(fc_block);
-			if (!write_log_invalid) { // fc_block is write valid, coalesce current write
+
+		if (packed) {
+			logblk_no = loghdr_meta->pack_blk;
+			log_offset = loghdr_meta->pack_off + loghdr->log_offset[idx];
+			pack_start = offset_in_block;
+			pack_end = offset_in_block + size;
+			// fc_block is write valid and holds the range, overwrite it.
+			// A packed range must be within reach of this header (see
+			// log_pack_need_blk); if not, it is packed again with the write.
+			if (fc_block && !write_log_invalid &&
+					fcache_log_covers(fc_block, offset_in_block, size)) {
+				if (!fcache_log_packed(fc_block) ||
+						(loghdr_meta->hdr_blkno >= fc_block->pack_addr &&
+						 loghdr_meta->hdr_blkno - fc_block->pack_addr <=
+						 LOG_PACK_SPAN / 2)) {
+					logblk_no = fcache_log_blk(fc_block);
+					log_offset = fcache_log_pos(fc_block, offset_in_block);
+					coalesced = 1;
+				} else {
+					pack_start = fc_block->start_offset;
+					pack_end = fc_block->end_offset;
+					read_packed_block(inode, fc_block, pack_buf, pack_start,
+							pack_end - pack_start);
+					memcpy(pack_buf + (offset_in_block - pack_start),
+							loghdr_meta->io_vec[n_iovec].base, size);
+				}
+			}
+		} else {
+			logblk_no = loghdr_meta->log_blocks + loghdr_meta->pos;
+			loghdr_meta->pos++;
+			log_offset = offset_in_block;
+			// fc_block is write valid, coalesce current write. A packed
+			// block belongs to a logheader and a remapped one to the
+			// shared area; they are merged below instead.
+			if (fc_block && !write_log_invalid &&
+					!fcache_log_packed(fc_block) &&
+					!fcache_log_remapped(fc_block)) {
 				logblk_no = fc_block->log_addr;
+				coalesced = 1;
 			}
 		}
 
@@ -792,6 +1312,7 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 
 		// the logblk_no could be either a new block or existing one (coalescing case).
 		loghdr->blocks[idx] = logblk_no;
+		loghdr->log_offset[idx] = log_offset;
 
 		// case 1. the IO fits into one block.
 		if (offset_in_block + size <= g_block_size_bytes) {
@@ -803,60 +1324,144 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 
 		log_bh->b_data = loghdr_meta->io_vec[n_iovec].base;
 		log_bh->b_size = io_size;
-		log_bh->b_offset = offset_in_block;
+		log_bh->b_offset = log_offset;
+
+		// a packed range written again with the write in it.
+		if (packed && !coalesced && pack_end - pack_start != io_size) {
+			loghdr->log_offset[idx] += offset_in_block - pack_start;
+			log_bh->b_data = pack_buf;
+			log_bh->b_size = pack_end - pack_start;
+		}
 
 		mlfs_assert(log_bh->b_dev == g_fs_log->dev);
 
-		mlfs_debug("inum %u offset %lu @ blockno %lx (partial io_size=%u)\n",
-				loghdr->inode_no[idx], loghdr->data[idx], logblk_no, io_size);
+		mlfs_debug("inum %u offset %lu @ blockno %lx + %u (partial io_size=%u)\n",
+				loghdr->inode_no[idx], loghdr->data[idx], logblk_no,
+				log_offset, io_size);
 
 		mlfs_write(log_bh);
 
 		bh_release(log_bh);
 
+		if (packed && enable_perf_stats) {
+			g_perf_stats.log_packed_nr++;
+			g_perf_stats.log_packed_bytes += io_size;
+		}
+
 		// after finish writing to log, let's update fcache structure
-		if (fc_block) {
-			if (write_log_invalid) { // fc_block is write invalid. need update
-				//FIXME: what if async digest happens after checking log invalidation but before finish using log value
-				if (!check_read_log_invalidation(fc_block) && fc_block->start_offset < offset_in_block) { 
-                    // fc_block is read valid, can patch data from Read Only log area to current partially new log block
-					uint8_t buffer[g_block_size_bytes];
-
-					log_bh = bh_get_sync_IO(g_log_dev, fc_block->log_addr, BH_NO_DATA_ALLOC);
-					log_bh->b_offset = fc_block->start_offset;
+		if (fc_block && coalesced) {
+			mlfs_debug("write is coalesced %lu @ %lu\n", loghdr->data[idx], logblk_no);
+		} else if (fc_block && packed) {
+			// the old log data of the block is not needed anymore
+			// (see log_pack_small_write). Validity follows the logheader.
+			fc_block->log_version = g_fs_log->avail_version;
+			fc_block->log_addr = loghdr_meta->hdr_blkno;
+			fc_block->start_offset = pack_start;
+			fc_block->end_offset = pack_end;
+			fc_block->log_offset = log_offset;
+			fc_block->pack_addr = logblk_no;
+			fc_block->remap_addr = 0;
+		} else if (fc_block) {
+			// fc_block is write invalid or packed. need update
+			//FIXME: what if async digest happens after checking log invalidation but before finish using log value
+			if (!check_read_log_invalidation(fc_block) &&
+					fcache_log_uncovered(fc_block, offset_in_block, io_size)) {
+				// fc_block is read valid, can patch data from Read Only log area to current partially new log block
+				uint8_t buffer[g_block_size_bytes];
+				uint32_t start = fc_block->start_offset;
+
+				if (start < offset_in_block) {
+					if (fcache_log_packed(fc_block)) {
+						read_packed_block(inode, fc_block, buffer, start,
+								offset_in_block - start);
+					} else if (fcache_log_remapped(fc_block)) {
+						log_bh = bh_get_sync_IO(g_root_dev, fc_block->remap_addr, BH_NO_DATA_ALLOC);
+						log_bh->b_offset = start;
+						log_bh->b_data = buffer;
+						log_bh->b_size = offset_in_block - start;
+						bh_submit_read_sync_IO(log_bh);
+						bh_release(log_bh);
+					} else {
+						log_bh = bh_get_sync_IO(g_log_dev, fc_block->log_addr, BH_NO_DATA_ALLOC);
+						log_bh->b_offset = start;
+						log_bh->b_data = buffer;
+						log_bh->b_size = offset_in_block - start;
+						bh_submit_read_sync_IO(log_bh);
+						bh_release(log_bh);
+					}
+
+					log_bh = bh_get_sync_IO(g_log_dev, logblk_no, BH_NO_DATA_ALLOC);
+					log_bh->b_offset = start;
 					log_bh->b_data = buffer;
-					log_bh->b_size = offset_in_block - fc_block->start_offset;
-					bh_submit_read_sync_IO(log_bh);
+					log_bh->b_size = offset_in_block - start;
+					mlfs_write(log_bh);
 					bh_release(log_bh);
+				}
+
+				// the tail of a packed range is known exactly.
+				if (fcache_log_packed(fc_block) &&
+						fc_block->end_offset > offset_in_block + io_size) {
+					uint32_t tail = offset_in_block + io_size;
+
+					read_packed_block(inode, fc_block, buffer, tail,
+							fc_block->end_offset - tail);
 
 					log_bh = bh_get_sync_IO(g_log_dev, logblk_no, BH_NO_DATA_ALLOC);
-					log_bh->b_offset = fc_block->start_offset;
+					log_bh->b_offset = tail;
 					log_bh->b_data = buffer;
-					log_bh->b_size = offset_in_block - fc_block->start_offset;
+					log_bh->b_size = fc_block->end_offset - tail;
 					mlfs_write(log_bh);
 					bh_release(log_bh);
-
-					mlfs_debug("patch partial write log %lu, from %lu, offset from %lu to %lu\n", 
-                            logblk_no, fc_block->log_addr, fc_block->start_offset, offset_in_block);
-				} else { // fc_block is read invalid, can't patch data, keep the current valid offset in block as it is
-					fc_block->start_offset = offset_in_block;
 				}
-				// here we actually update fcache structure
-				fc_block->log_version = g_fs_log->avail_version;
-				fc_block->log_addr = logblk_no;
-			} else { // fc_block is write valid, new write has already been coalesced
-				if (fc_block->log_addr)  {
-					mlfs_debug("write is coalesced %lu @ %lu\n", loghdr->data[idx], logblk_no);
+
+				// so is a remapped block, which is whole.
+				if (fcache_log_remapped(fc_block) &&
+						offset_in_block + io_size < g_block_size_bytes) {
+					uint32_t tail = offset_in_block + io_size;
+
+					log_bh = bh_get_sync_IO(g_root_dev, fc_block->remap_addr, BH_NO_DATA_ALLOC);
+					log_bh->b_offset = tail;
+					log_bh->b_data = buffer;
+					log_bh->b_size = g_block_size_bytes - tail;
+					bh_submit_read_sync_IO(log_bh);
+					bh_release(log_bh);
+
+					log_bh = bh_get_sync_IO(g_log_dev, logblk_no, BH_NO_DATA_ALLOC);
+					log_bh->b_offset = tail;
+					log_bh->b_data = buffer;
+					log_bh->b_size = g_block_size_bytes - tail;
+					mlfs_write(log_bh);
+					bh_release(log_bh);
 				}
+
+				mlfs_debug("patch partial write log %lu, from %lu, offset from %lu to %lu\n",
+						logblk_no, fc_block->log_addr, start, offset_in_block);
+
+				fc_block->start_offset = min(start, offset_in_block);
+			} else { // fc_block is read invalid, can't patch data, keep the current valid offset in block as it is
+				fc_block->start_offset = offset_in_block;
 			}
+			// here we actually update fcache structure
+			fc_block->log_version = g_fs_log->avail_version;
+			fc_block->log_addr = logblk_no;
+			fc_block->end_offset = 0;
+			fc_block->log_offset = fc_block->start_offset;
+			fc_block->pack_addr = 0;
+			fc_block->remap_addr = 0;
 		}
 
 		// if there is no fcache before, let's add this new cache after write has been logged
 		if (!fc_block) {
 			mlfs_assert(loghdr_meta->pos <= loghdr_meta->nr_log_blocks);
 
-			fc_block = fcache_alloc_add(inode, key, logblk_no, offset_in_block);
+			fc_block = fcache_alloc_add(inode, key,
+					packed ? loghdr_meta->hdr_blkno : logblk_no, offset_in_block);
 			fc_block->log_version = g_fs_log->avail_version;
+			if (packed) {
+				fc_block->end_offset = offset_in_block + io_size;
+				fc_block->log_offset = log_offset;
+				fc_block->pack_addr = logblk_no;
+			}
 		}
 
         if (enable_perf_stats) {
@@ -867,6 +1472,9 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 	} else {
         // Handling large (possibly multi-block) write.
 		offset_t cur_offset;
+		// written to leased shared-area blocks instead of the log.
+		int remapped = (loghdr->remap_mask & (1ULL << idx));
+		uint8_t dev = remapped ? g_root_dev : g_fs_log->dev;
         uint64_t aligned_tsc;
 
         if (enable_perf_stats) {
@@ -884,8 +1492,12 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 
 		mlfs_assert(nr_logblocks > 0);
 
-		logblk_no = loghdr_meta->log_blocks + loghdr_meta->pos;
-		loghdr_meta->pos += nr_logblocks;
+		if (remapped) {
+			logblk_no = loghdr->blocks[idx];
+		} else {
+			logblk_no = loghdr_meta->log_blocks + loghdr_meta->pos;
+			loghdr_meta->pos += nr_logblocks;
+		}
 
 		mlfs_assert(loghdr_meta->pos <= loghdr_meta->nr_log_blocks);
 
@@ -927,8 +1539,8 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
         }
 		loghdr->blocks[idx] = logblk_no;
 
-        ssize_t ret = g_bdev[g_fs_log->dev]->storage_engine->write(
-                g_fs_log->dev, loghdr_meta->io_vec[n_iovec].base, logblk_no, size);
+        ssize_t ret = g_bdev[dev]->storage_engine->write(
+                dev, loghdr_meta->io_vec[n_iovec].base, logblk_no, size);
 
         if (enable_perf_stats) {
             g_perf_stats.log_aligned_wronly_tsc += (asm_rdtscp() - start_tsc);
@@ -970,6 +1582,11 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
 
 				fc_block = fcache_alloc_add(inode, key, logblk_no + k, 0);
 				fc_block->log_version = g_fs_log->avail_version;
+				if (remapped) {
+					// validity follows the logheader.
+					fc_block->log_addr = loghdr_meta->hdr_blkno;
+					fc_block->remap_addr = logblk_no + k;
+				}
 
                 if (enable_perf_stats) {
                     g_perf_stats.log_hash_fc_add_tsc += (asm_rdtscp() - tsc);
@@ -977,8 +1594,13 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
                 }
 			} else {
 				fc_block->log_version = g_fs_log->avail_version;
-				fc_block->log_addr = logblk_no + k;
+				fc_block->log_addr = remapped ?
+					loghdr_meta->hdr_blkno : logblk_no + k;
 				fc_block->start_offset = 0;
+				fc_block->end_offset = 0;
+				fc_block->log_offset = 0;
+				fc_block->pack_addr = 0;
+				fc_block->remap_addr = remapped ? logblk_no + k : 0;
 			}
 		}
 
@@ -994,6 +1616,8 @@ static int persist_log_file(struct logheader_meta *loghdr_meta,
         }
 	}
 
+	epoch_exit();
+
 	return 0;
 }
 
@@ -1027,9 +1651,10 @@ static uint32_t compute_log_blocks(struct logheader_meta *loghdr_meta)
 				uint32_t size;
 				size = loghdr_meta->io_vec[n_iovec].size;
 
-				if (size < g_block_size_bytes)
-					nr_log_blocks++;
-				else
+				if (size < g_block_size_bytes) {
+					if (!log_pack_small_write(loghdr_meta, i, size))
+						nr_log_blocks++;
+				} else if (!log_remap_large_write(loghdr_meta, i, size))
 					nr_log_blocks +=
 						(size >> g_block_size_shift);
 				n_iovec++;
@@ -1106,14 +1731,353 @@ static void persist_log_blocks(struct logheader_meta *loghdr_meta)
 	}
 }
 
-static void commit_log(void)
+#ifdef CONCURRENT
+/* Group commit.
+ *
+ * Transactions, concurrent or back-to-back from one thread, join the open
+ * commit group and share its log header, so the header is persisted once
+ * per group rather than once per transaction. A group reserves a region
+ * of LOG_GROUP_BLOCKS log blocks when it opens; each member takes its
+ * data blocks, and room for its small writes in the group's pack block,
+ * from the region, writes them and returns without waiting for the
+ * header. The group is closed when its header or region is full, or by
+ * the flusher thread once g_fs_log->group_window_ns has passed since it
+ * opened; the unused tail of the region is given back if nothing was
+ * reserved after it. Whoever closes a group persists and publishes its
+ * header once all members have written their blocks.
+ * A write is thus durable within one window, or once fsync, fdatasync
+ * or close flushes the open group (log_sync). set_log_commit_now()
+ * flushes it too and commits the caller's transactions on their own
+ * header, durable on return.
+ */
+#define LOG_GROUP_BLOCKS 64
+
+struct log_group {
+	// shared log header. only loghdr, ext and hdr_blkno are used.
+	struct logheader_meta meta;
+	// region of the group; the next log header follows it.
+	addr_t data_start;
+	uint32_t nr_blocks;
+	// blocks handed out to members, pack blocks included.
+	uint32_t used;
+	addr_t pack_blk;
+	uint32_t pack_used;
+	struct timespec deadline;
+	uint32_t n_members;
+	// members done with their log blocks, under lock.
+	uint32_t n_done;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+};
+
+// g_open_group and g_group_opening are protected by g_group_lock.
+// g_group_cond wakes the flusher when a group opens, g_group_open_cond
+// the members waiting for it.
+static pthread_mutex_t g_group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_group_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_group_open_cond = PTHREAD_COND_INITIALIZER;
+static struct log_group *g_open_group;
+static int g_group_opening;
+
+/* Open a new group. Called with g_group_lock held and no group open.
+ * The region is reserved with the lock dropped, since that may wait for
+ * digest; others wanting a group meanwhile wait for this one. Returns
+ * the open group, or NULL if it has been closed already. */
+static struct log_group *log_group_open(void)
 {
-	struct logheader_meta *loghdr_meta;
-	struct logheader *loghdr;
-	uint64_t tsc_begin, tsc_end;
+	struct log_group *grp;
+	uint64_t nsec;
 
-	// loghdr_meta is stored in TLS.
-	loghdr_meta = get_loghdr_meta();
+	if (g_group_opening) {
+		while (g_group_opening)
+			pthread_cond_wait(&g_group_open_cond, &g_group_lock);
+		return g_open_group;
+	}
+
+	g_group_opening = 1;
+	pthread_mutex_unlock(&g_group_lock);
+
+	grp = (struct log_group *)mlfs_zalloc(sizeof(struct log_group));
+	pthread_mutex_init(&grp->lock, NULL);
+	pthread_cond_init(&grp->done_cond, NULL);
+
+	// +1 for a next log header block.
+	grp->nr_blocks = LOG_GROUP_BLOCKS;
+	grp->data_start = log_reserve(&grp->meta, grp->nr_blocks + 1);
+
+	clock_gettime(CLOCK_REALTIME, &grp->deadline);
+	nsec = grp->deadline.tv_nsec + g_fs_log->group_window_ns;
+	grp->deadline.tv_sec += nsec / 1000000000UL;
+	grp->deadline.tv_nsec = nsec % 1000000000UL;
+
+	pthread_mutex_lock(&g_group_lock);
+	g_group_opening = 0;
+	g_open_group = grp;
+	pthread_cond_broadcast(&g_group_open_cond);
+	pthread_cond_signal(&g_group_cond);
+
+	return grp;
+}
+
+/* No member joins a closed group. Called with g_group_lock held.
+ * If next_avail is still right after the region, nothing was reserved
+ * after it and the unused tail goes back to the log. Otherwise the tail
+ * stays in the log unused and the next header is the one at its end. */
+static void log_group_close(struct log_group *grp)
+{
+	addr_t end = grp->data_start + grp->nr_blocks;
+
+	g_open_group = NULL;
+
+	if (grp->used < grp->nr_blocks &&
+			cmpxchg(&g_fs_log->next_avail, end + 1,
+				grp->data_start + grp->used + 1) == end + 1)
+		end = grp->data_start + grp->used;
+
+	grp->meta.loghdr.next_loghdr_blkno = end;
+	grp->meta.loghdr.inuse = LH_COMMIT_MAGIC;
+}
+
+// persist and publish the header of a closed group, then free it.
+static void log_group_flush(struct log_group *grp)
+{
+	uint64_t tsc_begin, tsc_end;
+
+	if (enable_perf_stats)
+		tsc_begin = asm_rdtscp();
+
+	pthread_mutex_lock(&grp->lock);
+	while (grp->n_done != grp->n_members)
+		pthread_cond_wait(&grp->done_cond, &grp->lock);
+	pthread_mutex_unlock(&grp->lock);
+
+	if (enable_perf_stats) {
+		tsc_end = asm_rdtscp();
+		g_perf_stats.log_group_wait_tsc += (tsc_end - tsc_begin);
+		tsc_begin = tsc_end;
+	}
+
+	persist_log_header(&grp->meta, grp->meta.hdr_blkno);
+
+	if (enable_perf_stats) {
+		tsc_end = asm_rdtscp();
+		g_perf_stats.loghdr_write_tsc += (tsc_end - tsc_begin);
+		g_perf_stats.loghdr_write_nr++;
+		g_perf_stats.log_group_nr++;
+		g_perf_stats.log_group_members_nr += grp->n_members;
+	}
+
+	log_publish(&grp->meta);
+
+	pthread_cond_destroy(&grp->done_cond);
+	pthread_mutex_destroy(&grp->lock);
+	mlfs_free(grp);
+}
+
+// close the open group, if any, and make it durable.
+static void log_group_sync(void)
+{
+	struct log_group *grp;
+
+	pthread_mutex_lock(&g_group_lock);
+	grp = g_open_group;
+	if (grp)
+		log_group_close(grp);
+	pthread_mutex_unlock(&g_group_lock);
+
+	if (grp)
+		log_group_flush(grp);
+}
+
+// closes the open group when its window has passed.
+static void *log_group_flusher(void *arg)
+{
+	struct log_group *grp;
+
+	*((volatile int *)arg) = 1;
+
+	pthread_mutex_lock(&g_group_lock);
+	while (1) {
+		grp = g_open_group;
+		if (!grp) {
+			pthread_cond_wait(&g_group_cond, &g_group_lock);
+			continue;
+		}
+
+		if (pthread_cond_timedwait(&g_group_cond, &g_group_lock,
+					&grp->deadline) != ETIMEDOUT || g_open_group != grp)
+			continue;
+
+		log_group_close(grp);
+		pthread_mutex_unlock(&g_group_lock);
+		log_group_flush(grp);
+		pthread_mutex_lock(&g_group_lock);
+	}
+
+	return NULL;
+}
+
+// Each ext record is '<entry idx><payload>|'. Rebase entry indices
+// to the position of the member in the shared header.
+static void log_group_add_ext(struct log_group *grp,
+		struct logheader_meta *loghdr_meta, uint32_t entry_base)
+{
+	uint8_t *src = loghdr_meta->loghdr_ext;
+	uint8_t *end = src + loghdr_meta->ext_used;
+	uint8_t *dst = grp->meta.loghdr_ext + grp->meta.ext_used;
+
+	while (src < end) {
+		*dst++ = *src++ + entry_base;
+		while (src < end && *src != '|')
+			*dst++ = *src++;
+		if (src < end)
+			*dst++ = *src++;
+	}
+	*dst = '\0';
+
+	grp->meta.ext_used = dst - grp->meta.loghdr_ext;
+}
+
+// 1 if the small writes of loghdr_meta need a new pack block in grp.
+static inline int log_group_need_pack(struct log_group *grp,
+		struct logheader_meta *loghdr_meta)
+{
+	return loghdr_meta->pack_used && (!grp->pack_blk ||
+			grp->pack_used + loghdr_meta->pack_used > g_block_size_bytes);
+}
+
+static int log_group_fits(struct log_group *grp,
+		struct logheader_meta *loghdr_meta, uint32_t nr_data_blocks)
+{
+	return grp->meta.loghdr.n + loghdr_meta->loghdr.n <= g_max_loghdr_entries &&
+		grp->meta.ext_used + loghdr_meta->ext_used <
+		sizeof(grp->meta.loghdr_ext) &&
+		grp->used + nr_data_blocks + log_group_need_pack(grp, loghdr_meta) <=
+		grp->nr_blocks;
+}
+
+/* Add the entries of loghdr_meta to the group header and hand out its
+ * log blocks. Called with g_group_lock held. Returns the index of its
+ * first entry in the group header. */
+static uint32_t log_group_add(struct log_group *grp,
+		struct logheader_meta *loghdr_meta, uint32_t nr_data_blocks)
+{
+	struct logheader *loghdr = &(loghdr_meta->loghdr);
+	uint32_t entry_base = grp->meta.loghdr.n, i;
+
+	if (log_group_need_pack(grp, loghdr_meta)) {
+		grp->pack_blk = grp->data_start + grp->used++;
+		grp->pack_used = 0;
+
+		if (enable_perf_stats)
+			g_perf_stats.log_pack_blocks_nr++;
+	}
+
+	if (loghdr_meta->pack_used) {
+		loghdr_meta->pack_blk = grp->pack_blk;
+		loghdr_meta->pack_off = grp->pack_used;
+		grp->pack_used += loghdr_meta->pack_used;
+	}
+
+	for (i = 0; i < loghdr->n; i++) {
+		grp->meta.loghdr.type[entry_base + i] = loghdr->type[i];
+		grp->meta.loghdr.inode_no[entry_base + i] = loghdr->inode_no[i];
+		grp->meta.loghdr.data[entry_base + i] = loghdr->data[i];
+		grp->meta.loghdr.length[entry_base + i] = loghdr->length[i];
+
+		if (loghdr->remap_mask & (1ULL << i))
+			grp->meta.loghdr.remap_mask |= (1ULL << (entry_base + i));
+	}
+	grp->meta.loghdr.n += loghdr->n;
+
+	if (loghdr_meta->ext_used)
+		log_group_add_ext(grp, loghdr_meta, entry_base);
+
+	loghdr_meta->hdr_blkno = grp->meta.hdr_blkno;
+	loghdr_meta->log_blocks = grp->data_start + grp->used;
+	loghdr_meta->nr_log_blocks = nr_data_blocks;
+	loghdr_meta->pos = 0;
+
+	grp->used += nr_data_blocks;
+	grp->n_members++;
+
+	return entry_base;
+}
+
+static void log_group_commit(struct logheader_meta *loghdr_meta,
+		uint32_t nr_data_blocks)
+{
+	struct logheader *loghdr = &(loghdr_meta->loghdr);
+	struct log_group *grp;
+	uint32_t entry_base, i;
+	int closer = 0;
+	uint64_t tsc_begin, tsc_end;
+
+	pthread_mutex_lock(&g_group_lock);
+
+	while (1) {
+		grp = g_open_group;
+		if (!grp) {
+			grp = log_group_open();
+			if (!grp)
+				continue;
+		}
+
+		if (log_group_fits(grp, loghdr_meta, nr_data_blocks))
+			break;
+
+		// no room left. commit it and open a new group.
+		log_group_close(grp);
+		pthread_mutex_unlock(&g_group_lock);
+		log_group_flush(grp);
+		pthread_mutex_lock(&g_group_lock);
+	}
+
+	entry_base = log_group_add(grp, loghdr_meta, nr_data_blocks);
+
+	if (grp->meta.loghdr.n == g_max_loghdr_entries ||
+			grp->used == grp->nr_blocks) {
+		log_group_close(grp);
+		closer = 1;
+	}
+
+	pthread_mutex_unlock(&g_group_lock);
+
+	if (enable_perf_stats)
+		tsc_begin = asm_rdtscp();
+
+	persist_log_blocks(loghdr_meta);
+
+	if (enable_perf_stats) {
+		tsc_end = asm_rdtscp();
+		g_perf_stats.log_write_tsc += (tsc_end - tsc_begin);
+		g_perf_stats.log_write_nr++;
+	}
+
+	// the group may be freed once the last member is done, unless
+	// this member closed it and flushes it below.
+	pthread_mutex_lock(&grp->lock);
+	for (i = 0; i < loghdr->n; i++) {
+		grp->meta.loghdr.blocks[entry_base + i] = loghdr->blocks[i];
+		grp->meta.loghdr.log_offset[entry_base + i] = loghdr->log_offset[i];
+	}
+	if (++grp->n_done == grp->n_members)
+		pthread_cond_signal(&grp->done_cond);
+	pthread_mutex_unlock(&grp->lock);
+
+	if (closer)
+		log_group_flush(grp);
+}
+#endif
+
+static void commit_log(void)
+{
+	struct logheader_meta *loghdr_meta;
+	struct logheader *loghdr;
+	uint64_t tsc_begin, tsc_end;
+
+	// loghdr_meta is stored in TLS.
+	loghdr_meta = get_loghdr_meta();
 	mlfs_assert(loghdr_meta);
 
 	/* There was no log update during transaction */
@@ -1128,22 +2092,63 @@ static void commit_log(void)
 		panic("empty log header\n");
 
 	if (loghdr->n > 0) {
-		uint32_t nr_log_blocks;
+		uint32_t nr_log_blocks, new_pack;
 
 		// Pre-compute required log blocks for atomic append.
 		nr_log_blocks = compute_log_blocks(loghdr_meta);
+
+#ifdef CONCURRENT
+		if (g_fs_log->group_window_ns && !tls_commit_now &&
+				nr_log_blocks <= LOG_GROUP_BLOCKS / 2) {
+			log_group_commit(loghdr_meta, nr_log_blocks);
+			return;
+		}
+#endif
+
 		nr_log_blocks++; // +1 for a next log header block;
 
+#ifdef CONCURRENT
+		// lock-free reservation of header and log blocks.
+		if (enable_perf_stats)
+			tsc_begin = asm_rdtscp();
+
+		loghdr_meta->log_blocks = log_reserve(loghdr_meta, nr_log_blocks);
+
+		// a group open before this header would hold up its publish
+		// for the rest of the window.
+		if (g_fs_log->group_window_ns)
+			log_group_sync();
+
+		loghdr_meta->nr_log_blocks = nr_log_blocks;
+		// the last block (nr_log_blocks - 1) is the next log header.
+		loghdr_meta->pos = 0;
+
+		if (enable_perf_stats) {
+			tsc_end = asm_rdtscp();
+			g_perf_stats.log_alloc_tsc += (tsc_end - tsc_begin);
+            g_perf_stats.log_alloc_nr++;
+		}
+
+		loghdr->next_loghdr_blkno =
+			loghdr_meta->log_blocks + loghdr_meta->nr_log_blocks - 1;
+		loghdr->inuse = LH_COMMIT_MAGIC;
+#else
 		pthread_mutex_lock(g_fs_log->shared_log_lock);
 
 		// atomic log allocation.
 		if (enable_perf_stats)
 			tsc_begin = asm_rdtscp();
-		// g_fs_log->next_avail += nr_log_blocks atomically here
-		loghdr_meta->log_blocks = log_alloc(nr_log_blocks);
+		// g_fs_log->next_avail += nr_log_blocks atomically here,
+		// after a new pack block if this header needs one.
+		new_pack = log_pack_need_blk(loghdr_meta,
+				g_fs_log->next_avail_header);
+		loghdr_meta->log_blocks = log_alloc(nr_log_blocks + new_pack) +
+			new_pack;
+		log_pack_take(loghdr_meta,
+				new_pack ? loghdr_meta->log_blocks - 1 : 0);
 		loghdr_meta->nr_log_blocks = nr_log_blocks;
-		// loghdr_meta->pos = 0 is used for log header block.
-		loghdr_meta->pos = 1;
+		// the last block (nr_log_blocks - 1) is the next log header.
+		loghdr_meta->pos = 0;
 
 		if (enable_perf_stats) {
 			tsc_end = asm_rdtscp();
@@ -1151,18 +2156,19 @@ static void commit_log(void)
             g_perf_stats.log_alloc_nr++;
 		}
 
-		// Here holds:
+		// Here holds (one more with a new pack block):
 		//     loghdr_meta->log_blocks == loghdr_meta->hdr_blkno + 1
 		// There should always be:
 		//     g_fs_log->next_avail == g_fs_log->next_avail_header + 1
 		loghdr_meta->hdr_blkno = g_fs_log->next_avail_header;
-		g_fs_log->next_avail_header = loghdr_meta->log_blocks + loghdr_meta->nr_log_blocks;
-		g_fs_log->next_avail++;
+		g_fs_log->next_avail_header =
+			loghdr_meta->log_blocks + loghdr_meta->nr_log_blocks - 1;
 
 		loghdr->next_loghdr_blkno = g_fs_log->next_avail_header;
 		loghdr->inuse = LH_COMMIT_MAGIC;
 
 		pthread_mutex_unlock(g_fs_log->shared_log_lock);
+#endif
 
 		mlfs_debug("pid %u [commit] log block %lu nr_log_blocks %u\n",
 				getpid(), loghdr_meta->log_blocks, loghdr_meta->nr_log_blocks);
@@ -1202,7 +2208,11 @@ static void commit_log(void)
 			g_perf_stats.loghdr_write_nr++;
 		}
 
+#ifdef CONCURRENT
+		log_publish(loghdr_meta);
+#else
 		atomic_fetch_add(&g_log_sb->n_digest, 1);
+#endif
 
 		mlfs_assert(loghdr_meta->loghdr.next_loghdr_blkno
 				>= g_fs_log->log_sb_blk);
@@ -1339,14 +2349,105 @@ int make_digest_request_async(int percent)
     }
 }
 
+#ifdef DIGEST_SHM_RING
+static void digest_ring_attach(void)
+{
+	int fd;
+
+	fd = shm_open(SHM_NAME, O_RDWR, 0666);
+	if (fd == -1) {
+		perror("shm_open");
+		panic("cannot open shared memory\n");
+	}
+
+	digest_rings = (struct digest_ring_area *)mmap(NULL,
+			DIGEST_SHM_AREA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, DIGEST_RING_OFFSET);
+	if (digest_rings == MAP_FAILED) {
+		perror("mmap");
+		panic("cannot map digest rings\n");
+	}
+
+	close(fd);
+
+	if (digest_rings->magic != DIGEST_RING_MAGIC)
+		panic("digest rings are not set up. Is kernfs running?\n");
+
+	mlfs_assert(g_fs_log->dev < g_n_devices);
+	g_digest_ring = &digest_rings->ring[g_fs_log->dev];
+
+	if (IDXAPI_IS_ROCACHED())
+		pmem_nvm_hash_table_set_dirty_log(hashfs_dirty_log_of(digest_rings));
+
+	// drop acks left behind by a previous libfs on this log device.
+	g_digest_ring->ack_tail = g_digest_ring->ack_head;
+
+	pthread_spin_init(&digest_req_lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+// queue a request for kernfs and return its seq. Several requests can be
+// outstanding; this only waits when the ring is full.
+static uint32_t post_digest_request(digest_req_t *req)
+{
+	struct digest_ring *ring = g_digest_ring;
+	uint32_t seq;
+
+	pthread_spin_lock(&digest_req_lock);
+	while (ring->req_head - ring->req_tail >= DIGEST_RING_SLOTS)
+		cpu_relax();
+
+	seq = ring->req_head;
+	req->seq = seq;
+	req->dev = g_fs_log->dev;
+	ring->req[seq % DIGEST_RING_SLOTS] = *req;
+
+	__sync_synchronize();
+	ring->req_head = seq + 1;
+	pthread_spin_unlock(&digest_req_lock);
+
+	// full barrier, pairs with kernfs setting kernfs_sleeping.
+	atomic_inc(&digest_rings->req_seq);
+	if (digest_rings->kernfs_sleeping)
+		sys_futex((void *)&digest_rings->req_seq, FUTEX_WAKE, 1,
+				NULL, NULL, 0);
+
+	return seq;
+}
+
+// only the digest thread consumes acks.
+static void wait_digest_ack(uint32_t seq, digest_ack_t *ack)
+{
+	struct digest_ring *ring = g_digest_ring;
+	uint32_t tail;
+
+	while (1) {
+		tail = ring->ack_tail;
+		while (ring->ack_head == tail)
+			sys_futex((void *)&ring->ack_head, FUTEX_WAIT, tail,
+					NULL, NULL, 0);
+
+		__sync_synchronize();
+		*ack = ring->ack[tail % DIGEST_RING_SLOTS];
+		__sync_synchronize();
+		ring->ack_tail = tail + 1;
+
+		if (ack->seq == seq)
+			return;
+
+		mlfs_debug("drop stale digest ack %u (want %u)\n", ack->seq, seq);
+	}
+}
+#endif
+
 /**
- * Don't call this outside of strata.
+ * Ask kernfs to digest percent of the committed logheaders, but no more
+ * than max_hdrs of them (0: no limit).
  */
-uint32_t make_digest_request_sync(int percent)
+static uint32_t digest_request(int percent, uint32_t max_hdrs)
 {
 	int ret, i;
-	char cmd[MAX_SOCK_BUF];
 	uint32_t digest_count = 0, n_digest;
+	uint32_t lease_want = 0;
 	loghdr_t *loghdr;
 	addr_t loghdr_blkno = g_fs_log->start_blk;
 	struct inode *ip;
@@ -1360,19 +2461,99 @@ uint32_t make_digest_request_sync(int percent)
 	n_digest = atomic_load(&g_log_sb->n_digest);
 
 	g_fs_log->n_digest_req = (percent * n_digest) / 100;
-	socklen_t len = sizeof(struct sockaddr_un);
-	sprintf(cmd, "|digest |%d|%u|%lu|%lu|",
-			g_fs_log->dev, g_fs_log->n_digest_req, g_log_sb->start_digest, 0UL);
+	if (max_hdrs && g_fs_log->n_digest_req > max_hdrs)
+		g_fs_log->n_digest_req = max_hdrs;
 
-	mlfs_debug("%s\n", cmd);
+	// ask for a fresh remap lease when the current one runs low.
+	if (g_fs_log->remap_nr - g_fs_log->remap_used < REMAP_LEASE_BLOCKS / 2)
+		lease_want = REMAP_LEASE_BLOCKS;
+
+#ifdef DIGEST_SHM_RING
+	{
+		digest_req_t req = {0};
+
+		req.cmd = DIGEST_CMD_DIGEST;
+		req.count = g_fs_log->n_digest_req;
+		req.blkno = g_log_sb->start_digest;
+		req.lease_want = lease_want;
+
+		mlfs_debug("digest request: count %u blkno %lu\n", req.count, req.blkno);
+
+		digest_req_seq = post_digest_request(&req);
+	}
+#else
+	{
+		char cmd[MAX_SOCK_BUF];
+		socklen_t len = sizeof(struct sockaddr_un);
 
-	// send digest command
-	ret = sendto(g_sock_fd, cmd, MAX_SOCK_BUF, 0,
-			(struct sockaddr *)&g_srv_addr, len);
+		sprintf(cmd, "|digest |%d|%u|%lu|%lu|%u|",
+				g_fs_log->dev, g_fs_log->n_digest_req, g_log_sb->start_digest, 0UL,
+				lease_want);
+
+		mlfs_debug("%s\n", cmd);
+
+		// send digest command
+		ret = sendto(g_sock_fd, cmd, MAX_SOCK_BUF, 0,
+				(struct sockaddr *)&g_srv_addr, len);
+	}
+#endif
 
 	return n_digest;
 }
 
+/**
+ * Don't call this outside of strata.
+ */
+uint32_t make_digest_request_sync(int percent)
+{
+	return digest_request(percent, 0);
+}
+
+// give unused leased blocks back to kernfs.
+static void return_remap_lease(addr_t blknr, uint32_t nr)
+{
+#ifdef DIGEST_SHM_RING
+	digest_req_t req = {0};
+
+	req.cmd = DIGEST_CMD_LEASE;
+	req.count = nr;
+	req.blkno = blknr;
+
+	mlfs_debug("lease return: blkno %lu count %u\n", blknr, nr);
+
+	// kernfs does not ack lease returns.
+	post_digest_request(&req);
+#else
+	char cmd[MAX_SOCK_BUF];
+
+	sprintf(cmd, "|lease |%d|%u|%lu|%lu|", g_fs_log->dev, nr, blknr, 0UL);
+
+	mlfs_debug("%s\n", cmd);
+
+	sendto(g_sock_fd, cmd, MAX_SOCK_BUF, 0,
+			(struct sockaddr *)&g_srv_addr, sizeof(struct sockaddr_un));
+#endif
+}
+
+// switch to a new lease, returning what is left of the old one.
+static void set_remap_lease(addr_t blknr, uint32_t nr)
+{
+	addr_t old_blknr;
+	uint32_t old_nr;
+
+	pthread_spin_lock(&g_fs_log->log_lock);
+	old_blknr = g_fs_log->remap_blk + g_fs_log->remap_used;
+	old_nr = g_fs_log->remap_nr - g_fs_log->remap_used;
+
+	g_fs_log->remap_blk = blknr;
+	g_fs_log->remap_nr = nr;
+	g_fs_log->remap_used = 0;
+	pthread_spin_unlock(&g_fs_log->log_lock);
+
+	if (old_nr)
+		return_remap_lease(old_blknr, old_nr);
+}
+
 static void cleanup_lru_list(int lru_updated)
 {
 	lru_node_t *node, *tmp;
@@ -1389,17 +2570,102 @@ static void cleanup_lru_list(int lru_updated)
 	pthread_rwlock_unlock(shm_lru_rwlock);
 }
 
-void handle_digest_response(char *ack_cmd)
+#ifndef DIGEST_SHM_RING
+static void parse_digest_response(char *ack_cmd, digest_ack_t *ack)
 {
-	char ack[10] = {0};
-	addr_t next_hdr_of_digested_hdr;
-	int n_digested, rotated, lru_updated;
-	struct inode *inode, *tmp;
+	char ack_header[10] = {0};
 
     //printf("digest response, %s\n", ack_cmd);
 
-	sscanf(ack_cmd, "|%s |%d|%lu|%d|%d|", ack, &n_digested,
-			&next_hdr_of_digested_hdr, &rotated, &lru_updated);
+	memset(ack, 0, sizeof(digest_ack_t));
+	sscanf(ack_cmd, "|%s |%d|%lu|%d|%d|%lu|%u|%lu|", ack_header, &ack->n_digested,
+			&ack->next_hdr, &ack->rotated, &ack->lru_updated,
+			&ack->lease_blkno, &ack->lease_count, &ack->idx_gen);
+}
+#endif
+
+// pick up what digest wrote to the shared area for this inode.
+static void resync_digested_inode(struct inode *inode)
+{
+	if (!(inode->flags & I_DELETING)) {
+		if (inode->itype == T_FILE) {
+			sync_inode_ext_tree(g_root_dev, inode);
+		} else if(inode->itype == T_DIR) {
+			// do nothing?
+		} else if(inode->itype == T_DEV) {
+			panic("unsupported inode type\n");
+		}
+	} else {
+		inode->flags &= ~I_DELETING;
+		//bitmap_clear(sb[inode->dev]->s_inode_bitmap, inode->inum, 1);
+	}
+}
+
+// inodes the last digest may have touched, kept for log_bloom_rebuild.
+static struct inode **digested_inodes;
+static uint32_t max_digested_inodes;
+
+static void keep_digested_inode(uint32_t n, struct inode *inode)
+{
+	if (n == max_digested_inodes) {
+		max_digested_inodes = max_digested_inodes ? max_digested_inodes * 2 : 1024;
+		digested_inodes = (struct inode **)realloc(digested_inodes,
+				sizeof(struct inode *) * max_digested_inodes);
+		if (!digested_inodes)
+			panic("cannot grow digested inode list\n");
+	}
+
+	digested_inodes[n] = inode;
+}
+
+/* Resync every inode the last digest may have touched and switch it to
+ * the other half of its log summary, in a single pass over the icache.
+ * The inodes are kept in digested_inodes. Returns the number of inodes. */
+static uint32_t resync_digested_inodes(void)
+{
+	struct inode *inode, *tmp;
+	uint32_t n = 0;
+#ifdef DIGEST_SHM_RING
+	digest_inodes_t *di;
+	uint32_t i;
+
+	// kernfs lists the inodes of the digested logheaders; visit only
+	// those unless the list overflowed.
+	di = digest_inodes_of(digest_rings, g_fs_log->dev);
+	if (!di->overflow) {
+		for (i = 0; i < di->n; i++) {
+			inode = icache_find(g_root_dev, di->inum[i]);
+			if (!inode)
+				continue;
+			resync_digested_inode(inode);
+			log_bloom_flip(inode);
+			keep_digested_inode(n++, inode);
+		}
+		return n;
+	}
+#endif
+
+	HASH_ITER(hash_handle, inode_hash[g_root_dev], inode, tmp) {
+		resync_digested_inode(inode);
+		log_bloom_flip(inode);
+		keep_digested_inode(n++, inode);
+	}
+
+	return n;
+}
+
+// hash_idx_gen of kernfs when the cached global index was last dropped.
+static uint64_t idx_gen_seen;
+
+void handle_digest_response(digest_ack_t *ack)
+{
+	addr_t next_hdr_of_digested_hdr = ack->next_hdr;
+	int n_digested = ack->n_digested;
+	int rotated = ack->rotated;
+	addr_t lease_blknr = ack->lease_blkno;
+	uint32_t lease_nr = ack->lease_count;
+	uint32_t n_resync = 0, i;
+	uint64_t tsc_begin;
 
 	if (g_fs_log->n_digest_req == n_digested)  {
 		mlfs_debug("%s", "digest is done correctly\n");
@@ -1424,39 +2690,64 @@ void handle_digest_response(char *ack_cmd)
 
 	// adjust g_log_sb->n_digest properly
 	atomic_fetch_sub(&g_log_sb->n_digest, n_digested);
+	n_digested_total += n_digested;
+
+	if (lease_nr)
+		set_remap_lease(lease_blknr, lease_nr);
 
 	//Start cleanup process after digest is done.
 
 	//cleanup_lru_list(lru_updated);
 
+	// the cached global index is stale only if some digest changed the
+	// index since the last time we dropped it.
 	if (g_idx_cached && IDXAPI_IS_GLOBAL()) {
-		// printf("INVALIDATE!\n");
-        int api_err = mlfs_hash_cache_invalidate();
-        if (api_err) panic("couldn't invalidate cache!\n");
-    }
+		if (ack->idx_gen != idx_gen_seen) {
+			int api_err = mlfs_hash_cache_invalidate();
+			if (api_err) panic("couldn't invalidate cache!\n");
+			idx_gen_seen = ack->idx_gen;
+
+			if (enable_perf_stats)
+				g_perf_stats.idx_invalidate_nr++;
+		} else if (enable_perf_stats) {
+			g_perf_stats.idx_invalidate_skip_nr++;
+		}
+	}
 
   	if (IDXAPI_IS_HASHFS() && IDXAPI_IS_ROCACHED()) {
-    	// printf("RO caching update!\n");
-    	memcpy((char*)pmem_ht_vol->entries, pmem_ht_vol->entries_pm, pmem_ht_vol->nbytes);
+		int64_t n_lines;
+
+		if (enable_perf_stats)
+			tsc_begin = asm_rdtscp();
+
+		// copy the entry lines kernfs changed since the last refresh.
+		n_lines = pmem_nvm_hash_table_refresh_cache();
+
+		if (enable_perf_stats) {
+			g_perf_stats.rocache_refresh_tsc += asm_rdtscp() - tsc_begin;
+			if (n_lines < 0)
+				g_perf_stats.rocache_refresh_full_nr++;
+			else
+				g_perf_stats.rocache_refresh_lines += n_lines;
+		}
   	}
 
-	// TODO: optimize this. Now sync all inodes in the inode_hash.
-	// As the optimization, Kernfs sends inodes lists (via shared memory),
-	// and Libfs syncs inodes based on the list.
-    HASH_ITER(hash_handle, inode_hash[g_root_dev], inode, tmp) {
-        if (!(inode->flags & I_DELETING)) {
-            if (inode->itype == T_FILE) {
-                sync_inode_ext_tree(g_root_dev, inode);
-            } else if(inode->itype == T_DIR) {
-                // do nothing?
-            } else if(inode->itype == T_DEV) {
-                panic("unsupported inode type\n");
-            }
-        } else {
-            inode->flags &= ~I_DELETING;
-            //bitmap_clear(sb[inode->dev]->s_inode_bitmap, inode->inum, 1);
-        }
-    }
+	if (enable_perf_stats)
+		tsc_begin = asm_rdtscp();
+
+	// digested blocks read from the shared area now; take them out of
+	// the log summaries (see log_bloom_rebuild). libfs never frees an
+	// inode, so the list stays valid across the epoch wait.
+	n_resync = resync_digested_inodes();
+	epoch_synchronize();
+	for (i = 0; i < n_resync; i++)
+		log_bloom_rebuild(digested_inodes[i]);
+
+	if (enable_perf_stats) {
+		g_perf_stats.digest_resync_tsc += asm_rdtscp() - tsc_begin;
+		g_perf_stats.digest_resync_nr++;
+		g_perf_stats.digest_resync_inodes += n_resync;
+	}
 #ifdef EXTCACHE
     // unset uptodate flag of all buffer heads
     // all buffer heads should point to extent tree nodes
@@ -1481,13 +2772,99 @@ void handle_digest_response(char *ack_cmd)
 	//	show_libfs_stats("digest response");
 }
 
+// block until kernfs acks the outstanding digest request and apply it.
+static void wait_digest_response(void)
+{
+	digest_ack_t ack;
+#ifdef DIGEST_SHM_RING
+	wait_digest_ack(digest_req_seq, &ack);
+	handle_digest_response(&ack);
+#else
+	char buf[MAX_SOCK_BUF] = {0};
+	struct epoll_event kernfs_epev;
+	struct sockaddr_un srv_addr;
+	int ret;
+
+	ret = epoll_wait(kernfs_epfd, &kernfs_epev, 1, -1);
+	if (ret >= 0) {
+		socklen_t len = sizeof(struct sockaddr_un);
+
+		ret = recvfrom(g_sock_fd, buf, MAX_SOCK_BUF, 0,
+				(struct sockaddr *)&srv_addr, &len);
+
+		mlfs_debug("received %s\n", buf);
+
+		parse_digest_response(buf, &ack);
+		handle_digest_response(&ack);
+	}
+#endif
+}
+
+/* Streaming digest, run by the digest thread every stream_tick_ms.
+ * Each tick digests a small batch: the ingest rate (EWMA of logheaders
+ * committed per tick) plus a quarter of the backlog above
+ * stream_target_blk. The log then stays short and digests stay small,
+ * so writers rarely reach the digest_start_blk and stall thresholds. */
+#define STREAM_MIN_BATCH 8
+#define STREAM_EWMA_SHIFT 4
+
+static void digest_stream_tick(void)
+{
+	// fixed point, STREAM_EWMA_SHIFT fractional bits.
+	static uint64_t ingest_ewma;
+	static uint64_t last_committed;
+	uint64_t committed, ingest, batch;
+	uint32_t pending;
+	addr_t used, blks_per_hdr;
+
+	pending = atomic_load(&g_log_sb->n_digest);
+	committed = n_digested_total + pending;
+	ingest = committed - last_committed;
+	last_committed = committed;
+
+	ingest_ewma += (ingest << STREAM_EWMA_SHIFT) >> 3;
+	ingest_ewma -= ingest_ewma >> 3;
+
+	if (!pending || g_fs_log->digesting)
+		return;
+
+	used = log_used_blocks();
+	blks_per_hdr = used / pending;
+	if (!blks_per_hdr)
+		blks_per_hdr = 1;
+
+	batch = ingest_ewma >> STREAM_EWMA_SHIFT;
+	if (used > g_fs_log->stream_target_blk)
+		batch += (used - g_fs_log->stream_target_blk) / blks_per_hdr / 4;
+
+	if (batch < STREAM_MIN_BATCH)
+		batch = STREAM_MIN_BATCH;
+	if (batch > pending)
+		batch = pending;
+
+	mlfs_debug("stream digest: pending %u used %lu batch %lu\n",
+			pending, used, batch);
+
+	digest_request(100, batch);
+	wait_digest_response();
+
+	if (enable_perf_stats) {
+		g_perf_stats.digest_stream_nr++;
+		g_perf_stats.digest_stream_hdrs += batch;
+	}
+}
+
 #define EVENT_COUNT 1
 void *digest_thread(void *arg)
 {
-	int epfd, kernfs_epfd, ret, n, flags;
-	char buf[MAX_SOCK_BUF] = {0}, cmd_buf[MAX_CMD_BUF] = {0};
-	struct epoll_event kernfs_epev = {0}, epev[EVENT_COUNT] = {0};
-	struct sockaddr_un srv_addr;
+	int epfd, ret, n;
+	char cmd_buf[MAX_CMD_BUF] = {0};
+	struct epoll_event epev[EVENT_COUNT] = {0};
+#ifdef DIGEST_SHM_RING
+	digest_ring_attach();
+#else
+	int flags;
+	struct epoll_event kernfs_epev = {0};
 
 	// setup server address
 	memset(&g_srv_addr, 0, sizeof(g_addr));
@@ -1532,6 +2909,7 @@ void *digest_thread(void *arg)
 			&kernfs_epev);
 	if (ret < 0)
 		panic("fail to connect epoll fd\n");
+#endif
 
 	// epoll for pipe and kernfs
 	epfd = epoll_create(1);
@@ -1552,15 +2930,20 @@ void *digest_thread(void *arg)
 
 	while(1) {
 		int i;
-		n = epoll_wait(epfd, epev, EVENT_COUNT, -1);
+		n = epoll_wait(epfd, epev, EVENT_COUNT,
+				g_fs_log->stream_tick_ms ? g_fs_log->stream_tick_ms : -1);
 
 		if (n < 0 && errno != EINTR) {
 			panic("epoll wait problem: digest completion\n");
         }
 
+		if (n == 0 && g_fs_log->stream_tick_ms) {
+			digest_stream_tick();
+			continue;
+		}
+
 		for (i = 0; i < n; i++) {
 			int _fd = epev[i].data.fd;
-			socklen_t len = sizeof(struct sockaddr_un);
 
 			if (_fd == g_fs_log->digest_fd[0]) {
 				mlfs_debug("digest_pipe: event %d\n", epev[i].events);
@@ -1627,19 +3010,14 @@ void *digest_thread(void *arg)
 					}
 #endif
 					// Waiting for ACK of digest from kernfs.
-					ret = epoll_wait(kernfs_epfd, &kernfs_epev, 1, -1);
-					if (ret >= 0) {
-						ret = recvfrom(g_sock_fd, buf, MAX_SOCK_BUF, 0,
-								(struct sockaddr *)&srv_addr, &len);
-
-						mlfs_debug("received %s\n", buf);
-
-						handle_digest_response(buf);
-					}
+					wait_digest_response();
 				}
-			} else if (_fd == g_sock_fd) {
+			}
+#ifndef DIGEST_SHM_RING
+			else if (_fd == g_sock_fd) {
 				panic("should receive this _fd in kernfs");
 			}
+#endif
 		}
 	}
 }
@@ -57,12 +57,58 @@ struct fs_log {
 	// # of logheaders in the lh_list.
 	uint32_t nloghdr;
 
+	// header block of the oldest transaction not yet published to n_digest.
+	// With CONCURRENT, writers reserve log space without a lock and
+	// publish their headers in log order by advancing this cursor.
+	addr_t next_publish_hdr;
+
+	// group commit window in ns (MLFS_GROUP_COMMIT in us): an open
+	// commit group is closed this long after it opened.
+	// 0 disables group commit.
+	uint64_t group_window_ns;
+
+	// digest policy in log blocks used: ask for an async digest above
+	// digest_start_blk (MLFS_DIGEST_START, % of log) and stall writers
+	// once the tail is within digest_stall_blk of the head
+	// (MLFS_DIGEST_STALL, % of log).
+	addr_t digest_start_blk;
+	addr_t digest_stall_blk;
+
+	// streaming digest: every stream_tick_ms (MLFS_DIGEST_STREAM) the
+	// digest thread digests a small batch sized to hold the log around
+	// stream_target_blk (MLFS_DIGEST_STREAM_TARGET, % of log).
+	// 0 disables streaming.
+	int stream_tick_ms;
+	addr_t stream_target_blk;
+
+	// shared-area blocks leased from kernfs. Large writes go there
+	// directly and are remapped into the file at digest (DIGEST_REMAP).
+	// remap_used blocks from remap_blk on are taken. Under log_lock.
+	addr_t remap_blk;
+	uint32_t remap_nr;
+	uint32_t remap_used;
+
+	// pack block shared by the small writes of successive transactions
+	// (see log_pack_reserve). pack_used bytes of pack_blk are taken; it
+	// was reserved at avail_version pack_version. Under log_lock.
+	addr_t pack_blk;
+	uint32_t pack_used;
+	uint32_t pack_version;
+
 	// used for threads
 	pthread_spinlock_t log_lock;
 	// used for parent and child processes.
 	pthread_mutex_t *shared_log_lock;
 };
 
+// blocks asked for when less than half of a remap lease is left.
+#define REMAP_LEASE_BLOCKS 4096
+
+// a transaction packs into the shared pack block only if its header is
+// at most this many blocks after it. The log tail keeps this distance
+// from the digest head, so a pack block outlives its transactions.
+#define LOG_PACK_SPAN 256
+
 //forward declaration
 struct inode;
 
@@ -74,6 +120,9 @@ void add_to_loghdr(uint8_t type, struct inode *inode, offset_t data,
 void start_log_tx(void);
 void abort_log_tx(void);
 void commit_log_tx(void);
+void set_log_commit_now(int enable);
+void log_sync(void);
+const char *log_commit_mode(void);
 int check_read_log_invalidation(struct fcache_block*);
 int check_write_log_invalidation(struct fcache_block*);
 
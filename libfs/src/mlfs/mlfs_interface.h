@@ -14,6 +14,9 @@ unsigned int make_digest_request_sync(int percent);
 int make_digest_request_async(int percent);
 void wait_on_digesting(void);
 void wait_on_not_digesting(void);
+void set_log_commit_now(int enable);
+void log_sync(void);
+const char *log_commit_mode(void);
 /*
 static void install_log_group(struct logheader *loghdr,
 		addr_t hdr_blkno);
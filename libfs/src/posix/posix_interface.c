@@ -354,9 +354,27 @@ int mlfs_posix_close(int fd)
 
 	mlfs_debug("close file inum %u fd %d\n", f->ip->inum, f->fd);
 
+	log_sync();
+
 	return mlfs_file_close(f);
 }
 
+// writes are in the log once they return; only a commit group can hold
+// them back from being durable.
+int mlfs_posix_fsync(int fd)
+{
+	struct file *f;
+
+	f = &g_fd_table.open_files[fd];
+
+	if (f->ref == 0)
+		return -EBADF;
+
+	log_sync();
+
+	return 0;
+}
+
 int mlfs_posix_mkdir(char *path, mode_t mode)
 {
 	int ret = 0;
@@ -20,6 +20,7 @@ off_t mlfs_posix_lseek(int fd, int64_t offset, int origin);
 int mlfs_posix_mkdir(char *path, unsigned int mode);
 int mlfs_posix_rmdir(char *path);
 int mlfs_posix_close(int fd);
+int mlfs_posix_fsync(int fd);
 int mlfs_posix_stat(const char *filename, struct stat *stat_buf);
 int mlfs_posix_fstat(int fd, struct stat *stat_buf);
 int mlfs_posix_fallocate(int fd, offset_t offset, offset_t len);
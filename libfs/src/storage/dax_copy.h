@@ -0,0 +1,111 @@
+#ifndef _DAX_COPY_H_
+#define _DAX_COPY_H_
+
+#include <string.h>
+#include <immintrin.h>
+
+#include "global/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Copy kernels for reads from a DAX mapping into DRAM.
+ *
+ * Small copies go to memcpy, which is already specialized by size. Copies
+ * of DAX_COPY_NT_MIN bytes or more use streaming (MOVNTDQA) loads of whole
+ * cache lines, four lines per iteration, so a large read does not evict
+ * the reader's working set from the cache. The source must be 64-byte
+ * aligned, as every block in the mapping is; the destination can have any
+ * alignment. The kernel is picked at run time from what the CPU supports,
+ * so it does not depend on AVX_FLAGS.
+ */
+#define DAX_COPY_NT_MIN (64UL << 10)
+
+#define DAX_COPY_AVX512 __attribute__((target("avx512f")))
+#define DAX_COPY_AVX2 __attribute__((target("avx2")))
+
+static inline DAX_COPY_AVX512 void dax_copy_nt_avx512(uint8_t *dst,
+		const uint8_t *src, size_t size)
+{
+	__m512i a, b, c, d;
+
+	for (; size >= 256; size -= 256, src += 256, dst += 256) {
+		a = _mm512_stream_load_si512((void *)(src));
+		b = _mm512_stream_load_si512((void *)(src + 64));
+		c = _mm512_stream_load_si512((void *)(src + 128));
+		d = _mm512_stream_load_si512((void *)(src + 192));
+		_mm512_storeu_si512((void *)(dst), a);
+		_mm512_storeu_si512((void *)(dst + 64), b);
+		_mm512_storeu_si512((void *)(dst + 128), c);
+		_mm512_storeu_si512((void *)(dst + 192), d);
+	}
+
+	if (size)
+		memcpy(dst, src, size);
+}
+
+static inline DAX_COPY_AVX2 void dax_copy_nt_avx2(uint8_t *dst,
+		const uint8_t *src, size_t size)
+{
+	__m256i a, b, c, d, e, f, g, h;
+
+	for (; size >= 256; size -= 256, src += 256, dst += 256) {
+		a = _mm256_stream_load_si256((__m256i *)(src));
+		b = _mm256_stream_load_si256((__m256i *)(src + 32));
+		c = _mm256_stream_load_si256((__m256i *)(src + 64));
+		d = _mm256_stream_load_si256((__m256i *)(src + 96));
+		e = _mm256_stream_load_si256((__m256i *)(src + 128));
+		f = _mm256_stream_load_si256((__m256i *)(src + 160));
+		g = _mm256_stream_load_si256((__m256i *)(src + 192));
+		h = _mm256_stream_load_si256((__m256i *)(src + 224));
+		_mm256_storeu_si256((__m256i *)(dst), a);
+		_mm256_storeu_si256((__m256i *)(dst + 32), b);
+		_mm256_storeu_si256((__m256i *)(dst + 64), c);
+		_mm256_storeu_si256((__m256i *)(dst + 96), d);
+		_mm256_storeu_si256((__m256i *)(dst + 128), e);
+		_mm256_storeu_si256((__m256i *)(dst + 160), f);
+		_mm256_storeu_si256((__m256i *)(dst + 192), g);
+		_mm256_storeu_si256((__m256i *)(dst + 224), h);
+	}
+
+	if (size)
+		memcpy(dst, src, size);
+}
+
+static inline void dax_copy_nt(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	if (__builtin_cpu_supports("avx512f"))
+		dax_copy_nt_avx512(dst, src, size);
+	else if (__builtin_cpu_supports("avx2"))
+		dax_copy_nt_avx2(dst, src, size);
+	else
+		memcpy(dst, src, size);
+}
+
+static inline void dax_copy_to_dram(uint8_t *dst, const uint8_t *src,
+		size_t size)
+{
+	switch (size) {
+		// one block, the common case.
+		case 4096:
+			memcpy(dst, src, 4096);
+			return;
+		case 8192:
+			memcpy(dst, src, 8192);
+			return;
+		default:
+			break;
+	}
+
+	if (size < DAX_COPY_NT_MIN || ((uintptr_t)src & 63))
+		memcpy(dst, src, size);
+	else
+		dax_copy_nt(dst, src, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
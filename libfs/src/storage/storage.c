@@ -62,7 +62,7 @@ struct storage_operations storage_hdd = {
 	NULL,
 	hdd_commit,
 	NULL,
-	NULL,
+	hdd_readahead,
 	hdd_exit,
 };
 
@@ -102,7 +102,7 @@ struct storage_operations storage_hdd = {
 	.commit = hdd_commit,
 	.wait_io = NULL,
 	.erase = NULL,
-	.readahead = NULL,
+	.readahead = hdd_readahead,
 	.exit = hdd_exit,
 };
 
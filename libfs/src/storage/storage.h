@@ -83,6 +83,7 @@ uint8_t *dax_init(uint8_t dev, char *dev_path);
 int dax_read(uint8_t dev, uint8_t *buf, addr_t blockno, uint32_t io_size);
 int dax_read_unaligned(uint8_t dev, uint8_t *buf, addr_t blockno, uint32_t offset,
 		uint32_t io_size);
+int dax_read_direct(uint8_t dev, uint8_t *buf, addr_t blockno, size_t io_size);
 int dax_write(uint8_t dev, uint8_t *buf, addr_t blockno, uint32_t io_size);
 int dax_write_unaligned(uint8_t dev, uint8_t *buf, addr_t blockno, uint32_t offset,
 		uint32_t io_size);
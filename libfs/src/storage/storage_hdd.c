@@ -66,6 +66,12 @@ int hdd_commit(uint8_t dev)
 	return 0;
 }
 
+int hdd_readahead(uint8_t dev, addr_t blockno, uint32_t io_size)
+{
+	return posix_fadvise(fd, blockno << g_block_size_shift, io_size,
+			POSIX_FADV_WILLNEED);
+}
+
 void hdd_exit(uint8_t dev)
 {
 	close(fd);
@@ -0,0 +1,162 @@
+/*
+ *  Log commit scalability test: each thread appends to its own file and
+ *  the number of writers is doubled from 1 up to -j. Build libfs with
+ *  -DCONCURRENT to exercise the lock-free log reservation path; the mode
+ *  libfs was built with is printed first, and -c refuses to run without it.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <mlfs/mlfs_interface.h>
+
+#define MAX_THREADS 64
+#define MAX_FILE_NAME_LEN 1024
+
+static size_t io_size = 4096;
+static uint32_t max_threads = 8;
+static uint32_t n_ops = 10000;
+static pthread_t threads[MAX_THREADS];
+static int fd_v[MAX_THREADS];
+static pthread_barrier_t g_barrier;
+static char *write_buf;
+
+static inline int panic(char *str) {
+    fprintf(stderr, "%s", str);
+    exit(-1);
+}
+
+#ifndef PREFIX
+#define PREFIX "/mlfs"
+#endif
+#define OPTSTRING "b:j:n:ch"
+void print_help(char **argv) {
+    printf("usage: %s -b io_size -j max_threads -n ops_per_thread "
+            "[-c (require CONCURRENT)]\n", argv[0]);
+}
+
+static void *worker_thread(void *arg) {
+    int fd = fd_v[(uintptr_t)arg];
+
+    pthread_barrier_wait(&g_barrier);
+
+    for (uint32_t i = 0; i < n_ops; ++i) {
+        ssize_t ws = write(fd, write_buf, io_size);
+        assert(ws == io_size && "append reported too few bytes");
+    }
+
+    return NULL;
+}
+
+static void wait_digest(void) {
+    if (make_digest_request_async(100) == 0)
+        wait_on_not_digesting();
+    wait_on_digesting();
+}
+
+static double run_round(uint32_t n_threads) {
+    char filename[MAX_FILE_NAME_LEN];
+    struct timeval start, end;
+
+    for (uintptr_t i = 0; i < n_threads; ++i) {
+        snprintf(filename, MAX_FILE_NAME_LEN, PREFIX "/log_scale.%u.%lu",
+                n_threads, i);
+        fd_v[i] = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd_v[i] < 0) {
+            perror("open failed");
+            exit(-1);
+        }
+    }
+
+    assert(pthread_barrier_init(&g_barrier, NULL, n_threads + 1) == 0);
+    for (uintptr_t i = 0; i < n_threads; ++i) {
+        assert(pthread_create(&threads[i], NULL, worker_thread, (void*)i) == 0);
+    }
+
+    if (gettimeofday(&start, NULL)) panic("GETTIMEOFDAY\n");
+    pthread_barrier_wait(&g_barrier);
+
+    for (uint32_t i = 0; i < n_threads; ++i) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    if (gettimeofday(&end, NULL)) panic("GETTIMEOFDAY\n");
+    pthread_barrier_destroy(&g_barrier);
+
+    for (uint32_t i = 0; i < n_threads; ++i) {
+        close(fd_v[i]);
+    }
+
+    return ((double)(end.tv_sec - start.tv_sec)) +
+           ((double)(end.tv_usec - start.tv_usec) * 1e-6);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    bool require_concurrent = false;
+    double base_tput = 0;
+
+    while ((c = getopt(argc, argv, OPTSTRING)) != -1) {
+        switch (c) {
+            case 'b':
+                io_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                max_threads = atoi(optarg);
+                assert(max_threads > 0 && max_threads <= MAX_THREADS &&
+                        "too many threads");
+                break;
+            case 'n':
+                n_ops = atoi(optarg);
+                break;
+            case 'c':
+                require_concurrent = true;
+                break;
+            case 'h':
+                print_help(argv);
+                exit(0);
+                break;
+            case '?':
+            default:
+                print_help(argv);
+                panic("wrong args\n");
+        }
+    }
+
+    printf("log commit: %s\n", log_commit_mode());
+    if (require_concurrent && !strstr(log_commit_mode(), "CONCURRENT"))
+        panic("libfs was built without -DCONCURRENT\n");
+
+    write_buf = (char *)malloc(io_size);
+    assert(write_buf);
+    memset(write_buf, 42, io_size);
+
+    printf("threads\tops/s\t\tMB/s\tspeedup\n");
+    for (uint32_t n = 1; n <= max_threads; n <<= 1) {
+        double secs, tput;
+
+        // start every round with an empty log.
+        wait_digest();
+
+        secs = run_round(n);
+        tput = ((double)n * n_ops) / secs;
+        if (n == 1)
+            base_tput = tput;
+
+        printf("%u\t%.0f\t%.2f\t%.2f\n", n, tput,
+                (tput * io_size) / (1024.0 * 1024.0), tput / base_tput);
+
+        if (n < max_threads && (n << 1) > max_threads)
+            n = max_threads >> 1;
+    }
+
+    return 0;
+}
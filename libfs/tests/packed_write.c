@@ -0,0 +1,171 @@
+/*
+ *  Small write correctness test: sub-block writes at random offsets are
+ *  packed into log blocks shared by many writes. Every round overwrites
+ *  random ranges of a file, then reads the whole file back from the log
+ *  and again after a digest, comparing against an in-memory copy.
+ *
+ *  With -R, block-aligned writes of several blocks are mixed with small
+ *  overwrites instead. With kernfs built with -DDIGEST_REMAP the large
+ *  writes are digested by remapping their blocks into the file.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <mlfs/mlfs_interface.h>
+
+#define BLOCK_SIZE 4096
+
+// 0: the default of the mode.
+static uint32_t n_blocks;
+static uint32_t n_rounds = 10;
+static uint32_t n_writes;
+// bytes, or blocks with -R.
+static uint32_t max_io_size;
+static bool remap;
+
+static inline int panic(char *str) {
+    fprintf(stderr, "%s", str);
+    exit(-1);
+}
+
+#ifndef PREFIX
+#define PREFIX "/mlfs"
+#endif
+#define OPTSTRING "b:r:n:s:Rh"
+void print_help(char **argv) {
+    printf("usage: %s [-R] -b blocks -r rounds -n writes_per_round "
+            "-s max_io_size (blocks with -R)\n", argv[0]);
+}
+
+static void wait_digest(void) {
+    if (make_digest_request_async(100) == 0)
+        wait_on_not_digesting();
+    wait_on_digesting();
+}
+
+static void check_file(int fd, char *expect, char *buf, size_t size,
+        const char *when) {
+    ssize_t rs = pread(fd, buf, size, 0);
+    assert(rs == size && "read reported too few bytes");
+
+    for (size_t i = 0; i < size; ++i) {
+        if (buf[i] != expect[i]) {
+            fprintf(stderr, "%s: mismatch at %lu (block %lu + %lu): "
+                    "got %d expected %d\n", when, i, i / BLOCK_SIZE,
+                    i % BLOCK_SIZE, buf[i], expect[i]);
+            exit(-1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int c, fd;
+    size_t file_size;
+    char *expect, *buf;
+
+    while ((c = getopt(argc, argv, OPTSTRING)) != -1) {
+        switch (c) {
+            case 'b':
+                n_blocks = atoi(optarg);
+                break;
+            case 'r':
+                n_rounds = atoi(optarg);
+                break;
+            case 'n':
+                n_writes = atoi(optarg);
+                break;
+            case 's':
+                max_io_size = atoi(optarg);
+                break;
+            case 'R':
+                remap = true;
+                break;
+            case 'h':
+                print_help(argv);
+                exit(0);
+                break;
+            case '?':
+            default:
+                print_help(argv);
+                panic("wrong args\n");
+        }
+    }
+
+    if (!n_blocks)
+        n_blocks = remap ? 256 : 64;
+    if (!n_writes)
+        n_writes = remap ? 200 : 1000;
+    if (!max_io_size)
+        max_io_size = remap ? 16 : 256;
+
+    if (remap)
+        assert(max_io_size <= n_blocks && "io size must be within the file");
+    else
+        assert(max_io_size < BLOCK_SIZE &&
+                "io size must be smaller than a block");
+
+    file_size = (size_t)n_blocks * BLOCK_SIZE;
+    expect = (char *)malloc(file_size);
+    buf = (char *)malloc(file_size);
+    assert(expect && buf);
+
+    fd = open(remap ? PREFIX "/remap_write" : PREFIX "/packed_write",
+            O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("open failed");
+        exit(-1);
+    }
+
+    // fill the file with whole blocks and digest it to the shared area.
+    memset(expect, 'a', file_size);
+    assert(pwrite(fd, expect, file_size, 0) == file_size);
+    wait_digest();
+
+    srand(42);
+    for (uint32_t r = 0; r < n_rounds; ++r) {
+        for (uint32_t i = 0; i < n_writes; ++i) {
+            char v = 'b' + (r * n_writes + i) % 24;
+            off_t pos;
+            uint32_t size;
+
+            // with -R, one in four writes is a small overwrite.
+            if (remap && rand() % 4) {
+                uint32_t nr = 1 + rand() % max_io_size;
+
+                pos = (off_t)(rand() % (n_blocks - nr + 1)) * BLOCK_SIZE;
+                size = nr * BLOCK_SIZE;
+            } else {
+                size = 1 + rand() % (remap ? BLOCK_SIZE - 1 : max_io_size);
+                pos = (off_t)(rand() % n_blocks) * BLOCK_SIZE +
+                    rand() % (BLOCK_SIZE - size + 1);
+            }
+
+            memset(expect + pos, v, size);
+            memset(buf, v, size);
+            ssize_t ws = pwrite(fd, buf, size, pos);
+            assert(ws == size && "write reported too few bytes");
+        }
+
+        check_file(fd, expect, buf, file_size, "before digest");
+        wait_digest();
+        check_file(fd, expect, buf, file_size, "after digest");
+
+        printf("round %u: OK\n", r);
+    }
+
+    close(fd);
+    free(expect);
+    free(buf);
+
+    printf("%s write test: OK\n", remap ? "remap" : "packed");
+
+    return 0;
+}
@@ -1057,10 +1057,10 @@ int shim_do_fsync(int fd)
 	}
 
 	if (in_mlfs) {
-		// libfs has quick persistency guarantee.
-		// fsync is nop.
+		// libfs has quick persistency guarantee; only writes in a
+		// commit group are not durable yet.
 		MLFS_RET_DEF(int);
-		MLFS_RET = 0;
+		MLFS_RET = mlfs_posix_fsync(get_mlfs_fd(MLFS_FD));
         syscall_dump("%d", MLFS_RET, "%d", MLFS_FD);
 #ifdef MIRROR_SYSCALL
 		if (MLFS_RET != ret) {
@@ -1094,9 +1094,8 @@ int shim_do_fdatasync(int fd)
 	}
 
 	if (in_mlfs) {
-		// fdatasync is nop.
 		MLFS_RET_DEF(int);
-		MLFS_RET = 0;
+		MLFS_RET = mlfs_posix_fsync(get_mlfs_fd(MLFS_FD));
         syscall_dump("%d", MLFS_RET, "%d", MLFS_FD);
 #ifdef MIRROR_SYSCALL
 		if (MLFS_RET != ret) {